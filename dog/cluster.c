@@ -24,6 +24,8 @@ static struct sd_option cluster_options[] = {
 	{'t', "strict", false,
 	 "do not serve write request if number of nodes is not sufficient"},
 	{'s', "backend", false, "show backend store information"},
+	{'l', "placement", true,
+	 "specify the object placement algorithm (ring or straw2)"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -33,6 +35,7 @@ static struct cluster_cmd_data {
 	bool force;
 	bool show_store;
 	bool strict;
+	bool straw2;
 	char name[STORE_LEN];
 } cluster_cmd_data;
 
@@ -122,6 +125,8 @@ static int cluster_format(int argc, char **argv)
 	hdr.flags |= SD_FLAG_CMD_WRITE;
 	if (cluster_cmd_data.strict)
 		hdr.cluster.flags |= SD_CLUSTER_FLAG_STRICT;
+	if (cluster_cmd_data.straw2)
+		hdr.cluster.flags |= SD_CLUSTER_FLAG_STRAW2;
 
 	printf("using backend %s store\n", store_name);
 	ret = dog_exec_req(&sd_nid, &hdr, store_name);
@@ -141,22 +146,15 @@ static int cluster_format(int argc, char **argv)
 
 static int cluster_info(int argc, char **argv)
 {
-	int i, ret;
+	int ret;
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	struct epoch_log *logs;
-	int nr_logs, log_length;
+	struct epoch_log *logs, *log;
 	time_t ti, ct;
 	struct tm tm;
 	char time_str[128];
 
-	log_length = sd_epoch * sizeof(struct epoch_log);
-	logs = xmalloc(log_length);
-
-	sd_init_req(&hdr, SD_OP_STAT_CLUSTER);
-	hdr.data_length = log_length;
-
-	ret = dog_exec_req(&sd_nid, &hdr, logs);
+	ret = dog_stat_cluster(&hdr, &logs);
 	if (ret < 0)
 		goto error;
 
@@ -175,16 +173,12 @@ static int cluster_info(int argc, char **argv)
 			printf("Cluster store: ");
 		if (rsp->result == SD_RES_SUCCESS) {
 			char copy[10];
-			int data, parity;
 			if (!logs->copy_policy)
 				snprintf(copy, sizeof(copy), "%d",
 					 logs->nr_copies);
-			else {
-				ec_policy_to_dp(logs->copy_policy,
-						&data, &parity);
-				snprintf(copy, sizeof(copy), "%d:%d",
-					 data, parity);
-			}
+			else
+				ec_policy_to_str(logs->copy_policy, copy,
+						 sizeof(copy));
 			printf("%s with %s redundancy policy\n",
 			       logs->drv_name, copy);
 		} else
@@ -197,12 +191,12 @@ static int cluster_info(int argc, char **argv)
 		printf("Epoch Time           Version\n");
 	}
 
-	nr_logs = rsp->data_length / sizeof(struct epoch_log);
-	for (i = 0; i < nr_logs; i++) {
+	for (log = logs; (char *)log < (char *)logs + rsp->data_length;
+	     log = epoch_log_next(log)) {
 		int j;
 		const struct sd_node *entry;
 
-		ti = logs[i].time;
+		ti = log->time;
 		if (raw_output) {
 			snprintf(time_str, sizeof(time_str), "%" PRIu64, (uint64_t) ti);
 		} else {
@@ -210,10 +204,10 @@ static int cluster_info(int argc, char **argv)
 			strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
 		}
 
-		printf(raw_output ? "%s %d" : "%s %6d", time_str, logs[i].epoch);
+		printf(raw_output ? "%s %d" : "%s %6d", time_str, log->epoch);
 		printf(" [");
-		for (j = 0; j < logs[i].nr_nodes; j++) {
-			entry = logs[i].nodes + j;
+		for (j = 0; j < log->nr_nodes; j++) {
+			entry = log->nodes + j;
 			printf("%s%s",
 			       (j == 0) ? "" : ", ",
 			       addr_to_str(entry->nid.addr, entry->nid.port));
@@ -557,7 +551,7 @@ static int cluster_check(int argc, char **argv)
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprhs", "show cluster information",
 	 NULL, CMD_NEED_NODELIST, cluster_info, cluster_options},
-	{"format", NULL, "bctaph", "create a Sheepdog store",
+	{"format", NULL, "bctlaph", "create a Sheepdog store",
 	 NULL, CMD_NEED_NODELIST, cluster_format, cluster_options},
 	{"shutdown", NULL, "aph", "stop Sheepdog",
 	 NULL, 0, cluster_shutdown, cluster_options},
@@ -591,7 +585,13 @@ static int cluster_parser(int ch, const char *opt)
 			       "  x(1 to %d)   - number of replicated copies\n"
 			       "To create erasure coded vdi, set -c x:y\n"
 			       "  x(2,4,8,16)  - number of data strips\n"
-			       "  y(1 to 15)   - number of parity strips",
+			       "  y(1 to 15)   - number of parity strips\n"
+			       "To create locally repairable coded vdi, "
+			       "set -c x:y:z\n"
+			       "  x(4,8,16)    - number of data strips\n"
+			       "  y(2,4,8)     - number of local groups, "
+			       "less than x\n"
+			       "  z(1 to 4)    - number of global parity strips",
 			       opt, SD_MAX_COPIES);
 			exit(EXIT_FAILURE);
 		}
@@ -605,6 +605,17 @@ static int cluster_parser(int ch, const char *opt)
 	case 't':
 		cluster_cmd_data.strict = true;
 		break;
+	case 'l':
+		if (strcmp(opt, "straw2") == 0)
+			cluster_cmd_data.straw2 = true;
+		else if (strcmp(opt, "ring") == 0)
+			cluster_cmd_data.straw2 = false;
+		else {
+			sd_err("Invalid placement algorithm %s, "
+			       "set ring or straw2", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
 	}
 
 	return 0;
@@ -224,6 +224,42 @@ int send_light_req(const struct node_id *nid, struct sd_req *hdr)
 	return 0;
 }
 
+/*
+ * Get the epoch logs from the latest one to the first one.  They are packed
+ * with their actual sizes, so retry with a larger buffer until the oldest one
+ * is returned.  The caller must free '*logsp'.
+ */
+int dog_stat_cluster(struct sd_req *hdr, struct epoch_log **logsp)
+{
+	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+	size_t len = (sd_epoch + 1) * epoch_log_size(sd_nodes_nr);
+	size_t max_len = (sd_epoch + 1) * sizeof(struct epoch_log);
+	struct epoch_log *logs = NULL, *last, *log;
+	int ret;
+
+	for (;;) {
+		logs = xrealloc(logs, len);
+		sd_init_req(hdr, SD_OP_STAT_CLUSTER);
+		hdr->data_length = len;
+
+		ret = dog_exec_req(&sd_nid, hdr, logs);
+		if (ret < 0 || rsp->data_length == 0 || len >= max_len)
+			break;
+
+		last = logs;
+		for (log = logs; (char *)log < (char *)logs + rsp->data_length;
+		     log = epoch_log_next(log))
+			last = log;
+		if (last->epoch <= 1)
+			break;
+
+		len = MIN(len * 2, max_len);
+	}
+
+	*logsp = logs;
+	return ret;
+}
+
 int subcmd_depth = -1;
 struct subcommand *subcmd_stack[MAX_SUBCMD_DEPTH];
 
@@ -449,18 +485,34 @@ void dump_loglevels(bool err)
 	}
 }
 
+/* d:l:r of locally repairable code, see SD_EC_LRC_FLAG */
+static uint8_t parse_lrc_copy(int d, int l, int r, uint8_t *copy_policy)
+{
+	if (d != 4 && d != 8 && d != 16)
+		return 0;
+	if ((l != 2 && l != 4 && l != 8) || l >= d)
+		return 0;
+	if (r < 1 || r > 4)
+		return 0;
+
+	*copy_policy = lrc_dlr_to_policy(d, l, r);
+	return d + l + r;
+}
+
 /* Return 0 to indicate ill str */
 uint8_t parse_copy(const char *str, uint8_t *copy_policy)
 {
-	char *n1, *n2;
+	char *n1, *n2, *n3;
 	uint8_t copy, parity;
 	char p[10];
 
-	strcpy(p, str);
+	pstrcpy(p, sizeof(p), str);
 	n1 = strtok(p, ":");
 	n2 = strtok(NULL, ":");
+	n3 = strtok(NULL, ":");
 
-	if ((!n1 || !is_numeric(n1)) || (n2 && !is_numeric(n2)))
+	if ((!n1 || !is_numeric(n1)) || (n2 && !is_numeric(n2)) ||
+	    (n3 && !is_numeric(n3)))
 		return 0;
 
 	copy = strtol(n1, NULL, 10);
@@ -471,6 +523,10 @@ uint8_t parse_copy(const char *str, uint8_t *copy_policy)
 		return copy;
 	}
 
+	if (n3)
+		return parse_lrc_copy(copy, strtol(n2, NULL, 10),
+				      strtol(n3, NULL, 10), copy_policy);
+
 	if (copy != 2 && copy != 4 && copy != 8 && copy != 16)
 		return 0;
 
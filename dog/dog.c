@@ -52,6 +52,8 @@ uint32_t sd_epoch;
 
 int sd_nodes_nr;
 struct rb_root sd_vroot = RB_ROOT;
+struct vnode_ring sd_vring;
+uint16_t sd_cluster_flags;
 struct rb_root sd_nroot = RB_ROOT;
 int sd_zones_nr;
 /* a number of zones never exceeds a number of nodes */
@@ -112,7 +114,8 @@ int update_node_list(int max_nodes)
 			sd_zones[sd_zones_nr++] = n->zone;
 	}
 
-	nodes_to_vnodes(&sd_nroot, &sd_vroot);
+	sd_cluster_flags = rsp->node.cluster_flags;
+	nodes_to_vnode_ring(&sd_nroot, &sd_vroot, &sd_vring, sd_cluster_flags);
 	sd_epoch = hdr.epoch;
 out:
 	if (buf)
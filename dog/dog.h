@@ -61,6 +61,8 @@ extern bool verbose;
 
 extern uint32_t sd_epoch;
 extern struct rb_root sd_vroot;
+extern struct vnode_ring sd_vring;
+extern uint16_t sd_cluster_flags;
 extern struct rb_root sd_nroot;
 extern int sd_nodes_nr;
 extern int sd_zones_nr;
@@ -80,13 +82,15 @@ int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 		     uint8_t copies, uint8_t, bool create, bool direct);
 int dog_exec_req(const struct node_id *, struct sd_req *hdr, void *data);
 int send_light_req(const struct node_id *, struct sd_req *hdr);
+int dog_stat_cluster(struct sd_req *hdr, struct epoch_log **logsp);
 int do_generic_subcommand(struct subcommand *sub, int argc, char **argv);
 int update_node_list(int max_nodes);
 void confirm(const char *message);
 void work_queue_wait(struct work_queue *q);
 int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
-		  uint8_t nr_copies, uint8_t copy_policy, uint8_t store_policy);
+		  uint8_t nr_copies, uint8_t copy_policy, uint8_t store_policy,
+		  uint8_t ec_stripe_shift);
 int do_vdi_check(const struct sd_inode *inode);
 void show_progress(uint64_t done, uint64_t total, bool raw);
 size_t get_store_objsize(uint8_t copy_policy, uint64_t oid);
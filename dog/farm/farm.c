@@ -30,6 +30,7 @@ struct vdi_entry {
 	uint8_t  nr_copies;
 	uint8_t copy_policy;
 	uint8_t store_policy;
+	uint8_t ec_stripe_shift;
 	struct rb_node rb;
 };
 static struct rb_root last_vdi_tree = RB_ROOT;
@@ -59,7 +60,7 @@ static struct vdi_entry *find_vdi(const char *name)
 static struct vdi_entry *new_vdi(const char *name, uint64_t vdi_size,
 				 uint32_t vdi_id, uint32_t snap_id,
 				 uint8_t nr_copies, uint8_t copy_policy,
-				 uint8_t store_policy)
+				 uint8_t store_policy, uint8_t ec_stripe_shift)
 {
 	struct vdi_entry *vdi;
 	vdi = xmalloc(sizeof(struct vdi_entry));
@@ -70,6 +71,7 @@ static struct vdi_entry *new_vdi(const char *name, uint64_t vdi_size,
 	vdi->nr_copies = nr_copies;
 	vdi->copy_policy = copy_policy;
 	vdi->store_policy = store_policy;
+	vdi->ec_stripe_shift = ec_stripe_shift;
 	return vdi;
 }
 
@@ -84,7 +86,8 @@ static void insert_vdi(struct sd_inode *new)
 			      new->snap_id,
 			      new->nr_copies,
 			      new->copy_policy,
-			      new->store_policy);
+			      new->store_policy,
+			      new->ec_stripe_shift);
 		rb_insert(&last_vdi_tree, vdi, rb, vdi_cmp);
 	} else if (vdi->snap_id < new->snap_id) {
 		vdi->vdi_size = new->vdi_size;
@@ -93,6 +96,7 @@ static void insert_vdi(struct sd_inode *new)
 		vdi->nr_copies = new->nr_copies;
 		vdi->copy_policy = new->copy_policy;
 		vdi->store_policy = new->store_policy;
+		vdi->ec_stripe_shift = new->ec_stripe_shift;
 	}
 }
 
@@ -106,7 +110,8 @@ static int create_active_vdis(void)
 				  vdi->vdi_id, &new_vid,
 				  false, vdi->nr_copies,
 				  vdi->copy_policy,
-				  vdi->store_policy) < 0)
+				  vdi->store_policy,
+				  vdi->ec_stripe_shift) < 0)
 			return -1;
 	}
 	return 0;
@@ -191,7 +196,7 @@ out:
 }
 
 static int notify_vdi_add(uint32_t vdi_id, uint8_t nr_copies,
-			  uint8_t copy_policy)
+			  uint8_t copy_policy, uint8_t ec_stripe_shift)
 {
 	int ret = -1;
 	struct sd_req hdr;
@@ -202,6 +207,7 @@ static int notify_vdi_add(uint32_t vdi_id, uint8_t nr_copies,
 	hdr.vdi_state.new_vid = vdi_id;
 	hdr.vdi_state.copies = nr_copies;
 	hdr.vdi_state.copy_policy = copy_policy;
+	hdr.vdi_state.ec_stripe_shift = ec_stripe_shift;
 	hdr.vdi_state.set_bitmap = true;
 
 	ret = dog_exec_req(&sd_nid, &hdr, buf);
@@ -370,9 +376,12 @@ static void do_load_object(struct work *work)
 		goto error;
 
 	if (is_vdi_obj(sw->entry.oid)) {
+		struct sd_inode *inode = buffer;
+
 		if (notify_vdi_add(oid_to_vid(sw->entry.oid),
 				   sw->entry.nr_copies,
-				   sw->entry.copy_policy) < 0)
+				   sw->entry.copy_policy,
+				   inode->ec_stripe_shift) < 0)
 			goto error;
 
 		sd_write_lock(&vdi_list_lock);
@@ -399,7 +408,13 @@ static void load_object_done(struct work *work)
 
 static int queue_load_snapshot_work(struct trunk_entry *entry, void *data)
 {
-	struct snapshot_work *sw = xzalloc(sizeof(struct snapshot_work));
+	bool vdi_pass = *(bool *)data;
+	struct snapshot_work *sw;
+
+	if (is_vdi_obj(entry->oid) != vdi_pass)
+		return 0;
+
+	sw = xzalloc(sizeof(struct snapshot_work));
 
 	memcpy(&sw->entry, entry, sizeof(struct trunk_entry));
 	sw->work.fn = do_load_object;
@@ -418,13 +433,23 @@ int farm_load_snapshot(uint32_t idx, const char *tag)
 		goto out;
 
 	wq = create_work_queue("load snapshot", WQ_DYNAMIC);
-	if (for_each_entry_in_trunk(trunk_sha1, queue_load_snapshot_work,
-				    NULL) < 0)
-		goto out;
 
-	work_queue_wait(wq);
-	if (uatomic_is_true(&work_error))
-		goto out;
+	/*
+	 * Load the vdi objects first to register the vdi states, which tell
+	 * the gateway how to lay out the data objects, e.g. the stripe size.
+	 */
+	for (int i = 0; i < 2; i++) {
+		bool vdi_pass = i == 0;
+
+		if (for_each_entry_in_trunk(trunk_sha1,
+					    queue_load_snapshot_work,
+					    &vdi_pass) < 0)
+			goto out;
+
+		work_queue_wait(wq);
+		if (uatomic_is_true(&work_error))
+			goto out;
+	}
 
 	if (create_active_vdis() < 0)
 		goto out;
@@ -345,6 +345,19 @@ again:
 		       stat.r.peer_total_remove_nr, 0UL,
 		       strnumber(stat.r.peer_total_rx),
 		       strnumber(stat.r.peer_total_tx));
+		printf("%s%"PRIu64"\t%"PRIu64"\t%.1f%%\n",
+		       raw_output ? "" :
+		       "\nPlacement cache\tLookup\tMiss\tHit rate\n\t\t",
+		       stat.p.cache_lookup, stat.p.cache_miss,
+		       stat.p.cache_lookup ?
+		       100.0 * (stat.p.cache_lookup - stat.p.cache_miss) /
+		       stat.p.cache_lookup : 0.0);
+		printf("%s%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+		       raw_output ? "" :
+		       "\nCluster lock\tAcquire\tCached\tContended\tWait(us)\n"
+		       "\t\t",
+		       stat.l.acquire_nr, stat.l.cached_nr,
+		       stat.l.contended_nr, stat.l.wait_time);
 	}
 
 	return EXIT_SUCCESS;
@@ -33,6 +33,7 @@ static struct sd_option vdi_options[] = {
 	{'f', "force", false, "do operation forcibly"},
 	{'y', "hyper", false, "create a hyper volume"},
 	{'o', "oid", true, "specify the object id of the tracking object"},
+	{'z', "stripe", true, "specify the erasure coded stripe size (1K to 1M)"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -50,6 +51,7 @@ static struct vdi_cmd_data {
 	bool force;
 	uint8_t copy_policy;
 	uint8_t store_policy;
+	uint8_t ec_stripe_shift;
 	uint64_t oid;
 } vdi_cmd_data = { ~0, };
 
@@ -92,9 +94,7 @@ static char *redundancy_scheme(uint8_t copy_nr, uint8_t policy)
 	static char str[10];
 
 	if (policy > 0) {
-		int d, p;
-		ec_policy_to_dp(policy, &d, &p);
-		snprintf(str, sizeof(str), "%d:%d", d, p);
+		ec_policy_to_str(policy, str, sizeof(str));
 	} else {
 		snprintf(str, sizeof(str), "%d", copy_nr);
 	}
@@ -457,9 +457,33 @@ static int read_vdi_obj(const char *vdiname, int snapid, const char *tag,
 	return EXIT_SUCCESS;
 }
 
+/*
+ * The stripe size of an erasure coded vdi is kept at the end of the inode, so
+ * read it separately when only the inode header has been read
+ */
+static int read_ec_stripe_shift(uint32_t vid, const struct sd_inode *inode,
+				uint8_t *shift)
+{
+	int ret;
+
+	*shift = 0;
+	if (!inode->copy_policy)
+		return EXIT_SUCCESS;
+
+	ret = dog_read_object(vid_to_vdi_oid(vid), shift, sizeof(*shift),
+			      offsetof(struct sd_inode, ec_stripe_shift), true);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to read the stripe size of %"PRIx32, vid);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
-		  uint8_t nr_copies, uint8_t copy_policy, uint8_t store_policy)
+		  uint8_t nr_copies, uint8_t copy_policy, uint8_t store_policy,
+		  uint8_t ec_stripe_shift)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -479,6 +503,7 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 	hdr.vdi.copies = nr_copies;
 	hdr.vdi.copy_policy = copy_policy;
 	hdr.vdi.store_policy = store_policy;
+	hdr.vdi.ec_stripe_shift = ec_stripe_shift;
 
 	ret = dog_exec_req(&sd_nid, &hdr, buf);
 	if (ret < 0)
@@ -529,7 +554,8 @@ static int vdi_create(int argc, char **argv)
 
 	ret = do_vdi_create(vdiname, size, 0, &vid, false,
 			    vdi_cmd_data.nr_copies, vdi_cmd_data.copy_policy,
-			    vdi_cmd_data.store_policy);
+			    vdi_cmd_data.store_policy,
+			    vdi_cmd_data.ec_stripe_shift);
 	if (ret != EXIT_SUCCESS || !vdi_cmd_data.prealloc)
 		goto out;
 
@@ -582,6 +608,7 @@ static int vdi_snapshot(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
 	uint32_t vid, new_vid;
+	uint8_t shift;
 	int ret;
 	char buf[SD_INODE_HEADER_SIZE];
 	struct sd_inode *inode = (struct sd_inode *)buf;
@@ -596,6 +623,10 @@ static int vdi_snapshot(int argc, char **argv)
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
+	ret = read_ec_stripe_shift(vid, inode, &shift);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
 	ret = dog_write_object(vid_to_vdi_oid(vid), 0,
 			       vdi_cmd_data.snapshot_tag,
 			       SD_MAX_VDI_TAG_LEN,
@@ -607,7 +638,7 @@ static int vdi_snapshot(int argc, char **argv)
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, vid, &new_vid, true,
 			    inode->nr_copies, inode->copy_policy,
-			    inode->store_policy);
+			    inode->store_policy, shift);
 
 	if (ret == EXIT_SUCCESS && verbose) {
 		if (raw_output)
@@ -653,7 +684,7 @@ static int vdi_clone(int argc, char **argv)
 
 	ret = do_vdi_create(dst_vdi, inode->vdi_size, base_vid, &new_vid, false,
 			    vdi_cmd_data.nr_copies, inode->copy_policy,
-			    inode->store_policy);
+			    inode->store_policy, inode->ec_stripe_shift);
 	if (ret != EXIT_SUCCESS || !vdi_cmd_data.prealloc)
 		goto out;
 
@@ -827,6 +858,7 @@ static int vdi_rollback(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
 	uint32_t base_vid, new_vid;
+	uint8_t shift;
 	int ret;
 	char buf[SD_INODE_HEADER_SIZE];
 	struct sd_inode *inode = (struct sd_inode *)buf;
@@ -842,6 +874,10 @@ static int vdi_rollback(int argc, char **argv)
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
+	ret = read_ec_stripe_shift(base_vid, inode, &shift);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
 	if (!vdi_cmd_data.force)
 		confirm("This operation dicards any changes made since the"
 			" previous\nsnapshot was taken.  Continue? [yes/no]: ");
@@ -854,7 +890,7 @@ static int vdi_rollback(int argc, char **argv)
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, base_vid, &new_vid,
 			     false, vdi_cmd_data.nr_copies, inode->copy_policy,
-			     inode->store_policy);
+			     inode->store_policy, shift);
 
 	if (ret == EXIT_SUCCESS && verbose) {
 		if (raw_output)
@@ -971,16 +1007,10 @@ static int do_track_object(uint64_t oid, uint8_t nr_copies)
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	const struct sd_vnode *vnode_buf[SD_MAX_COPIES];
-	struct epoch_log *logs;
-	int nr_logs, log_length;
-
-	log_length = sd_epoch * sizeof(struct epoch_log);
-	logs = xmalloc(log_length);
-
-	sd_init_req(&hdr, SD_OP_STAT_CLUSTER);
-	hdr.data_length = log_length;
+	struct epoch_log *logs, *log, **log_array = NULL;
+	int nr_logs = 0;
 
-	ret = dog_exec_req(&sd_nid, &hdr, logs);
+	ret = dog_stat_cluster(&hdr, &logs);
 	if (ret < 0)
 		goto error;
 
@@ -989,42 +1019,54 @@ static int do_track_object(uint64_t oid, uint8_t nr_copies)
 		goto error;
 	}
 
-	nr_logs = rsp->data_length / sizeof(struct epoch_log);
+	for (log = logs; (char *)log < (char *)logs + rsp->data_length;
+	     log = epoch_log_next(log)) {
+		log_array = xrealloc(log_array,
+				     sizeof(*log_array) * (nr_logs + 1));
+		log_array[nr_logs++] = log;
+	}
+
 	for (i = nr_logs - 1; i >= 0; i--) {
 		struct rb_root vroot = RB_ROOT;
 		struct rb_root nroot = RB_ROOT;
+		struct vnode_ring vring;
+
+		log = log_array[i];
 
 		printf("\nobj %"PRIx64" locations at epoch %d, copies = %d\n",
-		       oid, logs[i].epoch, nr_copies);
+		       oid, log->epoch, nr_copies);
 		printf("---------------------------------------------------\n");
 
 		/*
 		 * When # of nodes is less than nr_copies, we only print
 		 * remaining nodes that holds all the remaining copies.
 		 */
-		if (logs[i].nr_nodes < nr_copies) {
-			for (j = 0; j < logs[i].nr_nodes; j++) {
-				const struct node_id *n = &logs[i].nodes[j].nid;
+		if (log->nr_nodes < nr_copies) {
+			for (j = 0; j < log->nr_nodes; j++) {
+				const struct node_id *n = &log->nodes[j].nid;
 
 				printf("%s\n", addr_to_str(n->addr, n->port));
 			}
 			continue;
 		}
-		for (int k = 0; k < logs[i].nr_nodes; k++)
-			rb_insert(&nroot, &logs[i].nodes[k], rb, node_cmp);
-		nodes_to_vnodes(&nroot, &vroot);
-		oid_to_vnodes(oid, &vroot, nr_copies, vnode_buf);
+		for (int k = 0; k < log->nr_nodes; k++)
+			rb_insert(&nroot, &log->nodes[k], rb, node_cmp);
+		nodes_to_vnode_ring(&nroot, &vroot, &vring, sd_cluster_flags);
+		oid_to_vnodes(oid, &vring, nr_copies, vnode_buf);
 		for (j = 0; j < nr_copies; j++) {
 			const struct node_id *n = &vnode_buf[j]->node->nid;
 
 			printf("%s\n", addr_to_str(n->addr, n->port));
 		}
+		vnode_ring_destroy(&vring);
 		rb_destroy(&vroot, struct sd_vnode, rb);
 	}
 
+	free(log_array);
 	free(logs);
 	return EXIT_SUCCESS;
 error:
+	free(log_array);
 	free(logs);
 	return EXIT_SYSFAIL;
 }
@@ -1631,24 +1673,22 @@ static void check_erasure_object(struct vdi_check_info *info)
 {
 	int d = 0, p = 0, i, j, k;
 	int dp = ec_policy_to_dp(info->copy_policy, &d, &p);
-	struct fec *ctx = ec_init(d, dp);
-	int miss_idx[dp], input_idx[dp];
+	struct fec *ctx = ec_init_policy(info->copy_policy);
+	int miss_idx[dp], input_idx[d];
 	uint64_t oid = info->oid;
 	size_t len = get_store_objsize(info->copy_policy, oid);
 	char *obj = xmalloc(len);
-	uint8_t *input[dp];
+	uint8_t *input[d];
+	bool avail[dp];
 
 	for (i = 0; i < dp; i++)
 		miss_idx[i] = -1;
 
-	for (i = 0, j = 0, k = 0; i < info->nr_copies; i++)
-		if (!info->vcw[i].object_found) {
+	for (i = 0, j = 0; i < info->nr_copies; i++) {
+		avail[i] = info->vcw[i].object_found;
+		if (!avail[i])
 			miss_idx[j++] = i;
-		} else {
-			input_idx[k] = i;
-			input[k] = info->vcw[i].buf;
-			k++;
-		}
+	}
 
 	if (!j) { /* No object missing */
 		int idx[d];
@@ -1660,25 +1700,25 @@ static void check_erasure_object(struct vdi_check_info *info)
 			uint8_t *ds[d];
 			for (j = 0; j < d; j++)
 				ds[j] = info->vcw[j].buf;
-			ec_decode_buffer(ctx, ds, idx, obj, d + k);
+			ec_decode_buffer(ctx, ds, idx, obj, d + k, len);
 			if (memcmp(obj, info->vcw[d + k].buf, len) != 0) {
 				/* TODO repair the inconsistency */
 				sd_err("object %"PRIx64" is inconsistent", oid);
 				goto out;
 			}
 		}
-	} else if (j > p) {
+	} else if (!ec_pick_strips(ctx, avail, input_idx)) {
 		sd_err("failed to rebuild object %"PRIx64". %d copies get "
 		       "lost, more than %d", oid, j, p);
 		goto out;
 	} else {
+		for (i = 0; i < d; i++)
+			input[i] = info->vcw[input_idx[i]].buf;
+
 		for (k = 0; k < j; k++) {
 			int m = miss_idx[k];
-			uint8_t *ds[d];
 
-			for (i = 0; i < d; i++)
-				ds[i] = input[i];
-			ec_decode_buffer(ctx, ds, input_idx, obj, m);
+			ec_decode_buffer(ctx, input, input_idx, obj, m, len);
 			write_object_to(info->vcw[m].vnode, oid, obj, true,
 					info->vcw[m].ec_index);
 			fprintf(stdout, "fixed missing %"PRIx64", "
@@ -1768,7 +1808,7 @@ static void queue_vdi_check_work(const struct sd_inode *inode, uint64_t oid,
 	info->wq = wq;
 	info->copy_policy = inode->copy_policy;
 
-	oid_to_vnodes(oid, &sd_vroot, nr_copies, tgt_vnodes);
+	oid_to_vnodes(oid, &sd_vring, nr_copies, tgt_vnodes);
 	for (int i = 0; i < nr_copies; i++) {
 		info->vcw[i].info = info;
 		info->vcw[i].ec_index = i;
@@ -2091,7 +2131,7 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, inode->vdi_id, &vid,
 			    false, inode->nr_copies, inode->copy_policy,
-			    inode->store_policy);
+			    inode->store_policy, inode->ec_stripe_shift);
 	if (ret != EXIT_SUCCESS) {
 		sd_err("Failed to read VDI");
 		goto out;
@@ -2141,6 +2181,7 @@ static int vdi_restore(int argc, char **argv)
 	struct sd_inode *inode_for_check = xzalloc(sizeof(*inode_for_check));
 	struct sd_inode *current_inode = xzalloc(sizeof(*current_inode));
 	struct sd_inode *parent_inode = (struct sd_inode *)buf;
+	uint32_t current_vid;
 	bool need_current_recovery = false;
 
 	if (!vdi_cmd_data.snapshot_id && !vdi_cmd_data.snapshot_tag[0]) {
@@ -2164,11 +2205,16 @@ static int vdi_restore(int argc, char **argv)
 	 * delete the current vdi temporarily first to avoid making
 	 * the current state become snapshot
 	 */
-	ret = read_vdi_obj(vdiname, 0, "", NULL, current_inode,
+	ret = read_vdi_obj(vdiname, 0, "", &current_vid, current_inode,
 			   SD_INODE_HEADER_SIZE);
 	if (ret != EXIT_SUCCESS)
 		goto out;
 
+	ret = read_ec_stripe_shift(current_vid, current_inode,
+				   &current_inode->ec_stripe_shift);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
 	ret = dog_read_object(vid_to_vdi_oid(current_inode->parent_vdi_id),
 			     parent_inode, SD_INODE_HEADER_SIZE, 0, true);
 	if (ret != SD_RES_SUCCESS) {
@@ -2200,7 +2246,8 @@ out:
 					     current_inode->parent_vdi_id, NULL,
 					     true, current_inode->nr_copies,
 					     current_inode->copy_policy,
-					     current_inode->store_policy);
+					     current_inode->store_policy,
+					     current_inode->ec_stripe_shift);
 		if (recovery_ret != EXIT_SUCCESS) {
 			sd_err("failed to resume the current vdi");
 			ret = recovery_ret;
@@ -2334,6 +2381,11 @@ static int vdi_cache_info(int argc, char **argv)
 	fprintf(stdout, "\nCache size %s, used %s, %s\n",
 		strnumber(info.size), strnumber(info.used),
 		info.directio ? "directio" : "non-directio");
+	fprintf(stdout, "Hit %"PRIu64", miss %"PRIu64", evicted %"PRIu64"\n",
+		info.hit, info.miss, info.evict);
+	if (info.mem_size)
+		fprintf(stdout, "RAM tier size %s, used %s\n",
+			strnumber(info.mem_size), strnumber(info.mem_used));
 
 	return EXIT_SUCCESS;
 }
@@ -2408,7 +2460,7 @@ static struct subcommand vdi_cmd[] = {
 	{"check", "<vdiname>", "saph", "check and repair image's consistency",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_check, vdi_options},
-	{"create", "<vdiname> <size>", "Pycaphrv", "create an image",
+	{"create", "<vdiname> <size>", "Pycazphrv", "create an image",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_create, vdi_options},
 	{"snapshot", "<vdiname>", "saphrv", "create a snapshot",
@@ -2466,6 +2518,7 @@ static struct subcommand vdi_cmd[] = {
 static int vdi_parser(int ch, const char *opt)
 {
 	char *p;
+	uint64_t size;
 
 	switch (ch) {
 	case 'P':
@@ -2508,11 +2561,28 @@ static int vdi_parser(int ch, const char *opt)
 			       "  x(1 to %d)   - number of replicated copies\n"
 			       "To create erasure coded vdi, set -c x:y\n"
 			       "  x(2,4,8,16)  - number of data strips\n"
-			       "  y(1 to 15)   - number of parity strips",
+			       "  y(1 to 15)   - number of parity strips\n"
+			       "To create locally repairable coded vdi, "
+			       "set -c x:y:z\n"
+			       "  x(4,8,16)    - number of data strips\n"
+			       "  y(2,4,8)     - number of local groups, "
+			       "less than x\n"
+			       "  z(1 to 4)    - number of global parity strips",
 			       opt, SD_MAX_COPIES);
 			exit(EXIT_FAILURE);
 		}
 		break;
+	case 'z':
+		if (option_parse_size(opt, &size) < 0 ||
+		    (size & (size - 1)) || size < SD_EC_DATA_STRIPE_SIZE ||
+		    size > ec_stripe_size(SD_EC_MAX_STRIPE_SHIFT)) {
+			sd_err("Invalid stripe size %s, it must be a power of 2"
+			       " between 1K and 1M", opt);
+			exit(EXIT_FAILURE);
+		}
+		vdi_cmd_data.ec_stripe_shift =
+			__ffs(size / SD_EC_DATA_STRIPE_SIZE);
+		break;
 	case 'F':
 		vdi_cmd_data.from_snapshot_id = strtol(opt, &p, 10);
 		if (opt == p) {
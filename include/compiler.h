@@ -36,6 +36,9 @@
 
 #define __packed __attribute((packed))
 
+#define CACHE_LINE_SIZE 64
+#define __cacheline_aligned __attribute__((aligned(CACHE_LINE_SIZE)))
+
 #define asmlinkage  __attribute__((regparm(0)))
 
 #define __printf(a, b) __attribute__((format(printf, a, b)))
@@ -128,10 +131,16 @@ static inline int fallocate(int fd, int mode, __off_t offset, __off_t len)
 #define X86_FEATURE_SSSE3	(4 * 32 + 9) /* Supplemental SSE-3 */
 #define X86_FEATURE_OSXSAVE	(4 * 32 + 27) /* "" XSAVE enabled in the OS */
 #define X86_FEATURE_AVX	(4 * 32 + 28) /* Advanced Vector Extensions */
+#define X86_FEATURE_AVX2	(9 * 32 + 5) /* AVX2 instructions */
+#define X86_FEATURE_AVX512F	(9 * 32 + 16) /* AVX-512 Foundation */
+#define X86_FEATURE_AVX512BW	(9 * 32 + 30) /* AVX-512 BW (Byte/Word) */
 
 #define XSTATE_FP	0x1
 #define XSTATE_SSE	0x2
 #define XSTATE_YMM	0x4
+#define XSTATE_OPMASK	0x20
+#define XSTATE_ZMM_Hi256	0x40
+#define XSTATE_Hi16_ZMM	0x80
 
 #define XCR_XFEATURE_ENABLED_MASK	0x00000000
 
@@ -163,6 +172,9 @@ static inline uint64_t xgetbv(uint32_t idx)
 #define cpu_has_ssse3           cpu_has(X86_FEATURE_SSSE3)
 #define cpu_has_avx		cpu_has(X86_FEATURE_AVX)
 #define cpu_has_osxsave		cpu_has(X86_FEATURE_OSXSAVE)
+#define cpu_has_avx2		cpu_has(X86_FEATURE_AVX2)
+#define cpu_has_avx512f		cpu_has(X86_FEATURE_AVX512F)
+#define cpu_has_avx512bw	cpu_has(X86_FEATURE_AVX512BW)
 
 #endif /* __x86_64__ */
 
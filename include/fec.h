@@ -65,13 +65,19 @@
 #include "util.h"
 #include "sheepdog_proto.h"
 
+struct dec_matrix_cache;
+
 struct fec {
 	unsigned long magic;
 	unsigned short d, dp;                     /* parameters of the code */
+	unsigned short l;               /* local groups of LRC, 0 for RS */
 	uint8_t *enc_matrix;
+	struct dec_matrix_cache *dec_cache;  /* recently used decode matrices */
 };
 
 void init_fec(void);
+/* Return the name of the SIMD instruction set used for the GF arithmetic */
+const char *fec_simd_name(void);
 /*
  * param d the number of blocks required to reconstruct
  * param dp the total number of blocks created
@@ -120,10 +126,71 @@ void fec_decode(const struct fec *code,
 #define SD_EC_NR_STRIPE_PER_OBJECT (SD_DATA_OBJ_SIZE / SD_EC_DATA_STRIPE_SIZE)
 #define SD_EC_MAX_STRIP (16)
 
+/*
+ * 1K is the default stripe size.  VDIs for large sequential workloads can
+ * choose a bigger one at creation, which is stored as a shift of the default
+ * size in the inode, to cut the per-stripe overhead.
+ */
+#define SD_EC_MAX_STRIPE_SHIFT (10) /* 1M */
+
+static inline uint32_t ec_stripe_size(uint8_t shift)
+{
+	return SD_EC_DATA_STRIPE_SIZE << shift;
+}
+
+/*
+ * Locally repairable code (LRC) policy
+ *
+ * The d data strips are split into l local groups, each of which has a local
+ * parity (XOR of the group), and r global parities cover all the data strips.
+ * A single lost strip is then rebuilt from the d/l - 1 others of its group
+ * plus the local parity instead of d strips.
+ *
+ * The policy is encoded as 0b11DDLLRR where d = 4 << DD, l = 2 << LL and
+ * r = RR + 1.  Upper nibble of the Reed-Solomon policy is d/2, which is
+ * never 0b11xx, so both can't be confused.
+ *
+ * The strips are laid out as d data strips, then l local parities (the one
+ * of group g at d + g) and then r global parities.
+ */
+#define SD_EC_LRC_FLAG (0xc0)
+
+static inline bool ec_policy_is_lrc(uint8_t policy)
+{
+	return (policy & SD_EC_LRC_FLAG) == SD_EC_LRC_FLAG;
+}
+
+static inline int lrc_policy_to_dlr(uint8_t policy, int *l, int *r)
+{
+	if (l)
+		*l = 2 << ((policy >> 2) & 0b11);
+	if (r)
+		*r = (policy & 0b11) + 1;
+
+	return 4 << ((policy >> 4) & 0b11);
+}
+
+static inline uint8_t lrc_dlr_to_policy(int d, int l, int r)
+{
+	return SD_EC_LRC_FLAG | (__builtin_ctz(d / 4) << 4) |
+		(__builtin_ctz(l / 2) << 2) | (r - 1);
+}
+
 static inline int ec_policy_to_dp(uint8_t policy, int *d, int *p)
 {
 	int ed = 0, ep = 0;
 
+	if (ec_policy_is_lrc(policy)) {
+		int l, r;
+
+		ed = lrc_policy_to_dlr(policy, &l, &r);
+		if (d)
+			*d = ed;
+		if (p)
+			*p = l + r;
+		return ed + l + r;
+	}
+
 	ep = policy & 0b1111;
 	ed = policy >> 4;
 
@@ -154,10 +221,29 @@ static inline int ec_policy_to_dp(uint8_t policy, int *d, int *p)
  *  R1    R2   R3   R4   R5   ...   Rn  Rn+1  Rn+2  Rn+3
  */
 
-/* Return the erasure code context to encode|decode */
-static inline struct fec *ec_init(int d, int dp)
+/*
+ * Return the erasure code context to encode|decode
+ *
+ * The context is immutable, so it is built only once for each (d, dp) and
+ * shared by all the threads.
+ */
+struct fec *ec_init(int d, int dp);
+
+/* Return the erasure code context of the copy policy, either RS or LRC */
+struct fec *ec_init_policy(uint8_t policy);
+
+/* Print the copy policy of erasure coded vdi as 'd:p' or 'd:l:r' for LRC */
+static inline void ec_policy_to_str(uint8_t policy, char *str, size_t size)
 {
-	return fec_new(d, dp);
+	int d, p, l, r;
+
+	if (ec_policy_is_lrc(policy)) {
+		d = lrc_policy_to_dlr(policy, &l, &r);
+		snprintf(str, size, "%d:%d:%d", d, l, r);
+	} else {
+		ec_policy_to_dp(policy, &d, &p);
+		snprintf(str, size, "%d:%d", d, p);
+	}
 }
 
 /*
@@ -178,6 +264,28 @@ static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
 	fec_encode(ctx, ds, ps, pidx, p, SD_EC_DATA_STRIPE_SIZE / ctx->d);
 }
 
+/*
+ * This function encodes nr_stripe stripes at once
+ *
+ * @buf: data of the stripes, laid out stripe by stripe as in the object
+ * @ds: data strips to return, each of which holds its strips of all the
+ *      stripes in a row
+ * @ps: parity strips to return, in the same layout as ds
+ * @stripe_size: size of a data stripe of the vdi
+ */
+void ec_encode_stripes(struct fec *ctx, const uint8_t *buf, uint8_t *ds[],
+		       uint8_t *ps[], int nr_stripe, uint32_t stripe_size);
+
+/*
+ * This function updates the parity strips for a change of a data strip
+ *
+ * @idx: index of the changed data strip
+ * @delta: XOR of the old and new data of the changed range
+ * @ps: parity strips of the changed range to update
+ */
+void ec_update_parity(struct fec *ctx, int idx, const uint8_t *delta,
+		      uint8_t *ps[], size_t len);
+
 /*
  * This function takes input strips and return the lost strip
  *
@@ -191,12 +299,44 @@ void ec_decode(struct fec *ctx, const uint8_t *input[],
 	       const int inidx[],
 	       uint8_t output[], int idx);
 
-/* Destroy the erasure code context */
+/*
+ * This function picks d strips to rebuild the lost ones from
+ *
+ * Data strips are preferred, then the local parity of the groups which lost
+ * only one data strip, and then the global parities.  Any d strips picked so
+ * can rebuild the others, because every square submatrix of the parity part
+ * of a systematic Vandermonde code is invertible.
+ *
+ * @avail: availability of each strip of the stripe
+ * @idx: indexes of the picked strips to return, in numeric order
+ *
+ * Return false if the lost strips can't be rebuilt.
+ */
+bool ec_pick_strips(const struct fec *ctx, const bool avail[], int idx[]);
+
+/*
+ * Return the number of strips to rebuild the strip 'idx' by its local group,
+ * whose indexes are stored in group, or 0 if idx has no local group
+ */
+int ec_local_group(const struct fec *ctx, int idx, int group[]);
+
+/* Rebuild a strip of the local group, which is the XOR of the others */
+void ec_local_decode(const uint8_t *input[], int nr, uint8_t *output,
+		     size_t len);
+
+/* Release the erasure code context, which is kept cached */
 static inline void ec_destroy(struct fec *ctx)
 {
-	fec_free(ctx);
 }
 
+/*
+ * This function rebuilds len bytes of the lost strip object 'idx' from the
+ * same range of the others
+ *
+ * Strips of the same stripe sit at the same offset in all the strip objects,
+ * so this works for any stripe size of the vdi, as long as len is a multiple
+ * of SD_EC_DATA_STRIPE_SIZE / d.
+ */
 void ec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
-		      char *buf, int idx);
+		      char *buf, int idx, size_t len);
 #endif
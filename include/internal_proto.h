@@ -24,7 +24,7 @@
 #include "rbtree.h"
 #include "fec.h"
 
-#define SD_SHEEP_PROTO_VER 0x09
+#define SD_SHEEP_PROTO_VER 0x0c
 
 #define SD_DEFAULT_COPIES 3
 /*
@@ -39,8 +39,9 @@
  * number is determined by the cluster driver because we have to pass
  * sys->cinfo around the cluster to handle membership management.
  *
- * Currently, only zookeeper driver support SD_MAX_NODES nodes because
- * its message buffer size is large enough to hold nodes[SD_MAX_NODES].
+ * Only the actual nodes are sent (see cluster_info_size()), so the limit
+ * is the message buffer size of the driver.  Currently, only zookeeper
+ * driver support SD_MAX_NODES nodes.
  */
 #define SD_MAX_NODES 6144
 #define SD_DEFAULT_VNODES 128
@@ -99,9 +100,11 @@
 #define SD_OP_SET_LOGLEVEL	0xBA
 #define SD_OP_NFS_CREATE	0xBB
 #define SD_OP_NFS_DELETE	0xBC
+#define SD_OP_BATCH		0xBD
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
+#define SD_FLAG_CMD_NOWAIT   0x0800 /* don't wait for the object recovery */
 
 /* flags for VDI attribute operations */
 #define SD_FLAG_CMD_CREAT    0x0100
@@ -130,6 +133,7 @@
 #define SD_RES_NOT_FOUND	0x93 /* Cannot found target */
 
 #define SD_CLUSTER_FLAG_STRICT  0x0001 /* Strict mode for write */
+#define SD_CLUSTER_FLAG_STRAW2  0x0002 /* Place objects by straw2 buckets */
 
 enum sd_status {
 	SD_STATUS_OK = 1,
@@ -190,6 +194,28 @@ struct epoch_log {
 	struct sd_node nodes[SD_MAX_NODES];
 };
 
+/*
+ * Only the first nr_nodes entries of the node lists are sent over the wire,
+ * so the below sizes should be used instead of sizeof().
+ */
+static inline size_t cluster_info_size(const struct cluster_info *cinfo)
+{
+	return offsetof(struct cluster_info, nodes) +
+		cinfo->nr_nodes * sizeof(struct sd_node);
+}
+
+/* SD_OP_STAT_CLUSTER returns the epoch logs packed with this size */
+static inline size_t epoch_log_size(uint32_t nr_nodes)
+{
+	return offsetof(struct epoch_log, nodes) +
+		nr_nodes * sizeof(struct sd_node);
+}
+
+static inline struct epoch_log *epoch_log_next(const struct epoch_log *log)
+{
+	return (struct epoch_log *)((char *)log + epoch_log_size(log->nr_nodes));
+}
+
 struct vdi_op_message {
 	struct sd_req req;
 	struct sd_rsp rsp;
@@ -241,6 +267,11 @@ struct object_cache_info {
 	struct cache_info caches[CACHE_MAX];
 	int count;
 	uint8_t directio;
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t evict;
+	uint64_t mem_size;
+	uint64_t mem_used;
 };
 
 struct sd_stat {
@@ -261,6 +292,17 @@ struct sd_stat {
 		uint64_t peer_total_read_nr;
 		uint64_t peer_total_write_nr;
 	} r;
+	struct s_placement {
+		/* placement cache of the current epoch */
+		uint64_t cache_lookup;
+		uint64_t cache_miss;
+	} p;
+	struct s_lock {
+		uint64_t acquire_nr; /* nr of cluster lock acquisitions */
+		uint64_t cached_nr; /* handed over without the lock service */
+		uint64_t contended_nr; /* waited for another local holder */
+		uint64_t wait_time; /* total wait in microseconds */
+	} l;
 };
 
 void sd_inode_stat(const struct sd_inode *inode, uint64_t *, uint64_t *,
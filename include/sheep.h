@@ -26,9 +26,47 @@ struct sd_vnode {
 	uint64_t hash;
 };
 
+/* Algorithms to place objects, selected at format */
+enum sd_placement {
+	SD_PLACEMENT_RING = 0,	/* consistent hashing over the vnode ring */
+	SD_PLACEMENT_STRAW2,	/* weighted straw2 buckets of zones and nodes */
+};
+
+/*
+ * A flattened copy of the vnode ring
+ *
+ * The vnode hashes are kept sorted in one contiguous array and the zone and
+ * the vnode of each entry are stored at the same index of 'zones' and
+ * 'vnodes'.  This is much more cache friendly than walking the rb-tree of
+ * separately allocated vnodes, so the placement of objects uses it.
+ *
+ * For straw2, there is one entry per node instead, which is grouped by zone.
+ * 'hashes' holds the hash of the node id and the weight of the node is its
+ * number of vnodes.
+ */
+struct vnode_ring {
+	enum sd_placement algo;
+	int nr_vnodes;
+	uint64_t *hashes;
+	uint32_t *zones;
+	const struct sd_vnode **vnodes;
+
+	/* straw2 only */
+	struct sd_vnode *buckets;	/* entries owned by the ring */
+	uint32_t *weights;
+	int nr_zones;
+	int *zone_start;		/* entries of zone z start at [z] */
+	uint64_t *zone_hashes;
+	uint64_t *zone_weights;
+};
+
+struct placement_cache;
+
 struct vnode_info {
 	struct rb_root vroot;
 	struct rb_root nroot;
+	struct vnode_ring vring;
+	struct placement_cache *pcache;
 	int nr_nodes;
 	int nr_zones;
 	refcnt_t refcnt;
@@ -53,67 +91,441 @@ static inline int vnode_cmp(const struct sd_vnode *node1,
 	return intcmp(node1->hash, node2->hash);
 }
 
-/* If v1_hash < oid_hash <= v2_hash, then oid is resident on v2 */
-static inline struct sd_vnode *
-oid_to_first_vnode(uint64_t oid, struct rb_root *root)
+/* Build the ring from the vnode tree, which must outlive the ring */
+static inline void vnode_ring_init(struct vnode_ring *ring,
+				   struct rb_root *vroot)
 {
-	struct sd_vnode dummy = {
-		.hash = sd_hash_oid(oid),
-	};
-	return rb_nsearch(root, &dummy, rb, vnode_cmp);
+	struct sd_vnode *v;
+	int n = 0;
+
+	rb_for_each_entry(v, vroot, rb)
+		n++;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->algo = SD_PLACEMENT_RING;
+	ring->nr_vnodes = n;
+	ring->hashes = xmalloc(sizeof(*ring->hashes) * n);
+	ring->zones = xmalloc(sizeof(*ring->zones) * n);
+	ring->vnodes = xmalloc(sizeof(*ring->vnodes) * n);
+
+	n = 0;
+	rb_for_each_entry(v, vroot, rb) {
+		ring->hashes[n] = v->hash;
+		ring->zones[n] = v->node->zone;
+		ring->vnodes[n] = v;
+		n++;
+	}
 }
 
-/* Replica are placed along the ring one by one with different zones */
-static inline void oid_to_vnodes(uint64_t oid, struct rb_root *root,
-				 int nr_copies,
-				 const struct sd_vnode **vnodes)
+static inline int bucket_cmp(const struct sd_vnode *b1,
+			     const struct sd_vnode *b2)
+{
+	return intcmp(b1->node->zone, b2->node->zone) ?:
+		intcmp(b1->hash, b2->hash);
+}
+
+/* Build the straw2 buckets from the nodes, which must outlive the ring */
+static inline void vnode_ring_init_straw2(struct vnode_ring *ring,
+					  struct rb_root *nroot)
+{
+	struct sd_node *n;
+	int nr = 0, z = -1;
+
+	rb_for_each_entry(n, nroot, rb)
+		if (n->nr_vnodes)
+			nr++;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->algo = SD_PLACEMENT_STRAW2;
+	ring->nr_vnodes = nr;
+	ring->hashes = xmalloc(sizeof(*ring->hashes) * nr);
+	ring->zones = xmalloc(sizeof(*ring->zones) * nr);
+	ring->vnodes = xmalloc(sizeof(*ring->vnodes) * nr);
+	ring->buckets = xmalloc(sizeof(*ring->buckets) * nr);
+	ring->weights = xmalloc(sizeof(*ring->weights) * nr);
+	ring->zone_start = xmalloc(sizeof(*ring->zone_start) * (nr + 1));
+	ring->zone_hashes = xmalloc(sizeof(*ring->zone_hashes) * nr);
+	ring->zone_weights = xzalloc(sizeof(*ring->zone_weights) * nr);
+
+	nr = 0;
+	rb_for_each_entry(n, nroot, rb) {
+		if (!n->nr_vnodes)
+			continue;
+		ring->buckets[nr].node = n;
+		ring->buckets[nr].hash = sd_hash(&n->nid,
+						 offsetof(typeof(n->nid),
+							  io_addr));
+		nr++;
+	}
+	xqsort(ring->buckets, nr, bucket_cmp);
+
+	for (int i = 0; i < nr; i++) {
+		const struct sd_node *node = ring->buckets[i].node;
+
+		if (z < 0 || node->zone != ring->zones[i - 1]) {
+			ring->zone_start[++z] = i;
+			ring->zone_hashes[z] = sd_hash_64(node->zone);
+		}
+		ring->hashes[i] = ring->buckets[i].hash;
+		ring->zones[i] = node->zone;
+		ring->vnodes[i] = ring->buckets + i;
+		ring->weights[i] = node->nr_vnodes;
+		ring->zone_weights[z] += node->nr_vnodes;
+	}
+	ring->nr_zones = z + 1;
+	ring->zone_start[ring->nr_zones] = nr;
+}
+
+static inline void vnode_ring_destroy(struct vnode_ring *ring)
+{
+	free(ring->hashes);
+	free(ring->zones);
+	free(ring->vnodes);
+	free(ring->buckets);
+	free(ring->weights);
+	free(ring->zone_start);
+	free(ring->zone_hashes);
+	free(ring->zone_weights);
+	ring->nr_vnodes = 0;
+}
+
+/*
+ * Return the index of the first vnode whose hash is equal to or larger than
+ * 'hash', starting the scan at 'start'.
+ *
+ * When objects are placed in ascending order of their hashes, passing the
+ * previous result as 'start' turns the lookups into one linear sweep over the
+ * ring.  The result can be nr_vnodes, which means the ring wraps around.
+ */
+static inline int vnode_ring_seek(const struct vnode_ring *ring, uint64_t hash,
+				  int start)
 {
-	const struct sd_vnode *next = oid_to_first_vnode(oid, root);
+	int i = start;
 
-	vnodes[0] = next;
+	while (i < ring->nr_vnodes && ring->hashes[i] < hash)
+		i++;
+
+	return i;
+}
+
+/* Same as vnode_ring_seek() for a single object, by a binary search */
+static inline int vnode_ring_find(const struct vnode_ring *ring, uint64_t hash)
+{
+	int lo = 0, hi = ring->nr_vnodes;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (ring->hashes[mid] < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Replica are placed along the ring one by one with different zones, starting
+ * from the ring index 'idx'.  Return the ring indexes of the replica in 'out'.
+ */
+static inline void vnode_ring_walk(const struct vnode_ring *ring, int idx,
+				   int nr_copies, int *out)
+{
+	uint32_t zones[SD_MAX_COPIES];
+	int first, next;
+
+	first = next = idx < ring->nr_vnodes ? idx : 0;
+	out[0] = first;
+	zones[0] = ring->zones[first];
 	for (int i = 1; i < nr_copies; i++) {
 next:
-		next = rb_entry(rb_next(&next->rb), struct sd_vnode, rb);
-		if (!next) /* Wrap around */
-			next = rb_entry(rb_first(root), struct sd_vnode, rb);
-		if (unlikely(next == vnodes[0]))
+		if (++next == ring->nr_vnodes) /* Wrap around */
+			next = 0;
+		if (unlikely(next == first))
 			panic("can't find a valid vnode");
 		for (int j = 0; j < i; j++)
-			if (same_zone(vnodes[j], next))
+			if (zones[j] == ring->zones[next])
 				goto next;
-		vnodes[i] = next;
+		out[i] = next;
+		zones[i] = ring->zones[next];
+	}
+}
+
+/* Same as oid_to_nodes(), but start from the ring index 'idx' */
+static inline void vnode_ring_to_nodes(const struct vnode_ring *ring, int idx,
+				       int nr_copies,
+				       const struct sd_node **nodes)
+{
+	int out[SD_MAX_COPIES];
+
+	vnode_ring_walk(ring, idx, nr_copies, out);
+	for (int i = 0; i < nr_copies; i++)
+		nodes[i] = ring->vnodes[out[i]]->node;
+}
+
+/*
+ * log2(x) in 16.16 fixed point
+ *
+ * Only integer arithmetic is used, so that all the nodes agree on the
+ * placement whatever their floating point units are.
+ */
+static inline uint32_t fixed_log2(uint64_t x)
+{
+	int n = 63 - __builtin_clzll(x);
+	/* the mantissa in [1, 2) as 1.30 fixed point */
+	uint64_t y = n > 30 ? x >> (n - 30) : x << (30 - n);
+	uint32_t r = n << 16;
+
+	for (int i = 15; i >= 0; i--) {
+		y = (y * y) >> 30;
+		if (y >= (2ULL << 30)) {
+			y >>= 1;
+			r |= 1U << i;
+		}
+	}
+
+	return r;
+}
+
+/*
+ * The straw of an item for the object, -log2 of a uniform value in (0, 1]
+ *
+ * The straw divided by the weight of the item is exponentially distributed
+ * with the rate of the weight, so the item of the shortest one is picked with
+ * the probability proportional to its weight.  Changing an item only moves
+ * the objects which pick it before or after the change.
+ */
+static inline uint32_t straw2_len(uint64_t hash, uint64_t item_hash)
+{
+	uint64_t h = sd_hash_next(hash ^ item_hash);
+
+	return (48 << 16) - fixed_log2((h >> 16) + 1);
+}
+
+/* Return true if l1 / w1 < l2 / w2 */
+static inline bool straw2_shorter(uint64_t l1, uint64_t w1, uint64_t l2,
+				  uint64_t w2)
+{
+	return l1 * w2 < l2 * w1;
+}
+
+/*
+ * Place the replica of the object on the nr_copies zones of the shortest
+ * straws, and on the node of the shortest straw in each zone
+ */
+static inline void straw2_place(const struct vnode_ring *ring, uint64_t hash,
+				int nr_copies, int *out)
+{
+	uint32_t len[SD_MAX_COPIES];
+	int top[SD_MAX_COPIES], n = 0;
+
+	if (unlikely(nr_copies > ring->nr_zones))
+		panic("can't find a valid vnode");
+
+	for (int z = 0; z < ring->nr_zones; z++) {
+		uint32_t l = straw2_len(hash, ring->zone_hashes[z]);
+		uint64_t w = ring->zone_weights[z];
+		int j;
+
+		if (n == nr_copies &&
+		    !straw2_shorter(l, w, len[n - 1],
+				    ring->zone_weights[top[n - 1]]))
+			continue;
+		if (n < nr_copies)
+			n++;
+		for (j = n - 1; j > 0; j--) {
+			if (!straw2_shorter(l, w, len[j - 1],
+					    ring->zone_weights[top[j - 1]]))
+				break;
+			top[j] = top[j - 1];
+			len[j] = len[j - 1];
+		}
+		top[j] = z;
+		len[j] = l;
 	}
+
+	for (int i = 0; i < nr_copies; i++) {
+		int start = ring->zone_start[top[i]];
+		int end = ring->zone_start[top[i] + 1], best = start;
+		uint32_t best_len = 0;
+
+		for (int k = start; k < end && end - start > 1; k++) {
+			uint32_t l = straw2_len(hash, ring->hashes[k]);
+
+			if (k == start ||
+			    straw2_shorter(l, ring->weights[k], best_len,
+					   ring->weights[best])) {
+				best = k;
+				best_len = l;
+			}
+		}
+		out[i] = best;
+	}
+}
+
+/* Return the entries of the replica of the object of 'hash' in 'out' */
+static inline void vnode_ring_place(const struct vnode_ring *ring,
+				    uint64_t hash, int nr_copies, int *out)
+{
+	if (ring->algo == SD_PLACEMENT_STRAW2)
+		straw2_place(ring, hash, nr_copies, out);
+	else
+		vnode_ring_walk(ring, vnode_ring_find(ring, hash), nr_copies,
+				out);
+}
+
+/*
+ * For the ring, if v1_hash < oid_hash <= v2_hash, then oid is resident on v2
+ */
+static inline void oid_to_vnodes(uint64_t oid, const struct vnode_ring *ring,
+				 int nr_copies,
+				 const struct sd_vnode **vnodes)
+{
+	int out[SD_MAX_COPIES];
+
+	vnode_ring_place(ring, sd_hash_oid(oid), nr_copies, out);
+	for (int i = 0; i < nr_copies; i++)
+		vnodes[i] = ring->vnodes[out[i]];
 }
 
 static inline const struct sd_vnode *
-oid_to_vnode(uint64_t oid, struct rb_root *root, int copy_idx)
+oid_to_vnode(uint64_t oid, const struct vnode_ring *ring, int copy_idx)
 {
 	const struct sd_vnode *vnodes[SD_MAX_COPIES];
 
-	oid_to_vnodes(oid, root, copy_idx + 1, vnodes);
+	oid_to_vnodes(oid, ring, copy_idx + 1, vnodes);
 
 	return vnodes[copy_idx];
 }
 
 static inline const struct sd_node *
-oid_to_node(uint64_t oid, struct rb_root *root, int copy_idx)
+oid_to_node(uint64_t oid, const struct vnode_ring *ring, int copy_idx)
 {
 	const struct sd_vnode *vnode;
 
-	vnode = oid_to_vnode(oid, root, copy_idx);
+	vnode = oid_to_vnode(oid, ring, copy_idx);
 
 	return vnode->node;
 }
 
-static inline void oid_to_nodes(uint64_t oid, struct rb_root *root,
+static inline void oid_to_nodes(uint64_t oid, const struct vnode_ring *ring,
 				int nr_copies,
 				const struct sd_node **nodes)
 {
-	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	int out[SD_MAX_COPIES];
 
-	oid_to_vnodes(oid, root, nr_copies, vnodes);
+	vnode_ring_place(ring, sd_hash_oid(oid), nr_copies, out);
 	for (int i = 0; i < nr_copies; i++)
-		nodes[i] = vnodes[i]->node;
+		nodes[i] = ring->vnodes[out[i]]->node;
+}
+
+/*
+ * Placement cache of hot objects
+ *
+ * The gateway and recovery place the same objects many times a second, so
+ * each vnode_info keeps the ring indexes of the replica of recently used
+ * objects in a direct mapped cache.  A new epoch comes with a new vnode_info,
+ * which starts with an empty cache, so no entry outlives its ring.
+ *
+ * The cache is lock-free.  Each entry is protected by a sequence count which
+ * is odd while a writer updates it.  A reader which sees the count change
+ * takes it as a miss instead of retrying, and a writer which loses the race
+ * for an entry just gives up caching the object.
+ */
+#define PLACEMENT_CACHE_BITS 10
+
+struct placement_entry {
+	unsigned long seq;
+	uint64_t oid;
+	int nr_copies;
+	int idx[SD_MAX_COPIES];
+};
+
+struct placement_cache {
+	struct placement_entry entries[1 << PLACEMENT_CACHE_BITS];
+	/* Counted per thread not to share a cache line on every lookup */
+	struct placement_stat {
+		unsigned long nr_lookup;
+		unsigned long nr_miss;
+	} __cacheline_aligned stat[NR_STAT_SLOTS];
+};
+
+/* Sum up the lookups and misses of all the threads */
+static inline void placement_cache_get_stat(struct placement_cache *pc,
+					    uint64_t *nr_lookup,
+					    uint64_t *nr_miss)
+{
+	*nr_lookup = *nr_miss = 0;
+	for (int i = 0; i < NR_STAT_SLOTS; i++) {
+		*nr_lookup += uatomic_read(&pc->stat[i].nr_lookup);
+		*nr_miss += uatomic_read(&pc->stat[i].nr_miss);
+	}
+}
+
+static inline struct placement_entry *
+placement_cache_slot(struct placement_cache *pc, uint64_t oid)
+{
+	/* Fibonacci hashing, much cheaper than sd_hash_oid() */
+	uint64_t h = oid * 0x9E3779B97F4A7C15ULL;
+
+	return &pc->entries[h >> (64 - PLACEMENT_CACHE_BITS)];
+}
+
+static inline bool placement_cache_lookup(struct placement_cache *pc,
+					  uint64_t oid, int nr_copies,
+					  int *idx)
+{
+	struct placement_entry *e = placement_cache_slot(pc, oid);
+	unsigned long seq = uatomic_read(&e->seq);
+
+	if (seq & 1)
+		return false;
+	cmm_smp_rmb();
+	/* replica are placed one by one, so a longer list is also fine */
+	if (e->oid != oid || e->nr_copies < nr_copies)
+		return false;
+	memcpy(idx, e->idx, sizeof(*idx) * nr_copies);
+	cmm_smp_rmb();
+
+	return uatomic_read(&e->seq) == seq;
+}
+
+static inline void placement_cache_insert(struct placement_cache *pc,
+					  uint64_t oid, int nr_copies,
+					  const int *idx)
+{
+	struct placement_entry *e = placement_cache_slot(pc, oid);
+	unsigned long seq = uatomic_read(&e->seq);
+
+	if ((seq & 1) || uatomic_cmpxchg(&e->seq, seq, seq + 1) != seq)
+		return;
+	e->oid = oid;
+	e->nr_copies = nr_copies;
+	memcpy(e->idx, idx, sizeof(*idx) * nr_copies);
+	cmm_smp_wmb();
+	uatomic_set(&e->seq, seq + 2);
+}
+
+/* Same as oid_to_vnodes(), but look up the placement cache first */
+static inline void oid_to_vnodes_cached(uint64_t oid,
+					const struct vnode_ring *ring,
+					struct placement_cache *pc,
+					int nr_copies,
+					const struct sd_vnode **vnodes)
+{
+	struct placement_stat *stat = pc->stat + stat_slot();
+	int idx[SD_MAX_COPIES];
+
+	uatomic_inc(&stat->nr_lookup);
+	if (!placement_cache_lookup(pc, oid, nr_copies, idx)) {
+		uatomic_inc(&stat->nr_miss);
+		vnode_ring_place(ring, sd_hash_oid(oid), nr_copies, idx);
+		placement_cache_insert(pc, oid, nr_copies, idx);
+	}
+
+	for (int i = 0; i < nr_copies; i++)
+		vnodes[i] = ring->vnodes[idx[i]];
 }
 
 static inline const char *sd_strerror(int err)
@@ -230,6 +642,25 @@ nodes_to_vnodes(struct rb_root *nroot, struct rb_root *vroot)
 		node_to_vnodes(n, vroot);
 }
 
+/*
+ * Build the placement of the nodes by the algorithm in the cluster flags
+ *
+ * The vnodes are added to vroot only for the ring, but vroot must be
+ * destroyed after the ring in both cases.
+ */
+static inline void nodes_to_vnode_ring(struct rb_root *nroot,
+				       struct rb_root *vroot,
+				       struct vnode_ring *ring,
+				       uint16_t cluster_flags)
+{
+	if (cluster_flags & SD_CLUSTER_FLAG_STRAW2) {
+		vnode_ring_init_straw2(ring, nroot);
+	} else {
+		nodes_to_vnodes(nroot, vroot);
+		vnode_ring_init(ring, vroot);
+	}
+}
+
 static inline void nodes_to_buffer(struct rb_root *nroot, void *buffer)
 {
 	struct sd_node *n, *buf = buffer;
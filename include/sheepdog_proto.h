@@ -143,7 +143,7 @@ struct sd_req {
 			uint8_t		copies;
 			uint8_t		copy_policy;
 			uint8_t		store_policy;
-			uint8_t		reserved;
+			uint8_t		ec_stripe_shift;
 			uint32_t	snapid;
 		} vdi;
 
@@ -163,7 +163,12 @@ struct sd_req {
 			uint8_t		set_bitmap; /* 0 means false */
 						    /* others mean true */
 			uint8_t		copy_policy;
+			uint8_t		ec_stripe_shift;
 		} vdi_state;
+		struct {
+			uint64_t	generation;
+			uint64_t	version;
+		} vdi_sync;
 
 		uint32_t		__pad[8];
 	};
@@ -197,7 +202,9 @@ struct sd_rsp {
 		struct {
 			uint32_t	__pad;
 			uint32_t	nr_nodes;
-			uint32_t	__reserved[2];
+			uint16_t	cluster_flags;
+			uint16_t	__reserved1;
+			uint32_t	__reserved2;
 			uint64_t	store_size;
 			uint64_t	store_free;
 		} node;
@@ -206,6 +213,12 @@ struct sd_rsp {
 			uint32_t	__pad2;
 			uint8_t		digest[20];
 		} hash;
+		struct {
+			uint32_t	__pad1;
+			uint32_t	__pad2;
+			uint64_t	generation;
+			uint64_t	version;
+		} vdi_sync;
 
 		uint32_t		__pad[8];
 	};
@@ -229,6 +242,14 @@ struct sd_inode {
 	uint32_t child_vdi_id[MAX_CHILDREN];
 	uint32_t data_vdi_id[SD_INODE_DATA_INDEX];
 	uint32_t btree_counter;
+	/*
+	 * The shift of the erasure coded stripe size.  This takes the tail
+	 * padding of the structure, so the size of the inode doesn't change
+	 * and older versions, which always zeroed it, read all VDIs as 1K.
+	 * It is not in the inode header, which most readers read only.
+	 */
+	uint8_t  ec_stripe_shift;
+	uint8_t  __pad[3];
 };
 
 struct sd_extent {
@@ -288,6 +309,9 @@ extern void sd_inode_copy_vdis(write_node_fn writer, read_node_fn reader,
 			       uint8_t nr_copies, uint8_t copy_policy,
 			       struct sd_inode *newi);
 
+extern void sd_inode_invalidate_bnode(uint64_t oid);
+extern void sd_inode_set_cache_size(size_t size);
+
 typedef void (*btree_cb_fn)(void *data, enum btree_node_type type, void *arg);
 extern void traverse_btree(read_node_fn reader, const struct sd_inode *inode,
 			   btree_cb_fn fn, void *arg);
@@ -469,6 +493,10 @@ static inline __attribute__((used)) void __sd_proto_build_bug_ons(void)
 	/* never called, only for checking BUILD_BUG_ON()s */
 	BUILD_BUG_ON(sizeof(struct sd_req) != SD_REQ_SIZE);
 	BUILD_BUG_ON(sizeof(struct sd_rsp) != SD_RSP_SIZE);
+	/* ec_stripe_shift must stay in what was the tail padding */
+	BUILD_BUG_ON(offsetof(struct sd_inode, ec_stripe_shift) % 8 != 4);
+	BUILD_BUG_ON(sizeof(struct sd_inode) !=
+		     offsetof(struct sd_inode, ec_stripe_shift) + 4);
 }
 
 #endif
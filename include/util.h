@@ -265,6 +265,24 @@ static inline int refcount_dec(refcnt_t *rc)
 	return uatomic_sub_return(&rc->val, 1);
 }
 
+/*
+ * Statistics which many threads count are split into NR_STAT_SLOTS cache
+ * lines.  A thread counts into the slot of stat_slot() only, so that the
+ * threads don't bounce a shared cache line, and a reader sums all the slots.
+ * Threads share a slot only when there are more of them than the slots.
+ */
+#define NR_STAT_SLOTS 64
+
+extern __thread int stat_slot_idx;
+int alloc_stat_slot(void);
+
+static inline int stat_slot(void)
+{
+	if (unlikely(stat_slot_idx < 0))
+		stat_slot_idx = alloc_stat_slot();
+	return stat_slot_idx;
+}
+
 /* wrapper for pthread_mutex */
 
 #define SD_MUTEX_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER }
@@ -443,6 +461,11 @@ static inline void sd_write_lock(struct sd_rw_lock *lock)
 		panic("failed to lock for writing, %s", strerror(ret));
 }
 
+static inline int sd_write_trylock(struct sd_rw_lock *lock)
+{
+	return pthread_rwlock_trywrlock(&lock->rwlock);
+}
+
 static inline void sd_rw_unlock(struct sd_rw_lock *lock)
 {
 	int ret;
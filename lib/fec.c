@@ -62,6 +62,10 @@
 #include "fec.h"
 #include "util.h"
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 /*
  * Primitive polynomials - see Lin & Costello, Appendix A,
  * and  Lee & Messerschmitt, p. 453.
@@ -210,7 +214,7 @@ static void generate_gf(void)
  */
 #define addmul(dst, src, c, sz)                 \
 	if (c != 0)				\
-		_addmul1(dst, src, c, sz)
+		addmul_fn(dst, src, c, sz)
 
 #define UNROLL 16               /* 1, 4, 8, 16 */
 static void _addmul1(register uint8_t *dst,
@@ -251,6 +255,141 @@ static void _addmul1(register uint8_t *dst,
 		GF_ADDMULC(*dst, *src);
 }
 
+/*
+ * SIMD versions of _addmul1()
+ *
+ * c * x is split into c * (x & 0x0f) ^ c * (x & 0xf0), and both halves are
+ * looked up from 16-entry tables with PSHUFB, which multiplies 16, 32 or 64
+ * bytes at once depending on the vector width.  The tails shorter than a
+ * vector are handled by _addmul1().
+ */
+static uint8_t gf_mul_lo[256][16] __attribute__((aligned(16)));
+static uint8_t gf_mul_hi[256][16] __attribute__((aligned(16)));
+
+static void _init_mul_nibble_table(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 16; j++) {
+			gf_mul_lo[i][j] = gf_mul(i, j);
+			gf_mul_hi[i][j] = gf_mul(i, j << 4);
+		}
+}
+
+#ifdef __x86_64__
+
+__attribute__((target("ssse3")))
+static void addmul_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+			 size_t sz)
+{
+	const __m128i lo = _mm_load_si128((const __m128i *)gf_mul_lo[c]);
+	const __m128i hi = _mm_load_si128((const __m128i *)gf_mul_hi[c]);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 16 <= sz; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+		__m128i h = _mm_shuffle_epi8(hi,
+				_mm_and_si128(_mm_srli_epi64(s, 4), mask));
+
+		d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+	if (i < sz)
+		_addmul1(dst + i, src + i, c, sz - i);
+}
+
+__attribute__((target("avx2")))
+static void addmul_avx2(uint8_t *dst, const uint8_t *src, uint8_t c,
+			size_t sz)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(
+		_mm_load_si128((const __m128i *)gf_mul_lo[c]));
+	const __m256i hi = _mm256_broadcastsi128_si256(
+		_mm_load_si128((const __m128i *)gf_mul_hi[c]));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 32 <= sz; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+		__m256i h = _mm256_shuffle_epi8(hi,
+				_mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+
+		d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+		_mm256_storeu_si256((__m256i *)(dst + i), d);
+	}
+	if (i < sz)
+		addmul_ssse3(dst + i, src + i, c, sz - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void addmul_avx512(uint8_t *dst, const uint8_t *src, uint8_t c,
+			  size_t sz)
+{
+	const __m512i lo = _mm512_broadcast_i32x4(
+		_mm_load_si128((const __m128i *)gf_mul_lo[c]));
+	const __m512i hi = _mm512_broadcast_i32x4(
+		_mm_load_si128((const __m128i *)gf_mul_hi[c]));
+	const __m512i mask = _mm512_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 64 <= sz; i += 64) {
+		__m512i s = _mm512_loadu_si512((const void *)(src + i));
+		__m512i d = _mm512_loadu_si512((const void *)(dst + i));
+		__m512i l = _mm512_shuffle_epi8(lo, _mm512_and_si512(s, mask));
+		__m512i h = _mm512_shuffle_epi8(hi,
+				_mm512_and_si512(_mm512_srli_epi64(s, 4), mask));
+
+		d = _mm512_xor_si512(d, _mm512_xor_si512(l, h));
+		_mm512_storeu_si512((void *)(dst + i), d);
+	}
+	if (i < sz)
+		addmul_avx2(dst + i, src + i, c, sz - i);
+}
+
+/* Check if the OS saves the register states of the vector width */
+static bool xstate_enabled(uint64_t mask)
+{
+	if (!cpu_has_osxsave)
+		return false;
+
+	return (xgetbv(XCR_XFEATURE_ENABLED_MASK) & mask) == mask;
+}
+
+#endif /* __x86_64__ */
+
+static void (*addmul_fn)(uint8_t *, const uint8_t *, uint8_t, size_t) =
+	_addmul1;
+static const char *addmul_name = "generic";
+
+static void select_addmul(void)
+{
+#ifdef __x86_64__
+	if (cpu_has_avx512f && cpu_has_avx512bw &&
+	    xstate_enabled(XSTATE_SSE | XSTATE_YMM | XSTATE_OPMASK |
+			   XSTATE_ZMM_Hi256 | XSTATE_Hi16_ZMM)) {
+		addmul_fn = addmul_avx512;
+		addmul_name = "avx512";
+	} else if (cpu_has_avx2 && xstate_enabled(XSTATE_SSE | XSTATE_YMM)) {
+		addmul_fn = addmul_avx2;
+		addmul_name = "avx2";
+	} else if (cpu_has_ssse3) {
+		addmul_fn = addmul_ssse3;
+		addmul_name = "ssse3";
+	}
+#endif
+}
+
+const char *fec_simd_name(void)
+{
+	return addmul_name;
+}
+
 /* computes C = AB where A is dp*d, B is d*m, C is dp*m */
 static void _matmul(uint8_t *a, uint8_t *b, uint8_t *c, unsigned dp, unsigned d,
 		    unsigned m)
@@ -435,6 +574,8 @@ void init_fec(void)
 {
 	generate_gf();
 	_init_mul_table();
+	_init_mul_nibble_table();
+	select_addmul();
 }
 
 /*
@@ -445,10 +586,53 @@ void init_fec(void)
 
 #define FEC_MAGIC	0xFECC0DEC
 
+/*
+ * Inverting the decode matrix is O(d^3), while the set of the available strips
+ * rarely changes.  So each context keeps the recently used decode matrices in
+ * an LRU list keyed by the strip indexes passed to fec_decode().  The list is
+ * looked up once per call, and ec_decode_buffer() uses the matrix for all the
+ * stripes of the buffer.
+ */
+#define MAX_DEC_MATRIX	64
+
+struct dec_matrix {
+	struct list_node list;
+	uint8_t idx[SD_EC_MAX_STRIP];
+	uint8_t matrix[];
+};
+
+struct dec_matrix_cache {
+	struct sd_mutex lock;
+	struct list_head head;
+	int nr;
+};
+
+static struct dec_matrix_cache *alloc_dec_matrix_cache(void)
+{
+	struct dec_matrix_cache *cache = xzalloc(sizeof(*cache));
+
+	sd_init_mutex(&cache->lock);
+	INIT_LIST_HEAD(&cache->head);
+	return cache;
+}
+
+static void free_dec_matrix_cache(struct dec_matrix_cache *cache)
+{
+	struct dec_matrix *m;
+
+	list_for_each_entry(m, &cache->head, list) {
+		list_del(&m->list);
+		free(m);
+	}
+	sd_destroy_mutex(&cache->lock);
+	free(cache);
+}
+
 void fec_free(struct fec *p)
 {
 	assert(p != NULL && p->magic == (((FEC_MAGIC ^ p->d) ^ p->dp) ^
 					 (unsigned long) (p->enc_matrix)));
+	free_dec_matrix_cache(p->dec_cache);
 	free(p->enc_matrix);
 	free(p);
 }
@@ -463,6 +647,7 @@ struct fec *fec_new(unsigned short d, unsigned short dp)
 	retval = (struct fec *)xmalloc(sizeof(struct fec));
 	retval->d = d;
 	retval->dp = dp;
+	retval->l = 0;
 	retval->enc_matrix = NEW_GF_MATRIX(dp, d);
 	retval->magic = ((FEC_MAGIC^d)^dp)^(unsigned long)(retval->enc_matrix);
 	tmp_m = NEW_GF_MATRIX(dp, d);
@@ -489,10 +674,100 @@ struct fec *fec_new(unsigned short d, unsigned short dp)
 	for (p = retval->enc_matrix, col = 0; col < d; col++, p += d + 1)
 		*p = 1;
 	free(tmp_m);
+	retval->dec_cache = alloc_dec_matrix_cache();
 
 	return retval;
 }
 
+/*
+ * Build the generator of LRC: the identity on top, then a row of ones over
+ * the data strips of each local group and the parity rows of the systematic
+ * Vandermonde code with r parities at the bottom.
+ */
+static struct fec *lrc_new(unsigned short d, unsigned short l,
+			   unsigned short r)
+{
+	struct fec *rs = fec_new(d, d + r), *retval;
+	unsigned short dp = d + l + r, group_size = d / l;
+	uint8_t *p;
+
+	retval = (struct fec *)xmalloc(sizeof(struct fec));
+	retval->d = d;
+	retval->dp = dp;
+	retval->l = l;
+	retval->enc_matrix = NEW_GF_MATRIX(dp, d);
+	retval->magic = ((FEC_MAGIC^d)^dp)^(unsigned long)(retval->enc_matrix);
+
+	memcpy(retval->enc_matrix, rs->enc_matrix, d * d);
+	p = retval->enc_matrix + d * d;
+	memset(p, 0, l * d);
+	for (unsigned g = 0; g < l; g++, p += d)
+		memset(p + g * group_size, 1, group_size);
+	memcpy(p, rs->enc_matrix + d * d, r * d);
+	fec_free(rs);
+	retval->dec_cache = alloc_dec_matrix_cache();
+
+	return retval;
+}
+
+static struct fec *ec_ctx_cache[SD_EC_MAX_STRIP + 1][SD_EC_MAX_STRIP * 2];
+static struct fec *lrc_ctx_cache[1 << 6];
+static struct sd_mutex ec_ctx_lock = SD_MUTEX_INITIALIZER;
+
+struct fec *ec_init(int d, int dp)
+{
+	struct fec *ctx;
+
+	assert(d <= SD_EC_MAX_STRIP && dp < SD_EC_MAX_STRIP * 2);
+
+	ctx = uatomic_read(&ec_ctx_cache[d][dp]);
+	if (likely(ctx))
+		return ctx;
+
+	sd_mutex_lock(&ec_ctx_lock);
+	ctx = ec_ctx_cache[d][dp];
+	if (!ctx) {
+		ctx = fec_new(d, dp);
+		/* publish the context after it is fully built */
+		cmm_smp_wmb();
+		uatomic_set(&ec_ctx_cache[d][dp], ctx);
+	}
+	sd_mutex_unlock(&ec_ctx_lock);
+
+	return ctx;
+}
+
+struct fec *ec_init_policy(uint8_t policy)
+{
+	struct fec *ctx, **slot;
+	int d, l, r;
+
+	if (!ec_policy_is_lrc(policy)) {
+		int dp = ec_policy_to_dp(policy, &d, NULL);
+
+		return ec_init(d, dp);
+	}
+
+	slot = &lrc_ctx_cache[policy & ~SD_EC_LRC_FLAG];
+	ctx = uatomic_read(slot);
+	if (likely(ctx))
+		return ctx;
+
+	d = lrc_policy_to_dlr(policy, &l, &r);
+	assert(l < d && d <= SD_EC_MAX_STRIP);
+
+	sd_mutex_lock(&ec_ctx_lock);
+	ctx = *slot;
+	if (!ctx) {
+		ctx = lrc_new(d, l, r);
+		cmm_smp_wmb();
+		uatomic_set(slot, ctx);
+	}
+	sd_mutex_unlock(&ec_ctx_lock);
+
+	return ctx;
+}
+
 /*
  * To make sure that we stay within cache in the inner loops of fec_encode().
  * (It would probably help to also do this for fec_decode().
@@ -525,6 +800,148 @@ void fec_encode(const struct fec *code,
 	}
 }
 
+/*
+ * Encoding is done byte by byte, so the parity of many stripes can be
+ * computed by one fec_encode() call over the data strips laid out column by
+ * column, which makes the vector loops of addmul() much longer than a strip.
+ * We copy and encode EC_ENCODE_LEN bytes of each strip at a time, so that the
+ * copied data are still in L1 cache when they are encoded.  Short strips are
+ * gathered from several stripes and long ones are split into pieces.
+ */
+#define EC_ENCODE_LEN	1024
+
+void ec_encode_stripes(struct fec *ctx, const uint8_t *buf, uint8_t *ds[],
+		       uint8_t *ps[], int nr_stripe, uint32_t stripe_size)
+{
+	int d = ctx->d, p = ctx->dp - ctx->d;
+	size_t strip_size = stripe_size / d;
+	size_t piece = min(strip_size, (size_t)EC_ENCODE_LEN);
+	int chunk = EC_ENCODE_LEN / piece;
+	const uint8_t *src[d];
+	uint8_t *dst[p];
+	int pidx[p], i, j, s;
+
+	for (i = 0; i < p; i++)
+		pidx[i] = d + i;
+
+	for (s = 0; s < nr_stripe; s += chunk) {
+		int n = min(chunk, nr_stripe - s);
+
+		for (size_t o = 0; o < strip_size; o += piece) {
+			size_t off = strip_size * s + o;
+
+			for (i = 0; i < n; i++) {
+				const uint8_t *stripe = buf +
+					(size_t)stripe_size * (s + i) + o;
+
+				for (j = 0; j < d; j++)
+					memcpy(ds[j] + off + strip_size * i,
+					       stripe + strip_size * j, piece);
+			}
+
+			for (j = 0; j < d; j++)
+				src[j] = ds[j] + off;
+			for (j = 0; j < p; j++)
+				dst[j] = ps[j] + off;
+			fec_encode(ctx, src, dst, pidx, p, piece * n);
+		}
+	}
+}
+
+/* P' = P + c * (D' - D), where c is the coefficient of D for P */
+void ec_update_parity(struct fec *ctx, int idx, const uint8_t *delta,
+		      uint8_t *ps[], size_t len)
+{
+	int d = ctx->d;
+
+	for (int i = 0; i < ctx->dp - d; i++) {
+		uint8_t c = ctx->enc_matrix[(d + i) * d + idx];
+
+		addmul(ps[i], delta, c, len);
+	}
+}
+
+/*
+ * Parities are picked greedily in numeric order, as long as they add a new
+ * equation for the lost data strips, i.e. the rank of their rows restricted
+ * to the lost columns grows.  The local parity of a group which lost one
+ * strip always does, so LRC prefers it to the global ones.
+ */
+bool ec_pick_strips(const struct fec *ctx, const bool avail[], int idx[])
+{
+	int d = ctx->d, nr_lost = 0, nr_basis = 0, n = 0;
+	int lost[SD_EC_MAX_STRIP], pivot[SD_EC_MAX_STRIP];
+	uint8_t basis[SD_EC_MAX_STRIP][SD_EC_MAX_STRIP];
+
+	for (int i = 0; i < d; i++) {
+		if (avail[i])
+			idx[n++] = i;
+		else
+			lost[nr_lost++] = i;
+	}
+
+	for (int i = d; i < ctx->dp && nr_basis < nr_lost; i++) {
+		const uint8_t *row = ctx->enc_matrix + i * d;
+		uint8_t v[SD_EC_MAX_STRIP], c;
+		int j;
+
+		if (!avail[i])
+			continue;
+
+		for (j = 0; j < nr_lost; j++)
+			v[j] = row[lost[j]];
+		for (int b = 0; b < nr_basis; b++) {
+			c = v[pivot[b]];
+			for (j = 0; c && j < nr_lost; j++)
+				v[j] ^= gf_mul(c, basis[b][j]);
+		}
+		for (j = 0; j < nr_lost && !v[j]; j++)
+			;
+		if (j == nr_lost)
+			continue;
+
+		c = inverse[v[j]];
+		for (int k = 0; k < nr_lost; k++)
+			basis[nr_basis][k] = gf_mul(c, v[k]);
+		pivot[nr_basis++] = j;
+		idx[n++] = i;
+	}
+
+	return nr_basis == nr_lost;
+}
+
+int ec_local_group(const struct fec *ctx, int idx, int group[])
+{
+	int g, n = 0, group_size;
+
+	if (!ctx->l)
+		return 0;
+
+	group_size = ctx->d / ctx->l;
+	if (idx < ctx->d)
+		g = idx / group_size;
+	else if (idx < ctx->d + ctx->l)
+		g = idx - ctx->d;
+	else
+		return 0;
+
+	for (int i = g * group_size; i < (g + 1) * group_size; i++)
+		if (i != idx)
+			group[n++] = i;
+	if (idx != ctx->d + g)
+		group[n++] = ctx->d + g;
+
+	return n;
+}
+
+void ec_local_decode(const uint8_t *input[], int nr, uint8_t *output,
+		     size_t len)
+{
+	memset(output, 0, len);
+	for (int i = 0; i < nr; i++)
+		addmul(output, input[i], 1, len);
+}
+
 /*
  * Build decode matrix into some memory space.
  *
@@ -548,19 +965,75 @@ build_decode_matrix_into_space(const struct fec *const code,
 	_invert_mat(matrix, d);
 }
 
-void fec_decode(const struct fec *code,
-		const uint8_t *const *const inpkts,
-		uint8_t *const *const outpkts,
-		const int *const idx, size_t sz)
+static bool lookup_decode_matrix(struct dec_matrix_cache *cache,
+				 const uint8_t *key, unsigned d,
+				 uint8_t *matrix)
+{
+	struct dec_matrix *m;
+	bool found = false;
+
+	sd_mutex_lock(&cache->lock);
+	list_for_each_entry(m, &cache->head, list) {
+		if (memcmp(m->idx, key, d) == 0) {
+			memcpy(matrix, m->matrix, d * d);
+			list_move(&m->list, &cache->head);
+			found = true;
+			break;
+		}
+	}
+	sd_mutex_unlock(&cache->lock);
+
+	return found;
+}
+
+static void insert_decode_matrix(struct dec_matrix_cache *cache,
+				 const uint8_t *key, unsigned d,
+				 const uint8_t *matrix)
+{
+	struct dec_matrix *m = xmalloc(sizeof(*m) + d * d);
+
+	memcpy(m->idx, key, d);
+	memcpy(m->matrix, matrix, d * d);
+
+	sd_mutex_lock(&cache->lock);
+	list_add(&m->list, &cache->head);
+	if (++cache->nr > MAX_DEC_MATRIX) {
+		struct dec_matrix *last;
+
+		last = list_entry(cache->head.n.prev, struct dec_matrix, list);
+		list_del(&last->list);
+		free(last);
+		cache->nr--;
+	}
+	sd_mutex_unlock(&cache->lock);
+}
+
+static void get_decode_matrix(const struct fec *const code,
+			      const int *const idx, uint8_t *const matrix)
+{
+	unsigned d = code->d;
+	uint8_t key[SD_EC_MAX_STRIP];
+
+	for (unsigned i = 0; i < d; i++)
+		key[i] = idx[i];
+
+	if (lookup_decode_matrix(code->dec_cache, key, d, matrix))
+		return;
+
+	build_decode_matrix_into_space(code, idx, d, matrix);
+	insert_decode_matrix(code->dec_cache, key, d, matrix);
+}
+
+/* Same as fec_decode(), but with the decode matrix built for idx */
+static void fec_decode_matrix(const struct fec *code, const uint8_t *m_dec,
+			      const uint8_t *const *const inpkts,
+			      uint8_t *const *const outpkts,
+			      const int *const idx, size_t sz)
 {
-	uint8_t m_dec[code->d * code->d];
 	unsigned char outix = 0;
 	unsigned char row = 0;
 	unsigned char col = 0;
 
-	assert(code->d * code->d < 8 * 1024 * 1024);
-	build_decode_matrix_into_space(code, idx, code->d, m_dec);
-
 	for (row = 0; row < code->d; row++) {
 		/*
 		 * If the block whose number is i is present, then it is
@@ -577,6 +1050,18 @@ void fec_decode(const struct fec *code,
 	}
 }
 
+void fec_decode(const struct fec *code,
+		const uint8_t *const *const inpkts,
+		uint8_t *const *const outpkts,
+		const int *const idx, size_t sz)
+{
+	uint8_t m_dec[code->d * code->d];
+
+	assert(code->d * code->d < 8 * 1024 * 1024);
+	get_decode_matrix(code, idx, m_dec);
+	fec_decode_matrix(code, m_dec, inpkts, outpkts, idx, sz);
+}
+
 /*
  * fec_decode need primary(data) strips in the numeric place, e,g, we have
  * indexes passed as { 0, 2, 4, 5 } and 4, 5 are parity strip, we need to pass
@@ -627,8 +1112,32 @@ static inline bool data_is_missing(const uint8_t *dp[], int d)
  * @output: the lost ds or ps to return
  * @idx: index of output which is lost
  */
-void ec_decode(struct fec *ctx, const uint8_t *input[], const int inidx[],
-	       uint8_t output[], int idx)
+/*
+ * Get the decode matrix for the input strips of inidx into m_dec.  Return
+ * false if no data strip is lost, when the matrix isn't needed.
+ */
+static bool ec_decode_matrix(struct fec *ctx, const int inidx[],
+			     uint8_t *m_dec)
+{
+	static const uint8_t present;
+	const uint8_t *dp[ctx->dp], *oin[ctx->d];
+	int oidx[ctx->d];
+
+	memset(dp, 0, sizeof(dp));
+	for (int i = 0; i < ctx->d; i++)
+		dp[inidx[i]] = &present;
+	if (!data_is_missing(dp, ctx->d))
+		return false;
+
+	decode_prepare(ctx, dp, oin, oidx);
+	get_decode_matrix(ctx, oidx, m_dec);
+	return true;
+}
+
+/* Same as ec_decode(), but with the matrix from ec_decode_matrix() */
+static void __ec_decode(struct fec *ctx, const uint8_t *input[],
+			const int inidx[], uint8_t output[], int idx,
+			const uint8_t *m_dec)
 {
 	int edp = ctx->dp, ep = ctx->dp - ctx->d, ed = ctx->d;
 	const uint8_t *dp[edp];
@@ -665,7 +1174,8 @@ void ec_decode(struct fec *ctx, const uint8_t *input[], const int inidx[],
 	/* Fill the data strip if missing */
 	if (data_is_missing(dp, ed)) {
 		int m = 0;
-		fec_decode(ctx, oin, missing, oidx, strip_size);
+		fec_decode_matrix(ctx, m_dec, oin, missing, oidx,
+				  strip_size);
 		for (i = 0; i < ed; i++)
 			if (!dp[i])
 				dp[i] = missing[m++];
@@ -682,19 +1192,32 @@ out:
 	memcpy(output, dp[idx], strip_size);
 }
 
+void ec_decode(struct fec *ctx, const uint8_t *input[], const int inidx[],
+	       uint8_t output[], int idx)
+{
+	uint8_t m_dec[ctx->d * ctx->d];
+
+	ec_decode_matrix(ctx, inidx, m_dec);
+	__ec_decode(ctx, input, inidx, output, idx, m_dec);
+}
+
 void ec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
-		      char *buf, int idx)
+		      char *buf, int idx, size_t len)
 {
 	int i, j, d = ctx->d;
 	size_t strip_size = SD_EC_DATA_STRIPE_SIZE / d;
+	uint8_t m_dec[d * d];
 
-	for (i = 0; i < SD_EC_NR_STRIPE_PER_OBJECT; i++) {
+	assert(len % strip_size == 0);
+	/* all the stripes lost the same strips */
+	ec_decode_matrix(ctx, in_idx, m_dec);
+	for (i = 0; i < len / strip_size; i++) {
 		const uint8_t *in[d];
 		uint8_t out[strip_size];
 
 		for (j = 0; j < d; j++)
 			in[j] = input[j] + strip_size * i;
-		ec_decode(ctx, in, in_idx, out, idx);
+		__ec_decode(ctx, in, in_idx, out, idx, m_dec);
 		memcpy(buf + strip_size * i, out, strip_size);
 	}
 }
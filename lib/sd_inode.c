@@ -95,10 +95,69 @@
 #define OFFSET_IDX(data, n) ((char *)(data) + sizeof(struct sd_extent_header) \
 			+ n * sizeof(struct sd_extent_idx))
 
+/*
+ * Cache of leaf-nodes of hyper volumes.
+ *
+ * Looking up an index of a B-tree whose root is an idx-node needs a leaf-node
+ * which is as large as SD_INODE_DATA_INDEX_SIZE, so we keep the used part of
+ * the recently read leaf-nodes keyed by their oid and write them through when
+ * sd_inode_set_vid() updates them.  The nodes are shared by all the threads
+ * and refcounted; a node which is replaced or evicted is freed when its last
+ * user puts it.  The key of a leaf-node never changes once it is cached, only
+ * the vdi_id of its sd_extents is updated in place.
+ *
+ * A leaf-node is read by pages: its header first, then only the pages which
+ * the binary search for an index probes.  The pages of a node are loaded
+ * under bnode->lock until all of them are, then the node is searched without
+ * the lock.
+ *
+ * Other gateways and processes write the B-tree without telling us, so a
+ * cached node is only a hint.  A lookup which hits the cache reads the header
+ * and the page it ends in again and compares them with the cached ones, and
+ * sd_inode_set_vid() always modifies a node read afresh.
+ */
+#define BNODE_HASH_BITS		8
+#define DEFAULT_BNODE_CACHE_SIZE (64 * 1024 * 1024)
+/* sizeof(struct sd_extent) divides it, so an sd_extent never straddles pages */
+#define BNODE_PAGE_SIZE		4096
+#define BNODE_MAX_PAGES		(SD_INODE_DATA_INDEX_SIZE / BNODE_PAGE_SIZE)
+
+struct bnode {
+	struct hlist_node hash;
+	struct list_node lru;
+	uint64_t oid;
+	refcnt_t refcnt;
+	size_t size;
+	struct sd_extent_header *header;
+
+	struct sd_mutex lock;
+	/* all the pages are loaded */
+	uatomic_bool complete;
+	/* replaced or dropped in the cache, so don't load pages any more */
+	uatomic_bool stale;
+	unsigned long pages[BITS_TO_LONGS(BNODE_MAX_PAGES)];
+};
+
+static struct bnode_cache {
+	struct sd_mutex lock;
+	struct hlist_head hash[1 << BNODE_HASH_BITS];
+	struct list_head lru;
+	size_t size;
+	size_t max_size;
+	/* bumped whenever a leaf-node is written or invalidated */
+	uint64_t seq;
+} bnode_cache = {
+	.lock = SD_MUTEX_INITIALIZER,
+	.lru = LIST_HEAD_INIT(bnode_cache.lru),
+	.max_size = DEFAULT_BNODE_CACHE_SIZE,
+};
+
 struct find_path {
 	struct sd_extent_idx *p_idx;
 	struct sd_extent *p_ext;
+	/* p_bnode->header, either cached or a private copy */
 	struct sd_extent_header *p_ext_header;
+	struct bnode *p_bnode;
 	int depth;
 };
 
@@ -132,6 +191,35 @@ static int index_comp(void *a, void *b)
 		return 0;
 }
 
+static size_t leaf_node_size(const struct sd_extent_header *header)
+{
+	uint32_t entries = min(header->entries, (uint32_t)EXT_MAX_ENTRIES);
+
+	return sizeof(*header) + entries * sizeof(struct sd_extent);
+}
+
+/* Read the used part of the leaf-node 'oid' into 'leaf_node' */
+static int read_leaf_node(read_node_fn reader, uint64_t oid,
+			  struct sd_extent_header *leaf_node)
+{
+	void *tmp = (void *)leaf_node;
+	size_t size;
+	int ret;
+
+	ret = reader(oid, &tmp, BNODE_PAGE_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	size = leaf_node_size(leaf_node);
+	leaf_node->entries = (size - sizeof(*leaf_node)) /
+		sizeof(struct sd_extent);
+	if (size <= BNODE_PAGE_SIZE)
+		return SD_RES_SUCCESS;
+
+	tmp = (char *)leaf_node + BNODE_PAGE_SIZE;
+	return reader(oid, &tmp, size - BNODE_PAGE_SIZE, BNODE_PAGE_SIZE);
+}
+
 /*
  * traverse the whole btree that include all the inode->data_vdi_id, bnode,
  * data objects and call btree_cb_fn()
@@ -143,7 +231,6 @@ void traverse_btree(read_node_fn reader, const struct sd_inode *inode,
 	struct sd_extent_header *leaf_node = NULL;
 	struct sd_extent *last, *iter;
 	struct sd_extent_idx *last_idx, *iter_idx;
-	void *tmp;
 
 	fn(header, BTREE_HEAD, arg);
 	if (header->depth == 1) {
@@ -158,11 +245,9 @@ void traverse_btree(read_node_fn reader, const struct sd_inode *inode,
 		last_idx = LAST_IDX(inode->data_vdi_id);
 		iter_idx = FIRST_IDX(inode->data_vdi_id);
 		leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
-		tmp = (void *)leaf_node;
 
 		while (iter_idx != last_idx) {
-			reader(iter_idx->oid, &tmp,
-					SD_INODE_DATA_INDEX_SIZE, 0);
+			read_leaf_node(reader, iter_idx->oid, leaf_node);
 
 			fn(iter_idx, BTREE_IDX, arg);
 			fn(leaf_node, BTREE_HEAD, arg);
@@ -287,6 +372,478 @@ static struct sd_extent_idx *search_idx_entry(struct sd_extent_header *header,
 			sizeof(struct sd_extent_idx), index_comp);
 }
 
+static inline int bnode_page(const struct bnode *bnode, const void *p)
+{
+	return ((const char *)p - (const char *)bnode->header) /
+		BNODE_PAGE_SIZE;
+}
+
+static inline int bnode_nr_pages(const struct bnode *bnode)
+{
+	return DIV_ROUND_UP(bnode->size, BNODE_PAGE_SIZE);
+}
+
+/*
+ * Allocate a leaf-node which can grow up to 'capacity'.  The buffer is page
+ * aligned because the readers and the writers may do direct I/O on it.
+ */
+static struct bnode *bnode_alloc(uint64_t oid, size_t capacity)
+{
+	struct bnode *bnode = xzalloc(sizeof(*bnode));
+
+	bnode->oid = oid;
+	bnode->header = xvalloc(capacity);
+	INIT_HLIST_NODE(&bnode->hash);
+	INIT_LIST_NODE(&bnode->lru);
+	sd_init_mutex(&bnode->lock);
+	refcount_set(&bnode->refcnt, 1);
+
+	return bnode;
+}
+
+static void bnode_put(struct bnode *bnode)
+{
+	if (refcount_dec(&bnode->refcnt) == 0) {
+		sd_destroy_mutex(&bnode->lock);
+		free(bnode->header);
+		free(bnode);
+	}
+}
+
+/* Must be called with bnode->lock held if the node is cached */
+static void bnode_set_pages(struct bnode *bnode, int first, int last)
+{
+	int nr = bnode_nr_pages(bnode);
+
+	for (int n = first; n <= last; n++)
+		set_bit(n, bnode->pages);
+	if (find_next_zero_bit(bnode->pages, nr, 0) >= nr)
+		uatomic_set_true(&bnode->complete);
+}
+
+/*
+ * Read the pages from 'first' to 'last' of the leaf-node which are not loaded
+ * yet.  Must be called with bnode->lock held.
+ */
+static int __bnode_load_pages(read_node_fn reader, struct bnode *bnode,
+			      int first, int last)
+{
+	int n = first, end, ret;
+	uint64_t offset;
+	void *tmp;
+
+	while (n <= last) {
+		if (test_bit(n, bnode->pages)) {
+			n++;
+			continue;
+		}
+		for (end = n + 1; end <= last; end++)
+			if (test_bit(end, bnode->pages))
+				break;
+
+		offset = (uint64_t)n * BNODE_PAGE_SIZE;
+		tmp = (char *)bnode->header + offset;
+		ret = reader(bnode->oid, &tmp,
+			     min((size_t)end * BNODE_PAGE_SIZE, bnode->size) -
+			     offset, offset);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		if (uatomic_is_true(&bnode->stale))
+			return SD_RES_AGAIN;
+		bnode_set_pages(bnode, n, end - 1);
+		n = end;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int bnode_load_pages(read_node_fn reader, struct bnode *bnode,
+			    int first, int last)
+{
+	int ret;
+
+	if (uatomic_is_true(&bnode->complete))
+		return SD_RES_SUCCESS;
+
+	sd_mutex_lock(&bnode->lock);
+	ret = __bnode_load_pages(reader, bnode, first, last);
+	sd_mutex_unlock(&bnode->lock);
+
+	return ret;
+}
+
+/*
+ * Search 'idx' in the leaf-node.  If the node is not loaded entirely, only
+ * the pages which the binary search probes are read.
+ */
+static int bnode_search(read_node_fn reader, struct bnode *bnode,
+			uint32_t idx, struct sd_extent **ext)
+{
+	struct sd_extent *first = FIRST_EXT(bnode->header);
+	int64_t l = 0, r = (int64_t)bnode->header->entries - 1, m;
+	int n, ret = SD_RES_SUCCESS;
+
+	if (uatomic_is_true(&bnode->complete)) {
+		*ext = search_ext_entry(bnode->header, idx);
+		return SD_RES_SUCCESS;
+	}
+
+	sd_mutex_lock(&bnode->lock);
+	while (l <= r) {
+		m = (l + r) / 2;
+		n = bnode_page(bnode, first + m);
+		ret = __bnode_load_pages(reader, bnode, n, n);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+
+		if (idx < first[m].idx)
+			r = m - 1;
+		else if (idx > first[m].idx)
+			l = m + 1;
+		else {
+			l = m;
+			break;
+		}
+	}
+	*ext = first + l;
+out:
+	sd_mutex_unlock(&bnode->lock);
+	return ret;
+}
+
+static struct bnode *bnode_lookup(uint64_t oid)
+{
+	struct hlist_head *head;
+	struct hlist_node *n;
+	struct bnode *bnode;
+
+	head = bnode_cache.hash + hash_64(oid, BNODE_HASH_BITS);
+	hlist_for_each_entry(bnode, n, head, hash) {
+		if (bnode->oid == oid)
+			return bnode;
+	}
+
+	return NULL;
+}
+
+/*
+ * Drop 'bnode' from the cache.  If the node is 'stale', it is no longer what
+ * the object has.  Must be called with bnode_cache.lock held.
+ */
+static void bnode_unlink(struct bnode *bnode, bool stale)
+{
+	hlist_del(&bnode->hash);
+	list_del(&bnode->lru);
+	bnode_cache.size -= bnode->size;
+	if (stale)
+		uatomic_set_true(&bnode->stale);
+	bnode_put(bnode);
+}
+
+/*
+ * Cache 'bnode' in place of the old node of the same oid.  If 'seq' is not
+ * the current sequence of the cache, the node was read before it was written
+ * or invalidated, so it is left to the caller alone.
+ */
+static void bnode_insert(struct bnode *bnode, uint64_t seq)
+{
+	struct bnode *old, *last;
+
+	sd_mutex_lock(&bnode_cache.lock);
+	if (seq != bnode_cache.seq || bnode->size > bnode_cache.max_size)
+		goto out;
+
+	old = bnode_lookup(bnode->oid);
+	if (old)
+		bnode_unlink(old, true);
+
+	refcount_inc(&bnode->refcnt);
+	hlist_add_head(&bnode->hash, bnode_cache.hash +
+		       hash_64(bnode->oid, BNODE_HASH_BITS));
+	list_add(&bnode->lru, &bnode_cache.lru);
+	bnode_cache.size += bnode->size;
+
+	while (bnode_cache.size > bnode_cache.max_size) {
+		last = list_entry(bnode_cache.lru.n.prev, struct bnode, lru);
+		bnode_unlink(last, false);
+	}
+out:
+	sd_mutex_unlock(&bnode_cache.lock);
+}
+
+/*
+ * Get the leaf-node 'oid' from the cache, or read its first page by 'reader'
+ * and cache it.  'cached' tells which.
+ */
+static struct bnode *bnode_get(read_node_fn reader, uint64_t oid,
+			       bool *cached, int *ret)
+{
+	struct sd_extent_header *page;
+	struct bnode *bnode = NULL;
+	uint64_t seq;
+	size_t size;
+	void *tmp;
+
+	sd_mutex_lock(&bnode_cache.lock);
+	bnode = bnode_lookup(oid);
+	if (bnode) {
+		refcount_inc(&bnode->refcnt);
+		list_move(&bnode->lru, &bnode_cache.lru);
+	}
+	seq = bnode_cache.seq;
+	sd_mutex_unlock(&bnode_cache.lock);
+
+	*cached = !!bnode;
+	if (bnode) {
+		*ret = SD_RES_SUCCESS;
+		return bnode;
+	}
+
+	page = xvalloc(BNODE_PAGE_SIZE);
+	tmp = (void *)page;
+	*ret = reader(oid, &tmp, BNODE_PAGE_SIZE, 0);
+	if (*ret != SD_RES_SUCCESS)
+		goto out;
+
+	size = leaf_node_size(page);
+	bnode = bnode_alloc(oid, size);
+	bnode->size = size;
+	memcpy(bnode->header, page, min(size, (size_t)BNODE_PAGE_SIZE));
+	bnode->header->entries = (size - sizeof(*page)) /
+		sizeof(struct sd_extent);
+	bnode_set_pages(bnode, 0, 0);
+	bnode_insert(bnode, seq);
+out:
+	free(page);
+	return bnode;
+}
+
+/*
+ * Check that the cached leaf-node still gives the sd_extent 'ext' for 'idx',
+ * by reading its header and the page of 'ext' again.  If 'idx' is not in the
+ * node, the pages of the entries on both sides of 'ext' are read.  Return
+ * SD_RES_AGAIN if the node is changed.
+ */
+static int bnode_check(read_node_fn reader, struct bnode *bnode, uint32_t idx,
+		       struct sd_extent *ext)
+{
+	struct sd_extent_header *header = bnode->header, *page;
+	struct sd_extent *first = FIRST_EXT(header), *last = LAST_EXT(header);
+	struct sd_extent *lo = ext, *hi = ext;
+	size_t start, len;
+	int n, ret;
+	void *tmp;
+
+	if (first == last)
+		return SD_RES_AGAIN;
+
+	if (!(ext < last && ext->idx == idx)) {
+		if (ext > first)
+			lo = ext - 1;
+		if (ext == last)
+			hi = ext - 1;
+	}
+	n = bnode_page(bnode, lo);
+
+	page = xvalloc(BNODE_PAGE_SIZE * 2);
+	tmp = (void *)page;
+	if (n > 0) {
+		ret = reader(bnode->oid, &tmp, sizeof(*header), 0);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		if (memcmp(page, header, sizeof(*header)) != 0) {
+			ret = SD_RES_AGAIN;
+			goto out;
+		}
+	}
+
+	start = (size_t)n * BNODE_PAGE_SIZE;
+	len = min((size_t)(bnode_page(bnode, hi) + 1) * BNODE_PAGE_SIZE,
+		  bnode->size) - start;
+	ret = reader(bnode->oid, &tmp, len, start);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	sd_mutex_lock(&bnode->lock);
+	if (memcmp(page, (char *)header + start, len) != 0)
+		ret = SD_RES_AGAIN;
+	sd_mutex_unlock(&bnode->lock);
+out:
+	free(page);
+	return ret;
+}
+
+/*
+ * Write through the leaf-node 'bnode' which is written out by 'ret'.  The
+ * cache gets a copy of the node trimmed to its used part.
+ */
+static void bnode_commit(struct bnode *bnode, int ret)
+{
+	struct bnode *copy;
+	uint64_t seq;
+
+	if (ret != SD_RES_SUCCESS) {
+		sd_inode_invalidate_bnode(bnode->oid);
+		return;
+	}
+
+	copy = bnode_alloc(bnode->oid, bnode->size);
+	copy->size = bnode->size;
+	memcpy(copy->header, bnode->header, bnode->size);
+	memcpy(copy->pages, bnode->pages, sizeof(copy->pages));
+	bnode_set_pages(copy, 0, 0);
+
+	sd_mutex_lock(&bnode_cache.lock);
+	seq = ++bnode_cache.seq;
+	sd_mutex_unlock(&bnode_cache.lock);
+
+	bnode_insert(copy, seq);
+	bnode_put(copy);
+}
+
+/*
+ * Write through the vdi_id of the sd_extent of 'idx' at 'offset' in the
+ * leaf-node 'oid'
+ */
+static void bnode_update_vid(uint64_t oid, uint64_t offset, uint32_t idx,
+			     uint32_t vdi_id, int ret)
+{
+	struct bnode *bnode;
+	struct sd_extent *ext;
+
+	if (ret != SD_RES_SUCCESS) {
+		sd_inode_invalidate_bnode(oid);
+		return;
+	}
+
+	sd_mutex_lock(&bnode_cache.lock);
+	bnode_cache.seq++;
+	bnode = bnode_lookup(oid);
+	if (bnode)
+		refcount_inc(&bnode->refcnt);
+	sd_mutex_unlock(&bnode_cache.lock);
+
+	if (!bnode)
+		return;
+
+	/*
+	 * The page is either loaded with the vdi_id already written out, or
+	 * it is here and we update it.
+	 */
+	sd_mutex_lock(&bnode->lock);
+	ext = (struct sd_extent *)((char *)bnode->header + offset);
+	if (offset < bnode->size &&
+	    test_bit(bnode_page(bnode, ext), bnode->pages) && ext->idx == idx)
+		uatomic_set(&ext->vdi_id, vdi_id);
+	sd_mutex_unlock(&bnode->lock);
+	bnode_put(bnode);
+}
+
+/*
+ * Drop the cached leaf-node 'oid'.  This must be called when the leaf-node is
+ * written by other than sd_inode_set_vid().
+ */
+void sd_inode_invalidate_bnode(uint64_t oid)
+{
+	struct bnode *bnode;
+
+	sd_mutex_lock(&bnode_cache.lock);
+	bnode_cache.seq++;
+	bnode = bnode_lookup(oid);
+	if (bnode)
+		bnode_unlink(bnode, true);
+	sd_mutex_unlock(&bnode_cache.lock);
+}
+
+/*
+ * Set the upper limit of the memory for the cached leaf-nodes.  Zero disables
+ * the cache.
+ */
+void sd_inode_set_cache_size(size_t size)
+{
+	struct bnode *last;
+
+	sd_mutex_lock(&bnode_cache.lock);
+	bnode_cache.max_size = size;
+	bnode_cache.seq++;
+	while (bnode_cache.size > bnode_cache.max_size) {
+		last = list_entry(bnode_cache.lru.n.prev, struct bnode, lru);
+		bnode_unlink(last, false);
+	}
+	sd_mutex_unlock(&bnode_cache.lock);
+}
+
+/*
+ * Replace the leaf-node in 'path' with a private copy which can be modified.
+ * The entries from 'from' to the end are loaded in it.
+ */
+static int get_private_leaf(read_node_fn reader, struct find_path *path,
+			    struct sd_extent *from)
+{
+	struct bnode *bnode = path->p_bnode, *new;
+	int ret;
+
+	ret = bnode_load_pages(reader, bnode, bnode_page(bnode, from),
+			       bnode_nr_pages(bnode) - 1);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	new = bnode_alloc(bnode->oid, SD_INODE_DATA_INDEX_SIZE);
+	sd_mutex_lock(&bnode->lock);
+	new->size = bnode->size;
+	memcpy(new->header, bnode->header, bnode->size);
+	memcpy(new->pages, bnode->pages, sizeof(new->pages));
+	sd_mutex_unlock(&bnode->lock);
+
+	if (path->p_ext)
+		path->p_ext = FIRST_EXT(new->header) +
+			(path->p_ext - FIRST_EXT(bnode->header));
+	path->p_ext_header = new->header;
+	path->p_bnode = new;
+	bnode_put(bnode);
+
+	return SD_RES_SUCCESS;
+}
+
+static void put_path(struct find_path *path)
+{
+	if (path->p_bnode)
+		bnode_put(path->p_bnode);
+	path->p_bnode = NULL;
+	path->p_ext_header = NULL;
+}
+
+/*
+ * Write out the modified leaf-node 'bnode' from the sd_extent 'from' to the
+ * end, and its header.  The entries are written before the header so that the
+ * header never counts entries which are not written yet.
+ */
+static void write_leaf_node(write_node_fn writer, const struct sd_inode *inode,
+			    struct bnode *bnode, struct sd_extent *from,
+			    bool create)
+{
+	uint64_t start;
+	int ret;
+
+	bnode->size = leaf_node_size(bnode->header);
+	start = round_down((char *)from - (char *)bnode->header,
+			   BNODE_PAGE_SIZE);
+	bnode_set_pages(bnode, start / BNODE_PAGE_SIZE,
+			bnode_nr_pages(bnode) - 1);
+	/* rewriting the first page is cheaper than another request */
+	if (start <= BNODE_PAGE_SIZE)
+		start = 0;
+
+	ret = writer(bnode->oid, (char *)bnode->header + start,
+		     bnode->size - start, start, 0, inode->nr_copies,
+		     inode->copy_policy, create, false);
+	if (ret == SD_RES_SUCCESS && start)
+		ret = writer(bnode->oid, bnode->header, sizeof(*bnode->header),
+			     0, 0, inode->nr_copies, inode->copy_policy, false,
+			     false);
+	bnode_commit(bnode, ret);
+}
+
 static void insert_ext_entry_nosearch(struct sd_extent_header *header,
 				      struct sd_extent *ext, uint32_t idx,
 				      uint32_t vdi_id)
@@ -340,8 +897,9 @@ static void split_to_nodes(struct sd_extent_header *src,
 			num * sizeof(struct sd_extent));
 	left->entries = num;
 
-	mempcpy(right, src, sizeof(struct sd_extent_header));
-	mempcpy(FIRST_EXT(right), OFFSET_EXT(src, num),
+	/* 'right' can be 'src' */
+	memmove(right, src, sizeof(struct sd_extent_header));
+	memmove(FIRST_EXT(right), OFFSET_EXT(src, num),
 			(src->entries - num) * sizeof(struct sd_extent));
 	right->entries = src->entries - num;
 }
@@ -354,47 +912,47 @@ static void split_to_nodes(struct sd_extent_header *src,
  */
 static void transfer_to_idx_root(write_node_fn writer, struct sd_inode *inode)
 {
-	struct sd_extent_header *left;
-	struct sd_extent_header *right;
+	struct bnode *left, *right;
 	struct sd_extent_header *root = EXT_HEADER(inode->data_vdi_id);
 	uint64_t left_oid, right_oid;
 	uint32_t num = root->entries / 2;
 
+	left_oid = vid_to_btree_oid(inode->vdi_id, inode->btree_counter++);
+	right_oid = vid_to_btree_oid(inode->vdi_id, inode->btree_counter++);
+
 	/* create two leaf-node and copy the entries from root-node */
-	left = xvalloc(SD_INODE_DATA_INDEX_SIZE);
-	right = xvalloc(SD_INODE_DATA_INDEX_SIZE);
+	left = bnode_alloc(left_oid, SD_INODE_DATA_INDEX_SIZE);
+	right = bnode_alloc(right_oid, SD_INODE_DATA_INDEX_SIZE);
 
-	split_to_nodes(root, left, right, num);
+	split_to_nodes(root, left->header, right->header, num);
 
 	/* write two nodes back */
-	left_oid = vid_to_btree_oid(inode->vdi_id, inode->btree_counter++);
-	right_oid = vid_to_btree_oid(inode->vdi_id, inode->btree_counter++);
-
-	writer(left_oid, left, SD_INODE_DATA_INDEX_SIZE, 0, 0,
-	       inode->nr_copies, inode->copy_policy, true, false);
-	writer(right_oid, right, SD_INODE_DATA_INDEX_SIZE, 0, 0,
-	       inode->nr_copies, inode->copy_policy, true, false);
+	write_leaf_node(writer, inode, left, FIRST_EXT(left->header), true);
+	write_leaf_node(writer, inode, right, FIRST_EXT(right->header), true);
 
 	/* change root from ext-node to idx-node */
 	root->entries = 0;
 	root->depth = 2;
-	insert_idx_entry(root, (LAST_EXT(left) - 1)->idx, left_oid);
-	insert_idx_entry(root, (LAST_EXT(right) - 1)->idx, right_oid);
+	insert_idx_entry(root, (LAST_EXT(left->header) - 1)->idx, left_oid);
+	insert_idx_entry(root, (LAST_EXT(right->header) - 1)->idx, right_oid);
 
-	free(left);
-	free(right);
+	bnode_put(left);
+	bnode_put(right);
 }
 
 /*
  * Search whole btree for 'idx'.
  * Return available position (could insert new sd_extent) if can't find 'idx'.
+ * If 'for_write', the leaf-node is read afresh because it will be modified.
  */
 static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
-			      uint32_t idx, struct find_path *path)
+			      uint32_t idx, struct find_path *path,
+			      bool for_write)
 {
 	struct sd_extent_header *header, *leaf_node;
-	void *tmp;
+	struct bnode *bnode;
 	uint64_t oid;
+	bool cached;
 	int ret = SD_RES_NOT_FOUND;
 
 	header = EXT_HEADER(inode->data_vdi_id);
@@ -403,29 +961,53 @@ static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
 	if (header->depth == 2) {
 		path->depth = 2;
 		path->p_idx = search_idx_entry(header, idx);
-		leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
-		tmp = (void *)leaf_node;
 
 		if (idx_in_range(header, path->p_idx)) {
 			oid = path->p_idx->oid;
-			ret = reader(oid, &tmp, SD_INODE_DATA_INDEX_SIZE, 0);
+			if (for_write)
+				sd_inode_invalidate_bnode(oid);
+again:
+			bnode = bnode_get(reader, oid, &cached, &ret);
 			if (ret != SD_RES_SUCCESS)
 				goto out;
-			path->p_ext = search_ext_entry(leaf_node, idx);
+			ret = bnode_search(reader, bnode, idx, &path->p_ext);
+			if (ret == SD_RES_SUCCESS && cached)
+				ret = bnode_check(reader, bnode, idx,
+						  path->p_ext);
+			if (ret != SD_RES_SUCCESS) {
+				bnode_put(bnode);
+				/* the node is rewritten since we read it */
+				if (ret == SD_RES_AGAIN) {
+					sd_inode_invalidate_bnode(oid);
+					goto again;
+				}
+				goto out;
+			}
+			leaf_node = bnode->header;
 			path->p_ext_header = leaf_node;
+			path->p_bnode = bnode;
 			if (ext_in_range(leaf_node, path->p_ext) &&
 					path->p_ext->idx == idx)
 				ret = SD_RES_SUCCESS;
+			else
+				ret = SD_RES_NOT_FOUND;
 		} else {
 			/* check if last idx-node has space */
 			oid = (path->p_idx - 1)->oid;
-			ret = reader(oid, &tmp, SD_INODE_DATA_INDEX_SIZE, 0);
+			if (for_write)
+				sd_inode_invalidate_bnode(oid);
+			bnode = bnode_get(reader, oid, &cached, &ret);
 			if (ret != SD_RES_SUCCESS)
 				goto out;
+			leaf_node = bnode->header;
 			if (leaf_node->entries < EXT_MAX_ENTRIES) {
-				path->p_ext = search_ext_entry(leaf_node, idx);
+				/* 'idx' is larger than any in the node */
+				path->p_ext = LAST_EXT(leaf_node);
 				path->p_ext_header = leaf_node;
-			}
+				path->p_bnode = bnode;
+			} else
+				bnode_put(bnode);
+			ret = SD_RES_NOT_FOUND;
 		}
 	} else if (header->depth == 1) {
 		path->depth = 1;
@@ -444,6 +1026,7 @@ uint32_t sd_inode_get_vid(read_node_fn reader, const struct sd_inode *inode,
 			  uint32_t idx)
 {
 	struct find_path path;
+	uint32_t vdi_id = 0;
 	int ret;
 
 	if (inode->store_policy == 0)
@@ -454,42 +1037,49 @@ uint32_t sd_inode_get_vid(read_node_fn reader, const struct sd_inode *inode,
 			return 0;
 
 		memset(&path, 0, sizeof(path));
-		ret = search_whole_btree(reader, inode, idx, &path);
+		ret = search_whole_btree(reader, inode, idx, &path, false);
 		if (ret == SD_RES_SUCCESS)
-			return path.p_ext->vdi_id;
-		if (path.p_ext_header)
-			free(path.p_ext_header);
+			vdi_id = uatomic_read(&path.p_ext->vdi_id);
+		put_path(&path);
 	}
 
-	return 0;
+	return vdi_id;
 }
 
 /*
  * When the leaf-node is full, we need to create a new node and
  * move half of the data into new one.
  */
-static void split_ext_node(write_node_fn writer, struct sd_inode *inode,
-			   struct find_path *path)
+static int split_ext_node(write_node_fn writer, read_node_fn reader,
+			  struct sd_inode *inode, struct find_path *path)
 {
-	struct sd_extent_header *old = path->p_ext_header, *new_ext;
-	uint32_t num = old->entries / 2;
+	struct sd_extent_header *old;
+	struct bnode *new_ext;
+	uint32_t num;
 	uint64_t new_oid;
+	int ret;
 
-	new_ext = xvalloc(SD_INODE_DATA_INDEX_SIZE);
-
-	split_to_nodes(old, new_ext, old, num);
+	ret = get_private_leaf(reader, path, FIRST_EXT(path->p_ext_header));
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 
+	old = path->p_ext_header;
+	num = old->entries / 2;
 	new_oid = vid_to_btree_oid(inode->vdi_id, inode->btree_counter++);
-	writer(new_oid, new_ext, SD_INODE_DATA_INDEX_SIZE, 0, 0,
-	       inode->nr_copies, inode->copy_policy, true, false);
-	writer(path->p_idx->oid, old, SD_INODE_DATA_INDEX_SIZE, 0, 0,
-	       inode->nr_copies, inode->copy_policy, false, false);
+	new_ext = bnode_alloc(new_oid, SD_INODE_DATA_INDEX_SIZE);
+
+	split_to_nodes(old, new_ext->header, old, num);
+
+	write_leaf_node(writer, inode, new_ext, FIRST_EXT(new_ext->header),
+			true);
+	write_leaf_node(writer, inode, path->p_bnode, FIRST_EXT(old), false);
 
 	/* write new index */
 	insert_idx_entry(EXT_HEADER(inode->data_vdi_id),
-			LAST_EXT(new_ext)->idx, new_oid);
+			(LAST_EXT(new_ext->header) - 1)->idx, new_oid);
 
-	free(new_ext);
+	bnode_put(new_ext);
+	return SD_RES_SUCCESS;
 }
 
 /*
@@ -501,7 +1091,7 @@ static int insert_new_node(write_node_fn writer, read_node_fn reader,
 			   uint32_t idx, uint32_t vdi_id)
 {
 	struct sd_extent_header *header = EXT_HEADER(inode->data_vdi_id);
-	struct sd_extent_header *leaf_node = NULL;
+	struct bnode *leaf_node;
 	uint64_t oid;
 	int ret = SD_RES_SUCCESS;
 
@@ -520,46 +1110,51 @@ static int insert_new_node(write_node_fn writer, read_node_fn reader,
 				goto out;
 			}
 			if (path->p_ext_header->entries >= EXT_MAX_ENTRIES) {
-				split_ext_node(writer, inode, path);
-				ret = SD_RES_AGAIN;
+				ret = split_ext_node(writer, reader, inode,
+						     path);
+				if (ret == SD_RES_SUCCESS)
+					ret = SD_RES_AGAIN;
 				goto out;
 			}
+			ret = get_private_leaf(reader, path, path->p_ext);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
 			insert_ext_entry_nosearch(path->p_ext_header,
 					path->p_ext, idx, vdi_id);
-			writer(path->p_idx->oid, path->p_ext_header,
-			       SD_INODE_DATA_INDEX_SIZE, 0, 0, inode->nr_copies,
-			       inode->copy_policy, false, false);
+			write_leaf_node(writer, inode, path->p_bnode,
+					path->p_ext, false);
 		} else if (path->p_ext_header) {
 			/* the last idx-node */
+			ret = get_private_leaf(reader, path, path->p_ext);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
 			insert_ext_entry_nosearch(path->p_ext_header,
 					path->p_ext, idx, vdi_id);
 			path->p_idx--;
 			path->p_idx->idx =
 				(LAST_EXT(path->p_ext_header) - 1)->idx;
-			writer(path->p_idx->oid, path->p_ext_header,
-			       SD_INODE_DATA_INDEX_SIZE, 0, 0, inode->nr_copies,
-			       inode->copy_policy, false, false);
+			write_leaf_node(writer, inode, path->p_bnode,
+					path->p_ext, false);
 		} else {
 			/* if btree is full, then panic */
 			if (header->entries >= EXT_IDX_MAX_ENTRIES)
 				panic("%s() B-tree is full!", __func__);
 			/* create a new ext-node */
-			leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
-			sd_inode_init(leaf_node, 2);
 			oid = vid_to_btree_oid(inode->vdi_id,
 					inode->btree_counter++);
-			insert_ext_entry_nosearch(leaf_node,
-					FIRST_EXT(leaf_node), idx, vdi_id);
-			writer(oid, leaf_node, SD_INODE_DATA_INDEX_SIZE,
-					0, 0, inode->nr_copies,
-					inode->copy_policy, true, false);
+			leaf_node = bnode_alloc(oid, SD_INODE_DATA_INDEX_SIZE);
+			sd_inode_init(leaf_node->header, 2);
+			insert_ext_entry_nosearch(leaf_node->header,
+					FIRST_EXT(leaf_node->header), idx,
+					vdi_id);
+			write_leaf_node(writer, inode, leaf_node,
+					FIRST_EXT(leaf_node->header), true);
+			bnode_put(leaf_node);
 			insert_idx_entry_nosearch(header, path->p_idx,
 					idx, oid);
 		}
 	}
 out:
-	if (leaf_node)
-		free(leaf_node);
 	return ret;
 }
 
@@ -571,7 +1166,7 @@ void sd_inode_set_vid(write_node_fn writer, read_node_fn reader,
 	uint64_t offset;
 	int ret;
 
-	path.p_ext_header = NULL;
+	memset(&path, 0, sizeof(path));
 
 	if (inode->store_policy == 0)
 		inode->data_vdi_id[idx] = vdi_id;
@@ -583,28 +1178,32 @@ void sd_inode_set_vid(write_node_fn writer, read_node_fn reader,
 			panic("%s() B-tree in inode is corrupt!", __func__);
 		while (1) {
 			memset(&path, 0, sizeof(path));
-			ret = search_whole_btree(reader, inode, idx, &path);
+			ret = search_whole_btree(reader, inode, idx, &path,
+						 true);
 			if (ret == SD_RES_SUCCESS) {
-				path.p_ext->vdi_id = vdi_id;
 				/*
 				 * Only write the vdi_id in sd_extent for
 				 * second level leaf-node.
 				 */
-				if (!path.p_ext_header)
+				if (!path.p_ext_header) {
+					path.p_ext->vdi_id = vdi_id;
 					goto out;
+				}
 				offset = (unsigned char *)(path.p_ext) -
-					 (unsigned char *)(path.p_ext_header) +
-					 offsetof(struct sd_extent, vdi_id);
-				writer(path.p_idx->oid, &vdi_id, sizeof(vdi_id),
-				       offset, 0, inode->nr_copies,
-				       inode->copy_policy, false, false);
+					 (unsigned char *)(path.p_ext_header);
+				ret = writer(path.p_idx->oid, &vdi_id,
+					     sizeof(vdi_id), offset +
+					     offsetof(struct sd_extent, vdi_id),
+					     0, inode->nr_copies,
+					     inode->copy_policy, false, false);
+				bnode_update_vid(path.p_idx->oid, offset, idx,
+						 vdi_id, ret);
 				goto out;
 			} else {
 				ret = insert_new_node(writer, reader, inode,
 						&path, idx, vdi_id);
 				if (SD_RES_AGAIN == ret) {
-					if (path.p_ext_header)
-						free(path.p_ext_header);
+					put_path(&path);
 					continue;
 				} else
 					goto out;
@@ -612,8 +1211,7 @@ void sd_inode_set_vid(write_node_fn writer, read_node_fn reader,
 		}
 	}
 out:
-	if (path.p_ext_header)
-		free(path.p_ext_header);
+	put_path(&path);
 	if (inode->store_policy != 0)
 		dump_btree(reader, inode);
 }
@@ -706,7 +1304,6 @@ void sd_inode_copy_vdis(write_node_fn writer, read_node_fn reader,
 	struct sd_extent_header *leaf_node;
 	struct sd_extent_idx *last_idx, *old_iter_idx, *new_iter_idx;
 	uint64_t oid;
-	void *tmp;
 
 	memcpy(newi->data_vdi_id, data_vdi_id, sizeof(newi->data_vdi_id));
 
@@ -716,13 +1313,11 @@ void sd_inode_copy_vdis(write_node_fn writer, read_node_fn reader,
 		old_iter_idx = FIRST_IDX(data_vdi_id);
 		new_iter_idx = FIRST_IDX(newi->data_vdi_id);
 		leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
-		tmp = (void *)leaf_node;
 		while (old_iter_idx != last_idx) {
-			reader(old_iter_idx->oid, &tmp,
-			       SD_INODE_DATA_INDEX_SIZE, 0);
+			read_leaf_node(reader, old_iter_idx->oid, leaf_node);
 			oid = vid_to_btree_oid(newi->vdi_id,
 					       newi->btree_counter++);
-			writer(oid, leaf_node, SD_INODE_DATA_INDEX_SIZE, 0, 0,
+			writer(oid, leaf_node, leaf_node_size(leaf_node), 0, 0,
 			       nr_copies, copy_policy, true, false);
 			new_iter_idx->oid = oid;
 			old_iter_idx++;
@@ -541,6 +541,16 @@ void reraise_crash_signal(int signo, int status)
 	exit(status);
 }
 
+__thread int stat_slot_idx = -1;
+
+/* Give each thread the next statistics slot in turn */
+int alloc_stat_slot(void)
+{
+	static unsigned long next;
+
+	return (uatomic_add_return(&next, 1) - 1) % NR_STAT_SLOTS;
+}
+
 pid_t gettid(void)
 {
 	return syscall(SYS_gettid);
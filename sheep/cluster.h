@@ -59,7 +59,9 @@ struct cluster_driver {
 	 * sd_join_handler() must be called on at least one node which already
 	 * paticipates in the cluster.  If the content of 'opaque' is changed in
 	 * sd_join_handler(), the updated 'opaque' must be passed to
-	 * sd_accept_handler().
+	 * sd_accept_handler().  The updated one can be longer than the
+	 * original, so the driver passes a buffer of enough size and sends
+	 * only the length which sd_join_handler() returns.
 	 *
 	 * Returns zero on success, -1 on error
 	 */
@@ -133,6 +135,9 @@ struct cluster_driver {
 	 *
 	 * After all thread unlock, all the resource of this distributed lock
 	 * will be released.
+	 *
+	 * The local and zookeeper drivers cache the ownership while other
+	 * threads of this node wait for the same lock, see cluster/lock.c.
 	 */
 	void (*unlock)(uint64_t lock_id);
 
@@ -192,6 +197,23 @@ static inline const char *get_cdrv_option(const struct cluster_driver *cdrv,
 		return NULL;
 }
 
+/*
+ * The lock service of a cluster driver.  ->acquire and ->release take and
+ * drop the distributed lock of 'lock_id' for this node; they are called by
+ * one thread at a time for the same lock id, not necessarily the same one.
+ */
+struct cluster_lock_ops {
+	void (*acquire)(uint64_t lock_id);
+	void (*release)(uint64_t lock_id);
+};
+
+/* cached ownership of the distributed locks, see cluster/lock.c */
+void cluster_lock_acquire(const struct cluster_lock_ops *ops,
+			  uint64_t lock_id);
+void cluster_lock_release(const struct cluster_lock_ops *ops,
+			  uint64_t lock_id);
+void cluster_lock_get_stat(struct s_lock *stat);
+
 /* callbacks back into sheepdog from the cluster drivers */
 void sd_accept_handler(const struct sd_node *joined,
 		       const struct rb_root *nroot, size_t nr_members,
@@ -204,6 +226,6 @@ int sd_reconnect_handler(void);
 void sd_update_node_handler(struct sd_node *);
 bool sd_join_handler(const struct sd_node *joining,
 		     const struct rb_root *nroot, size_t nr_nodes,
-		     void *opaque);
+		     void *opaque, size_t *opaque_len);
 
 #endif
@@ -257,6 +257,7 @@ static bool __corosync_dispatch_one(struct corosync_event *cevent)
 	struct sd_node *node;
 	struct cpg_node *n;
 	struct rb_root nroot = RB_ROOT;
+	size_t len;
 	int idx;
 
 	switch (cevent->type) {
@@ -270,8 +271,12 @@ static bool __corosync_dispatch_one(struct corosync_event *cevent)
 			return false;
 
 		build_node_list(cpg_nodes, nr_cpg_nodes, &nroot);
+		/* the accepted message can be longer than the joining one */
+		len = SD_MAX_EVENT_BUF_SIZE;
+		cevent->msg = xrealloc(cevent->msg, len);
 		if (sd_join_handler(&cevent->sender.node, &nroot,
-				    nr_cpg_nodes, cevent->msg)) {
+				    nr_cpg_nodes, cevent->msg, &len)) {
+			cevent->msg_len = len;
 			send_message(COROSYNC_MSG_TYPE_ACCEPT, &cevent->sender,
 				     cpg_nodes, nr_cpg_nodes, cevent->msg,
 				     cevent->msg_len);
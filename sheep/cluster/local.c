@@ -17,6 +17,7 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/syscall.h>
 
 #include "cluster.h"
 #include "event.h"
@@ -24,15 +25,14 @@
 #include "util.h"
 #include "rbtree.h"
 
-#define MAX_EVENTS 500
 #define PROCESS_CHECK_INTERVAL 50 /* ms */
 #define LOCAL_MAX_NODES 1024
 
 static const char *shmfile = "/tmp/sheepdog_shm";
 static const char *lockdir = "/tmp/sheepdog_locks/";
 /*
- * we have to use sd_rw_lock because flock isn't thread exclusive
- * and it also serves to project lock_tree
+ * flock isn't thread exclusive, but cluster/lock.c lets only one thread
+ * take the same lock at a time.  sd_rw_lock protects lock_tree.
  */
 static struct sd_rw_lock lock_tree_lock = SD_RW_LOCK_INITIALIZER;
 static struct rb_root lock_tree_root = RB_ROOT;
@@ -45,8 +45,6 @@ struct lock_entry {
 
 static int shmfd;
 static int sigfd;
-static int block_event_pos;
-static int nonblock_event_pos;
 static struct local_node this_node;
 static bool joined;
 
@@ -77,7 +75,8 @@ static bool lnode_eq(const struct local_node *a, const struct local_node *b)
 }
 
 enum local_event_type {
-	EVENT_JOIN = 1,
+	EVENT_PAD = 0,	/* fills the end of a ring */
+	EVENT_JOIN,
 	EVENT_ACCEPT,
 	EVENT_LEAVE,
 	EVENT_GATEWAY,
@@ -86,29 +85,100 @@ enum local_event_type {
 	EVENT_UPDATE_NODE,
 };
 
+/*
+ * An event record in a ring.  The current members are appended to the
+ * events which change the membership, followed by buf.
+ */
 struct local_event {
-	enum local_event_type type;
+	/* position of this record in the ring + 1, set when it is published */
+	uint64_t seq;
+	uint32_t len;
+	uint32_t type;
+
 	struct local_node sender;
 
 	bool callbacked;
 	bool removed;
 
+	uint32_t buf_size;
 	size_t buf_len;
-	uint8_t buf[SD_MAX_EVENT_BUF_SIZE];
 
 	size_t nr_lnodes; /* the number of sheep processes */
-	struct local_node lnodes[LOCAL_MAX_NODES];
+	struct local_node lnodes[0];
+};
+
+#define EVENT_ALIGN	16
+
+static inline uint8_t *event_buf(struct local_event *ev)
+{
+	return (uint8_t *)(ev->lnodes + ev->nr_lnodes);
+}
+
+/*
+ * shared memory queue
+ *
+ * Events are appended to two rings, one for block events and one for the
+ * others, which all the sheep processes read with their own cursors.  A
+ * producer reserves its record by advancing the tail of the ring with
+ * cmpxchg and publishes it by setting its seq, so sending notifications
+ * doesn't need any lock.  The consumers only read the rings except for the
+ * in-place updates of the block and join events.
+ *
+ * The flock of shmfile is taken only to change the membership (join,
+ * leave, gateway and node update events), to accept a join event and to
+ * attach a process.
+ */
+
+enum local_ring {
+	BLOCK_RING,
+	NONBLOCK_RING,
+	NR_RINGS,
 };
 
-/* shared memory queue */
+#define BLOCK_RING_SIZE		(1024 * 1024)
+#define NONBLOCK_RING_SIZE	(64 * 1024 * 1024)
+
+static const uint64_t ring_size[NR_RINGS] = {
+	[BLOCK_RING] = BLOCK_RING_SIZE,
+	[NONBLOCK_RING] = NONBLOCK_RING_SIZE,
+};
+
+/* a sheep process which reads the rings */
+struct local_member {
+	pid_t pid;
+	/* set when the process waits for a wakeup, see shm_queue_notify() */
+	uint32_t waiting;
+	uint64_t pos[NR_RINGS];
+};
 
 static struct shm_queue {
-	int block_event_pos;
-	struct local_event block_events[MAX_EVENTS];
-	int nonblock_event_pos;
-	struct local_event nonblock_events[MAX_EVENTS];
+	uint64_t tail[NR_RINGS];
+
+	/* the current membership, updated with the flock held */
+	size_t nr_lnodes;
+	struct local_node lnodes[LOCAL_MAX_NODES];
+
+	int nr_members; /* the high water mark of members[] */
+	struct local_member members[LOCAL_MAX_NODES];
+
+	uint8_t block_ring[BLOCK_RING_SIZE];
+	uint8_t nonblock_ring[NONBLOCK_RING_SIZE];
 } *shm_queue;
 
+/* this process in shm_queue->members[] */
+static struct local_member *this_member;
+
+static inline uint8_t *ring_base(enum local_ring r)
+{
+	return r == BLOCK_RING ? shm_queue->block_ring :
+		shm_queue->nonblock_ring;
+}
+
+static inline struct local_event *ring_event(enum local_ring r, uint64_t pos)
+{
+	return (struct local_event *)(ring_base(r) + pos % ring_size[r]);
+}
+
 static inline void node_insert(struct sd_node *new, struct rb_root *root)
 {
 	if (rb_insert(root, new, rb, node_cmp))
@@ -136,16 +206,14 @@ static void shm_queue_unlock(void)
 	xflock(shmfd, LOCK_UN);
 }
 
+/* Called with the flock held */
 static size_t get_nodes(struct local_node *n)
 {
-	struct local_event *ev;
-
-	ev = shm_queue->nonblock_events + shm_queue->nonblock_event_pos;
-
 	if (n)
-		memcpy(n, ev->lnodes, sizeof(ev->lnodes));
+		memcpy(n, shm_queue->lnodes,
+		       sizeof(*n) * shm_queue->nr_lnodes);
 
-	return ev->nr_lnodes;
+	return shm_queue->nr_lnodes;
 }
 
 static int process_exists(pid_t pid)
@@ -153,87 +221,200 @@ static int process_exists(pid_t pid)
 	return kill(pid, 0) == 0;
 }
 
-static struct local_event *shm_queue_peek_block_event(void)
+/* Return the oldest position of the ring which somebody still reads */
+static uint64_t ring_head(enum local_ring r, uint64_t tail)
 {
-	return shm_queue->block_events + (block_event_pos + 1) % MAX_EVENTS;
+	uint64_t head = tail;
+
+	for (int i = 0; i < uatomic_read(&shm_queue->nr_members); i++) {
+		struct local_member *m = shm_queue->members + i;
+		uint64_t pos;
+
+		if (!uatomic_read(&m->pid))
+			continue;
+
+		pos = uatomic_read(&m->pos[r]);
+		if (pos < head)
+			head = pos;
+	}
+
+	return head;
 }
 
-static struct local_event *shm_queue_peek_nonblock_event(void)
+/* Forget the members which have exited without detaching */
+static void reap_members(void)
 {
-	return shm_queue->nonblock_events +
-		(nonblock_event_pos + 1) % MAX_EVENTS;
+	for (int i = 0; i < uatomic_read(&shm_queue->nr_members); i++) {
+		struct local_member *m = shm_queue->members + i;
+		pid_t pid = uatomic_read(&m->pid);
+
+		if (pid && !process_exists(pid))
+			uatomic_cmpxchg(&m->pid, pid, 0);
+	}
 }
 
-static struct local_event *shm_queue_peek(void)
+/*
+ * Reserve a record of 'len' bytes in the ring.  The record has to be
+ * published with ring_publish() after it is filled.
+ */
+static struct local_event *ring_reserve(enum local_ring r, size_t len,
+					uint64_t *ppos)
 {
-	/* try to peek nonblock queue first */
-	if (nonblock_event_pos != shm_queue->nonblock_event_pos)
-		return shm_queue_peek_nonblock_event();
-	else if (block_event_pos != shm_queue->block_event_pos)
-		return shm_queue_peek_block_event();
-	else
-		return NULL;
+	uint64_t tail, pos, next, size = ring_size[r];
+	struct local_event *ev;
+
+	len = roundup(len, EVENT_ALIGN);
+	assert(len <= size / 2);
+
+	for (;;) {
+		tail = uatomic_read(&shm_queue->tail[r]);
+		pos = tail;
+		/* a record doesn't wrap around; pad the end of the ring */
+		if (pos % size + len > size)
+			pos += size - pos % size;
+		next = pos + len;
+
+		if (next - ring_head(r, tail) > size) {
+			sd_debug("ring %d is full", r);
+			reap_members();
+			usleep(1000);
+			continue;
+		}
+
+		if (uatomic_cmpxchg(&shm_queue->tail[r], tail, next) == tail)
+			break;
+	}
+
+	if (pos != tail) {
+		ev = ring_event(r, tail);
+		ev->len = pos - tail;
+		ev->type = EVENT_PAD;
+		cmm_smp_wmb();
+		uatomic_set(&ev->seq, tail + 1);
+	}
+
+	ev = ring_event(r, pos);
+	memset(ev, 0, sizeof(*ev));
+	ev->len = len;
+	*ppos = pos;
+
+	return ev;
 }
 
-static void shm_queue_push(struct local_event *ev)
+static void ring_publish(struct local_event *ev, uint64_t pos)
 {
-	int pos;
+	cmm_smp_wmb();
+	uatomic_set(&ev->seq, pos + 1);
+}
 
-	if (ev->type == EVENT_BLOCK) {
-		pos = (shm_queue->block_event_pos + 1) % MAX_EVENTS;
+static struct local_event *ring_peek(enum local_ring r)
+{
+	struct local_event *ev;
+	uint64_t pos;
 
-		shm_queue->block_events[pos] = *ev;
-		msync(shm_queue->block_events + pos, sizeof(*ev), MS_SYNC);
+	for (;;) {
+		pos = this_member->pos[r];
+		if (pos == uatomic_read(&shm_queue->tail[r]))
+			return NULL;
 
-		shm_queue->block_event_pos = pos;
-		msync(&shm_queue->block_event_pos, sizeof(pos), MS_SYNC);
-	} else {
-		pos = (shm_queue->nonblock_event_pos + 1) % MAX_EVENTS;
+		ev = ring_event(r, pos);
+		if (uatomic_read(&ev->seq) != pos + 1)
+			return NULL; /* reserved but not published yet */
+		cmm_smp_rmb();
 
-		shm_queue->nonblock_events[pos] = *ev;
-		msync(shm_queue->nonblock_events + pos, sizeof(*ev), MS_SYNC);
+		if (ev->type != EVENT_PAD)
+			return ev;
 
-		shm_queue->nonblock_event_pos = pos;
-		msync(&shm_queue->nonblock_event_pos, sizeof(pos), MS_SYNC);
+		uatomic_set(&this_member->pos[r], pos + ev->len);
 	}
 }
 
+static struct local_event *shm_queue_peek_block_event(void)
+{
+	return ring_peek(BLOCK_RING);
+}
+
+static struct local_event *shm_queue_peek(void)
+{
+	struct local_event *ev;
+
+	/* try to peek nonblock queue first */
+	ev = ring_peek(NONBLOCK_RING);
+	if (ev)
+		return ev;
+
+	return ring_peek(BLOCK_RING);
+}
+
 static void shm_queue_remove(struct local_event *ev)
 {
-	if (ev == shm_queue_peek_block_event())
-		block_event_pos = (block_event_pos + 1) % MAX_EVENTS;
-	else
-		nonblock_event_pos = (nonblock_event_pos + 1) % MAX_EVENTS;
+	enum local_ring r = ev->type == EVENT_BLOCK ? BLOCK_RING :
+		NONBLOCK_RING;
+
+	uatomic_set(&this_member->pos[r], this_member->pos[r] + ev->len);
 }
 
+/*
+ * Wake up the processes which wait for new events.  A process sets its
+ * ->waiting before it checks the rings for the last time, so it is woken
+ * up if anything is published after that, and the busy ones are not
+ * signaled at all.
+ */
 static void shm_queue_notify(void)
 {
-	int i;
-	size_t nr;
-	struct local_node lnodes[LOCAL_MAX_NODES];
+	cmm_smp_mb();
 
-	nr = get_nodes(lnodes);
+	for (int i = 0; i < uatomic_read(&shm_queue->nr_members); i++) {
+		struct local_member *m = shm_queue->members + i;
+		pid_t pid = uatomic_read(&m->pid);
 
-	for (i = 0; i < nr; i++) {
-		sd_debug("send signal to %s", lnode_to_str(lnodes + i));
-		kill(lnodes[i].pid, SIGUSR1);
+		if (!pid || !uatomic_read(&m->waiting))
+			continue;
+
+		if (uatomic_xchg(&m->waiting, 0)) {
+			sd_debug("send signal to %d", pid);
+			kill(pid, SIGUSR1);
+		}
 	}
 }
 
-static bool is_shm_queue_valid(void)
+/* Called with the flock held */
+static void shm_queue_attach(void)
 {
+	struct local_member *m = NULL;
 	int i;
-	size_t nr;
-	struct local_node lnodes[LOCAL_MAX_NODES];
 
-	nr = get_nodes(lnodes);
+	reap_members();
+	for (i = 0; i < shm_queue->nr_members; i++)
+		if (!shm_queue->members[i].pid) {
+			m = shm_queue->members + i;
+			break;
+		}
+	if (!m) {
+		if (shm_queue->nr_members == LOCAL_MAX_NODES)
+			panic("too many sheep processes");
+		m = shm_queue->members + shm_queue->nr_members;
+	}
 
-	if (nr == 0)
-		return true;
+	/* start reading from the events which are published after this */
+	for (i = 0; i < NR_RINGS; i++)
+		m->pos[i] = uatomic_read(&shm_queue->tail[i]);
+	m->waiting = 0;
+	uatomic_set(&m->pid, getpid());
+	if (m == shm_queue->members + shm_queue->nr_members)
+		uatomic_inc(&shm_queue->nr_members);
 
-	for (i = 0; i < nr; i++)
-		if (process_exists(lnodes[i].pid))
+	this_member = m;
+}
+
+static bool is_shm_queue_valid(void)
+{
+	for (int i = 0; i < shm_queue->nr_members; i++) {
+		pid_t pid = shm_queue->members[i].pid;
+
+		if (pid && process_exists(pid))
 			return true;
+	}
 
 	return false;
 }
@@ -257,13 +438,8 @@ static void shm_queue_init(void)
 	if (shm_queue == MAP_FAILED)
 		panic("mmap error, %m");
 
-	if (is_shm_queue_valid()) {
-		block_event_pos = shm_queue->block_event_pos;
-		nonblock_event_pos = shm_queue->nonblock_event_pos;
-	} else {
+	if (!is_shm_queue_valid()) {
 		/* initialize shared memory */
-		block_event_pos = 0;
-		nonblock_event_pos = 0;
 		ret = xftruncate(shmfd, 0);
 		if (ret != 0)
 			panic("failed to truncate shmfile, %m");
@@ -272,53 +448,81 @@ static void shm_queue_init(void)
 			panic("failed to truncate shmfile, %m");
 	}
 
+	shm_queue_attach();
+
 	shm_queue_unlock();
 }
 
+static bool is_membership_event(enum local_event_type type)
+{
+	switch (type) {
+	case EVENT_JOIN:
+	case EVENT_LEAVE:
+	case EVENT_GATEWAY:
+	case EVENT_UPDATE_NODE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* The membership events have to be added with the flock held */
 static int add_event(enum local_event_type type, struct local_node *lnode,
 		      void *buf, size_t buf_len)
 {
-	struct local_node *n;
-	struct local_event ev = {
-		.type = type,
-		.sender = *lnode,
-	};
+	struct local_node *n, *lnodes = NULL;
+	struct local_event *ev;
+	size_t nr_lnodes = 0, buf_size;
+	uint64_t pos;
+	enum local_ring r = type == EVENT_BLOCK ? BLOCK_RING : NONBLOCK_RING;
 
 	buf_len = MIN(buf_len, SD_MAX_EVENT_BUF_SIZE);
-	ev.buf_len = buf_len;
-	if (buf)
-		memcpy(ev.buf, buf, buf_len);
+	/* the join event is replaced with the accept event in place */
+	buf_size = type == EVENT_JOIN ? SD_MAX_EVENT_BUF_SIZE : buf_len;
 
-	ev.nr_lnodes = get_nodes(ev.lnodes);
+	if (is_membership_event(type)) {
+		lnodes = shm_queue->lnodes;
+		nr_lnodes = get_nodes(NULL);
 
-	switch (type) {
-	case EVENT_JOIN:
-		ev.lnodes[ev.nr_lnodes] = *lnode;
-		ev.nr_lnodes++;
-		break;
-	case EVENT_LEAVE:
-		xlremove(lnode, ev.lnodes, &ev.nr_lnodes, lnode_cmp);
-		break;
-	case EVENT_GATEWAY:
-		n = xlfind(lnode, ev.lnodes, ev.nr_lnodes, lnode_cmp);
-		n->gateway = true;
-		break;
-	case EVENT_NOTIFY:
-	case EVENT_BLOCK:
-		break;
-	case EVENT_UPDATE_NODE:
-		n = xlfind(lnode, ev.lnodes, ev.nr_lnodes, lnode_cmp);
-		n->node = lnode->node;
-		break;
-	case EVENT_ACCEPT:
-		abort();
+		switch (type) {
+		case EVENT_JOIN:
+			lnodes[nr_lnodes] = *lnode;
+			nr_lnodes++;
+			break;
+		case EVENT_LEAVE:
+			xlremove(lnode, lnodes, &nr_lnodes, lnode_cmp);
+			break;
+		case EVENT_GATEWAY:
+			n = xlfind(lnode, lnodes, nr_lnodes, lnode_cmp);
+			n->gateway = true;
+			break;
+		case EVENT_UPDATE_NODE:
+			n = xlfind(lnode, lnodes, nr_lnodes, lnode_cmp);
+			n->node = lnode->node;
+			break;
+		default:
+			abort();
+		}
+		shm_queue->nr_lnodes = nr_lnodes;
 	}
 
-	sd_debug("type = %d, sender = %s", ev.type, lnode_to_str(&ev.sender));
-	for (int i = 0; i < ev.nr_lnodes; i++)
-		sd_debug("%d: %s", i, lnode_to_str(ev.lnodes + i));
+	ev = ring_reserve(r, sizeof(*ev) + sizeof(*lnodes) * nr_lnodes +
+			  buf_size, &pos);
+	ev->type = type;
+	ev->sender = *lnode;
+	ev->buf_size = buf_size;
+	ev->buf_len = buf_len;
+	ev->nr_lnodes = nr_lnodes;
+	if (nr_lnodes)
+		memcpy(ev->lnodes, lnodes, sizeof(*lnodes) * nr_lnodes);
+	if (buf)
+		memcpy(event_buf(ev), buf, buf_len);
 
-	shm_queue_push(&ev);
+	sd_debug("type = %d, sender = %s", ev->type, lnode_to_str(&ev->sender));
+	for (int i = 0; i < ev->nr_lnodes; i++)
+		sd_debug("%d: %s", i, lnode_to_str(ev->lnodes + i));
+
+	ring_publish(ev, pos);
 
 	shm_queue_notify();
 
@@ -348,20 +552,91 @@ static void check_pids(void *arg)
 	nr = get_nodes(lnodes);
 
 	for (i = 0; i < nr; i++)
-		if (!process_exists(lnodes[i].pid)) {
+		if (!process_exists(lnodes[i].pid))
 			add_event(EVENT_LEAVE, lnodes + i, NULL, 0);
 
-			/* unblock blocking event if sender has gone */
-			ev = shm_queue_peek_block_event();
-			if (lnode_eq(lnodes + i, &ev->sender)) {
-				ev->removed = true;
-				msync(ev, sizeof(*ev), MS_SYNC);
-			}
-		}
+	/* unblock blocking event if sender has gone */
+	ev = shm_queue_peek_block_event();
+	if (ev && !process_exists(ev->sender.pid)) {
+		uatomic_set(&ev->removed, true);
+		shm_queue_notify();
+	}
 
 	shm_queue_unlock();
 
-	add_timer(arg, PROCESS_CHECK_INTERVAL);
+	if (arg)
+		add_timer(arg, PROCESS_CHECK_INTERVAL);
+}
+
+/*
+ * Watch the exit of the member processes with pidfds instead of polling
+ * them, if the kernel supports it.
+ */
+struct pid_watch {
+	pid_t pid;
+	int fd;
+};
+
+static struct pid_watch pid_watches[LOCAL_MAX_NODES];
+static int nr_pid_watches;
+
+static int local_pidfd_open(pid_t pid)
+{
+#ifdef __NR_pidfd_open
+	return syscall(__NR_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void pid_exit_handler(int fd, int events, void *data)
+{
+	check_pids(NULL);
+}
+
+/* Watch the processes of 'lnodes' and stop watching the others */
+static void update_pid_watches(const struct local_node *lnodes, size_t nr)
+{
+	int i, j;
+
+	for (i = 0; i < nr_pid_watches; i++) {
+		for (j = 0; j < nr; j++)
+			if (lnodes[j].pid == pid_watches[i].pid)
+				break;
+		if (j < nr)
+			continue;
+
+		unregister_event(pid_watches[i].fd);
+		close(pid_watches[i].fd);
+		pid_watches[i--] = pid_watches[--nr_pid_watches];
+	}
+
+	for (j = 0; j < nr; j++) {
+		int fd;
+
+		if (lnodes[j].pid == this_node.pid)
+			continue;
+		for (i = 0; i < nr_pid_watches; i++)
+			if (lnodes[j].pid == pid_watches[i].pid)
+				break;
+		if (i < nr_pid_watches)
+			continue;
+
+		fd = local_pidfd_open(lnodes[j].pid);
+		if (fd < 0) {
+			/* the process has gone already */
+			check_pids(NULL);
+			continue;
+		}
+		if (register_event(fd, pid_exit_handler, NULL) < 0) {
+			close(fd);
+			continue;
+		}
+		pid_watches[nr_pid_watches].pid = lnodes[j].pid;
+		pid_watches[nr_pid_watches].fd = fd;
+		nr_pid_watches++;
+	}
 }
 
 
@@ -385,28 +660,28 @@ static int local_leave(void)
 static int local_notify(void *msg, size_t msg_len)
 {
 
-	return add_event_lock(EVENT_NOTIFY, &this_node, msg, msg_len);
+	return add_event(EVENT_NOTIFY, &this_node, msg, msg_len);
 }
 
 static int local_block(void)
 {
-	return add_event_lock(EVENT_BLOCK, &this_node, NULL, 0);
+	return add_event(EVENT_BLOCK, &this_node, NULL, 0);
 }
 
 static int local_unblock(void *msg, size_t msg_len)
 {
 	struct local_event *ev;
 
-	shm_queue_lock();
-
 	ev = shm_queue_peek_block_event();
 
-	ev->removed = true;
-	msync(ev, sizeof(*ev), MS_SYNC);
-
+	/*
+	 * The notification is published before the block event is removed,
+	 * so nobody processes the next block event before it.
+	 */
 	add_event(EVENT_NOTIFY, &this_node, msg, msg_len);
 
-	shm_queue_unlock();
+	uatomic_set(&ev->removed, true);
+	shm_queue_notify();
 
 	return SD_RES_SUCCESS;
 }
@@ -417,7 +692,9 @@ static bool local_process_event(void)
 	struct local_event *ev;
 	int i;
 	struct rb_root root = RB_ROOT;
-	size_t nr_nodes = 0;
+	struct local_node *lnodes = NULL;
+	size_t nr_nodes = 0, len;
+	bool ret = true;
 
 	ev = shm_queue_peek();
 	if (!ev)
@@ -426,17 +703,23 @@ static bool local_process_event(void)
 	sd_debug("type = %d, sender = %s", ev->type, lnode_to_str(&ev->sender));
 	sd_debug("callbacked = %d, removed = %d", ev->callbacked, ev->removed);
 
-	if (ev->removed)
+	if (uatomic_read(&ev->removed))
 		goto out;
 
-	if (ev->callbacked)
+	if (uatomic_read(&ev->callbacked)) {
+		/* check_pids() misses the sender which left before we got here */
+		if (!process_exists(ev->sender.pid)) {
+			uatomic_set(&ev->removed, true);
+			goto out;
+		}
 		return false; /* wait for unblock event */
+	}
 
 	if (!joined) {
 		if (!lnode_eq(&this_node, &ev->sender))
 			goto out;
 
-		switch (ev->type) {
+		switch (uatomic_read(&ev->type)) {
 		case EVENT_JOIN:
 			break;
 		case EVENT_ACCEPT:
@@ -448,34 +731,51 @@ static bool local_process_event(void)
 		}
 	}
 
+	/* the other processes read the same event, so work on a copy */
+	if (ev->nr_lnodes) {
+		lnodes = xmalloc(sizeof(*lnodes) * ev->nr_lnodes);
+		memcpy(lnodes, ev->lnodes, sizeof(*lnodes) * ev->nr_lnodes);
+	}
 	for (i = 0; i < ev->nr_lnodes; i++) {
-		sd_debug("%d: %s", i, lnode_to_str(ev->lnodes + i));
-		if (!ev->lnodes[i].gateway) {
-			node_insert(&ev->lnodes[i].node, &root);
+		sd_debug("%d: %s", i, lnode_to_str(lnodes + i));
+		if (!lnodes[i].gateway) {
+			node_insert(&lnodes[i].node, &root);
 			nr_nodes++;
 		}
 	}
 
-	switch (ev->type) {
+	switch (uatomic_read(&ev->type)) {
 	case EVENT_JOIN:
 		for (i = 0; i < ev->nr_lnodes; i++)
-			if (node_eq(&ev->sender.node, &ev->lnodes[i].node)) {
-				rb_erase(&ev->lnodes[i].node.rb, &root);
+			if (node_eq(&ev->sender.node, &lnodes[i].node)) {
+				rb_erase(&lnodes[i].node.rb, &root);
 				nr_nodes--;
 			}
-		if (sd_join_handler(&ev->sender.node, &root, nr_nodes,
-				    ev->buf)) {
-			ev->type = EVENT_ACCEPT;
-			msync(ev, sizeof(*ev), MS_SYNC);
 
+		/* only one process replaces the join event with the reply */
+		ret = false;
+		shm_queue_lock();
+		len = ev->buf_size;
+		if (uatomic_read(&ev->type) == EVENT_JOIN &&
+		    sd_join_handler(&ev->sender.node, &root, nr_nodes,
+				    event_buf(ev), &len)) {
+			ev->buf_len = len;
+			cmm_smp_wmb();
+			uatomic_set(&ev->type, EVENT_ACCEPT);
 			shm_queue_notify();
+			ret = true;
 		}
+		shm_queue_unlock();
 
-		return false;
+		free(lnodes);
+		return ret;
 	case EVENT_ACCEPT:
-		sd_accept_handler(&ev->sender.node, &root, nr_nodes, ev->buf);
+		sd_accept_handler(&ev->sender.node, &root, nr_nodes,
+				  event_buf(ev));
+		update_pid_watches(ev->lnodes, ev->nr_lnodes);
 		break;
 	case EVENT_LEAVE:
+		update_pid_watches(ev->lnodes, ev->nr_lnodes);
 		if (ev->sender.gateway) {
 			sd_debug("gateway %s left sheepdog",
 				 lnode_to_str(&ev->sender));
@@ -486,11 +786,13 @@ static bool local_process_event(void)
 		sd_leave_handler(&ev->sender.node, &root, nr_nodes);
 		break;
 	case EVENT_BLOCK:
-		ev->callbacked = sd_block_handler(&ev->sender.node);
-		msync(ev, sizeof(*ev), MS_SYNC);
+		if (sd_block_handler(&ev->sender.node))
+			uatomic_set(&ev->callbacked, true);
+		free(lnodes);
 		return false;
 	case EVENT_NOTIFY:
-		sd_notify_handler(&ev->sender.node, ev->buf, ev->buf_len);
+		sd_notify_handler(&ev->sender.node, event_buf(ev),
+				  ev->buf_len);
 		break;
 	case EVENT_UPDATE_NODE:
 		if (lnode_eq(&ev->sender, &this_node))
@@ -499,10 +801,11 @@ static bool local_process_event(void)
 		sd_update_node_handler(&ev->sender.node);
 		break;
 	}
+	free(lnodes);
 out:
 	shm_queue_remove(ev);
 
-	return true;
+	return ret;
 }
 
 static void local_handler(int listen_fd, int events, void *data)
@@ -519,15 +822,19 @@ static void local_handler(int listen_fd, int events, void *data)
 	sd_debug("read siginfo");
 
 	ret = read(sigfd, &siginfo, sizeof(siginfo));
-	if (ret != sizeof(siginfo))
+	if (ret != sizeof(siginfo) && !(ret < 0 && errno == EAGAIN))
 		panic("failed to read from sigfd, %m");
 
-	shm_queue_lock();
-
-	while (local_process_event())
-		;
-
-	shm_queue_unlock();
+	/*
+	 * Declare that this process is waiting before the last check of the
+	 * rings, so that the events published after it wake us up again.
+	 */
+	do {
+		while (local_process_event())
+			;
+		uatomic_set(&this_member->waiting, 1);
+		cmm_smp_mb();
+	} while (local_process_event());
 }
 
 static int local_get_local_addr(uint8_t *myaddr)
@@ -542,7 +849,7 @@ static int local_get_local_addr(uint8_t *myaddr)
 static int local_init(const char *option)
 {
 	sigset_t mask;
-	int ret;
+	int ret, fd;
 	static struct timer t = {
 		.callback = check_pids,
 		.data = &t,
@@ -563,7 +870,12 @@ static int local_init(const char *option)
 		return -1;
 	}
 
-	add_timer(&t, PROCESS_CHECK_INTERVAL);
+	/* fall back to polling the processes if pidfd is not available */
+	fd = local_pidfd_open(getpid());
+	if (fd < 0)
+		add_timer(&t, PROCESS_CHECK_INTERVAL);
+	else
+		close(fd);
 
 	ret = register_event(sigfd, local_handler, NULL);
 	if (ret) {
@@ -571,6 +883,9 @@ static int local_init(const char *option)
 		return -1;
 	}
 
+	/* process the events which are published before registering sigfd */
+	uatomic_set(&this_member->waiting, 1);
+
 	ret = xmkdir(lockdir, sd_def_dmode);
 	if (ret < 0) {
 		sd_err("failed to create lockdir %s, %m", lockdir);
@@ -605,45 +920,64 @@ static struct lock_entry *lock_tree_add(struct lock_entry *new)
 	return rb_insert(&lock_tree_root, new, rb, lock_cmp);
 }
 
-static void local_lock(uint64_t lock_id)
+static void local_acquire_lock(uint64_t lock_id)
 {
 	struct lock_entry *entry;
+	char path[PATH_MAX];
+	int fd;
 
+	snprintf(path, sizeof(path), "%s%016"PRIx64, lockdir, lock_id);
+	fd = open(path, O_RDONLY | O_CREAT, sd_def_fmode);
+	if (fd < 0)
+		panic("failed to open %s, %m", path);
+	entry = xmalloc(sizeof(*entry));
+	entry->lock_id = lock_id;
+	entry->fd = fd;
+
+	/*
+	 * The lock tree is held only to find the fd, so the threads waiting
+	 * for different locks don't block each other.
+	 */
 	sd_write_lock(&lock_tree_lock);
-	entry = lock_tree_lookup(lock_id);
-	if (!entry) {
-		char path[PATH_MAX];
-		int fd;
-
-		snprintf(path, sizeof(path), "%s%016"PRIx64, lockdir, lock_id);
-		fd = open(path, O_RDONLY | O_CREAT, sd_def_fmode);
-		if (fd < 0)
-			panic("failed to open %s, %m", path);
-		entry = xmalloc(sizeof(*entry));
-		entry->lock_id = lock_id;
-		entry->fd = fd;
-		lock_tree_add(entry);
-	}
+	if (lock_tree_add(entry))
+		panic("lock %"PRIx64" is acquired twice", lock_id);
+	sd_rw_unlock(&lock_tree_lock);
 
-	if (xflock(entry->fd, LOCK_EX) < 0)
+	if (xflock(fd, LOCK_EX) < 0)
 		panic("lock failed %"PRIx64", %m", lock_id);
 }
 
-static void local_unlock(uint64_t lock_id)
+static void local_release_lock(uint64_t lock_id)
 {
 	struct lock_entry *entry;
 
+	sd_write_lock(&lock_tree_lock);
 	entry = lock_tree_lookup(lock_id);
 	if (!entry)
 		panic("can't find fd for lock %"PRIx64, lock_id);
+	rb_erase(&entry->rb, &lock_tree_root);
+	sd_rw_unlock(&lock_tree_lock);
 
 	if (xflock(entry->fd, LOCK_UN) < 0)
 		panic("unlock failed %"PRIx64", %m", lock_id);
 
 	close(entry->fd);
-	rb_erase(&entry->rb, &lock_tree_root);
 	free(entry);
-	sd_rw_unlock(&lock_tree_lock);
+}
+
+static const struct cluster_lock_ops local_lock_ops = {
+	.acquire = local_acquire_lock,
+	.release = local_release_lock,
+};
+
+static void local_lock(uint64_t lock_id)
+{
+	cluster_lock_acquire(&local_lock_ops, lock_id);
+}
+
+static void local_unlock(uint64_t lock_id)
+{
+	cluster_lock_release(&local_lock_ops, lock_id);
 }
 
 static int local_update_node(struct sd_node *node)
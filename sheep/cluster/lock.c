@@ -0,0 +1,197 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cached ownership of the distributed locks
+ *
+ * Taking a distributed lock costs a round trip to the lock service (a
+ * sequential znode for zookeeper, a flock for the local driver), and the
+ * threads of one sheep which compete on the same lock id used to pay it
+ * one by one.  Instead, only the first thread takes the distributed lock
+ * and the ownership is cached in this node: when the holder releases it
+ * while other local threads are waiting on the same lock id, the lock is
+ * handed to the next waiter without being released to the cluster.
+ *
+ * The cached ownership is a lease: it is kept for at most
+ * CLUSTER_LOCK_LEASE milliseconds and CLUSTER_LOCK_BATCH hand-overs since
+ * the distributed lock was taken, then it is released so that the other
+ * nodes waiting on the lock id get their turn.  The ownership is never kept
+ * when no local thread waits for it.
+ */
+
+#include "cluster.h"
+#include "list.h"
+#include "util.h"
+
+#define CLUSTER_LOCK_LEASE	100	/* millisecond */
+#define CLUSTER_LOCK_BATCH	64
+#define LOCK_HASH_BUCKET_NR	251
+
+struct cached_lock {
+	struct hlist_node hnode;
+	uint64_t id;
+	/* nr of threads which hold or wait for this lock */
+	int ref;
+	/* nr of threads which wait for this lock */
+	int nr_waiters;
+	/* a thread of this node holds this lock */
+	bool busy;
+	/* this node holds the distributed lock */
+	bool owned;
+	/* when the distributed lock is taken and hand-overs since then */
+	uint64_t lease_start;
+	int nr_batched;
+	struct sd_cond wait_cond;
+};
+
+static struct lock_bucket {
+	struct sd_mutex lock;
+	struct hlist_head head;
+} lock_table[LOCK_HASH_BUCKET_NR];
+
+static struct s_lock lock_stat;
+
+static void __attribute__((constructor)) init_lock_table(void)
+{
+	for (int i = 0; i < LOCK_HASH_BUCKET_NR; i++) {
+		sd_init_mutex(&lock_table[i].lock);
+		INIT_HLIST_HEAD(&lock_table[i].head);
+	}
+}
+
+static struct lock_bucket *lock_bucket(uint64_t lock_id)
+{
+	return lock_table + sd_hash_64(lock_id) % LOCK_HASH_BUCKET_NR;
+}
+
+/* Called with the bucket lock held */
+static struct cached_lock *lookup_cached_lock(struct lock_bucket *bucket,
+					      uint64_t lock_id)
+{
+	struct cached_lock *lock;
+	struct hlist_node *iter;
+
+	hlist_for_each_entry(lock, iter, &bucket->head, hnode) {
+		if (lock->id == lock_id)
+			return lock;
+	}
+
+	lock = xzalloc(sizeof(*lock));
+	lock->id = lock_id;
+	sd_cond_init(&lock->wait_cond);
+	hlist_add_head(&lock->hnode, &bucket->head);
+
+	return lock;
+}
+
+/* Called with the bucket lock held */
+static void put_cached_lock(struct cached_lock *lock)
+{
+	if (--lock->ref > 0)
+		return;
+
+	assert(!lock->owned && !lock->busy);
+	hlist_del(&lock->hnode);
+	sd_destroy_cond(&lock->wait_cond);
+	free(lock);
+}
+
+static bool lease_expired(const struct cached_lock *lock)
+{
+	return lock->nr_batched >= CLUSTER_LOCK_BATCH ||
+		clock_get_time() - lock->lease_start >=
+		CLUSTER_LOCK_LEASE * 1000000ULL;
+}
+
+void cluster_lock_acquire(const struct cluster_lock_ops *ops,
+			  uint64_t lock_id)
+{
+	struct lock_bucket *bucket = lock_bucket(lock_id);
+	struct cached_lock *lock;
+	uint64_t start = 0;
+
+	uatomic_inc(&lock_stat.acquire_nr);
+
+	sd_mutex_lock(&bucket->lock);
+	lock = lookup_cached_lock(bucket, lock_id);
+	lock->ref++;
+	if (lock->busy) {
+		uatomic_inc(&lock_stat.contended_nr);
+		start = clock_get_time();
+		lock->nr_waiters++;
+		while (lock->busy)
+			sd_cond_wait(&lock->wait_cond, &bucket->lock);
+		lock->nr_waiters--;
+	}
+	lock->busy = true;
+
+	if (lock->owned) {
+		/* the distributed lock is handed over by the previous holder */
+		uatomic_inc(&lock_stat.cached_nr);
+	} else {
+		/*
+		 * No other thread of this node can touch the distributed lock
+		 * while ->busy is set, so take it without the bucket lock.
+		 */
+		if (!start)
+			start = clock_get_time();
+		sd_mutex_unlock(&bucket->lock);
+		ops->acquire(lock_id);
+		sd_mutex_lock(&bucket->lock);
+		lock->owned = true;
+		lock->lease_start = clock_get_time();
+		lock->nr_batched = 0;
+	}
+	sd_mutex_unlock(&bucket->lock);
+
+	if (start)
+		uatomic_add(&lock_stat.wait_time,
+			    (clock_get_time() - start) / 1000);
+}
+
+void cluster_lock_release(const struct cluster_lock_ops *ops,
+			  uint64_t lock_id)
+{
+	struct lock_bucket *bucket = lock_bucket(lock_id);
+	struct cached_lock *lock;
+
+	sd_mutex_lock(&bucket->lock);
+	lock = lookup_cached_lock(bucket, lock_id);
+	if (!lock->busy)
+		panic("lock %"PRIx64" is not held", lock_id);
+
+	lock->nr_batched++;
+	if (lock->nr_waiters > 0 && !lease_expired(lock)) {
+		/* keep the distributed lock for the next local waiter */
+		lock->busy = false;
+		sd_cond_signal(&lock->wait_cond);
+		put_cached_lock(lock);
+		sd_mutex_unlock(&bucket->lock);
+		return;
+	}
+
+	/* ->busy is kept while releasing so that nobody takes it meanwhile */
+	sd_mutex_unlock(&bucket->lock);
+	ops->release(lock_id);
+	sd_mutex_lock(&bucket->lock);
+	lock->owned = false;
+	lock->busy = false;
+	if (lock->nr_waiters > 0)
+		sd_cond_signal(&lock->wait_cond);
+	put_cached_lock(lock);
+	sd_mutex_unlock(&bucket->lock);
+}
+
+void cluster_lock_get_stat(struct s_lock *stat)
+{
+	stat->acquire_nr = uatomic_read(&lock_stat.acquire_nr);
+	stat->cached_nr = uatomic_read(&lock_stat.cached_nr);
+	stat->contended_nr = uatomic_read(&lock_stat.contended_nr);
+	stat->wait_time = uatomic_read(&lock_stat.wait_time);
+}
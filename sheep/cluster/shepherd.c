@@ -98,10 +98,12 @@ retry:
 		goto retry;
 	} else if (rcv.type == SPH_SRV_MSG_NEW_NODE) {
 		struct sph_msg_join *join;
+		size_t opaque_len;
 		int join_len;
 
+		/* the accepted opaque can be longer than the joining one */
 		join_len = rcv.body_len;
-		join = xzalloc(join_len);
+		join = xzalloc(sizeof(*join) + SD_MAX_EVENT_BUF_SIZE);
 		ret = xread(sph_comm_fd, join, join_len);
 		if (ret != join_len) {
 			sd_err("xread() failed: %m");
@@ -112,8 +114,11 @@ retry:
 		 * FIXME: member change events must be ordered with nonblocked
 		 *        events
 		 */
-		if (!sd_join_handler(&join->new_node, NULL, 0, join->opaque))
+		opaque_len = SD_MAX_EVENT_BUF_SIZE;
+		if (!sd_join_handler(&join->new_node, NULL, 0, join->opaque,
+				     &opaque_len))
 			panic("sd_accept_handler() failed");
+		join_len = sizeof(*join) + opaque_len;
 
 		snd.type = SPH_CLI_MSG_ACCEPT;
 		snd.body_len = join_len;
@@ -285,8 +290,9 @@ static void msg_new_node(struct sph_msg *rcv)
 	int ret;
 	struct sph_msg_join *join;
 	struct sph_msg snd;
+	size_t opaque_len;
 
-	join = xzalloc(rcv->body_len);
+	join = xzalloc(sizeof(*join) + SD_MAX_EVENT_BUF_SIZE);
 	ret = xread(sph_comm_fd, join, rcv->body_len);
 	if (ret != rcv->body_len) {
 		sd_err("xread() failed: %m");
@@ -294,8 +300,9 @@ static void msg_new_node(struct sph_msg *rcv)
 	}
 
 	/* FIXME: member change events must be ordered with nonblocked events */
+	opaque_len = SD_MAX_EVENT_BUF_SIZE;
 	if (!sd_join_handler(&join->new_node, join->nodes, join->nr_nodes,
-			     join->opaque))
+			     join->opaque, &opaque_len))
 		/*
 		 * This should succeed always because shepherd should have sent
 		 * SPH_SRV_MSG_NEW_NODE only to the already joined node.
@@ -304,10 +311,10 @@ static void msg_new_node(struct sph_msg *rcv)
 
 	memset(&snd, 0, sizeof(snd));
 	snd.type = SPH_CLI_MSG_ACCEPT;
-	snd.body_len = rcv->body_len;
+	snd.body_len = sizeof(*join) + opaque_len;
 
-	ret = writev2(sph_comm_fd, &snd, join, rcv->body_len);
-	if (sizeof(snd) + rcv->body_len != ret) {
+	ret = writev2(sph_comm_fd, &snd, join, snd.body_len);
+	if (sizeof(snd) + snd.body_len != ret) {
 		sd_err("writev() failed: %m");
 		exit(1);
 	}
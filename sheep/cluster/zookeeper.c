@@ -44,8 +44,6 @@ struct cluster_lock {
 	/* wait for the release of id by other lock owner */
 	struct sd_cond wait_wakeup;
 	struct sd_mutex wait_mutex;
-	/* lock for different threads of the same node on the same id */
-	struct sd_mutex id_lock;
 	char lock_path[MAX_NODE_STR_LEN];
 };
 
@@ -301,8 +299,8 @@ static inline ZOOAPI int zk_get_children(const char *path,
 }
 
 /*
- * All the operations of the lock table is protected by
- * cluster_lock->id_lock so we don't need to add lock here
+ * cluster/lock.c lets only one thread of this node compete for the same
+ * lock id, so each lock has at most one znode in the lock directory.
  */
 
 static int lock_table_lookup_wakeup(uint64_t lock_id)
@@ -354,18 +352,11 @@ static struct cluster_lock *lock_table_lookup_acquire(uint64_t lock_id)
 
 		sd_cond_init(&ret_lock->wait_wakeup);
 		sd_init_mutex(&ret_lock->wait_mutex);
-		sd_init_mutex(&ret_lock->id_lock);
 
 		hlist_add_head(&(ret_lock->hnode), cluster_locks_table + hval);
 	}
 	sd_mutex_unlock(table_locks + hval);
 
-	/*
-	 * if many threads use locks with same id, we should use
-	 * ->id_lock to avoid the only zookeeper handler to
-	 * create many seq-ephemeral files.
-	 */
-	sd_mutex_lock(&ret_lock->id_lock);
 	return ret_lock;
 }
 
@@ -390,12 +381,10 @@ static void lock_table_lookup_release(uint64_t lock_id)
 			zk_wait();
 		}
 		lock->lock_path[0] = '\0';
-		sd_mutex_unlock(&lock->id_lock);
 		lock->ref--;
 		if (!lock->ref) {
 			hlist_del(iter);
 			/* free all resource used by this lock */
-			sd_destroy_mutex(&lock->id_lock);
 			sd_destroy_mutex(&lock->wait_mutex);
 			sd_destroy_cond(&lock->wait_wakeup);
 			snprintf(path, MAX_NODE_STR_LEN, LOCK_ZNODE "/%"PRIu64,
@@ -529,6 +518,7 @@ static int push_join_response(struct zk_event *ev)
 
 	ev->type = EVENT_ACCEPT;
 	ev->nr_nodes = nr_sd_nodes;
+	ev->buf_len = ev->msg_len + sizeof(struct sd_node) * nr_sd_nodes;
 	rb_for_each_entry(n, &sd_node_root, rb) {
 		memcpy(np++, n, sizeof(struct sd_node));
 	}
@@ -713,24 +703,21 @@ static void zk_watcher(zhandle_t *zh, int type, int state, const char *path,
 }
 
 /*
- * We placehold the enough space to piggyback the nodes information on join
- * response message so that every node can see the same membership view.
- *
- * We have to preallocate enough space and set msg_len as
- * sizeof(struct cluster_info) because of piggyback.
+ * The join message carries only the joining node's cluster info.  The master
+ * updates it in place and piggybacks the current nodes on the response, so
+ * that every node can see the same membership view.
  */
 static int add_join_event(void *msg, size_t msglen)
 {
 	struct zk_event ev;
-	size_t len = msglen + sizeof(struct sd_node) * SD_MAX_NODES;
 
-	if (unlikely((offsetof(struct zk_event, buf) + len) > ZK_MAX_BUF_SIZE))
+	if (unlikely((offsetof(struct zk_event, buf) + msglen) > ZK_MAX_BUF_SIZE))
 		panic("Zookeeper can't send message more than 1M");
 	ev.id = get_uniq_id();
 	ev.type = EVENT_JOIN;
 	ev.sender = this_node;
 	ev.msg_len = msglen;
-	ev.buf_len = len;
+	ev.buf_len = msglen;
 	if (msg)
 		memcpy(ev.buf, msg, msglen);
 	return zk_queue_push(&ev);
@@ -977,6 +964,8 @@ static int zk_unblock(void *msg, size_t msg_len)
 
 static void zk_handle_join(struct zk_event *ev)
 {
+	size_t len;
+
 	sd_debug("sender: %s", node_to_str(&ev->sender.node));
 	if (!uatomic_is_true(&is_master)) {
 		/* Let's await master acking the join-request */
@@ -984,7 +973,11 @@ static void zk_handle_join(struct zk_event *ev)
 		return;
 	}
 
-	sd_join_handler(&ev->sender.node, &sd_node_root, nr_sd_nodes, ev->buf);
+	len = ZK_MAX_BUF_SIZE - offsetof(struct zk_event, buf) -
+		sizeof(struct sd_node) * nr_sd_nodes;
+	sd_join_handler(&ev->sender.node, &sd_node_root, nr_sd_nodes, ev->buf,
+			&len);
+	ev->msg_len = len;
 	push_join_response(ev);
 
 	sd_debug("I'm the master now");
@@ -1234,7 +1227,7 @@ kick_block_event:
  * this directory wil be the owner of the lock; the other threads will
  * wait on a struct sd_cond (cluster_lock->wait_wakeup)
  */
-static void zk_lock(uint64_t lock_id)
+static void zk_acquire_lock(uint64_t lock_id)
 {
 	int flags = ZOO_SEQUENCE | ZOO_EPHEMERAL;
 	int rc, len = MAX_NODE_STR_LEN;
@@ -1305,11 +1298,26 @@ static void zk_lock(uint64_t lock_id)
 	}
 }
 
-static void zk_unlock(uint64_t lock_id)
+static void zk_release_lock(uint64_t lock_id)
 {
 	lock_table_lookup_release(lock_id);
 }
 
+static const struct cluster_lock_ops zk_lock_ops = {
+	.acquire = zk_acquire_lock,
+	.release = zk_release_lock,
+};
+
+static void zk_lock(uint64_t lock_id)
+{
+	cluster_lock_acquire(&zk_lock_ops, lock_id);
+}
+
+static void zk_unlock(uint64_t lock_id)
+{
+	cluster_lock_release(&zk_lock_ops, lock_id);
+}
+
 static int zk_init(const char *option)
 {
 	char *hosts, *to, *p;
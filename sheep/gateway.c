@@ -24,6 +24,7 @@ struct req_iter {
 	uint32_t wlen;
 	uint32_t dlen;
 	uint64_t off;
+	int result;
 };
 
 static struct req_iter *prepare_replication_requests(struct request *req,
@@ -50,12 +51,13 @@ static struct req_iter *prepare_replication_requests(struct request *req,
 /*
  * Make sure we don't overwrite the existing data for misaligned write
  *
- * If either offset or length of request isn't aligned to
- * SD_EC_DATA_STRIPE_SIZE, we have to read the unaligned blocks before write.
- * This kind of write amplification indeed slow down the write operation with
- * extra read overhead.
+ * If either offset or length of request isn't aligned to the stripe size, we
+ * have to read the unaligned blocks before write.  This kind of write
+ * amplification indeed slow down the write operation with extra read
+ * overhead.
  */
-static void *init_erasure_buffer(struct request *req, int buf_len)
+static void *init_erasure_buffer(struct request *req, uint32_t stripe_size,
+				 int buf_len)
 {
 	char *buf = xvalloc(buf_len);
 	uint32_t len = req->rq.data_length;
@@ -63,18 +65,18 @@ static void *init_erasure_buffer(struct request *req, int buf_len)
 	uint64_t oid = req->rq.obj.oid;
 	int opcode = req->rq.opcode;
 	struct sd_req hdr;
-	uint64_t head = round_down(off, SD_EC_DATA_STRIPE_SIZE);
-	uint64_t tail = round_down(off + len, SD_EC_DATA_STRIPE_SIZE);
+	uint64_t head = round_down(off, stripe_size);
+	uint64_t tail = round_down(off + len, stripe_size);
 	int ret;
 
 	if (opcode != SD_OP_WRITE_OBJ)
 		goto out;
 
-	if (off % SD_EC_DATA_STRIPE_SIZE) {
+	if (off % stripe_size) {
 		/* Read head */
 		sd_init_req(&hdr, SD_OP_READ_OBJ);
 		hdr.obj.oid = oid;
-		hdr.data_length = SD_EC_DATA_STRIPE_SIZE;
+		hdr.data_length = stripe_size;
 		hdr.obj.offset = head;
 		ret = exec_local_req(&hdr, buf);
 		if (ret != SD_RES_SUCCESS) {
@@ -83,11 +85,11 @@ static void *init_erasure_buffer(struct request *req, int buf_len)
 		}
 	}
 
-	if ((len + off) % SD_EC_DATA_STRIPE_SIZE && tail - head > 0) {
+	if ((len + off) % stripe_size && tail - head > 0) {
 		/* Read tail */
 		sd_init_req(&hdr, SD_OP_READ_OBJ);
 		hdr.obj.oid = oid;
-		hdr.data_length = SD_EC_DATA_STRIPE_SIZE;
+		hdr.data_length = stripe_size;
 		hdr.obj.offset = tail;
 		ret = exec_local_req(&hdr, buf + tail - head);
 		if (ret != SD_RES_SUCCESS) {
@@ -96,7 +98,7 @@ static void *init_erasure_buffer(struct request *req, int buf_len)
 		}
 	}
 out:
-	memcpy(buf + off % SD_EC_DATA_STRIPE_SIZE, req->data, len);
+	memcpy(buf + off % stripe_size, req->data, len);
 	return buf;
 }
 
@@ -109,21 +111,24 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 	uint32_t len = req->rq.data_length;
 	uint64_t off = req->rq.obj.offset;
 	int opcode = req->rq.opcode;
-	int start = off / SD_EC_DATA_STRIPE_SIZE;
-	int end = DIV_ROUND_UP(off + len, SD_EC_DATA_STRIPE_SIZE), i, j;
+	uint32_t stripe_size =
+		get_vdi_ec_stripe_size(oid_to_vid(req->rq.obj.oid));
+	int start = off / stripe_size;
+	int end = DIV_ROUND_UP(off + len, stripe_size), i;
 	int nr_stripe = end - start;
 	struct fec *ctx;
 	int strip_size, nr_to_send;
 	struct req_iter *reqs;
-	char *p, *buf = NULL;
+	uint8_t *ds[SD_EC_MAX_STRIP], *ps[SD_EC_MAX_STRIP];
+	char *buf = NULL;
 	uint8_t policy = req->rq.obj.copy_policy ?:
 		get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
 	int ed = 0, ep = 0, edp;
 
 	edp = ec_policy_to_dp(policy, &ed, &ep);
-	ctx = ec_init(ed, edp);
+	ctx = ec_init_policy(policy);
 	*nr = nr_to_send = (opcode == SD_OP_READ_OBJ) ? ed : edp;
-	strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
+	strip_size = stripe_size / ed;
 	reqs = xzalloc(sizeof(*reqs) * nr_to_send);
 
 	sd_debug("start %d, end %d, send %d, off %"PRIu64 ", len %"PRIu32,
@@ -148,7 +153,7 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 	if (opcode != SD_OP_WRITE_OBJ && opcode != SD_OP_CREATE_AND_WRITE_OBJ)
 		goto out; /* Read and remove operation */
 
-	p = buf = init_erasure_buffer(req, SD_EC_DATA_STRIPE_SIZE * nr_stripe);
+	buf = init_erasure_buffer(req, stripe_size, stripe_size * nr_stripe);
 	if (!buf) {
 		sd_err("failed to init erasure buffer %"PRIx64,
 		       req->rq.obj.oid);
@@ -156,22 +161,11 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 		reqs = NULL;
 		goto out;
 	}
-	for (i = 0; i < nr_stripe; i++) {
-		const uint8_t *ds[ed];
-		uint8_t *ps[ep];
-
-		for (j = 0; j < ed; j++)
-			ds[j] = reqs[j].buf + strip_size * i;
-
-		for (j = 0; j < ep; j++)
-			ps[j] = reqs[ed + j].buf + strip_size * i;
-
-		for (j = 0; j < ed; j++)
-			memcpy((uint8_t *)ds[j], p + j * strip_size,
-			       strip_size);
-		ec_encode(ctx, ds, ps);
-		p += SD_EC_DATA_STRIPE_SIZE;
-	}
+	for (i = 0; i < ed; i++)
+		ds[i] = reqs[i].buf;
+	for (i = 0; i < ep; i++)
+		ps[i] = reqs[ed + i].buf;
+	ec_encode_stripes(ctx, (uint8_t *)buf, ds, ps, nr_stripe, stripe_size);
 out:
 	ec_destroy(ctx);
 	free(buf);
@@ -225,25 +219,29 @@ static void finish_requests(struct request *req, struct req_iter *reqs,
 	uint32_t len = req->rq.data_length;
 	uint64_t off = req->rq.obj.offset;
 	int opcode = req->rq.opcode;
-	int start = off / SD_EC_DATA_STRIPE_SIZE;
-	int end = DIV_ROUND_UP(off + len, SD_EC_DATA_STRIPE_SIZE), i, j;
-	int nr_stripe = end - start;
+	uint32_t stripe_size;
+	int start, end, nr_stripe, i, j;
 
 	if (!is_erasure_obj(oid, req->rq.obj.copy_policy))
 		goto out;
 
+	stripe_size = get_vdi_ec_stripe_size(oid_to_vid(oid));
+	start = off / stripe_size;
+	end = DIV_ROUND_UP(off + len, stripe_size);
+	nr_stripe = end - start;
+
 	sd_debug("start %d, end %d, send %d, off %"PRIu64 ", len %"PRIu32,
 		 start, end, nr_to_send, off, len);
 
 	/* We need to assemble the data strips into the req buffer for read */
 	if (opcode == SD_OP_READ_OBJ) {
-		char *p, *buf = xmalloc(SD_EC_DATA_STRIPE_SIZE * nr_stripe);
+		char *p, *buf = xmalloc(stripe_size * nr_stripe);
 		uint8_t policy = req->rq.obj.copy_policy ?:
 			get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
 		int ed = 0, strip_size;
 
 		ec_policy_to_dp(policy, &ed, NULL);
-		strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
+		strip_size = stripe_size / ed;
 
 		p = buf;
 		for (i = 0; i < nr_stripe; i++) {
@@ -253,7 +251,7 @@ static void finish_requests(struct request *req, struct req_iter *reqs,
 				p += strip_size;
 			}
 		}
-		memcpy(req->data, buf + off % SD_EC_DATA_STRIPE_SIZE, len);
+		memcpy(req->data, buf + off % stripe_size, len);
 		req->rp.data_length = req->rq.data_length;
 		free(buf);
 	}
@@ -281,7 +279,7 @@ static int gateway_replication_read(struct request *req)
 
 	nr_copies = get_req_copy_number(req);
 
-	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (!vnode_is_local(v))
@@ -327,7 +325,7 @@ struct forward_info_entry {
 	struct pollfd pfd;
 	const struct node_id *nid;
 	struct sockfd *sfd;
-	void *buf;
+	struct req_iter *iter;
 };
 
 struct forward_info {
@@ -343,14 +341,17 @@ static inline void forward_info_update(struct forward_info *fi, int pos)
 		sizeof(struct forward_info_entry) * (fi->nr_sent - pos));
 }
 
-static inline void finish_one_entry(struct forward_info *fi, int i)
+static inline void finish_one_entry(struct forward_info *fi, int i,
+				    int result)
 {
+	fi->ent[i].iter->result = result;
 	sockfd_cache_put(fi->ent[i].nid, fi->ent[i].sfd);
 	forward_info_update(fi, i);
 }
 
 static inline void finish_one_entry_err(struct forward_info *fi, int i)
 {
+	fi->ent[i].iter->result = SD_RES_NETWORK_ERROR;
 	sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
 	forward_info_update(fi, i);
 }
@@ -383,14 +384,15 @@ static inline void pfd_info_init(struct forward_info *fi, struct pfd_info *pi)
  * Wait for all forward requests completion.
  *
  * Even if something goes wrong, we have to wait forward requests completion to
- * avoid interleaved requests.
+ * avoid interleaved requests.  The result of each request is stored in its
+ * req_iter.
  *
  * Return error code if any one request fails.
  */
-static int wait_forward_request(struct forward_info *fi, struct request *req)
+static int wait_forward_request(struct forward_info *fi, struct request *req,
+				int repeat)
 {
-	int nr_sent, err_ret = SD_RES_SUCCESS, ret, pollret, i,
-	    repeat = MAX_RETRY_COUNT;
+	int nr_sent, err_ret = SD_RES_SUCCESS, ret, pollret, i;
 	struct pfd_info pi;
 	struct sd_rsp *rsp = &req->rp;
 again:
@@ -446,7 +448,8 @@ again:
 			struct forward_info_entry *ent;
 
 			ent = forward_info_find(fi, pi.pfds[i].fd);
-			if (do_read(pi.pfds[i].fd, ent->buf, rsp->data_length,
+			if (do_read(pi.pfds[i].fd, ent->iter->buf,
+				    rsp->data_length,
 				    sheep_need_retry, req->rq.epoch,
 				    MAX_RETRY_COUNT)) {
 				sd_err("remote node might have gone away");
@@ -461,7 +464,7 @@ again:
 			       sd_strerror(ret));
 			err_ret = ret;
 		}
-		finish_one_entry(fi, i);
+		finish_one_entry(fi, i, ret);
 	}
 out:
 	if (fi->nr_sent > 0)
@@ -480,22 +483,244 @@ static inline void forward_info_init(struct forward_info *fi, size_t nr_to_send)
 
 static inline void
 forward_info_advance(struct forward_info *fi, const struct node_id *nid,
-		     struct sockfd *sfd, void *buf)
+		     struct sockfd *sfd, struct req_iter *iter)
 {
 	fi->ent[fi->nr_sent].nid = nid;
 	fi->ent[fi->nr_sent].pfd.fd = sfd->fd;
 	fi->ent[fi->nr_sent].pfd.events = POLLIN;
 	fi->ent[fi->nr_sent].sfd = sfd;
-	fi->ent[fi->nr_sent].buf = buf;
+	fi->ent[fi->nr_sent].iter = iter;
 	fi->nr_sent++;
 }
 
-static int gateway_forward_request(struct request *req)
+/*
+ * Send reqs[i] to target_nodes[i] with the header hdr in parallel and wait for
+ * the completion of all of them.  If ec_index is NULL, the i-th request is
+ * for the i-th strip.  repeat is the number of poll timeouts to wait for
+ * before giving up the requests not completed.
+ */
+static int forward_reqs(struct request *req, struct sd_req *hdr,
+			const struct sd_node **target_nodes,
+			const int *ec_index, struct req_iter *reqs,
+			int nr_to_send, int repeat)
 {
 	int i, err_ret = SD_RES_SUCCESS, ret;
-	unsigned wlen;
-	uint64_t oid = req->rq.obj.oid;
 	struct forward_info fi;
+
+	for (i = 0; i < nr_to_send; i++)
+		reqs[i].result = SD_RES_NETWORK_ERROR;
+
+	forward_info_init(&fi, nr_to_send);
+	for (i = 0; i < nr_to_send; i++) {
+		struct sockfd *sfd;
+		const struct node_id *nid;
+
+		nid = &target_nodes[i]->nid;
+		/*
+		 * Go on to the others on failure, so that a read can use the
+		 * strips that succeed.
+		 */
+		sfd = sockfd_cache_get(nid);
+		if (!sfd) {
+			err_ret = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+
+		hdr->data_length = reqs[i].dlen;
+		hdr->obj.offset = reqs[i].off;
+		hdr->obj.ec_index = ec_index ? ec_index[i] : i;
+		hdr->obj.copy_policy = req->rq.obj.copy_policy;
+		ret = send_req(sfd->fd, hdr, reqs[i].buf, reqs[i].wlen,
+			       sheep_need_retry, req->rq.epoch,
+			       MAX_RETRY_COUNT);
+		if (ret) {
+			sockfd_cache_del_node(nid);
+			err_ret = SD_RES_NETWORK_ERROR;
+			sd_debug("fail %d", ret);
+			continue;
+		}
+		forward_info_advance(&fi, nid, sfd, reqs + i);
+	}
+
+	sd_debug("nr_sent %d, err %x", fi.nr_sent, err_ret);
+	if (fi.nr_sent > 0) {
+		ret = wait_forward_request(&fi, req, repeat);
+		if (ret != SD_RES_SUCCESS)
+			err_ret = ret;
+	}
+
+	return err_ret;
+}
+
+/*
+ * Parity-delta update for small misaligned writes to an erasure coded object
+ *
+ * Instead of reading the head and tail stripes with erasure coded reads and
+ * re-encoding the whole stripes, we read the old data of the changed range
+ * from the data strips and the old parity of the same range, and update the
+ * parity with P' = P + c * (D' - D).  This reads and writes only the strips
+ * that are actually changed plus the parity strips, in two parallel rounds.
+ *
+ * Return SD_RES_AGAIN if the old data can't be read, e.g. some strips are
+ * lost, so that the caller can fall back to the usual path.  If the write
+ * round fails, some strips might be updated and the others not, so the delta
+ * must never be applied again to the stripes.
+ */
+#define MAX_DELTA_STRIPES 2
+
+static bool need_parity_delta(const struct request *req)
+{
+	uint32_t len = req->rq.data_length;
+	uint64_t off = req->rq.obj.offset;
+	uint32_t stripe_size;
+
+	if (req->rq.opcode != SD_OP_WRITE_OBJ ||
+	    !is_erasure_obj(req->rq.obj.oid, req->rq.obj.copy_policy))
+		return false;
+
+	stripe_size = get_vdi_ec_stripe_size(oid_to_vid(req->rq.obj.oid));
+	if (off % stripe_size == 0 && (off + len) % stripe_size == 0)
+		return false; /* no need to read old data */
+
+	return DIV_ROUND_UP(off + len, stripe_size) - off / stripe_size <=
+		MAX_DELTA_STRIPES;
+}
+
+/*
+ * Calculate the range of the strip 'idx' changed by the request, in the
+ * offset of the strip.  Return false if the strip is not changed.
+ */
+static bool get_strip_range(const struct request *req, int idx,
+			    uint32_t stripe_size, int strip_size,
+			    uint64_t *start, uint64_t *end)
+{
+	uint64_t off = req->rq.obj.offset, last = off + req->rq.data_length;
+	bool found = false;
+
+	for (uint64_t s = off / stripe_size; s * stripe_size < last; s++) {
+		uint64_t cs = s * stripe_size + idx * strip_size;
+		uint64_t a = max(cs, off), b = min(cs + strip_size, last);
+
+		if (a >= b)
+			continue;
+		if (!found)
+			*start = s * strip_size + a - cs;
+		*end = s * strip_size + b - cs;
+		found = true;
+	}
+
+	return found;
+}
+
+/* Copy the new data of the strip 'idx' from the request buffer */
+static void copy_strip_data(const struct request *req, int idx,
+			    uint32_t stripe_size, int strip_size,
+			    uint64_t start, uint64_t end, uint8_t *buf)
+{
+	uint64_t off = req->rq.obj.offset;
+
+	for (uint64_t x = start; x < end; x++) {
+		uint64_t pos = x / strip_size * stripe_size +
+			idx * strip_size + x % strip_size;
+
+		buf[x - start] = ((const uint8_t *)req->data)[pos - off];
+	}
+}
+
+static int gateway_ec_delta_write(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	uint8_t policy = req->rq.obj.copy_policy ?:
+		get_vdi_copy_policy(oid_to_vid(oid));
+	int ed = 0, ep = 0, edp = ec_policy_to_dp(policy, &ed, &ep);
+	uint32_t stripe_size = get_vdi_ec_stripe_size(oid_to_vid(oid));
+	int strip_size = stripe_size / ed;
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	const struct sd_node *nodes[SD_EC_MAX_STRIP * 2];
+	struct req_iter reqs[SD_EC_MAX_STRIP * 2] = {};
+	uint64_t start[SD_EC_MAX_STRIP], end[SD_EC_MAX_STRIP];
+	uint64_t pstart = UINT64_MAX, pend = 0;
+	int idx[SD_EC_MAX_STRIP * 2], nr = 0, nr_data, i;
+	uint8_t *ps[SD_EC_MAX_STRIP];
+	struct fec *ctx = ec_init_policy(policy);
+	struct sd_req hdr;
+	int ret;
+
+	sd_debug("%"PRIx64", off %"PRIu32", len %"PRIu32, oid,
+		 req->rq.obj.offset, req->rq.data_length);
+
+	if (get_req_copy_number(req) < edp)
+		return SD_RES_AGAIN;
+
+	vinfo_oid_to_nodes(req->vinfo, oid, edp, target_nodes);
+
+	/* Read the old data of the changed data strips and the parity */
+	for (i = 0; i < ed; i++) {
+		if (!get_strip_range(req, i, stripe_size, strip_size,
+				     start + i, end + i))
+			continue;
+		pstart = min(pstart, start[i]);
+		pend = max(pend, end[i]);
+
+		reqs[nr].dlen = end[i] - start[i];
+		reqs[nr].off = start[i];
+		reqs[nr].buf = xvalloc(reqs[nr].dlen);
+		nodes[nr] = target_nodes[i];
+		idx[nr++] = i;
+	}
+	nr_data = nr;
+	for (i = 0; i < ep; i++) {
+		reqs[nr].dlen = pend - pstart;
+		reqs[nr].off = pstart;
+		reqs[nr].buf = xvalloc(reqs[nr].dlen);
+		nodes[nr] = target_nodes[ed + i];
+		ps[i] = reqs[nr].buf;
+		idx[nr++] = ed + i;
+	}
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	hdr.opcode = SD_OP_READ_PEER;
+	hdr.flags &= ~SD_FLAG_CMD_WRITE;
+	ret = forward_reqs(req, &hdr, nodes, idx, reqs, nr, MAX_RETRY_COUNT);
+	if (ret != SD_RES_SUCCESS) {
+		sd_info("failed to read old data of %"PRIx64", %s", oid,
+			sd_strerror(ret));
+		ret = SD_RES_AGAIN;
+		goto out;
+	}
+
+	/* Update the parity with the delta and write them back */
+	for (i = 0; i < nr_data; i++) {
+		int j = idx[i];
+		uint8_t *delta = reqs[i].buf, *p[SD_EC_MAX_STRIP];
+
+		reqs[i].buf = xvalloc(reqs[i].dlen);
+		copy_strip_data(req, j, stripe_size, strip_size, start[j],
+				end[j], reqs[i].buf);
+		for (int k = 0; k < reqs[i].dlen; k++)
+			delta[k] ^= reqs[i].buf[k];
+		for (int k = 0; k < ep; k++)
+			p[k] = ps[k] + start[j] - pstart;
+		ec_update_parity(ctx, j, delta, p, reqs[i].dlen);
+		free(delta);
+	}
+	for (i = 0; i < nr; i++)
+		reqs[i].wlen = reqs[i].dlen;
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	ret = forward_reqs(req, &hdr, nodes, idx, reqs, nr, MAX_RETRY_COUNT);
+	req->rp.data_length = 0;
+out:
+	for (i = 0; i < nr; i++)
+		free(reqs[i].buf);
+	ec_destroy(ctx);
+	return ret;
+}
+
+static int gateway_forward_request(struct request *req)
+{
+	int err_ret = SD_RES_SUCCESS;
+	uint64_t oid = req->rq.obj.oid;
 	struct sd_req hdr;
 	const struct sd_node *target_nodes[SD_MAX_NODES];
 	int nr_copies = get_req_copy_number(req), nr_reqs, nr_to_send = 0;
@@ -503,9 +728,25 @@ static int gateway_forward_request(struct request *req)
 
 	sd_debug("%"PRIx64, oid);
 
+	if (need_parity_delta(req) && !req->ec_delta_failed) {
+		err_ret = gateway_ec_delta_write(req);
+		if (err_ret == SD_RES_SUCCESS)
+			return err_ret;
+		if (err_ret != SD_RES_AGAIN) {
+			/*
+			 * The parity might be updated already, so re-encode
+			 * the touched stripes in full, now and when the
+			 * request is retried.
+			 */
+			sd_info("failed to update %"PRIx64" by delta, %s", oid,
+				sd_strerror(err_ret));
+			req->ec_delta_failed = true;
+		}
+		err_ret = SD_RES_SUCCESS;
+	}
+
 	gateway_init_fwd_hdr(&hdr, &req->rq);
-	oid_to_nodes(oid, &req->vinfo->vroot, nr_copies, target_nodes);
-	forward_info_init(&fi, nr_copies);
+	vinfo_oid_to_nodes(req->vinfo, oid, nr_copies, target_nodes);
 	reqs = prepare_requests(req, &nr_to_send);
 	if (!reqs)
 		return SD_RES_NETWORK_ERROR;
@@ -532,43 +773,120 @@ static int gateway_forward_request(struct request *req)
 		nr_to_send = ds;
 	}
 
-	for (i = 0; i < nr_to_send; i++) {
-		struct sockfd *sfd;
-		const struct node_id *nid;
+	err_ret = forward_reqs(req, &hdr, target_nodes, NULL, reqs, nr_to_send,
+			       MAX_RETRY_COUNT);
+out:
+	finish_requests(req, reqs, nr_reqs);
+	return err_ret;
+}
 
-		nid = &target_nodes[i]->nid;
-		sfd = sockfd_cache_get(nid);
-		if (!sfd) {
-			err_ret = SD_RES_NETWORK_ERROR;
-			break;
-		}
+/*
+ * Degraded read of an erasure coded object
+ *
+ * The data strips are read without waiting for their recovery or for a busy
+ * node more than one poll timeout.  If some of them fail, we read the parity
+ * strips picked by ec_pick_strips() in parallel and rebuild just the requested
+ * range of the lost data strips, so that reads keep a predictable latency
+ * while nodes are missing.  If there are not enough strips, fall back to the
+ * usual path, which waits for the recovery.
+ */
+static int gateway_ec_read(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	uint32_t len = req->rq.data_length;
+	uint64_t off = req->rq.obj.offset;
+	uint8_t policy = req->rq.obj.copy_policy ?:
+		get_vdi_copy_policy(oid_to_vid(oid));
+	int ed = 0, ep = 0, edp = ec_policy_to_dp(policy, &ed, &ep);
+	uint32_t stripe_size = get_vdi_ec_stripe_size(oid_to_vid(oid));
+	int strip_size = stripe_size / ed;
+	int start = off / stripe_size;
+	int nr_stripe = DIV_ROUND_UP(off + len, stripe_size) - start;
+	int nr_copies = get_req_copy_number(req);
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	const struct sd_node *nodes[SD_EC_MAX_STRIP * 2];
+	struct req_iter *reqs = xzalloc(sizeof(*reqs) * edp);
+	struct req_iter preqs[SD_EC_MAX_STRIP];
+	uint8_t *input[SD_EC_MAX_STRIP];
+	int idx[SD_EC_MAX_STRIP], in_idx[SD_EC_MAX_STRIP];
+	bool avail[SD_EC_MAX_STRIP * 2];
+	int nr_lost = 0, n, i, ret;
+	struct fec *ctx;
+	struct sd_req hdr;
 
-		hdr.data_length = reqs[i].dlen;
-		wlen = reqs[i].wlen;
-		hdr.obj.offset = reqs[i].off;
-		hdr.obj.ec_index = i;
-		hdr.obj.copy_policy = req->rq.obj.copy_policy;
-		ret = send_req(sfd->fd, &hdr, reqs[i].buf, wlen,
-			       sheep_need_retry, req->rq.epoch,
-			       MAX_RETRY_COUNT);
-		if (ret) {
-			sockfd_cache_del_node(nid);
-			err_ret = SD_RES_NETWORK_ERROR;
-			sd_debug("fail %d", ret);
-			break;
-		}
-		forward_info_advance(&fi, nid, sfd, reqs[i].buf);
+	if (nr_copies < ed) {
+		free(reqs);
+		return gateway_forward_request(req);
 	}
 
-	sd_debug("nr_sent %d, err %x", fi.nr_sent, err_ret);
-	if (fi.nr_sent > 0) {
-		ret = wait_forward_request(&fi, req);
-		if (ret != SD_RES_SUCCESS)
-			err_ret = ret;
+	for (i = 0; i < edp; i++) {
+		reqs[i].dlen = strip_size * nr_stripe;
+		reqs[i].off = (uint64_t)start * strip_size;
 	}
+	for (i = 0; i < ed; i++)
+		reqs[i].buf = xvalloc(reqs[i].dlen);
+
+	vinfo_oid_to_nodes(req->vinfo, oid, nr_copies, target_nodes);
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	hdr.flags |= SD_FLAG_CMD_NOWAIT;
+	ret = forward_reqs(req, &hdr, target_nodes, NULL, reqs, ed, 0);
+	if (ret == SD_RES_SUCCESS)
+		goto out;
+
+	ctx = ec_init_policy(policy);
+	for (i = 0; i < edp; i++) {
+		if (i < ed)
+			avail[i] = reqs[i].result == SD_RES_SUCCESS;
+		else
+			avail[i] = i < nr_copies;
+		nr_lost += !avail[i] && i < ed;
+	}
+	sd_info("%"PRIx64" lost %d data strips, %s, read parity strips",
+		oid, nr_lost, sd_strerror(ret));
+
+	/* Read the picked parity strips until we have enough strips to decode */
+	do {
+		if (!ec_pick_strips(ctx, avail, in_idx)) {
+			sd_err("not enough strips of %"PRIx64" to rebuild",
+			       oid);
+			for (i = 0; i < edp; i++)
+				free(reqs[i].buf);
+			free(reqs);
+			return gateway_forward_request(req);
+		}
+
+		for (n = 0, i = 0; i < ed; i++) {
+			int p = in_idx[i];
+
+			if (p < ed || reqs[p].buf)
+				continue;
+			reqs[p].buf = xvalloc(reqs[p].dlen);
+			preqs[n] = reqs[p];
+			nodes[n] = target_nodes[p];
+			idx[n++] = p;
+		}
+		if (n)
+			forward_reqs(req, &hdr, nodes, idx, preqs, n, 0);
+		for (i = 0; i < n; i++) {
+			reqs[idx[i]] = preqs[i];
+			avail[idx[i]] = preqs[i].result == SD_RES_SUCCESS;
+		}
+	} while (n);
+
+	for (i = 0; i < ed; i++)
+		input[i] = reqs[in_idx[i]].buf;
+	for (i = 0; i < ed; i++)
+		if (reqs[i].result != SD_RES_SUCCESS)
+			ec_decode_buffer(ctx, input, in_idx,
+					 (char *)reqs[i].buf, i,
+					 reqs[i].dlen);
+	ec_destroy(ctx);
+	ret = SD_RES_SUCCESS;
 out:
-	finish_requests(req, reqs, nr_reqs);
-	return err_ret;
+	for (i = ed; i < edp; i++)
+		free(reqs[i].buf);
+	finish_requests(req, reqs, ed);
+	return ret;
 }
 
 int gateway_read_obj(struct request *req)
@@ -579,11 +897,23 @@ int gateway_read_obj(struct request *req)
 		return object_cache_handle_request(req);
 
 	if (is_erasure_oid(oid))
-		return gateway_forward_request(req);
+		return gateway_ec_read(req);
 	else
 		return gateway_replication_read(req);
 }
 
+/*
+ * Drop the cached copy of the B-tree node after it is written, so that the
+ * lookups of hyper volumes on this node see the new one.
+ */
+static int gateway_invalidate_bnode(struct request *req, int ret)
+{
+	if (is_vdi_btree_obj(req->rq.obj.oid))
+		sd_inode_invalidate_bnode(req->rq.obj.oid);
+
+	return ret;
+}
+
 int gateway_write_obj(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
@@ -592,9 +922,10 @@ int gateway_write_obj(struct request *req)
 		return SD_RES_READONLY;
 
 	if (!bypass_object_cache(req))
-		return object_cache_handle_request(req);
+		return gateway_invalidate_bnode(req,
+					object_cache_handle_request(req));
 
-	return gateway_forward_request(req);
+	return gateway_invalidate_bnode(req, gateway_forward_request(req));
 }
 
 static int gateway_handle_cow(struct request *req)
@@ -639,12 +970,13 @@ int gateway_create_and_write_obj(struct request *req)
 		return gateway_handle_cow(req);
 
 	if (!bypass_object_cache(req))
-		return object_cache_handle_request(req);
+		return gateway_invalidate_bnode(req,
+					object_cache_handle_request(req));
 
-	return gateway_forward_request(req);
+	return gateway_invalidate_bnode(req, gateway_forward_request(req));
 }
 
 int gateway_remove_obj(struct request *req)
 {
-	return gateway_forward_request(req);
+	return gateway_invalidate_bnode(req, gateway_forward_request(req));
 }
@@ -20,14 +20,58 @@ struct get_vdis_work {
 	struct work work;
 	DECLARE_BITMAP(vdi_inuse, SD_NR_VDIS);
 	struct sd_node joined;
-	struct rb_root nroot;
 };
 
 static struct sd_mutex wait_vdis_lock = SD_MUTEX_INITIALIZER;
 static struct sd_cond wait_vdis_cond = SD_COND_INITIALIZER;
 static refcnt_t nr_get_vdis_works;
 
-static main_thread(struct vnode_info *) current_vnode_info;
+/*
+ * The current vnode info is published so that any thread can grab it with
+ * get_vnode_info().  Only the main thread replaces it, so the main thread can
+ * read the pointer without any care.
+ */
+static struct vnode_info *current_vnode_info;
+
+/*
+ * While a thread grabs current_vnode_info, it marks its own reader slot with
+ * the grace period it started in.  The slots are thread-local, so the readers
+ * don't share a cache line.  See publish_vnode_info().
+ */
+struct vnode_info_reader {
+	unsigned long gp;	/* 0 if not grabbing */
+	struct list_node list;
+};
+
+static __thread struct vnode_info_reader vnode_info_reader;
+static LIST_HEAD(vnode_info_readers);
+static struct sd_mutex vnode_info_readers_lock = SD_MUTEX_INITIALIZER;
+static pthread_key_t vnode_info_reader_key;
+static pthread_once_t vnode_info_reader_once = PTHREAD_ONCE_INIT;
+static unsigned long vnode_info_gp = 1;
+
+/* The replaced vnode infos whose references are put after a grace period */
+struct deferred_vnode_info {
+	struct vnode_info *vinfo;
+	unsigned long gp;
+	struct list_node list;
+};
+
+static LIST_HEAD(deferred_vnode_infos);
+static bool reclaim_timer_pending;
+
+/*
+ * The vnode infos of the recent epochs, indexed by epoch modulo the size.
+ * Recovery rolls back the epochs one by one, so this keeps the consecutive
+ * epochs which it visits.
+ */
+#define VNODE_INFO_EPOCH_CACHE_SIZE 16
+
+static struct vnode_info_epoch_cache {
+	uint32_t epoch;
+	struct vnode_info *vinfo;
+} vnode_info_epoch_cache[VNODE_INFO_EPOCH_CACHE_SIZE];
+static struct sd_mutex vnode_info_epoch_cache_lock = SD_MUTEX_INITIALIZER;
 static main_thread(struct list_head *) pending_block_list;
 static main_thread(struct list_head *) pending_notify_list;
 
@@ -73,19 +117,133 @@ struct vnode_info *grab_vnode_info(struct vnode_info *vnode_info)
 	return vnode_info;
 }
 
+static void unregister_vnode_info_reader(void *data)
+{
+	struct vnode_info_reader *r = data;
+
+	sd_mutex_lock(&vnode_info_readers_lock);
+	list_del(&r->list);
+	sd_mutex_unlock(&vnode_info_readers_lock);
+}
+
+static void create_vnode_info_reader_key(void)
+{
+	if (pthread_key_create(&vnode_info_reader_key,
+			       unregister_vnode_info_reader))
+		panic("failed to create a key, %m");
+}
+
+/* Add the reader slot of this thread, which is removed when it exits */
+static void register_vnode_info_reader(struct vnode_info_reader *r)
+{
+	pthread_once(&vnode_info_reader_once, create_vnode_info_reader_key);
+	pthread_setspecific(vnode_info_reader_key, r);
+
+	sd_mutex_lock(&vnode_info_readers_lock);
+	list_add_tail(&r->list, &vnode_info_readers);
+	sd_mutex_unlock(&vnode_info_readers_lock);
+}
+
 /*
- * Get a reference to the currently active vnode information structure,
- * this must only be called from the main thread.
+ * Get a reference to the currently active vnode information structure.
+ * This can be called from any thread without the main thread's help.
  * This can return NULL if cluster is not started yet.
  */
-main_fn struct vnode_info *get_vnode_info(void)
+struct vnode_info *get_vnode_info(void)
 {
-	struct vnode_info *cur_vinfo = main_thread_get(current_vnode_info);
+	struct vnode_info_reader *r = &vnode_info_reader;
+	struct vnode_info *cur_vinfo;
+
+	if (unlikely(!list_linked(&r->list)))
+		register_vnode_info_reader(r);
 
-	if (cur_vinfo == NULL)
-		return NULL;
+	/* the exchange orders the mark before the load of the pointer */
+	uatomic_xchg(&r->gp, uatomic_read(&vnode_info_gp));
+	cur_vinfo = uatomic_read(&current_vnode_info);
+	/* refcount_inc() implies a full barrier before the slot is cleared */
+	if (cur_vinfo)
+		grab_vnode_info(cur_vinfo);
+	uatomic_set(&r->gp, 0);
 
-	return grab_vnode_info(cur_vinfo);
+	return cur_vinfo;
+}
+
+static void reclaim_vnode_info_timer(void *data);
+
+static struct timer reclaim_timer = {
+	.callback = reclaim_vnode_info_timer,
+};
+
+/*
+ * Put the replaced vnode infos which no reader can be grabbing any more, that
+ * is, every reader is idle or started after the replacement.  If some are
+ * left, try again a bit later rather than waiting for the readers.
+ */
+main_fn static void reclaim_vnode_info(void)
+{
+	struct deferred_vnode_info *d;
+	struct vnode_info_reader *r;
+	unsigned long min_gp = ULONG_MAX;
+
+	if (list_empty(&deferred_vnode_infos))
+		return;
+
+	sd_mutex_lock(&vnode_info_readers_lock);
+	list_for_each_entry(r, &vnode_info_readers, list) {
+		unsigned long gp = uatomic_read(&r->gp);
+
+		if (gp && gp < min_gp)
+			min_gp = gp;
+	}
+	sd_mutex_unlock(&vnode_info_readers_lock);
+
+	list_for_each_entry(d, &deferred_vnode_infos, list) {
+		if (d->gp > min_gp)
+			break;
+		list_del(&d->list);
+		put_vnode_info(d->vinfo);
+		free(d);
+	}
+
+	if (!list_empty(&deferred_vnode_infos) && !reclaim_timer_pending) {
+		reclaim_timer_pending = true;
+		add_timer(&reclaim_timer, 10);
+	}
+}
+
+static void reclaim_vnode_info_timer(void *data)
+{
+	reclaim_timer_pending = false;
+	reclaim_vnode_info();
+}
+
+/*
+ * Replace the current vnode info with 'new' and return the old one, whose
+ * reference the caller has to put.
+ *
+ * A reader might have loaded the old pointer but not yet grabbed it, so the
+ * reference which current_vnode_info held is not put here.  It is put once
+ * every reader which might have seen the old pointer has left, without
+ * making the main thread wait for them.  The main thread is the only writer.
+ */
+main_fn static struct vnode_info *publish_vnode_info(struct vnode_info *new)
+{
+	struct vnode_info *old = current_vnode_info;
+	struct deferred_vnode_info *d;
+
+	cmm_smp_wmb();
+	uatomic_set(&current_vnode_info, new);
+	if (old) {
+		d = xmalloc(sizeof(*d));
+		d->vinfo = old;
+		/* the readers from now on start in the new grace period */
+		d->gp = uatomic_add_return(&vnode_info_gp, 1);
+		list_add_tail(&d->list, &deferred_vnode_infos);
+		grab_vnode_info(old);
+	}
+	reclaim_vnode_info();
+
+	return old;
 }
 
 /* Release a reference to the current vnode information. */
@@ -93,6 +251,14 @@ void put_vnode_info(struct vnode_info *vnode_info)
 {
 	if (vnode_info) {
 		if (refcount_dec(&vnode_info->refcnt) == 0) {
+			uint64_t nr_lookup, nr_miss;
+
+			placement_cache_get_stat(vnode_info->pcache,
+						 &nr_lookup, &nr_miss);
+			sd_debug("placement cache lookup %"PRIu64", miss %"
+				 PRIu64, nr_lookup, nr_miss);
+			free(vnode_info->pcache);
+			vnode_ring_destroy(&vnode_info->vring);
 			rb_destroy(&vnode_info->vroot, struct sd_vnode, rb);
 			rb_destroy(&vnode_info->nroot, struct sd_node, rb);
 			free(vnode_info);
@@ -146,30 +312,98 @@ struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
 
 	recalculate_vnodes(&vnode_info->nroot);
 
-	nodes_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
+	nodes_to_vnode_ring(&vnode_info->nroot, &vnode_info->vroot,
+			    &vnode_info->vring, sys->cinfo.flags);
+	/* aligned for the per-thread statistics */
+	vnode_info->pcache = xvalloc(sizeof(*vnode_info->pcache));
+	memset(vnode_info->pcache, 0, sizeof(*vnode_info->pcache));
 	vnode_info->nr_zones = get_zones_nr_from(&vnode_info->nroot);
 	refcount_set(&vnode_info->refcnt, 1);
 	return vnode_info;
 }
 
+static struct vnode_info *lookup_vnode_info_epoch(uint32_t epoch)
+{
+	struct vnode_info_epoch_cache *c;
+	struct vnode_info *vinfo = NULL;
+
+	c = vnode_info_epoch_cache + epoch % VNODE_INFO_EPOCH_CACHE_SIZE;
+	sd_mutex_lock(&vnode_info_epoch_cache_lock);
+	if (c->vinfo && c->epoch == epoch)
+		vinfo = grab_vnode_info(c->vinfo);
+	sd_mutex_unlock(&vnode_info_epoch_cache_lock);
+
+	return vinfo;
+}
+
+static void cache_vnode_info_epoch(uint32_t epoch, struct vnode_info *vinfo)
+{
+	struct vnode_info_epoch_cache *c;
+	struct vnode_info *old;
+
+	c = vnode_info_epoch_cache + epoch % VNODE_INFO_EPOCH_CACHE_SIZE;
+	sd_mutex_lock(&vnode_info_epoch_cache_lock);
+	old = c->vinfo;
+	c->epoch = epoch;
+	c->vinfo = grab_vnode_info(vinfo);
+	sd_mutex_unlock(&vnode_info_epoch_cache_lock);
+
+	put_vnode_info(old);
+}
+
+/* Drop the cached vnode info of the epoch whose log is rewritten */
+void invalidate_vnode_info_epoch(uint32_t epoch)
+{
+	struct vnode_info_epoch_cache *c;
+	struct vnode_info *old = NULL;
+
+	c = vnode_info_epoch_cache + epoch % VNODE_INFO_EPOCH_CACHE_SIZE;
+	sd_mutex_lock(&vnode_info_epoch_cache_lock);
+	if (c->vinfo && c->epoch == epoch) {
+		old = c->vinfo;
+		c->vinfo = NULL;
+	}
+	sd_mutex_unlock(&vnode_info_epoch_cache_lock);
+
+	put_vnode_info(old);
+}
+
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 					struct vnode_info *cur_vinfo)
 {
-	struct sd_node nodes[SD_MAX_NODES];
+	int len = sizeof(struct sd_node) * SD_MAX_NODES;
+	struct sd_node *nodes;
 	struct rb_root nroot = RB_ROOT;
+	struct vnode_info *vinfo;
 	int nr_nodes;
+	bool local = true;
+
+	vinfo = lookup_vnode_info_epoch(epoch);
+	if (vinfo)
+		return vinfo;
 
-	nr_nodes = epoch_log_read(epoch, nodes, sizeof(nodes));
+	nodes = xmalloc(len);
+	nr_nodes = epoch_log_read(epoch, nodes, len);
 	if (nr_nodes < 0) {
-		nr_nodes = epoch_log_read_remote(epoch, nodes, sizeof(nodes),
+		nr_nodes = epoch_log_read_remote(epoch, nodes, len,
 						 NULL, cur_vinfo);
-		if (nr_nodes == 0)
+		if (nr_nodes == 0) {
+			free(nodes);
 			return NULL;
+		}
+		local = false;
 	}
 	for (int i = 0; i < nr_nodes; i++)
 		rb_insert(&nroot, &nodes[i], rb, node_cmp);
 
-	return alloc_vnode_info(&nroot);
+	vinfo = alloc_vnode_info(&nroot);
+	free(nodes);
+
+	/* only the epochs in our log are invalidated when they are changed */
+	if (local)
+		cache_vnode_info_epoch(epoch, vinfo);
+
+	return vinfo;
 }
 
 int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
@@ -183,6 +417,7 @@ int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
 		nodes_to_buffer(&cur_vinfo->nroot, data);
 		rsp->data_length = nr_nodes * sizeof(struct sd_node);
 		rsp->node.nr_nodes = nr_nodes;
+		rsp->node.cluster_flags = sys->cinfo.flags;
 
 		put_vnode_info(cur_vinfo);
 	} else {
@@ -195,6 +430,19 @@ int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
 /* Indicator if a cluster operation is currently running. */
 static bool cluster_op_running;
 
+/*
+ * In batch mode, all the pending cluster operations share one block event.
+ * This is true while it is requested but not yet handled.
+ */
+static bool block_requested;
+
+struct cluster_batch {
+	struct work work;
+	int nr_reqs;
+	struct request *reqs[SD_MAX_BATCH_OPS];
+	struct vdi_reservation reserved;
+};
+
 static struct vdi_op_message *prepare_cluster_msg(struct request *req,
 		size_t *sizep)
 {
@@ -256,6 +504,192 @@ drop:
 	cluster_op_running = false;
 }
 
+/*
+ * The message of a batch carries the messages of the operations in order.
+ * Each of them is preceded by its size and padded to 8 bytes.
+ */
+static inline size_t batch_entry_size(size_t size)
+{
+	return sizeof(uint64_t) + round_up(size, sizeof(uint64_t));
+}
+
+static struct vdi_op_message *prepare_batch_msg(struct cluster_batch *batch,
+						size_t *sizep)
+{
+	struct vdi_op_message *msg;
+	size_t size = sizeof(*msg), len;
+	uint8_t *p;
+
+	msg = xzalloc(SD_MAX_EVENT_BUF_SIZE);
+	sd_init_req(&msg->req, SD_OP_BATCH);
+	msg->rsp.result = SD_RES_SUCCESS;
+
+	p = msg->data;
+	for (int i = 0; i < batch->nr_reqs; i++) {
+		struct vdi_op_message *m;
+
+		m = prepare_cluster_msg(batch->reqs[i], &len);
+		size += batch_entry_size(len);
+		assert(size <= SD_MAX_EVENT_BUF_SIZE);
+
+		*(uint64_t *)p = len;
+		memcpy(p + sizeof(uint64_t), m, len);
+		p += batch_entry_size(len);
+		free(m);
+	}
+	msg->req.data_length = size - sizeof(*msg);
+
+	*sizep = size;
+	return msg;
+}
+
+/*
+ * Return true if the request can join the batch
+ *
+ * Operations which are allowed to be batched look up the VDI by the name at
+ * the start of the request data.  Only the operations on different VDIs are
+ * batched, so that they give the same results as when they run one by one.
+ */
+static inline bool is_batch_req(const struct request *req)
+{
+	return is_batch_op(req->op) && req->rq.data_length >= SD_MAX_VDI_LEN;
+}
+
+static bool can_batch(const struct cluster_batch *batch,
+		      const struct request *req)
+{
+	if (batch->nr_reqs == 0)
+		return true;
+	if (batch->nr_reqs == SD_MAX_BATCH_OPS)
+		return false;
+	if (!is_batch_req(batch->reqs[0]) || !is_batch_req(req))
+		return false;
+
+	for (int i = 0; i < batch->nr_reqs; i++)
+		if (!strncmp(batch->reqs[i]->data, req->data, SD_MAX_VDI_LEN))
+			return false;
+
+	return true;
+}
+
+static void cluster_batch_work(struct work *work)
+{
+	struct cluster_batch *batch =
+		container_of(work, struct cluster_batch, work);
+
+	for (int i = 0; i < batch->nr_reqs; i++) {
+		struct request *req = batch->reqs[i];
+
+		req->reserved = &batch->reserved;
+		do_process_work(&req->work);
+		req->reserved = NULL;
+	}
+}
+
+static void cluster_batch_done(struct work *work)
+{
+	struct cluster_batch *batch =
+		container_of(work, struct cluster_batch, work);
+	struct vdi_op_message *msg;
+	size_t size;
+	int ret;
+
+	if (batch->reqs[0]->status == REQUEST_DROPPED)
+		goto drop;
+
+	sd_debug("%d operations (%p)", batch->nr_reqs, batch);
+
+	msg = prepare_batch_msg(batch, &size);
+
+	ret = sys->cdrv->unblock(msg, size);
+	if (ret != SD_RES_SUCCESS) {
+		sd_emerg("Failed to unblock, %s, exiting.", sd_strerror(ret));
+		exit(1);
+	}
+
+	free(msg);
+	for (int i = 0; i < batch->nr_reqs; i++)
+		batch->reqs[i]->status = REQUEST_DONE;
+	free(batch);
+	return;
+drop:
+	/*
+	 * No unblock is sent, so no node sets the vids reserved by the batch.
+	 * They are released with it.
+	 */
+	for (int i = 0; i < batch->nr_reqs; i++) {
+		struct request *req = batch->reqs[i];
+
+		list_del(&req->pending_list);
+		req->rp.result = SD_RES_CLUSTER_ERROR;
+		put_request(req);
+	}
+	free(batch);
+	cluster_op_running = false;
+}
+
+/*
+ * Process the pending cluster operations on different VDIs from the head of
+ * the list in one block/unblock cycle.  The others are left for the next
+ * block event.
+ */
+static void queue_cluster_batch(void)
+{
+	struct cluster_batch *batch = xzalloc(sizeof(*batch));
+	size_t size = sizeof(struct vdi_op_message);
+	struct request *req;
+
+	list_for_each_entry(req, main_thread_get(pending_block_list),
+			    pending_list) {
+		/* the message can't be larger than the request data */
+		size += batch_entry_size(sizeof(struct vdi_op_message) +
+					 req->rq.data_length);
+		if (!can_batch(batch, req) || size > SD_MAX_EVENT_BUF_SIZE)
+			break;
+		batch->reqs[batch->nr_reqs++] = req;
+		req->status = REQUEST_QUEUED;
+	}
+
+	if (batch->nr_reqs == 1) {
+		/* send it in the plain format */
+		req = batch->reqs[0];
+		free(batch);
+		req->work.fn = do_process_work;
+		req->work.done = cluster_op_done;
+		queue_work(sys->block_wqueue, &req->work);
+		return;
+	}
+
+	batch->work.fn = cluster_batch_work;
+	batch->work.done = cluster_batch_done;
+	queue_work(sys->block_wqueue, &batch->work);
+}
+
+/* Request a block event for the requests left by the last batch */
+static void request_batch_block(void)
+{
+	struct request *req;
+	int ret;
+
+	if (block_requested ||
+	    list_empty(main_thread_get(pending_block_list)))
+		return;
+
+	ret = sys->cdrv->block();
+	if (ret == SD_RES_SUCCESS) {
+		block_requested = true;
+		return;
+	}
+
+	sd_err("failed to broadcast block to cluster, %s", sd_strerror(ret));
+	list_for_each_entry(req, main_thread_get(pending_block_list),
+			    pending_list) {
+		list_del(&req->pending_list);
+		req->rp.result = ret;
+		put_request(req);
+	}
+}
+
 /*
  * Perform a blocked cluster operation if we were the node requesting it
  * and do not have any other operation pending.
@@ -277,6 +711,12 @@ main_fn bool sd_block_handler(const struct sd_node *sender)
 
 	cluster_op_running = true;
 
+	if (sys->batch_cluster_op) {
+		block_requested = false;
+		queue_cluster_batch();
+		return true;
+	}
+
 	req = list_first_entry(main_thread_get(pending_block_list),
 				struct request, pending_list);
 	req->work.fn = do_process_work;
@@ -300,11 +740,14 @@ main_fn void queue_cluster_request(struct request *req)
 	sd_debug("%s (%p)", op_name(req->op), req);
 
 	if (has_process_work(req->op)) {
-		ret = sys->cdrv->block();
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("failed to broadcast block to cluster, %s",
-			       sd_strerror(ret));
-			goto error;
+		if (!sys->batch_cluster_op || !block_requested) {
+			ret = sys->cdrv->block();
+			if (ret != SD_RES_SUCCESS) {
+				sd_err("failed to broadcast block to cluster, "
+				       "%s", sd_strerror(ret));
+				goto error;
+			}
+			block_requested = true;
 		}
 		list_add_tail(&req->pending_list,
 			      main_thread_get(pending_block_list));
@@ -337,7 +780,7 @@ error:
 int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len,
 			  time_t *timestamp, struct vnode_info *vinfo)
 {
-	char buf[SD_MAX_NODES * sizeof(struct sd_node) + sizeof(time_t)];
+	char *buf = xmalloc(len);
 	const struct sd_node *node;
 	int ret;
 
@@ -362,9 +805,11 @@ int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len,
 		if (timestamp)
 			memcpy(timestamp, buf + nodes_len, sizeof(*timestamp));
 
+		free(buf);
 		return nodes_len / sizeof(struct sd_node);
 	}
 
+	free(buf);
 	/*
 	 * If no node has targeted epoch log, return 0 here to at least
 	 * allow reading older epoch logs.
@@ -419,9 +864,7 @@ static bool enough_nodes_gathered(struct cluster_info *cinfo,
 static void cluster_info_copy(struct cluster_info *dst,
 			      const struct cluster_info *src)
 {
-	int len = offsetof(struct cluster_info, nodes) +
-		src->nr_nodes * sizeof(struct sd_node);
-	memcpy(dst, src, len);
+	memcpy(dst, src, cluster_info_size(src));
 }
 
 static enum sd_status cluster_wait_check(const struct sd_node *joining,
@@ -451,6 +894,10 @@ static enum sd_status cluster_wait_check(const struct sd_node *joining,
 	return sys->cinfo.status;
 }
 
+/*
+ * Fetch the vdi states which are changed on 'node' since the last sync, a page
+ * at a time.
+ */
 static int get_vdis_from(struct sd_node *node)
 {
 	struct sd_req hdr;
@@ -458,26 +905,41 @@ static int get_vdis_from(struct sd_node *node)
 	struct vdi_state *vs = NULL;
 	int i, ret = SD_RES_SUCCESS;
 	unsigned int rlen;
-	int count;
+	uint64_t generation, version;
+	int count, total = 0;
 
 	if (node_is_local(node))
 		goto out;
 
-	rlen = SD_DATA_OBJ_SIZE; /* FIXME */
-	vs = xzalloc(rlen);
-	sd_init_req(&hdr, SD_OP_GET_VDI_COPIES);
-	hdr.data_length = rlen;
-	hdr.epoch = sys_epoch();
-	ret = sheep_exec_req(&node->nid, &hdr, (char *)vs);
-	if (ret != SD_RES_SUCCESS)
-		goto out;
+	get_vdi_state_sync_point(&node->nid, &generation, &version);
 
-	count = rsp->data_length / sizeof(*vs);
-	for (i = 0; i < count; i++) {
-		atomic_set_bit(vs[i].vid, sys->vdi_inuse);
-		add_vdi_state(vs[i].vid, vs[i].nr_copies, vs[i].snapshot,
-			      vs[i].copy_policy);
-	}
+	rlen = SD_DATA_OBJ_SIZE;
+	vs = xzalloc(rlen);
+	do {
+		sd_init_req(&hdr, SD_OP_GET_VDI_COPIES);
+		hdr.data_length = rlen;
+		hdr.epoch = sys_epoch();
+		hdr.vdi_sync.generation = generation;
+		hdr.vdi_sync.version = version;
+		ret = sheep_exec_req(&node->nid, &hdr, (char *)vs);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+
+		count = rsp->data_length / sizeof(*vs);
+		for (i = 0; i < count; i++) {
+			atomic_set_bit(vs[i].vid, sys->vdi_inuse);
+			add_vdi_state(vs[i].vid, vs[i].nr_copies,
+				      vs[i].snapshot, vs[i].copy_policy,
+				      vs[i].ec_stripe_shift);
+		}
+		total += count;
+		generation = rsp->vdi_sync.generation;
+		version = rsp->vdi_sync.version;
+	} while (count == rlen / sizeof(*vs));
+
+	sd_debug("%d vdi states from %s, version %" PRIu64, total,
+		 node_to_str(node), version);
+	set_vdi_state_sync_point(&node->nid, generation, version);
 out:
 	free(vs);
 	return ret;
@@ -487,6 +949,7 @@ static void do_get_vdis(struct work *work)
 {
 	struct get_vdis_work *w =
 		container_of(work, struct get_vdis_work, work);
+	struct vnode_info *vinfo;
 	struct sd_node *n;
 	int ret;
 
@@ -500,7 +963,9 @@ static void do_get_vdis(struct work *work)
 		return;
 	}
 
-	rb_for_each_entry(n, &w->nroot, rb) {
+	/* the nodes of the current epoch, which can be newer than the join */
+	vinfo = get_vnode_info();
+	rb_for_each_entry(n, &vinfo->nroot, rb) {
 		/* We should not fetch vdi_bitmap and copy list from myself */
 		if (node_is_local(n))
 			continue;
@@ -520,6 +985,7 @@ static void do_get_vdis(struct work *work)
 		 * exit this loop here.
 		 */
 	}
+	put_vnode_info(vinfo);
 }
 
 static void get_vdis_done(struct work *work)
@@ -532,7 +998,6 @@ static void get_vdis_done(struct work *work)
 	sd_cond_broadcast(&wait_vdis_cond);
 	sd_mutex_unlock(&wait_vdis_lock);
 
-	rb_destroy(&w->nroot, struct sd_node, rb);
 	free(w);
 }
 
@@ -609,14 +1074,12 @@ static void setup_backend_store(const struct cluster_info *cinfo)
 	}
 }
 
-static void get_vdis(const struct rb_root *nroot, const struct sd_node *joined)
+static void get_vdis(const struct sd_node *joined)
 {
 	struct get_vdis_work *w;
 
 	w = xmalloc(sizeof(*w));
 	w->joined = *joined;
-	INIT_RB_ROOT(&w->nroot);
-	rb_copy(nroot, struct sd_node, rb, &w->nroot, node_cmp);
 	refcount_inc(&nr_get_vdis_works);
 
 	w->work.fn = do_get_vdis;
@@ -653,15 +1116,13 @@ static void update_cluster_info(const struct cluster_info *cinfo,
 	sockfd_cache_add(&joined->nid);
 
 	/*
-	 * We need use main_thread_get() to obtain current_vnode_info. The
-	 * reference count of old_vnode_info is decremented at the last of this
-	 * function in order to release old_vnode_info. The counter part
+	 * The reference count of old_vnode_info is decremented at the last of
+	 * this function in order to release old_vnode_info. The counter part
 	 * of this dereference is alloc_vnode_info().
 	 */
-	old_vnode_info = main_thread_get(current_vnode_info);
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	old_vnode_info = publish_vnode_info(alloc_vnode_info(nroot));
 
-	get_vdis(nroot, joined);
+	get_vdis(joined);
 
 	if (cinfo->status == SD_STATUS_OK) {
 		if (!is_cluster_formatted())
@@ -678,11 +1139,11 @@ static void update_cluster_info(const struct cluster_info *cinfo,
 				old_vnode_info = alloc_old_vnode_info(joined,
 								      nroot);
 
-			start_recovery(main_thread_get(current_vnode_info),
+			start_recovery(current_vnode_info,
 				       old_vnode_info, true);
 		} else if (!was_cluster_shutdowned()) {
-			start_recovery(main_thread_get(current_vnode_info),
-				       main_thread_get(current_vnode_info),
+			start_recovery(current_vnode_info,
+				       current_vnode_info,
 				       false);
 		}
 		set_cluster_shutdown(false);
@@ -691,16 +1152,9 @@ static void update_cluster_info(const struct cluster_info *cinfo,
 	put_vnode_info(old_vnode_info);
 }
 
-/*
- * Pass on a notification message from the cluster driver.
- *
- * Must run in the main thread as it accesses unlocked state like
- * sys->pending_list.
- */
-main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
-			       size_t data_len)
+static void process_cluster_msg(const struct sd_node *sender,
+				struct vdi_op_message *msg, size_t data_len)
 {
-	struct vdi_op_message *msg = data;
 	const struct sd_op_template *op = get_sd_op(msg->req.opcode);
 	int ret = msg->rsp.result;
 	struct request *req = NULL;
@@ -732,9 +1186,39 @@ main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
 
 		put_request(req);
 	}
+}
+
+/*
+ * Pass on a notification message from the cluster driver.
+ *
+ * Must run in the main thread as it accesses unlocked state like
+ * sys->pending_list.
+ */
+main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
+			       size_t data_len)
+{
+	struct vdi_op_message *msg = data;
+
+	if (msg->req.opcode == SD_OP_BATCH) {
+		uint8_t *p = msg->data, *end = p + msg->req.data_length;
+
+		while (p < end) {
+			size_t len = *(uint64_t *)p;
 
-	if (has_process_work(op))
-		cluster_op_running = false;
+			process_cluster_msg(sender,
+					    (struct vdi_op_message *)
+					    (p + sizeof(uint64_t)), len);
+			p += batch_entry_size(len);
+		}
+	} else {
+		process_cluster_msg(sender, msg, data_len);
+		if (!has_process_work(get_sd_op(msg->req.opcode)))
+			return;
+	}
+
+	cluster_op_running = false;
+	if (sys->batch_cluster_op)
+		request_batch_block();
 }
 
 /*
@@ -747,7 +1231,7 @@ main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
  */
 main_fn bool sd_join_handler(const struct sd_node *joining,
 			     const struct rb_root *nroot, size_t nr_nodes,
-			     void *opaque)
+			     void *opaque, size_t *opaque_len)
 {
 	struct cluster_info *cinfo = opaque;
 	enum sd_status status;
@@ -769,9 +1253,13 @@ main_fn bool sd_join_handler(const struct sd_node *joining,
 	else
 		status = sys->cinfo.status;
 
+	if (cluster_info_size(&sys->cinfo) > *opaque_len)
+		panic("too small buffer for cluster info, %zu", *opaque_len);
+
 	cluster_info_copy(cinfo, &sys->cinfo);
 	cinfo->status = status;
 	cinfo->proto_ver = SD_SHEEP_PROTO_VER;
+	*opaque_len = cluster_info_size(cinfo);
 
 	sd_debug("%s: cluster_status = 0x%x",
 		 addr_to_str(joining->nid.addr, joining->nid.port),
@@ -785,7 +1273,7 @@ static int send_join_request(void)
 	struct sd_node *n = &sys->this_node;
 
 	sd_info("%s", node_to_str(n));
-	return sys->cdrv->join(n, &sys->cinfo, sizeof(sys->cinfo));
+	return sys->cdrv->join(n, &sys->cinfo, cluster_info_size(&sys->cinfo));
 }
 
 static void requeue_cluster_request(void)
@@ -794,6 +1282,9 @@ static void requeue_cluster_request(void)
 	struct vdi_op_message *msg;
 	size_t size;
 
+	/* the block event was lost with the session */
+	block_requested = false;
+
 	list_for_each_entry(req, main_thread_get(pending_notify_list),
 			    pending_list) {
 		/*
@@ -939,16 +1430,15 @@ main_fn void sd_leave_handler(const struct sd_node *left,
 		sys->this_node.nr_vnodes = 0;
 
 	/*
-	 * Using main_thread_get() instead of get_vnode_info() is allowed
-	 * because of the same reason of update_cluster_info()
+	 * The reference of old_vnode_info is dropped at the last of this
+	 * function, as update_cluster_info() does.
 	 */
-	old_vnode_info = main_thread_get(current_vnode_info);
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	old_vnode_info = publish_vnode_info(alloc_vnode_info(nroot));
 	if (sys->cinfo.status == SD_STATUS_OK) {
 		ret = inc_and_log_epoch();
 		if (ret != 0)
 			panic("cannot log current epoch %d", sys->cinfo.epoch);
-		start_recovery(main_thread_get(current_vnode_info),
+		start_recovery(current_vnode_info,
 			       old_vnode_info, true);
 	}
 
@@ -969,20 +1459,32 @@ static void update_node_size(struct sd_node *node)
 	put_vnode_info(cur_vinfo);
 }
 
+/* Rebuild the current vnode info for the placement algorithm set by format */
+main_fn void refresh_vnode_info(void)
+{
+	struct vnode_info *old = current_vnode_info;
+
+	if (!old)
+		return;
+
+	old = publish_vnode_info(alloc_vnode_info(&old->nroot));
+	put_vnode_info(old);
+}
+
 static void kick_node_recover(void)
 {
 	/*
-	 * Using main_thread_get() instead of get_vnode_info() is allowed
-	 * because of the same reason of update_cluster_info()
+	 * The reference of the old vnode info is dropped at the last of this
+	 * function, as update_cluster_info() does.
 	 */
-	struct vnode_info *old = main_thread_get(current_vnode_info);
+	struct vnode_info *old = current_vnode_info;
 	int ret;
 
-	main_thread_set(current_vnode_info, alloc_vnode_info(&old->nroot));
+	old = publish_vnode_info(alloc_vnode_info(&old->nroot));
 	ret = inc_and_log_epoch();
 	if (ret != 0)
 		panic("cannot log current epoch %d", sys->cinfo.epoch);
-	start_recovery(main_thread_get(current_vnode_info), old, true);
+	start_recovery(current_vnode_info, old, true);
 	put_vnode_info(old);
 }
 
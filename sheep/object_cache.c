@@ -11,6 +11,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/mman.h>
+
 #include "sheep_priv.h"
 
 /*
@@ -31,22 +33,68 @@
 
 #define CACHE_OBJECT_SIZE (SD_DATA_OBJ_SIZE / 1024 / 1024) /* M */
 
-/* Kick background pusher if dirty_count greater than it */
+/* Dirty blocks are tracked in 4K unit for the default object size */
+#define CACHE_NR_BLOCKS (SD_DATA_OBJ_SIZE / BLOCK_SIZE)
+
+/*
+ * Clean gaps between dirty runs up to this many blocks are pushed together
+ * with the runs, which saves a request at the cost of a little bandwidth.
+ */
+#define PUSH_MERGE_GAP 4
+
+/* Don't apply the dirty ratio unless dirty_count is greater than it */
 #define MAX_DIRTY_OBJECT_COUNT	10 /* Just a random number, no rationale */
 
+/* How often the writeback scheduler looks for objects to push */
+#define WRITEBACK_INTERVAL	1000 /* ms */
+
+/* The max number of objects pushed in one writeback pass of a VDI */
+#define MAX_WRITEBACK_BATCH	128
+
+/*
+ * Accesses to an inactive object within this period after it was cached are
+ * regarded as one reference, so a sequential scan doesn't activate it.
+ */
+#define CORRELATED_REF_PERIOD	(UINT64_C(1000000000)) /* ns */
+
+/* We evict inactive objects first while they are more than this percent */
+#define INACTIVE_RATIO		25
+
 struct global_cache {
 	uint32_t capacity; /* The real capacity of object cache of this node */
 	uatomic_bool in_reclaim; /* If the relcaimer is working */
+	uatomic_bool in_writeback; /* If the writeback worker is running */
+	uint64_t wb_budget; /* Bytes the writeback worker may push now */
+	uint64_t wb_refill_time; /* When wb_budget was refilled last time */
+
+	struct sd_mutex lru_lock; /* Protects the two lists and counters */
+	struct list_head inactive_head; /* Objects referenced once */
+	struct list_head active_head; /* Objects referenced more than once */
+	uint32_t nr_inactive;
+	uint32_t nr_active;
+
+	/* Counted per thread not to share a cache line on every hit */
+	struct cache_stat {
+		uint64_t nr_hit;
+		uint64_t nr_miss;
+		uint64_t nr_evict;
+	} __cacheline_aligned stat[NR_STAT_SLOTS];
 };
 
 struct object_cache_entry {
 	uint64_t idx; /* Index of this entry */
 	refcnt_t refcnt; /* Reference count of this entry */
-	uint64_t bmap; /* Each bit represents one dirty block in object */
+	/* Each bit represents one dirty block in object */
+	DECLARE_BITMAP(bmap, CACHE_NR_BLOCKS);
+	uint64_t dirty_time; /* When the entry was added to the dirty list */
 	struct object_cache *oc; /* Object cache this entry belongs to */
 	struct rb_node node; /* For lru tree of object cache */
 	struct list_node dirty_list; /* For dirty list of object cache */
-	struct list_node lru_list; /* For lru list of object cache */
+	struct list_node lru_list; /* For global inactive or active list */
+	bool active; /* If the entry is on the active list */
+	uatomic_bool referenced; /* If referenced since the reclaimer saw it */
+	uint64_t ref_time; /* When the entry was cached */
+	char *mem; /* Copy in the RAM tier, only for readonly objects */
 
 	struct sd_rw_lock lock; /* Entry lock */
 };
@@ -58,7 +106,6 @@ struct object_cache {
 	uint32_t total_count; /* Count of objects include dirty and clean */
 	struct hlist_node hash; /* VDI is linked to the global hash lists */
 	struct rb_root lru_tree; /* For faster object search */
-	struct list_head lru_head; /* Per VDI LRU list for reclaimer */
 	struct list_head dirty_head; /* Dirty objects linked to this list */
 	int push_efd; /* Used to synchronize between pusher and push threads */
 	struct sd_mutex push_mutex; /* mutex for pushing cache */
@@ -72,7 +119,26 @@ struct push_work {
 	struct object_cache *oc;
 };
 
+/*
+ * RAM tier
+ *
+ * Hot readonly (snapshot) objects are copied into an arena of object sized
+ * slots in front of the cache files, so reads of golden images shared by
+ * many VMs are served by memcpy without any syscall.  Readonly objects are
+ * never written, so the copy doesn't go stale and is simply dropped when the
+ * entry is freed.  The arena is backed by huge pages if they are available.
+ */
+struct mem_arena {
+	char *base;
+	size_t size;
+	uint32_t nr_slots;
+	uint32_t nr_free;
+	uint32_t *free_slots; /* Stack of free slot numbers */
+	struct sd_mutex lock;
+};
+
 static struct global_cache gcache;
+static struct mem_arena mem_arena;
 static char object_cache_dir[PATH_MAX];
 static int def_open_flags = O_RDWR;
 
@@ -86,10 +152,16 @@ static struct sd_rw_lock hashtable_lock[HASH_SIZE] = {
 static struct hlist_head cache_hashtable[HASH_SIZE];
 
 static int object_cache_push(struct object_cache *oc);
+static void kick_writeback(void);
+
+static inline bool bmap_is_empty(const unsigned long *bmap)
+{
+	return find_next_bit(bmap, CACHE_NR_BLOCKS, 0) == CACHE_NR_BLOCKS;
+}
 
 static inline bool entry_is_dirty(const struct object_cache_entry *entry)
 {
-	return !!entry->bmap;
+	return !bmap_is_empty(entry->bmap);
 }
 
 static inline int hash(uint64_t vid)
@@ -126,26 +198,22 @@ static inline bool idx_has_vdi_bit(uint64_t idx)
 
 static inline size_t get_cache_block_size(uint64_t oid)
 {
-	size_t bsize = DIV_ROUND_UP(get_objsize(oid),
-				    sizeof(uint64_t) * BITS_PER_BYTE);
+	size_t bsize = DIV_ROUND_UP(get_objsize(oid), CACHE_NR_BLOCKS);
 
 	return round_up(bsize, BLOCK_SIZE); /* To be FS friendly */
 }
 
-static uint64_t calc_object_bmap(uint64_t oid, size_t len, off_t offset)
+static void mark_dirty_blocks(unsigned long *bmap, uint64_t oid, size_t len,
+			      off_t offset)
 {
-	int start, end, nr;
-	uint64_t bmap = 0;
 	size_t bsize = get_cache_block_size(oid);
+	int start, end;
 
 	start = offset / bsize;
 	end = DIV_ROUND_UP(len + offset, bsize);
-	nr = end - start;
-
-	while (nr--)
-		set_bit_64(start + nr, &bmap);
 
-	return bmap;
+	for (int i = start; i < end; i++)
+		set_bit(i, bmap);
 }
 
 static inline void get_cache_entry(struct object_cache_entry *entry)
@@ -219,52 +287,170 @@ static struct object_cache_entry *lru_tree_search(struct rb_root *root,
 	return rb_search(root, &key, node, object_cache_cmp);
 }
 
-static void do_background_push(struct work *work)
+static void del_from_dirty_list(struct object_cache_entry *entry)
 {
-	struct push_work *pw = container_of(work, struct push_work, work);
-	struct object_cache *oc = pw->oc;
+	struct object_cache *oc = entry->oc;
 
-	if (sd_mutex_trylock(&oc->push_mutex) == EBUSY)
-		return;
+	list_del(&entry->dirty_list);
+	uatomic_dec(&oc->dirty_count);
+}
 
-	object_cache_push(oc);
-	sd_mutex_unlock(&oc->push_mutex);
+/* Return true if the dirty objects of 'oc' exceed the dirty ratio */
+static inline bool over_dirty_ratio(const struct object_cache *oc)
+{
+	uint32_t dirty = uatomic_read(&oc->dirty_count);
+
+	return dirty > MAX_DIRTY_OBJECT_COUNT &&
+		(uint64_t)dirty * 100 >
+		(uint64_t)oc->total_count * sys->object_cache_dirty_ratio;
 }
 
-static void background_push_done(struct work *work)
+static void add_to_dirty_list(struct object_cache_entry *entry)
 {
-	struct push_work *pw = container_of(work, struct push_work, work);
-	free(pw);
+	struct object_cache *oc = entry->oc;
+
+	entry->dirty_time = clock_get_time();
+	list_add_tail(&entry->dirty_list, &oc->dirty_head);
+	uatomic_inc(&oc->dirty_count);
+	/* FIXME read sys->status atomically */
+	if (over_dirty_ratio(oc) && sys->cinfo.status == SD_STATUS_OK)
+		kick_writeback();
+}
+
+/*
+ * Replacement policy
+ *
+ * All the cached objects of all the VDIs are on two global lists, like 2Q.  A
+ * new object is put on the inactive list, and moved to the active list only
+ * when it is referenced again after CORRELATED_REF_PERIOD.  The reclaimer
+ * evicts inactive objects first unless the inactive list is small, so a VDI
+ * which scans a lot of data once (backup, virus scan, etc.) evicts its own
+ * scanned objects rather than the hot working set of other VDIs.
+ *
+ * Cache hits don't take the lru lock.  They only set the reference bit of the
+ * entry, and the reclaimer moves the referenced entries which it finds at the
+ * head of the lists to the tail of the active list, like CLOCK.
+ *
+ * Lock order is cache lock -> lru lock.
+ */
+static void lru_add(struct object_cache_entry *entry)
+{
+	uatomic_set(&entry->ref_time, clock_get_time());
+	uatomic_set_false(&entry->referenced);
+	entry->active = false;
+
+	sd_mutex_lock(&gcache.lru_lock);
+	list_add_tail(&entry->lru_list, &gcache.inactive_head);
+	gcache.nr_inactive++;
+	sd_mutex_unlock(&gcache.lru_lock);
 }
 
-static void kick_background_pusher(struct object_cache *oc)
+static void __lru_del(struct object_cache_entry *entry)
 {
-	struct push_work *pw;
+	list_del(&entry->lru_list);
+	if (entry->active)
+		gcache.nr_active--;
+	else
+		gcache.nr_inactive--;
+}
 
-	pw = xzalloc(sizeof(struct push_work));
-	pw->oc = oc;
-	pw->work.fn = do_background_push;
-	pw->work.done = background_push_done;
-	queue_work(sys->oc_push_wqueue, &pw->work);
+static void lru_del(struct object_cache_entry *entry)
+{
+	sd_mutex_lock(&gcache.lru_lock);
+	if (list_linked(&entry->lru_list))
+		__lru_del(entry);
+	sd_mutex_unlock(&gcache.lru_lock);
 }
 
-static void del_from_dirty_list(struct object_cache_entry *entry)
+/* Called on every access to the entry */
+static void lru_touch(struct object_cache_entry *entry)
 {
-	struct object_cache *oc = entry->oc;
+	/* don't dirty the cache line of a hot entry again and again */
+	if (uatomic_is_true(&entry->referenced))
+		return;
 
-	list_del(&entry->dirty_list);
-	uatomic_dec(&oc->dirty_count);
+	if (clock_get_time() - uatomic_read(&entry->ref_time) >=
+	    CORRELATED_REF_PERIOD)
+		uatomic_set_true(&entry->referenced);
 }
 
-static void add_to_dirty_list(struct object_cache_entry *entry)
+/*
+ * Move the entry to the tail of the active list if it was referenced since the
+ * reclaimer saw it last time.  Called with the lru lock held.
+ */
+static bool lru_age(struct object_cache_entry *entry)
 {
-	struct object_cache *oc = entry->oc;
+	if (!uatomic_is_true(&entry->referenced))
+		return false;
 
-	list_add_tail(&entry->dirty_list, &oc->dirty_head);
-	/* FIXME read sys->status atomically */
-	if (uatomic_add_return(&oc->dirty_count, 1) > MAX_DIRTY_OBJECT_COUNT
-	    && sys->cinfo.status == SD_STATUS_OK)
-		kick_background_pusher(oc);
+	uatomic_set_false(&entry->referenced);
+	if (!entry->active) {
+		entry->active = true;
+		gcache.nr_inactive--;
+		gcache.nr_active++;
+	}
+	list_move_tail(&entry->lru_list, &gcache.active_head);
+	return true;
+}
+
+static int mem_arena_init(void)
+{
+	size_t size = round_down((uint64_t)sys->object_cache_mem_size *
+				 1024 * 1024, SD_DATA_OBJ_SIZE);
+	char *base;
+
+	if (!size)
+		return 0;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (base == MAP_FAILED) {
+		sd_info("no huge pages for the RAM tier, %m");
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			sd_err("failed to allocate the RAM tier, %m");
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(base, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	mem_arena.base = base;
+	mem_arena.size = size;
+	mem_arena.nr_slots = size / SD_DATA_OBJ_SIZE;
+	mem_arena.free_slots = xmalloc(sizeof(uint32_t) * mem_arena.nr_slots);
+	for (uint32_t i = 0; i < mem_arena.nr_slots; i++)
+		mem_arena.free_slots[i] = mem_arena.nr_slots - i - 1;
+	mem_arena.nr_free = mem_arena.nr_slots;
+	sd_init_mutex(&mem_arena.lock);
+	sd_info("RAM tier: %"PRIu32" objects", mem_arena.nr_slots);
+
+	return 0;
+}
+
+static char *mem_slot_get(void)
+{
+	char *slot = NULL;
+
+	sd_mutex_lock(&mem_arena.lock);
+	if (mem_arena.nr_free > 0) {
+		mem_arena.nr_free--;
+		slot = mem_arena.base + (size_t)SD_DATA_OBJ_SIZE *
+			mem_arena.free_slots[mem_arena.nr_free];
+	}
+	sd_mutex_unlock(&mem_arena.lock);
+
+	return slot;
+}
+
+static void mem_slot_put(char *slot)
+{
+	sd_mutex_lock(&mem_arena.lock);
+	mem_arena.free_slots[mem_arena.nr_free++] =
+		(slot - mem_arena.base) / SD_DATA_OBJ_SIZE;
+	sd_mutex_unlock(&mem_arena.lock);
 }
 
 static inline void free_cache_entry(struct object_cache_entry *entry)
@@ -272,10 +458,12 @@ static inline void free_cache_entry(struct object_cache_entry *entry)
 	struct object_cache *oc = entry->oc;
 
 	rb_erase(&entry->node, &oc->lru_tree);
-	list_del(&entry->lru_list);
+	lru_del(entry);
 	oc->total_count--;
 	if (list_linked(&entry->dirty_list))
 		del_from_dirty_list(entry);
+	if (entry->mem)
+		mem_slot_put(entry->mem);
 	sd_destroy_rw_lock(&entry->lock);
 	free(entry);
 }
@@ -380,21 +568,73 @@ out:
 	return ret;
 }
 
+/* Copy the whole object into the RAM tier if it is readonly */
+static void load_mem_copy(struct object_cache_entry *entry)
+{
+	uint32_t vid = entry->oc->vid;
+	uint64_t idx = entry_idx(entry);
+	char *slot;
+
+	if (!uatomic_read(&mem_arena.nr_free) ||
+	    !oid_is_readonly(idx_to_oid(vid, idx)))
+		return;
+
+	slot = mem_slot_get();
+	if (!slot)
+		return;
+
+	write_lock_entry(entry);
+	if (entry->mem || read_cache_object_noupdate(vid, idx, slot,
+						     SD_DATA_OBJ_SIZE, 0)
+	    != SD_RES_SUCCESS) {
+		unlock_entry(entry);
+		mem_slot_put(slot);
+		return;
+	}
+	entry->mem = slot;
+	unlock_entry(entry);
+	sd_debug("%"PRIx64" is loaded", idx_to_oid(vid, idx));
+}
+
+/*
+ * Only the objects referenced more than once (on the active list or with the
+ * reference bit set) are loaded, so a scan doesn't fill the RAM tier.
+ *
+ * Return SD_RES_NO_CACHE if the object is not in the RAM tier.
+ */
+static int read_mem_copy(struct object_cache_entry *entry, void *buf,
+			 size_t count, off_t offset)
+{
+	int ret = SD_RES_NO_CACHE;
+
+	if (!entry->mem &&
+	    (entry->active || uatomic_is_true(&entry->referenced)))
+		load_mem_copy(entry);
+
+	read_lock_entry(entry);
+	if (entry->mem) {
+		memcpy(buf, entry->mem + offset, count);
+		ret = SD_RES_SUCCESS;
+	}
+	unlock_entry(entry);
+
+	return ret;
+}
+
 static int read_cache_object(struct object_cache_entry *entry, void *buf,
 			     size_t count, off_t offset)
 {
 	uint32_t vid = entry->oc->vid;
 	uint64_t idx = entry_idx(entry);
-	struct object_cache *oc = entry->oc;
-	int ret;
+	int ret = SD_RES_NO_CACHE;
 
-	ret = read_cache_object_noupdate(vid, idx, buf, count, offset);
+	if (mem_arena.nr_slots && !idx_has_vdi_bit(idx))
+		ret = read_mem_copy(entry, buf, count, offset);
+	if (ret == SD_RES_NO_CACHE)
+		ret = read_cache_object_noupdate(vid, idx, buf, count, offset);
 
-	if (ret == SD_RES_SUCCESS) {
-		write_lock_cache(oc);
-		list_move_tail(&entry->lru_list, &oc->lru_head);
-		unlock_cache(oc);
-	}
+	if (ret == SD_RES_SUCCESS)
+		lru_touch(entry);
 	return ret;
 }
 
@@ -411,6 +651,12 @@ static int write_cache_object(struct object_cache_entry *entry, void *buf,
 
 	write_lock_entry(entry);
 
+	if (unlikely(entry->mem)) {
+		/* Shouldn't happen because the object is readonly */
+		mem_slot_put(entry->mem);
+		entry->mem = NULL;
+	}
+
 	ret = write_cache_object_noupdate(vid, idx, buf, count, offset);
 	if (ret != SD_RES_SUCCESS) {
 		unlock_entry(entry);
@@ -418,12 +664,12 @@ static int write_cache_object(struct object_cache_entry *entry, void *buf,
 	}
 	write_lock_cache(oc);
 	if (writeback) {
-		entry->bmap |= calc_object_bmap(oid, count, offset);
+		mark_dirty_blocks(entry->bmap, oid, count, offset);
 		if (!list_linked(&entry->dirty_list))
 			add_to_dirty_list(entry);
 	}
-	list_move_tail(&entry->lru_list, &oc->lru_head);
 	unlock_cache(oc);
+	lru_touch(entry);
 
 	unlock_entry(entry);
 
@@ -450,8 +696,9 @@ out:
 	return ret;
 }
 
-static int push_cache_object(uint32_t vid, uint64_t idx, uint64_t bmap,
-			     bool create)
+/* Push the blocks from 'first_bit' to 'last_bit' of the object */
+static int push_cache_blocks(uint32_t vid, uint64_t idx, int first_bit,
+			     int last_bit, bool create)
 {
 	struct sd_req hdr;
 	void *buf;
@@ -459,18 +706,9 @@ static int push_cache_object(uint32_t vid, uint64_t idx, uint64_t bmap,
 	uint64_t oid = idx_to_oid(vid, idx);
 	size_t data_length, bsize = get_cache_block_size(oid);
 	int ret = SD_RES_NO_MEM;
-	int first_bit, last_bit;
-
-	if (!bmap) {
-		sd_debug("WARN: nothing to flush %"PRIx64, oid);
-		return SD_RES_SUCCESS;
-	}
-
-	first_bit = ffsll(bmap) - 1;
-	last_bit = fls64(bmap) - 1;
 
-	sd_debug("%"PRIx64" bmap(%zd):0x%"PRIx64", first_bit:%d, last_bit:%d",
-		 oid, bsize, bmap, first_bit, last_bit);
+	sd_debug("%"PRIx64" bsize:%zd, first_bit:%d, last_bit:%d", oid, bsize,
+		 first_bit, last_bit);
 	offset = first_bit * bsize;
 	data_length = min((last_bit - first_bit + 1) * bsize,
 			  get_objsize(oid) - (size_t)offset);
@@ -498,13 +736,77 @@ out:
 	return ret;
 }
 
+/* Return the end of the dirty run at 'start', rounded up to 'align' blocks */
+static unsigned long stripe_end(const unsigned long *bmap, unsigned long start,
+				unsigned long align)
+{
+	unsigned long end = find_next_zero_bit(bmap, CACHE_NR_BLOCKS, start);
+
+	return min(round_up(end, align), (unsigned long)CACHE_NR_BLOCKS);
+}
+
+/*
+ * Push the dirty blocks of the object
+ *
+ * Only the dirty runs in 'bmap' are sent, each as a separate write, so that
+ * sparse small writes don't cost a push of the whole object.  An object which
+ * has to be created at the backend is pushed with one request because the
+ * first write creates it.
+ *
+ * The runs of an erasure coded object are widened to whole stripes with the
+ * clean blocks around them, which are cached too.  Otherwise a stripe larger
+ * than a block would be read back and re-encoded by the gateway at each push.
+ */
+static int push_cache_object(uint32_t vid, uint64_t idx,
+			     const unsigned long *bmap, bool create)
+{
+	uint64_t oid = idx_to_oid(vid, idx);
+	unsigned long start, end, next, align = 1;
+	size_t bsize = get_cache_block_size(oid);
+	int ret;
+
+	start = find_next_bit(bmap, CACHE_NR_BLOCKS, 0);
+	if (start == CACHE_NR_BLOCKS) {
+		sd_debug("WARN: nothing to flush %"PRIx64, oid);
+		return SD_RES_SUCCESS;
+	}
+
+	if (create) {
+		for (end = CACHE_NR_BLOCKS; !test_bit(end - 1, bmap); end--)
+			;
+		return push_cache_blocks(vid, idx, start, end - 1, true);
+	}
+
+	if (is_erasure_oid(oid))
+		align = max(get_vdi_ec_stripe_size(vid) / bsize, 1UL);
+
+	while (start < CACHE_NR_BLOCKS) {
+		end = stripe_end(bmap, start, align);
+		next = find_next_bit(bmap, CACHE_NR_BLOCKS, end);
+		/* Merge the following run if the clean gap is small */
+		while (next < CACHE_NR_BLOCKS &&
+		       round_down(next, align) - end <= PUSH_MERGE_GAP) {
+			end = stripe_end(bmap, next, align);
+			next = find_next_bit(bmap, CACHE_NR_BLOCKS, end);
+		}
+
+		ret = push_cache_blocks(vid, idx, round_down(start, align),
+					end - 1, false);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		start = next;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
 /*
  * The reclaim algorithm is similar to Linux kernel's page cache:
  *  - only tries to reclaim 'clean' object, which doesn't has any dirty updates,
- *    in a LRU list.
+ *    in the inactive list first and then in the active list.
  *  - skip the object when it is in R/W operation.
  *  - skip the dirty object if it is not in push(writeback) phase.
- *  - wait on the dirty object if it is in push phase.
+ *  - skip the object if its VDI has no more than 'reserve' cached.
  */
 
 /*
@@ -512,39 +814,68 @@ out:
  * buffer which is large enough to prevent cache overrun.
  */
 #define HIGH_WATERMARK (sys->object_cache_size * 9 / 10)
-static void do_reclaim_object(struct object_cache *oc)
+
+static bool can_reclaim(struct object_cache_entry *entry)
 {
-	struct object_cache_entry *entry;
-	uint64_t oid;
-	uint32_t cap;
+	struct object_cache *oc = entry->oc;
+	uint64_t oid = idx_to_oid(oc->vid, entry_idx(entry));
 
-	write_lock_cache(oc);
-	list_for_each_entry(entry, &oc->lru_head, lru_list) {
-		oid = idx_to_oid(oc->vid, entry_idx(entry));
-		if (entry_in_use(entry)) {
-			sd_debug("%"PRIx64" is in use, skip...", oid);
-			continue;
-		}
+	if (entry_in_use(entry)) {
+		sd_debug("%"PRIx64" is in use, skip...", oid);
+		return false;
+	}
 
-		/*
-		 * The shared snapshot objects won't be released after being
-		 * pulled and if sheep restarts, the remaining snapshot objects
-		 * will be marked as dirty. So for these kind of objects, we
-		 * can reclaim them safely.
-		 */
-		if (entry_is_dirty(entry) && !oid_is_readonly(oid)) {
-			sd_debug("%"PRIx64" is dirty, skip...", oid);
+	/*
+	 * The shared snapshot objects won't be released after being
+	 * pulled and if sheep restarts, the remaining snapshot objects
+	 * will be marked as dirty. So for these kind of objects, we
+	 * can reclaim them safely.
+	 */
+	if (entry_is_dirty(entry) && !oid_is_readonly(oid)) {
+		sd_debug("%"PRIx64" is dirty, skip...", oid);
+		return false;
+	}
+
+	if (oc->total_count * CACHE_OBJECT_SIZE <=
+	    sys->object_cache_reserve) {
+		sd_debug("%"PRIx32" is within its reservation, skip...",
+			 oc->vid);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Take a reclaimable entry off the head of 'head' and return it with its
+ * cache write-locked.  Skipped entries are rotated to the tail so that we
+ * don't scan them again soon.  At most *nr_scan entries are scanned.
+ *
+ * Called with the lru lock held.
+ */
+static struct object_cache_entry *isolate_entry(struct list_head *head,
+						uint32_t *nr_scan)
+{
+	struct object_cache_entry *entry;
+
+	while (!list_empty(head) && *nr_scan > 0) {
+		(*nr_scan)--;
+		entry = list_first_entry(head, struct object_cache_entry,
+					 lru_list);
+		if (lru_age(entry))
 			continue;
+		/* We hold the lru lock, so never wait for the cache lock */
+		if (sd_write_trylock(&entry->oc->lock) == 0) {
+			if (can_reclaim(entry)) {
+				__lru_del(entry);
+				return entry;
+			}
+			unlock_cache(entry->oc);
 		}
-		if (remove_cache_object(oc, entry_idx(entry)) != SD_RES_SUCCESS)
-			continue;
-		free_cache_entry(entry);
-		cap = uatomic_sub_return(&gcache.capacity, CACHE_OBJECT_SIZE);
-		sd_debug("%"PRIx64" reclaimed. capacity:%"PRId32, oid, cap);
-		if (cap <= HIGH_WATERMARK)
-			break;
+		list_move_tail(&entry->lru_list, head);
 	}
-	unlock_cache(oc);
+
+	return NULL;
 }
 
 struct reclaim_work {
@@ -555,33 +886,54 @@ struct reclaim_work {
 static void do_reclaim(struct work *work)
 {
 	struct reclaim_work *rw = container_of(work, struct reclaim_work, work);
-	struct object_cache *cache;
-	struct hlist_node *node;
-	int i, j;
+	struct object_cache_entry *entry;
+	struct object_cache *oc;
+	uint32_t cap, nr_scan_inactive, nr_scan_active;
+	uint64_t oid;
 
 	if (rw->delay)
 		sleep(rw->delay);
-	/* We choose a random victim to avoid reclaim the same one every time */
-	j = random();
-	for (i = 0; i < HASH_SIZE; i++) {
-		int idx = (i + j) % HASH_SIZE;
-		struct hlist_head *head = cache_hashtable + idx;
 
-		sd_read_lock(&hashtable_lock[idx]);
-		hlist_for_each_entry(cache, node, head, hash) {
-			uint32_t cap;
-
-			do_reclaim_object(cache);
-			cap = uatomic_read(&gcache.capacity);
-			if (cap <= HIGH_WATERMARK) {
-				sd_rw_unlock(&hashtable_lock[idx]);
-				sd_debug("complete, capacity %"PRIu32, cap);
-				return;
-			}
+	sd_mutex_lock(&gcache.lru_lock);
+	nr_scan_inactive = gcache.nr_inactive;
+	nr_scan_active = gcache.nr_active;
+	sd_mutex_unlock(&gcache.lru_lock);
+
+	for (cap = uatomic_read(&gcache.capacity); cap > HIGH_WATERMARK;) {
+		sd_mutex_lock(&gcache.lru_lock);
+		entry = NULL;
+		if ((uint64_t)gcache.nr_inactive * 100 >
+		    (uint64_t)(gcache.nr_inactive + gcache.nr_active) *
+		    INACTIVE_RATIO)
+			entry = isolate_entry(&gcache.inactive_head,
+					      &nr_scan_inactive);
+		if (!entry)
+			entry = isolate_entry(&gcache.active_head,
+					      &nr_scan_active);
+		if (!entry)
+			entry = isolate_entry(&gcache.inactive_head,
+					      &nr_scan_inactive);
+		sd_mutex_unlock(&gcache.lru_lock);
+
+		if (!entry)
+			break;
+
+		oc = entry->oc;
+		oid = idx_to_oid(oc->vid, entry_idx(entry));
+		if (remove_cache_object(oc, entry_idx(entry)) !=
+		    SD_RES_SUCCESS) {
+			lru_add(entry);
+			unlock_cache(oc);
+			continue;
 		}
-		sd_rw_unlock(&hashtable_lock[idx]);
+		free_cache_entry(entry);
+		unlock_cache(oc);
+
+		uatomic_inc(&gcache.stat[stat_slot()].nr_evict);
+		cap = uatomic_sub_return(&gcache.capacity, CACHE_OBJECT_SIZE);
+		sd_debug("%"PRIx64" reclaimed. capacity:%"PRId32, oid, cap);
 	}
-	sd_debug("finished");
+	sd_debug("finished, capacity %"PRIu32, cap);
 }
 
 static void reclaim_done(struct work *work)
@@ -632,7 +984,6 @@ not_found:
 		cache->push_efd = eventfd(0, 0);
 
 		INIT_LIST_HEAD(&cache->dirty_head);
-		INIT_LIST_HEAD(&cache->lru_head);
 
 		sd_init_rw_lock(&cache->lock);
 		hlist_add_head(&cache->hash, head);
@@ -692,11 +1043,11 @@ static void add_to_lru_cache(struct object_cache *oc, uint64_t idx, bool create)
 	if (unlikely(lru_tree_insert(&oc->lru_tree, entry)))
 		panic("the object already exist");
 	uatomic_add(&gcache.capacity, CACHE_OBJECT_SIZE);
-	list_add_tail(&entry->lru_list, &oc->lru_head);
+	lru_add(entry);
 	oc->total_count++;
 	if (create) {
 		/* Cache lock assure it is not raced with pusher */
-		entry->bmap = UINT64_MAX;
+		memset(entry->bmap, 0xff, sizeof(entry->bmap));
 		entry->idx |= CACHE_CREATE_BIT;
 		add_to_dirty_list(entry);
 	}
@@ -868,7 +1219,7 @@ clean:
 	if (uatomic_sub_return(&oc->push_count, 1) == 0)
 		eventfd_xwrite(oc->push_efd, 1);
 	entry->idx &= ~CACHE_CREATE_BIT;
-	entry->bmap = 0;
+	memset(entry->bmap, 0, sizeof(entry->bmap));
 	unlock_entry(entry);
 
 	sd_debug("%"PRIx64" done", oid);
@@ -920,6 +1271,200 @@ static int object_cache_push(struct object_cache *oc)
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * Writeback scheduler
+ *
+ * Instead of pushing all the dirty objects at once when the guest flushes,
+ * we push them continuously in the background so that SD_OP_FLUSH_VDI only
+ * has to push the objects dirtied recently:
+ *
+ *  - objects which have been dirty longer than 'dirty_age' seconds are
+ *    pushed, oldest first.  Zero disables the aging.
+ *  - when the dirty objects of a VDI exceed 'dirty_ratio' percent of its
+ *    cached objects, the oldest ones are pushed until it falls below.
+ *  - the dirty neighbours of a pushed object are pushed together with it,
+ *    because they are likely a part of the same sequential write.
+ *  - the amount of the pushed data is paced by 'push_rate' MB/s.  Zero means
+ *    no limit.
+ */
+
+static inline uint64_t entry_dirty_bytes(const struct object_cache_entry *e)
+{
+	uint64_t oid = idx_to_oid(e->oc->vid, entry_idx(e));
+	uint64_t nr = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(e->bmap); i++)
+		nr += __builtin_popcountl(e->bmap[i]);
+
+	return nr * get_cache_block_size(oid);
+}
+
+static void refill_writeback_budget(void)
+{
+	uint64_t rate = (uint64_t)sys->object_cache_push_rate * 1024 * 1024;
+	uint64_t now = clock_get_time(), elapsed;
+
+	if (!rate) {
+		gcache.wb_budget = UINT64_MAX;
+		return;
+	}
+
+	elapsed = now - gcache.wb_refill_time;
+	gcache.wb_refill_time = now;
+	/* Don't accumulate more than one second of budget */
+	gcache.wb_budget = min(gcache.wb_budget + rate * elapsed / 1000000000,
+			       rate);
+}
+
+static bool pick_writeback_entry(struct object_cache_entry *entry,
+				 struct object_cache_entry **batch, int *nr)
+{
+	uint64_t cost;
+
+	if (*nr == MAX_WRITEBACK_BATCH || gcache.wb_budget == 0)
+		return false;
+
+	cost = entry_dirty_bytes(entry);
+	gcache.wb_budget = gcache.wb_budget > cost ? gcache.wb_budget - cost : 0;
+
+	get_cache_entry(entry);
+	del_from_dirty_list(entry);
+	batch[(*nr)++] = entry;
+	return true;
+}
+
+/*
+ * Push the aged dirty objects of 'oc' and enough of the oldest ones to bring
+ * the cache under the dirty ratio.  Called with the push mutex held.
+ */
+static void object_cache_writeback(struct object_cache *oc, uint64_t now)
+{
+	struct object_cache_entry *batch[MAX_WRITEBACK_BATCH];
+	struct object_cache_entry *entry, *next;
+	uint64_t max_age = (uint64_t)sys->object_cache_dirty_age * 1000000000;
+	int nr = 0;
+
+	write_lock_cache(oc);
+	while (!list_empty(&oc->dirty_head)) {
+		entry = list_first_entry(&oc->dirty_head,
+					 struct object_cache_entry,
+					 dirty_list);
+		if ((!max_age || now - entry->dirty_time < max_age) &&
+		    !over_dirty_ratio(oc))
+			break;
+		if (!pick_writeback_entry(entry, batch, &nr))
+			break;
+
+		/* Coalesce the following dirty objects */
+		for (struct rb_node *n = rb_next(&entry->node); n;
+		     n = rb_next(n)) {
+			next = rb_entry(n, struct object_cache_entry, node);
+			if (entry_idx(next) != entry_idx(entry) + 1 ||
+			    !list_linked(&next->dirty_list))
+				break;
+			if (!pick_writeback_entry(next, batch, &nr))
+				break;
+			entry = next;
+		}
+	}
+
+	if (!nr) {
+		unlock_cache(oc);
+		return;
+	}
+
+	uatomic_set(&oc->push_count, nr);
+	for (int i = 0; i < nr; i++) {
+		struct push_work *pw;
+
+		pw = xzalloc(sizeof(struct push_work));
+		pw->work.fn = do_push_object;
+		pw->work.done = push_object_done;
+		pw->entry = batch[i];
+		queue_work(sys->oc_push_wqueue, &pw->work);
+	}
+	unlock_cache(oc);
+
+	eventfd_xread(oc->push_efd);
+	sd_debug("%"PRIx32" pushed %d objects", oc->vid, nr);
+}
+
+static void do_writeback(struct work *work)
+{
+	uint32_t *vids = NULL;
+	int nr_vids = 0, nr_alloc = 0;
+	uint64_t now = clock_get_time();
+
+	for (int i = 0; i < HASH_SIZE; i++) {
+		struct hlist_head *head = cache_hashtable + i;
+		struct object_cache *cache;
+		struct hlist_node *node;
+
+		sd_read_lock(&hashtable_lock[i]);
+		hlist_for_each_entry(cache, node, head, hash) {
+			if (!uatomic_read(&cache->dirty_count))
+				continue;
+			if (nr_vids == nr_alloc) {
+				nr_alloc = nr_alloc ? nr_alloc * 2 : 64;
+				vids = xrealloc(vids, sizeof(*vids) * nr_alloc);
+			}
+			vids[nr_vids++] = cache->vid;
+		}
+		sd_rw_unlock(&hashtable_lock[i]);
+	}
+
+	refill_writeback_budget();
+	for (int i = 0; i < nr_vids && gcache.wb_budget; i++) {
+		struct object_cache *cache = find_object_cache(vids[i], false);
+
+		if (!cache)
+			continue;
+		/* A flush is running, it will push everything anyway */
+		if (sd_mutex_trylock(&cache->push_mutex) == EBUSY)
+			continue;
+		object_cache_writeback(cache, now);
+		sd_mutex_unlock(&cache->push_mutex);
+	}
+	free(vids);
+}
+
+static void writeback_done(struct work *work)
+{
+	uatomic_set_false(&gcache.in_writeback);
+	free(work);
+
+	/* Pushed objects are clean now, which the reclaimer might wait for */
+	object_cache_try_to_reclaim(0);
+}
+
+static void kick_writeback(void)
+{
+	struct work *work;
+
+	if (!uatomic_set_true(&gcache.in_writeback))
+		/* the writeback worker is already running */
+		return;
+
+	work = xzalloc(sizeof(*work));
+	work->fn = do_writeback;
+	work->done = writeback_done;
+	queue_work(sys->oc_push_wqueue, work);
+}
+
+static void writeback_timer_fn(void *data)
+{
+	/* FIXME read sys->status atomically */
+	if (sys->cinfo.status == SD_STATUS_OK)
+		kick_writeback();
+
+	add_timer(data, WRITEBACK_INTERVAL);
+}
+
+static struct timer writeback_timer = {
+	.callback = writeback_timer_fn,
+	.data = &writeback_timer,
+};
+
 bool object_is_cached(uint64_t oid)
 {
 	uint32_t vid = oid_to_vid(oid);
@@ -950,7 +1495,7 @@ void object_cache_delete(uint32_t vid)
 	sd_rw_unlock(&hashtable_lock[h]);
 
 	write_lock_cache(cache);
-	list_for_each_entry(entry, &cache->lru_head, lru_list) {
+	rb_for_each_entry(entry, &cache->lru_tree, node) {
 		free_cache_entry(entry);
 		uatomic_sub(&gcache.capacity, CACHE_OBJECT_SIZE);
 	}
@@ -1004,11 +1549,12 @@ static int object_cache_flush_and_delete(struct object_cache *oc)
 	struct dirent *d;
 	uint32_t vid = oc->vid;
 	uint64_t idx;
-	uint64_t all = UINT64_MAX;
+	DECLARE_BITMAP(all, CACHE_NR_BLOCKS);
 	int ret = 0;
 	char p[PATH_MAX];
 
 	sd_debug("%"PRIx32, vid);
+	memset(all, 0xff, sizeof(all));
 	snprintf(p, sizeof(p), "%s/%06"PRIx32, object_cache_dir, vid);
 	dir = opendir(p);
 	if (!dir) {
@@ -1103,12 +1649,17 @@ retry:
 				  hdr->flags & SD_FLAG_CMD_CACHE);
 	switch (ret) {
 	case SD_RES_NO_CACHE:
+		uatomic_inc(&gcache.stat[stat_slot()].nr_miss);
 		ret = object_cache_pull(cache, idx);
 		if (ret != SD_RES_SUCCESS)
 			return ret;
 		break;
 	case SD_RES_EIO:
 		return ret;
+	case SD_RES_SUCCESS:
+		if (!create)
+			uatomic_inc(&gcache.stat[stat_slot()].nr_hit);
+		break;
 	}
 
 	entry = get_cache_entry_from(cache, idx);
@@ -1345,8 +1896,21 @@ int object_cache_init(const char *p)
 
 	uatomic_set(&gcache.capacity, 0);
 	uatomic_set_false(&gcache.in_reclaim);
+	uatomic_set_false(&gcache.in_writeback);
+	gcache.wb_refill_time = clock_get_time();
+	sd_init_mutex(&gcache.lru_lock);
+	INIT_LIST_HEAD(&gcache.inactive_head);
+	INIT_LIST_HEAD(&gcache.active_head);
+
+	ret = mem_arena_init();
+	if (ret < 0)
+		goto err;
 
 	ret = load_cache();
+	if (ret < 0)
+		goto err;
+
+	add_timer(&writeback_timer, WRITEBACK_INTERVAL);
 err:
 	strbuf_release(&buf);
 	return ret;
@@ -1392,6 +1956,16 @@ int object_cache_get_info(struct object_cache_info *info)
 	}
 	info->count = j;
 	info->directio = sys->object_cache_directio;
+	info->hit = info->miss = info->evict = 0;
+	for (int i = 0; i < NR_STAT_SLOTS; i++) {
+		info->hit += uatomic_read(&gcache.stat[i].nr_hit);
+		info->miss += uatomic_read(&gcache.stat[i].nr_miss);
+		info->evict += uatomic_read(&gcache.stat[i].nr_evict);
+	}
+	info->mem_size = mem_arena.size;
+	info->mem_used = (uint64_t)(mem_arena.nr_slots -
+				    uatomic_read(&mem_arena.nr_free)) *
+		SD_DATA_OBJ_SIZE;
 
 	return sizeof(*info);
 }
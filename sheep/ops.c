@@ -32,6 +32,13 @@ struct sd_op_template {
 	 */
 	bool is_admin_op;
 
+	/*
+	 * Cluster operations on different VDIs can be processed in one
+	 * block/unblock cycle in batch mode.  The request data must start with
+	 * the VDI name.
+	 */
+	bool batch;
+
 	/*
 	 * process_work() will be called in a worker thread, and process_main()
 	 * will be called in the main thread.
@@ -91,8 +98,10 @@ static int cluster_new_vdi(struct request *req)
 		.create_snapshot = !!hdr->vdi.snapid,
 		.copy_policy = hdr->vdi.copy_policy,
 		.store_policy = hdr->vdi.store_policy,
+		.ec_stripe_shift = hdr->vdi.ec_stripe_shift,
 		.nr_copies = hdr->vdi.copies,
 		.time = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000,
+		.reserved = req->reserved,
 	};
 
 	/* Client doesn't specify redundancy scheme (copy = 0) */
@@ -101,8 +110,31 @@ static int cluster_new_vdi(struct request *req)
 		iocb.copy_policy = sys->cinfo.copy_policy;
 	}
 
-	if (iocb.copy_policy)
-		iocb.nr_copies = ec_policy_to_dp(iocb.copy_policy, NULL, NULL);
+	if (iocb.copy_policy) {
+		int d;
+
+		/* ec_policy_to_dp() panics on a policy without parity */
+		if (!ec_policy_is_lrc(iocb.copy_policy) &&
+		    !(iocb.copy_policy & 0b1111))
+			return SD_RES_INVALID_PARMS;
+		iocb.nr_copies = ec_policy_to_dp(iocb.copy_policy, &d, NULL);
+		/* the gateway and fec keep SD_EC_MAX_STRIP strips at most */
+		if (d > SD_EC_MAX_STRIP)
+			return SD_RES_INVALID_PARMS;
+	} else {
+		iocb.ec_stripe_shift = 0;
+	}
+
+	if (iocb.ec_stripe_shift > SD_EC_MAX_STRIPE_SHIFT)
+		return SD_RES_INVALID_PARMS;
+
+	if (ec_policy_is_lrc(iocb.copy_policy)) {
+		int l, d = lrc_policy_to_dlr(iocb.copy_policy, &l, NULL);
+
+		/* local groups have 2 data strips at least */
+		if (l >= d)
+			return SD_RES_INVALID_PARMS;
+	}
 
 	if (hdr->data_length != SD_MAX_VDI_LEN)
 		return SD_RES_INVALID_PARMS;
@@ -115,6 +147,13 @@ static int cluster_new_vdi(struct request *req)
 	rsp->vdi.vdi_id = vid;
 	rsp->vdi.copies = iocb.nr_copies;
 
+	/*
+	 * Reserve the vid in the batch so that the following operations in it
+	 * don't pick it.  post_cluster_new_vdi() sets it on every node.
+	 */
+	if (ret == SD_RES_SUCCESS && req->reserved)
+		req->reserved->vids[req->reserved->nr++] = vid;
+
 	return ret;
 }
 
@@ -151,6 +190,7 @@ static int cluster_del_vdi(struct request *req)
 		.name = req->data,
 		.data_len = data_len,
 		.snapid = hdr->vdi.snapid,
+		.reserved = req->reserved,
 	};
 
 	if (vdi_init_tag(&iocb.tag, req->data, data_len) < 0)
@@ -219,6 +259,7 @@ static int cluster_get_vdi_info(struct request *req)
 		.name = req->data,
 		.data_len = data_len,
 		.snapid = hdr->vdi.snapid,
+		.reserved = req->reserved,
 	};
 
 	if (vdi_init_tag(&iocb.tag, req->data, data_len) < 0)
@@ -234,27 +275,10 @@ static int cluster_get_vdi_info(struct request *req)
 	return ret;
 }
 
-static int remove_epoch(uint32_t epoch)
-{
-	int ret;
-	char path[PATH_MAX];
-
-	sd_debug("remove epoch %"PRIu32, epoch);
-	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
-	ret = unlink(path);
-	if (ret && ret != -ENOENT) {
-		sd_err("failed to remove %s: %s", path, strerror(-ret));
-		return SD_RES_EIO;
-	}
-
-	return SD_RES_EIO;
-}
-
 static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 			   void *data)
 {
-	int i, ret;
-	uint32_t latest_epoch;
+	int ret;
 	struct store_driver *driver;
 	char *store_name = data;
 
@@ -265,7 +289,6 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	pstrcpy((char *)sys->cinfo.store, sizeof(sys->cinfo.store),
 		store_name);
 	sd_store = driver;
-	latest_epoch = get_latest_epoch();
 
 	ret = sd_store->format();
 	if (ret != SD_RES_SUCCESS)
@@ -282,9 +305,9 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 		sys->cinfo.nr_copies = SD_DEFAULT_COPIES;
 	sys->cinfo.ctime = req->cluster.ctime;
 	set_cluster_config(&sys->cinfo);
+	refresh_vnode_info();
 
-	for (i = 1; i <= latest_epoch; i++)
-		remove_epoch(i);
+	reset_epoch_log();
 
 	memset(sys->vdi_inuse, 0, sizeof(sys->vdi_inuse));
 	clean_vdi_state();
@@ -342,6 +365,7 @@ static int cluster_get_vdi_attr(struct request *req)
 	iocb.name = vattr->name;
 	iocb.tag = vattr->tag;
 	iocb.snapid = hdr->vdi.snapid;
+	iocb.reserved = req->reserved;
 	ret = vdi_lookup(&iocb, &info);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
@@ -407,7 +431,7 @@ static int local_read_vdis(const struct sd_req *req, struct sd_rsp *rsp,
 static int local_get_vdi_copies(const struct sd_req *req, struct sd_rsp *rsp,
 			   void *data)
 {
-	rsp->data_length = fill_vdi_state_list(data);
+	fill_vdi_state_list(req, rsp, data);
 
 	return SD_RES_SUCCESS;
 }
@@ -432,8 +456,9 @@ static int local_stat_recovery(const struct sd_req *req, struct sd_rsp *rsp,
 static int local_stat_cluster(struct request *req)
 {
 	struct sd_rsp *rsp = &req->rp;
-	struct epoch_log *elog;
-	int i, max_elogs;
+	struct epoch_log *elog, *log;
+	char *p = req->data;
+	size_t size;
 	uint32_t epoch;
 
 	if (req->vinfo == NULL) {
@@ -441,44 +466,50 @@ static int local_stat_cluster(struct request *req)
 		goto out;
 	}
 
-	max_elogs = req->rq.data_length / sizeof(*elog);
+	/*
+	 * The epoch logs are packed with their actual sizes, so read each one
+	 * into a full sized buffer first.
+	 */
+	log = xmalloc(sizeof(*log));
 	epoch = get_latest_epoch();
-	for (i = 0; i < max_elogs; i++) {
-		size_t nr_nodes;
+	for (int i = 0; epoch > 0; i++) {
+		int nr_nodes;
 
-		if (epoch <= 0)
-			break;
-
-		elog = (struct epoch_log *)req->data + i;
-		memset(elog, 0, sizeof(*elog));
+		memset(log, 0, sizeof(*log));
 
 		/* some filed only need to store in first elog */
 		if (i == 0) {
-			elog->ctime = sys->cinfo.ctime;
-			elog->disable_recovery = sys->cinfo.disable_recovery;
-			elog->nr_copies = sys->cinfo.nr_copies;
-			elog->copy_policy = sys->cinfo.copy_policy;
-			strncpy(elog->drv_name, (char *)sys->cinfo.store,
+			log->ctime = sys->cinfo.ctime;
+			log->disable_recovery = sys->cinfo.disable_recovery;
+			log->nr_copies = sys->cinfo.nr_copies;
+			log->copy_policy = sys->cinfo.copy_policy;
+			strncpy(log->drv_name, (char *)sys->cinfo.store,
 				STORE_LEN);
 		}
 
-		elog->epoch = epoch;
-		nr_nodes = epoch_log_read_with_timestamp(epoch, elog->nodes,
-							 sizeof(elog->nodes),
-							 (time_t *)&elog->time);
+		log->epoch = epoch;
+		nr_nodes = epoch_log_read_with_timestamp(epoch, log->nodes,
+							 sizeof(log->nodes),
+							 (time_t *)&log->time);
 		if (nr_nodes == -1)
-			nr_nodes = epoch_log_read_remote(epoch, elog->nodes,
-							 sizeof(elog->nodes),
-							 (time_t *)&elog->time,
+			nr_nodes = epoch_log_read_remote(epoch, log->nodes,
+							 sizeof(log->nodes),
+							 (time_t *)&log->time,
 							 req->vinfo);
 		assert(nr_nodes >= 0);
 		assert(nr_nodes <= SD_MAX_NODES);
-		elog->nr_nodes = nr_nodes;
+		log->nr_nodes = nr_nodes;
 
+		size = epoch_log_size(nr_nodes);
+		if (rsp->data_length + size > req->rq.data_length)
+			break;
 
-		rsp->data_length += sizeof(*elog);
+		elog = (struct epoch_log *)(p + rsp->data_length);
+		memcpy(elog, log, size);
+		rsp->data_length += size;
 		epoch--;
 	}
+	free(log);
 out:
 	switch (sys->cinfo.status) {
 	case SD_STATUS_OK:
@@ -624,13 +655,16 @@ static int cluster_notify_vdi_add(const struct sd_req *req, struct sd_rsp *rsp,
 		/* make the previous working vdi a snapshot */
 		add_vdi_state(req->vdi_state.old_vid,
 			      get_vdi_copy_number(req->vdi_state.old_vid),
-			      true, req->vdi_state.copy_policy);
+			      true, req->vdi_state.copy_policy,
+			      req->vdi_state.ec_stripe_shift);
 
 	if (req->vdi_state.set_bitmap)
 		atomic_set_bit(req->vdi_state.new_vid, sys->vdi_inuse);
 
 	add_vdi_state(req->vdi_state.new_vid, req->vdi_state.copies, false,
-		      req->vdi_state.copy_policy);
+		      req->vdi_state.copy_policy,
+		      req->vdi_state.ec_stripe_shift);
+	queue_sync_vdi_state_log();
 
 	return SD_RES_SUCCESS;
 }
@@ -813,6 +847,15 @@ out:
 static int local_sd_stat(const struct sd_req *req, struct sd_rsp *rsp,
 			 void *data)
 {
+	struct vnode_info *vinfo = get_vnode_info();
+
+	if (vinfo) {
+		placement_cache_get_stat(vinfo->pcache,
+					 &sys->stat.p.cache_lookup,
+					 &sys->stat.p.cache_miss);
+		put_vnode_info(vinfo);
+	}
+	cluster_lock_get_stat(&sys->stat.l);
 	memcpy(data, &sys->stat, sizeof(struct sd_stat));
 	rsp->data_length = sizeof(struct sd_stat);
 	return SD_RES_SUCCESS;
@@ -914,13 +957,22 @@ static int local_kill_node(const struct sd_req *req, struct sd_rsp *rsp,
 	return SD_RES_SUCCESS;
 }
 
+/* B-tree nodes of hyper volumes may be cached by sd_inode_get_vid() */
+static int peer_invalidate_bnode(uint64_t oid, int ret)
+{
+	if (is_vdi_btree_obj(oid))
+		sd_inode_invalidate_bnode(oid);
+
+	return ret;
+}
+
 static int peer_remove_obj(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
 
 	objlist_cache_remove(oid);
 
-	return sd_store->remove_object(oid);
+	return peer_invalidate_bnode(oid, sd_store->remove_object(oid));
 }
 
 int peer_read_obj(struct request *req)
@@ -960,7 +1012,7 @@ static int peer_write_obj(struct request *req)
 	iocb.length = hdr->data_length;
 	iocb.offset = hdr->obj.offset;
 
-	return sd_store->write(oid, &iocb);
+	return peer_invalidate_bnode(oid, sd_store->write(oid, &iocb));
 }
 
 static int peer_create_and_write_obj(struct request *req)
@@ -975,7 +1027,9 @@ static int peer_create_and_write_obj(struct request *req)
 	iocb.copy_policy = hdr->obj.copy_policy;
 	iocb.offset = hdr->obj.offset;
 
-	return sd_store->create_and_write(hdr->obj.oid, &iocb);
+	return peer_invalidate_bnode(hdr->obj.oid,
+				     sd_store->create_and_write(hdr->obj.oid,
+								&iocb));
 }
 
 static int local_get_loglevel(struct request *req)
@@ -1039,6 +1093,7 @@ static struct sd_op_template sd_ops[] = {
 		.name = "NEW_VDI",
 		.type = SD_OP_TYPE_CLUSTER,
 		.is_admin_op = true,
+		.batch = true,
 		.process_work = cluster_new_vdi,
 		.process_main = post_cluster_new_vdi,
 	},
@@ -1047,6 +1102,7 @@ static struct sd_op_template sd_ops[] = {
 		.name = "DEL_VDI",
 		.type = SD_OP_TYPE_CLUSTER,
 		.is_admin_op = true,
+		.batch = true,
 		.process_work = cluster_del_vdi,
 		.process_main = post_cluster_del_vdi,
 	},
@@ -1070,6 +1126,7 @@ static struct sd_op_template sd_ops[] = {
 	[SD_OP_GET_VDI_ATTR] = {
 		.name = "GET_VDI_ATTR",
 		.type = SD_OP_TYPE_CLUSTER,
+		.batch = true,
 		.process_work = cluster_get_vdi_attr,
 	},
 
@@ -1119,12 +1176,14 @@ static struct sd_op_template sd_ops[] = {
 	[SD_OP_GET_VDI_INFO] = {
 		.name = "GET_VDI_INFO",
 		.type = SD_OP_TYPE_CLUSTER,
+		.batch = true,
 		.process_work = cluster_get_vdi_info,
 	},
 
 	[SD_OP_LOCK_VDI] = {
 		.name = "LOCK_VDI",
 		.type = SD_OP_TYPE_CLUSTER,
+		.batch = true,
 		.process_work = cluster_get_vdi_info,
 	},
 
@@ -1437,6 +1496,11 @@ bool is_logging_op(const struct sd_op_template *op)
 	return !!op->is_admin_op;
 }
 
+bool is_batch_op(const struct sd_op_template *op)
+{
+	return !!op->batch;
+}
+
 bool has_process_work(const struct sd_op_template *op)
 {
 	return !!op->process_work;
@@ -201,6 +201,7 @@ int default_cleanup(void)
 static int init_vdi_state(uint64_t oid, const char *wd, uint32_t epoch)
 {
 	int ret;
+	uint8_t shift = 0;
 	struct sd_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
 	struct siocb iocb = {
 		.epoch = epoch,
@@ -215,8 +216,21 @@ static int init_vdi_state(uint64_t oid, const char *wd, uint32_t epoch)
 		goto out;
 	}
 
+	if (inode->copy_policy) {
+		/* the stripe size is at the end of the inode */
+		iocb.buf = &shift;
+		iocb.length = sizeof(shift);
+		iocb.offset = offsetof(struct sd_inode, ec_stripe_shift);
+		ret = default_read(oid, &iocb);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to read the stripe size of %" PRIx64
+			       " %" PRId32, oid, epoch);
+			goto out;
+		}
+	}
+
 	add_vdi_state(oid_to_vid(oid), inode->nr_copies,
-		      vdi_is_snapshot(inode), inode->copy_policy);
+		      vdi_is_snapshot(inode), inode->copy_policy, shift);
 	atomic_set_bit(oid_to_vid(oid), sys->vdi_inuse);
 
 	ret = SD_RES_SUCCESS;
@@ -231,7 +245,8 @@ static int init_objlist_and_vdi_bitmap(uint64_t oid, const char *wd,
 	int ret;
 	objlist_cache_insert(oid);
 
-	if (is_vdi_obj(oid)) {
+	/* The vdi states loaded from the log don't need the inode */
+	if (is_vdi_obj(oid) && !vdi_state_exist(oid_to_vid(oid))) {
 		sd_debug("found the VDI object %" PRIx64, oid);
 		ret = init_vdi_state(oid, wd, epoch);
 		if (ret != SD_RES_SUCCESS)
@@ -465,7 +480,7 @@ static bool oid_stale(uint64_t oid)
 	vinfo = get_vnode_info();
 
 	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
-	oid_to_vnodes(oid, &vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (vnode_is_local(v)) {
@@ -23,12 +23,21 @@ struct recovery_work {
 	struct work work;
 };
 
+/* an object in the list being prepared, with its hash value cached */
+struct object_hash {
+	uint64_t hash;
+	uint64_t oid;
+};
+
 /* for preparing lists */
 struct recovery_list_work {
 	struct recovery_work base;
 
 	uint64_t count;
 	uint64_t *oids;
+
+	/* the sorted list of screened objects while the list is prepared */
+	struct object_hash *objs;
 };
 
 /* for recoverying objects */
@@ -81,12 +90,14 @@ static void queue_recovery_work(struct recovery_info *rinfo);
 #define DEFAULT_LIST_BUFFER_SIZE (UINT64_C(1) << 22)
 static size_t list_buffer_size = DEFAULT_LIST_BUFFER_SIZE;
 
-static int obj_cmp(const uint64_t *oid1, const uint64_t *oid2)
+static int object_hash_cmp(const struct object_hash *a,
+			   const struct object_hash *b)
 {
-	const uint64_t hval1 = sd_hash_oid(*oid1);
-	const uint64_t hval2 = sd_hash_oid(*oid2);
+	int ret = intcmp(a->hash, b->hash);
 
-	return intcmp(hval1, hval2);
+	if (ret)
+		return ret;
+	return intcmp(a->oid, b->oid);
 }
 
 static inline bool node_is_gateway_only(void)
@@ -177,7 +188,7 @@ again:
 		else
 			goto rollback;
 	}
-	node = oid_to_node(oid, &old->vroot, idx);
+	node = vinfo_oid_to_node(old, oid, idx);
 	sd_debug("%"PRIx64" epoch %"PRIu32" tgt %"PRIu32" idx %d, %s",
 		 oid, epoch, tgt_epoch, idx, node_to_str(node));
 	if (invalid_node(node, rw->cur_vinfo))
@@ -302,7 +313,7 @@ static int recover_object_from_replica(struct recovery_obj_work *row,
 	for (int i = 0; i < nr_copies; i++) {
 		const struct sd_vnode *vnode;
 
-		vnode = oid_to_vnode(oid, &old->vroot, i);
+		vnode = vinfo_oid_to_vnode(old, oid, i);
 
 		if (vnode_is_local(vnode)) {
 			start = i;
@@ -315,7 +326,7 @@ static int recover_object_from_replica(struct recovery_obj_work *row,
 		const struct sd_node *node;
 		int idx = (i + start) % nr_copies;
 
-		node = oid_to_node(oid, &old->vroot, idx);
+		node = vinfo_oid_to_node(old, oid, idx);
 
 		if (invalid_node(node, row->base.cur_vinfo))
 			continue;
@@ -400,47 +411,85 @@ out:
 	return ret;
 }
 
+/*
+ * Rebuild the lost strip object from its local group if the vdi uses LRC,
+ * which reads only d/l strips
+ */
+static void *rebuild_erasure_object_local(struct fec *ctx, uint64_t oid,
+					  uint8_t idx,
+					  struct recovery_obj_work *row)
+{
+	int len = get_store_objsize(oid);
+	int group[SD_EC_MAX_STRIP], nr, i;
+	uint8_t *bufs[SD_EC_MAX_STRIP] = {};
+	char *lost = NULL;
+
+	nr = ec_local_group(ctx, idx, group);
+	if (!nr)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		bufs[i] = read_erasure_object(oid, group[i], row);
+		if (!bufs[i] || row->stop)
+			goto out;
+	}
+
+	lost = xvalloc(len);
+	ec_local_decode((const uint8_t **)bufs, nr, (uint8_t *)lost, len);
+	sd_debug("%"PRIx64" idx %d rebuilt from %d local strips", oid, idx, nr);
+out:
+	for (i = 0; i < nr; i++)
+		free(bufs[i]);
+	return lost;
+}
+
 static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 				    struct recovery_obj_work *row)
 {
 	int len = get_store_objsize(oid);
-	char *lost = xvalloc(len);
-	int i, j;
+	char *lost;
+	int i;
 	uint8_t policy = get_vdi_copy_policy(oid_to_vid(oid));
 	int ed = 0, edp;
 	edp = ec_policy_to_dp(policy, &ed, NULL);
-	struct fec *ctx = ec_init(ed, edp);
-	uint8_t *bufs[ed];
+	struct fec *ctx = ec_init_policy(policy);
+	uint8_t *bufs[edp], *input[ed];
+	bool avail[edp];
 	int idxs[ed];
 
-	for (i = 0; i < ed; i++)
+	lost = rebuild_erasure_object_local(ctx, oid, idx, row);
+	if (lost || row->stop)
+		goto out;
+
+	for (i = 0; i < edp; i++) {
 		bufs[i] = NULL;
-	for (i = 0; i < ed; i++)
-		idxs[i] = 0;
+		avail[i] = false;
+	}
 
-	/* Prepare replica */
-	for (i = 0, j = 0; i < edp && j < ed; i++) {
+	/* Prepare replica, until there are enough strips to rebuild it */
+	for (i = 0; i < edp; i++) {
 		if (i == idx)
 			continue;
-		bufs[j] = read_erasure_object(oid, i, row);
+		bufs[i] = read_erasure_object(oid, i, row);
 		if (row->stop)
 			break;
-		if (!bufs[j])
-			continue;
-		idxs[j++] = i;
-	}
-	if (j != ed) {
-		free(lost);
-		lost = NULL;
-		goto out;
+		avail[i] = !!bufs[i];
+		if (ec_pick_strips(ctx, avail, idxs))
+			break;
 	}
+	if (i == edp || row->stop)
+		goto free_bufs;
 
 	/* Rebuild the lost replica */
-	ec_decode_buffer(ctx, bufs, idxs, lost, idx);
-out:
-	ec_destroy(ctx);
 	for (i = 0; i < ed; i++)
+		input[i] = bufs[idxs[i]];
+	lost = xvalloc(len);
+	ec_decode_buffer(ctx, input, idxs, lost, idx, len);
+free_bufs:
+	for (i = 0; i < edp; i++)
 		free(bufs[i]);
+out:
+	ec_destroy(ctx);
 	return lost;
 }
 
@@ -449,7 +498,7 @@ static uint8_t local_node_copy_index(struct vnode_info *vinfo, uint64_t oid)
 	int idx;
 
 	for (idx = 0; idx < vinfo->nr_zones; idx++) {
-		const struct sd_node *n = oid_to_node(oid, &vinfo->vroot, idx);
+		const struct sd_node *n = vinfo_oid_to_node(vinfo, oid, idx);
 		if (node_is_local(n))
 			return idx;
 	}
@@ -462,7 +511,8 @@ static uint8_t local_node_copy_index(struct vnode_info *vinfo, uint64_t oid)
  * 1. read the lost object from its track in epoch history vertically because
  *    every copy that holds partial data of the object is unique
  * 2. if not found in 1, then tries to rebuild it with RS algorithm
- *    2.1 read enough other copies from their tracks in epoch history
+ *    2.1 read enough other copies from their tracks in epoch history, only
+ *        the local group of the lost object for LRC
  *    2.2 rebuild the lost object from the content of copies read at 2.1
  *
  * The subtle case is number for available zones is less than total copy number
@@ -930,40 +980,106 @@ retry:
 	return buf;
 }
 
-/* Screen out objects that don't belong to this node */
+/*
+ * Merge the sorted screened objects 'objs' into the sorted list of 'rlw',
+ * dropping objects which are already scheduled to be recovered
+ */
+static void merge_object_list(struct recovery_list_work *rlw,
+			      const struct object_hash *objs, size_t nr_objs)
+{
+	struct object_hash *merged;
+	size_t i = 0, j = 0, n = 0;
+
+	merged = xmalloc(sizeof(*merged) * (rlw->count + nr_objs));
+	while (i < rlw->count && j < nr_objs) {
+		int cmp = object_hash_cmp(rlw->objs + i, objs + j);
+
+		if (cmp < 0)
+			merged[n++] = rlw->objs[i++];
+		else if (cmp > 0)
+			merged[n++] = objs[j++];
+		else {
+			merged[n++] = rlw->objs[i++];
+			j++;
+		}
+	}
+	memcpy(merged + n, rlw->objs + i, sizeof(*merged) * (rlw->count - i));
+	n += rlw->count - i;
+	memcpy(merged + n, objs + j, sizeof(*merged) * (nr_objs - j));
+	n += nr_objs - j;
+
+	free(rlw->objs);
+	rlw->objs = merged;
+	rlw->count = n;
+}
+
+/*
+ * Screen out objects that don't belong to this node
+ *
+ * The objects are sorted by their hash values first so that all of them can
+ * be placed by a single sweep over the flattened vnode ring.  Straw2 has no
+ * ring to sweep, so the objects are placed one by one.
+ */
 static void screen_object_list(struct recovery_list_work *rlw,
+			       const struct vnode_ring *ring,
 			       uint64_t *oids, size_t nr_oids)
 {
 	struct recovery_work *rw = &rlw->base;
-	const struct sd_vnode *vnodes[SD_MAX_COPIES];
-	uint64_t old_count = rlw->count;
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	struct object_hash *objs;
 	uint64_t nr_objs;
-	uint64_t i, j;
+	size_t i, j, nr_local = 0;
+	int idx = 0;
 
+	objs = xmalloc(sizeof(*objs) * nr_oids);
 	for (i = 0; i < nr_oids; i++) {
-		if (xbsearch(&oids[i], rlw->oids, old_count, obj_cmp))
-			/* the object is already scheduled to be recovered */
-			continue;
-
-		nr_objs = get_obj_copy_number(oids[i], rw->cur_vinfo->nr_zones);
+		objs[i].hash = sd_hash_oid(oids[i]);
+		objs[i].oid = oids[i];
+	}
+	xqsort(objs, nr_oids, object_hash_cmp);
 
-		oid_to_vnodes(oids[i], &rw->cur_vinfo->vroot, nr_objs, vnodes);
+	for (i = 0; i < nr_oids; i++) {
+		nr_objs = get_obj_copy_number(objs[i].oid,
+					      rw->cur_vinfo->nr_zones);
+
+		if (ring->algo == SD_PLACEMENT_RING) {
+			idx = vnode_ring_seek(ring, objs[i].hash, idx);
+			vnode_ring_to_nodes(ring, idx, nr_objs, nodes);
+		} else {
+			int out[SD_MAX_COPIES];
+
+			vnode_ring_place(ring, objs[i].hash, nr_objs, out);
+			for (j = 0; j < nr_objs; j++)
+				nodes[j] = ring->vnodes[out[j]]->node;
+		}
 		for (j = 0; j < nr_objs; j++) {
-			if (!vnode_is_local(vnodes[j]))
+			if (!node_is_local(nodes[j]))
 				continue;
 
-			rlw->oids[rlw->count++] = oids[i];
-			/* enlarge the list buffer if full */
-			if (rlw->count == list_buffer_size / sizeof(uint64_t)) {
-				list_buffer_size *= 2;
-				rlw->oids = xrealloc(rlw->oids,
-						     list_buffer_size);
-			}
+			objs[nr_local++] = objs[i];
 			break;
 		}
 	}
 
-	xqsort(rlw->oids, rlw->count, obj_cmp);
+	merge_object_list(rlw, objs, nr_local);
+	free(objs);
+}
+
+/* Move the screened objects to the list buffer of 'rlw' */
+static void finish_screen_object_list(struct recovery_list_work *rlw)
+{
+	/* the list buffer must have room for at least one more object */
+	if (rlw->count >= list_buffer_size / sizeof(uint64_t)) {
+		while (rlw->count >= list_buffer_size / sizeof(uint64_t))
+			list_buffer_size *= 2;
+		rlw->oids = xrealloc(rlw->oids, list_buffer_size);
+	}
+
+	for (uint64_t i = 0; i < rlw->count; i++)
+		rlw->oids[i] = rlw->objs[i].oid;
+
+	free(rlw->objs);
+	rlw->objs = NULL;
 }
 
 /* Prepare the object list that belongs to this node */
@@ -1001,7 +1117,8 @@ again:
 		oids = fetch_object_list(node, rw->epoch, &nr_oids);
 		if (!oids)
 			continue;
-		screen_object_list(rlw, oids, nr_oids);
+		screen_object_list(rlw, &rw->cur_vinfo->vring, oids,
+				   nr_oids);
 		free(oids);
 	}
 
@@ -1013,6 +1130,7 @@ again:
 
 	sd_debug("%"PRIu64, rlw->count);
 out:
+	finish_screen_object_list(rlw);
 	free(nodes);
 }
 
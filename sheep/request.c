@@ -28,7 +28,7 @@ static bool is_access_local(struct request *req, uint64_t oid)
 	int i;
 
 	nr_copies = get_req_copy_number(req);
-	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		if (vnode_is_local(obj_vnodes[i]))
 			return true;
@@ -192,6 +192,13 @@ static bool request_in_recovery(struct request *req)
 		return false;
 
 	if (oid_in_recovery(req->local_oid)) {
+		if (req->rq.flags & SD_FLAG_CMD_NOWAIT) {
+			/* The requester will rebuild it from other strips */
+			sd_debug("%"PRIx64" in recovery", req->local_oid);
+			req->rp.result = SD_RES_NO_OBJ;
+			put_request(req);
+			return true;
+		}
 		sd_debug("%"PRIx64" wait on oid", req->local_oid);
 		sleep_on_wait_queue(req);
 		return true;
@@ -319,12 +326,19 @@ static void queue_gateway_request(struct request *req)
 	if (sys->enable_object_cache && !req->local)
 		goto queue_work;
 
+	/*
+	 * Erasure coded reads don't wait for the local strip to be recovered
+	 * either, because the gateway can rebuild it from the other strips.
+	 */
+	if (hdr->opcode == SD_OP_READ_OBJ && is_erasure_oid(hdr->obj.oid))
+		goto queue_work;
+
 	if (req->local_oid)
 		if (request_in_recovery(req))
 			return;
 
 queue_work:
-	if (RB_EMPTY_ROOT(&req->vinfo->vroot)) {
+	if (!req->vinfo->vring.nr_vnodes) {
 		sd_err("there is no living nodes");
 		goto end_request;
 	}
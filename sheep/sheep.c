@@ -80,6 +80,16 @@ static const char cache_help[] =
 "\tdir=: path to the location of the cache (default: $STORE/cache)\n"
 "\tdirectio: use directio mode for cache IO, "
 "if not specified use buffered IO\n"
+"\tdirty_age=: push dirty objects older than this in seconds "
+"(default: 5, 0: disable)\n"
+"\tdirty_ratio=: push dirty objects when more than this percent of "
+"the objects of a VDI are dirty (default: 10)\n"
+"\tpush_rate=: limit background pushing to this in MB/s "
+"(default: 0, unlimited)\n"
+"\treserve=: keep at least this size of cache for each VDI in megabytes "
+"(default: 0)\n"
+"\tmem=: size of the in-memory tier for hot snapshot objects "
+"(default: 0, disabled)\n"
 "\nExample:\n\t$ sheep -w size=200G,dir=/my_ssd,directio ...\n"
 "This tries to use /my_ssd as the cache storage with 200G allocted to the\n"
 "cache in directio mode\n";
@@ -117,6 +127,8 @@ static const char log_help[] =
 static struct sd_option sheep_options[] = {
 	{'b', "bindaddr", true, "specify IP address of interface to listen on",
 	 bind_help},
+	{'B', "batch", false, "process cluster operations on different VDIs "
+	 "in one block/unblock cycle"},
 	{'c', "cluster", true,
 	 "specify the cluster driver (default: "DEFAULT_CLUSTER_DRIVER")",
 	 cluster_help},
@@ -300,6 +312,78 @@ static int cache_directio_parser(const char *s)
 	return 0;
 }
 
+static int cache_dirty_age_parser(const char *s)
+{
+	char *p;
+	unsigned long age = strtoul(s, &p, 10);
+
+	if (s == p || *p != '\0' || age > UINT32_MAX) {
+		sd_err("Invalid cache option '%s': dirty_age must be "
+		       "a number of seconds", s);
+		return -1;
+	}
+
+	sys->object_cache_dirty_age = age;
+	return 0;
+}
+
+static int cache_dirty_ratio_parser(const char *s)
+{
+	char *p;
+	unsigned long ratio = strtoul(s, &p, 10);
+
+	if (s == p || *p != '\0' || ratio > 100) {
+		sd_err("Invalid cache option '%s': dirty_ratio must be "
+		       "between 0 and 100", s);
+		return -1;
+	}
+
+	sys->object_cache_dirty_ratio = ratio;
+	return 0;
+}
+
+static int cache_push_rate_parser(const char *s)
+{
+	char *p;
+	unsigned long rate = strtoul(s, &p, 10);
+
+	if (s == p || *p != '\0' || rate > UINT32_MAX) {
+		sd_err("Invalid cache option '%s': push_rate must be "
+		       "a number of MB/s", s);
+		return -1;
+	}
+
+	sys->object_cache_push_rate = rate;
+	return 0;
+}
+
+static int cache_reserve_parser(const char *s)
+{
+	uint64_t reserve;
+
+	if (option_parse_size(s, &reserve) < 0)
+		return -1;
+
+	sys->object_cache_reserve = reserve / 1024 / 1024;
+	return 0;
+}
+
+static int cache_mem_parser(const char *s)
+{
+	uint64_t mem_size;
+
+	if (option_parse_size(s, &mem_size) < 0)
+		return -1;
+	if (mem_size && mem_size < SD_DATA_OBJ_SIZE) {
+		sd_err("Invalid cache option '%s': mem must be at least "
+		       "%"PRIu64"M", s, SD_DATA_OBJ_SIZE / 1024 / 1024);
+		return -1;
+	}
+
+	sys->object_cache_mem_size = mem_size / 1024 / 1024;
+	return 0;
+}
+
 static char ocpath[PATH_MAX];
 
 static int cache_dir_parser(const char *s)
@@ -312,6 +396,11 @@ static struct option_parser cache_parsers[] = {
 	{ "size=", cache_size_parser },
 	{ "directio", cache_directio_parser },
 	{ "dir=", cache_dir_parser },
+	{ "dirty_age=", cache_dirty_age_parser },
+	{ "dirty_ratio=", cache_dirty_ratio_parser },
+	{ "push_rate=", cache_push_rate_parser },
+	{ "reserve=", cache_reserve_parser },
+	{ "mem=", cache_mem_parser },
 	{ NULL, NULL },
 };
 
@@ -448,6 +537,7 @@ static int create_work_queues(void)
 	sys->deletion_wqueue = create_ordered_work_queue("deletion");
 	sys->block_wqueue = create_ordered_work_queue("block");
 	sys->md_wqueue = create_ordered_work_queue("md");
+	sys->vdi_state_wqueue = create_ordered_work_queue("vdi_state");
 	sys->areq_wqueue = create_work_queue("async_req", WQ_UNLIMITED);
 	if (sys->enable_object_cache) {
 		sys->oc_reclaim_wqueue =
@@ -458,7 +548,7 @@ static int create_work_queues(void)
 	}
 	if (!sys->gateway_wqueue || !sys->io_wqueue || !sys->recovery_wqueue ||
 	    !sys->deletion_wqueue || !sys->block_wqueue || !sys->md_wqueue ||
-	    !sys->areq_wqueue)
+	    !sys->vdi_state_wqueue || !sys->areq_wqueue)
 			return -1;
 
 	return 0;
@@ -654,6 +744,9 @@ int main(int argc, char **argv)
 		case 'n':
 			sys->nosync = true;
 			break;
+		case 'B':
+			sys->batch_cluster_op = true;
+			break;
 		case 'y':
 			if (!str_to_addr(optarg, sys->this_node.nid.addr)) {
 				sd_err("Invalid address: '%s'", optarg);
@@ -699,6 +792,11 @@ int main(int argc, char **argv)
 		case 'w':
 			sys->enable_object_cache = true;
 			sys->object_cache_size = 0;
+			sys->object_cache_dirty_age = 5;
+			sys->object_cache_dirty_ratio = 10;
+			sys->object_cache_push_rate = 0;
+			sys->object_cache_reserve = 0;
+			sys->object_cache_mem_size = 0;
 
 			if (option_parse(optarg, ",", cache_parsers) < 0)
 				exit(1);
@@ -835,6 +933,14 @@ int main(int argc, char **argv)
 	if (ret)
 		exit(1);
 
+	ret = init_epoch_log();
+	if (ret)
+		exit(1);
+
+	ret = init_vdi_state_log(dir);
+	if (ret)
+		exit(1);
+
 	ret = create_listen_port(bindaddr, port);
 	if (ret)
 		exit(1);
@@ -90,6 +90,18 @@ struct request_iocb {
 	int result;
 };
 
+/* The max number of cluster operations processed in one block/unblock cycle */
+#define SD_MAX_BATCH_OPS 128
+
+/*
+ * The vids picked by the earlier operations of a cluster batch.  They are
+ * set in sys->vdi_inuse only when the batch is unblocked on every node.
+ */
+struct vdi_reservation {
+	int nr;
+	uint32_t vids[SD_MAX_BATCH_OPS];
+};
+
 struct request {
 	struct sd_req rq;
 	struct sd_rsp rp;
@@ -114,6 +126,11 @@ struct request {
 	struct work work;
 	enum REQUST_STATUS status;
 	bool stat; /* true if this request is during stat */
+	/* true if a parity-delta write failed, see gateway_forward_request() */
+	bool ec_delta_failed;
+
+	/* set while the request is processed in a cluster batch */
+	struct vdi_reservation *reserved;
 };
 
 struct system_info {
@@ -137,6 +154,7 @@ struct system_info {
 
 	bool gateway_only;
 	bool nosync;
+	bool batch_cluster_op;
 
 	struct work_queue *net_wqueue;
 	struct work_queue *gateway_wqueue;
@@ -148,6 +166,7 @@ struct system_info {
 	struct work_queue *oc_reclaim_wqueue;
 	struct work_queue *oc_push_wqueue;
 	struct work_queue *md_wqueue;
+	struct work_queue *vdi_state_wqueue;
 	struct work_queue *areq_wqueue;
 #ifdef HAVE_HTTP
 	struct work_queue *http_wqueue;
@@ -156,6 +175,11 @@ struct system_info {
 
 	uint32_t object_cache_size;
 	bool object_cache_directio;
+	uint32_t object_cache_dirty_age; /* in seconds */
+	uint32_t object_cache_dirty_ratio; /* in percent */
+	uint32_t object_cache_push_rate; /* in MB/s */
+	uint32_t object_cache_reserve; /* per VDI, in MB */
+	uint32_t object_cache_mem_size; /* RAM tier, in MB */
 
 	uatomic_bool use_journal;
 	bool backend_dio;
@@ -184,8 +208,10 @@ struct vdi_iocb {
 	bool create_snapshot;
 	uint8_t copy_policy;
 	uint8_t store_policy;
+	uint8_t ec_stripe_shift;
 	uint8_t nr_copies;
 	uint64_t time;
+	const struct vdi_reservation *reserved;
 };
 
 /* This structure is used to get information from sheepdog. */
@@ -201,7 +227,7 @@ struct vdi_state {
 	uint8_t nr_copies;
 	uint8_t snapshot;
 	uint8_t copy_policy;
-	uint8_t _pad;
+	uint8_t ec_stripe_shift;
 };
 
 struct store_driver {
@@ -290,13 +316,24 @@ int init_base_path(const char *dir);
 int init_disk_space(const char *d);
 int lock_base_dir(const char *d);
 
-int fill_vdi_state_list(void *data);
+void fill_vdi_state_list(const struct sd_req *hdr, struct sd_rsp *rsp,
+			 void *data);
 bool oid_is_readonly(uint64_t oid);
 int get_vdi_copy_number(uint32_t vid);
 int get_vdi_copy_policy(uint32_t vid);
+uint32_t get_vdi_ec_stripe_size(uint32_t vid);
 int get_obj_copy_number(uint64_t oid, int nr_zones);
 int get_req_copy_number(struct request *req);
-int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot, uint8_t);
+int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot, uint8_t,
+		  uint8_t);
+int sync_vdi_state_log(void);
+void queue_sync_vdi_state_log(void);
+bool vdi_state_exist(uint32_t vid);
+int init_vdi_state_log(const char *base_path);
+void get_vdi_state_sync_point(const struct node_id *nid, uint64_t *generation,
+			      uint64_t *version);
+void set_vdi_state_sync_point(const struct node_id *nid, uint64_t generation,
+			      uint64_t version);
 int vdi_exist(uint32_t vid);
 int vdi_create(const struct vdi_iocb *iocb, uint32_t *new_vid);
 int vdi_snapshot(const struct vdi_iocb *iocb, uint32_t *new_vid);
@@ -324,6 +361,8 @@ void put_vnode_info(struct vnode_info *vinfo);
 struct vnode_info *alloc_vnode_info(const struct rb_root *);
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 					struct vnode_info *cur_vinfo);
+void invalidate_vnode_info_epoch(uint32_t epoch);
+void refresh_vnode_info(void);
 void wait_get_vdis_done(void);
 
 int get_nr_copies(struct vnode_info *vnode_info);
@@ -359,6 +398,8 @@ int epoch_log_read_with_timestamp(uint32_t epoch, struct sd_node *nodes,
 int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len,
 			  time_t *timestamp, struct vnode_info *vinfo);
 uint32_t get_latest_epoch(void);
+int init_epoch_log(void);
+int reset_epoch_log(void);
 void init_config_path(const char *base_path);
 int init_config_file(void);
 int get_obj_list(const struct sd_req *, struct sd_rsp *, void *);
@@ -413,6 +454,7 @@ bool is_peer_op(const struct sd_op_template *op);
 bool is_gateway_op(const struct sd_op_template *op);
 bool is_force_op(const struct sd_op_template *op);
 bool is_logging_op(const struct sd_op_template *op);
+bool is_batch_op(const struct sd_op_template *op);
 bool has_process_work(const struct sd_op_template *op);
 bool has_process_main(const struct sd_op_template *op);
 void do_process_work(struct work *work);
@@ -432,6 +474,42 @@ static inline bool node_is_local(const struct sd_node *n)
 	return node_eq(n, &sys->this_node);
 }
 
+/* Place the object on the ring of vinfo through its placement cache */
+static inline void vinfo_oid_to_vnodes(struct vnode_info *vinfo, uint64_t oid,
+				       int nr_copies,
+				       const struct sd_vnode **vnodes)
+{
+	oid_to_vnodes_cached(oid, &vinfo->vring, vinfo->pcache, nr_copies,
+			     vnodes);
+}
+
+static inline void vinfo_oid_to_nodes(struct vnode_info *vinfo, uint64_t oid,
+				      int nr_copies,
+				      const struct sd_node **nodes)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, vnodes);
+	for (int i = 0; i < nr_copies; i++)
+		nodes[i] = vnodes[i]->node;
+}
+
+static inline const struct sd_vnode *
+vinfo_oid_to_vnode(struct vnode_info *vinfo, uint64_t oid, int copy_idx)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(vinfo, oid, copy_idx + 1, vnodes);
+
+	return vnodes[copy_idx];
+}
+
+static inline const struct sd_node *
+vinfo_oid_to_node(struct vnode_info *vinfo, uint64_t oid, int copy_idx)
+{
+	return vinfo_oid_to_vnode(vinfo, oid, copy_idx)->node;
+}
+
 /* gateway operations */
 int gateway_read_obj(struct request *req);
 int gateway_write_obj(struct request *req);
@@ -17,122 +17,633 @@ char *epoch_path;
 struct store_driver *sd_store;
 LIST_HEAD(store_drivers);
 
+/*
+ * An epoch is logged as either the nodes of the epoch followed by the creation
+ * time, or a delta against the previous epoch:
+ *
+ *   struct epoch_delta, the removed nodes, the added nodes
+ *
+ * The nodes are sorted by node_cmp().  A node whose attributes change is
+ * removed and added again.  The size of a delta is never the same as the one
+ * of a full node list modulo sizeof(struct sd_node), so both can be read
+ * without any version number.
+ */
+struct epoch_delta {
+	uint32_t magic;
+	uint32_t nr_removed;
+	uint32_t nr_added;
+	uint32_t __pad;
+	uint64_t time;
+	struct sd_node nodes[0];
+};
+
+#define SD_EPOCH_DELTA_MAGIC 0x5e9d37a1
+
+/* The max number of deltas chained before a full node list */
+#define SD_EPOCH_MAX_DELTAS 16
+
+static inline bool node_same(const struct sd_node *a, const struct sd_node *b)
+{
+	return node_eq(a, b) && a->nr_vnodes == b->nr_vnodes &&
+		a->zone == b->zone && a->space == b->space;
+}
+
+/*
+ * Build the delta from the sorted 'old' nodes to the sorted 'new' ones.
+ * Return NULL if it isn't smaller than the new node list.
+ */
+static struct epoch_delta *build_epoch_delta(const struct sd_node *old,
+					     size_t nr_old,
+					     const struct sd_node *new,
+					     size_t nr_new)
+{
+	struct epoch_delta *delta;
+	struct sd_node *removed, *added;
+	size_t i = 0, j = 0, nr_removed = 0, nr_added = 0;
+
+	removed = xmalloc(sizeof(*removed) * nr_old);
+	added = xmalloc(sizeof(*added) * nr_new);
+	while (i < nr_old || j < nr_new) {
+		int cmp = i == nr_old ? 1 : j == nr_new ? -1 :
+			node_cmp(old + i, new + j);
+
+		if (cmp < 0) {
+			removed[nr_removed++] = old[i++];
+		} else if (cmp > 0) {
+			added[nr_added++] = new[j++];
+		} else {
+			if (!node_same(old + i, new + j)) {
+				removed[nr_removed++] = old[i];
+				added[nr_added++] = new[j];
+			}
+			i++;
+			j++;
+		}
+	}
+
+	if (nr_removed + nr_added >= nr_new) {
+		delta = NULL;
+		goto out;
+	}
+
+	delta = xzalloc(sizeof(*delta) +
+			sizeof(struct sd_node) * (nr_removed + nr_added));
+	delta->magic = SD_EPOCH_DELTA_MAGIC;
+	delta->nr_removed = nr_removed;
+	delta->nr_added = nr_added;
+	memcpy(delta->nodes, removed, sizeof(*removed) * nr_removed);
+	memcpy(delta->nodes + nr_removed, added, sizeof(*added) * nr_added);
+out:
+	free(removed);
+	free(added);
+	return delta;
+}
+
+/* Apply the delta to the 'nr_nodes' nodes, and return the new number */
+static int apply_epoch_delta(struct sd_node *nodes, size_t nr_nodes,
+			     size_t max_nodes, const struct epoch_delta *delta)
+{
+	const struct sd_node *removed = delta->nodes;
+	const struct sd_node *added = delta->nodes + delta->nr_removed;
+	struct sd_node *old;
+	size_t i = 0, j = 0, k = 0, nr = 0;
+
+	old = xmalloc(sizeof(*old) * nr_nodes);
+	memcpy(old, nodes, sizeof(*old) * nr_nodes);
+	while (i < nr_nodes || j < delta->nr_added) {
+		if (i < nr_nodes && k < delta->nr_removed &&
+		    node_eq(old + i, removed + k)) {
+			i++;
+			k++;
+			continue;
+		}
+		if (nr == max_nodes)
+			break;
+		if (j == delta->nr_added ||
+		    (i < nr_nodes && node_cmp(old + i, added + j) < 0))
+			nodes[nr++] = old[i++];
+		else
+			nodes[nr++] = added[j++];
+	}
+	free(old);
+
+	if (nr == max_nodes && (i < nr_nodes || j < delta->nr_added))
+		return -1;
+	return nr;
+}
+
+/*
+ * The epoch log
+ *
+ * All the epochs are appended to a single file, epoch/log, as a struct
+ * epoch_record followed by the payload of the epoch described above.  An
+ * epoch which is written again is just appended again, and the in-memory
+ * index built at startup points to the last record of each epoch.  The log is
+ * rewritten with the live records when the superseded ones take more space
+ * than them.
+ *
+ * The per-epoch files of the older sheep are imported into the log at
+ * startup.
+ */
+struct epoch_record {
+	uint32_t magic;
+	uint32_t epoch;
+	uint32_t len;		/* length of the payload */
+	uint32_t checksum;	/* of the payload */
+};
+
+#define SD_EPOCH_RECORD_MAGIC 0x5e9d109a
+#define EPOCH_LOG_NAME "log"
+
+struct epoch_index {
+	uint64_t offset;	/* of the payload, 0 if the epoch isn't logged */
+	uint32_t len;
+};
+
+static char *epoch_log_path;
+static int epoch_log_fd = -1;
+static uint64_t epoch_log_len, epoch_log_stale;
+static uint32_t latest_epoch;
+/* epoch_index[e] is the index of epoch e */
+static struct epoch_index *epoch_index;
+static uint32_t nr_epoch_index;
+static struct sd_rw_lock epoch_log_lock = SD_RW_LOCK_INITIALIZER;
+
+static inline uint32_t epoch_checksum(const void *buf, size_t len)
+{
+	return (uint32_t)sd_hash(buf, len);
+}
+
+static inline bool is_full_epoch(uint32_t len)
+{
+	return len % sizeof(struct sd_node) == sizeof(time_t);
+}
+
+/* Called with epoch_log_lock held */
+static struct epoch_index *lookup_epoch_index(uint32_t epoch)
+{
+	if (epoch == 0 || epoch >= nr_epoch_index ||
+	    !epoch_index[epoch].offset)
+		return NULL;
+
+	return epoch_index + epoch;
+}
+
+/* Called with epoch_log_lock held for write */
+static void set_epoch_index(uint32_t epoch, uint64_t offset, uint32_t len)
+{
+	if (epoch >= nr_epoch_index) {
+		uint32_t nr = MAX(epoch + 1, nr_epoch_index * 2);
+
+		epoch_index = xrealloc(epoch_index, sizeof(*epoch_index) * nr);
+		memset(epoch_index + nr_epoch_index, 0,
+		       sizeof(*epoch_index) * (nr - nr_epoch_index));
+		nr_epoch_index = nr;
+	}
+
+	if (epoch_index[epoch].offset)
+		epoch_log_stale += sizeof(struct epoch_record) +
+			epoch_index[epoch].len;
+	epoch_index[epoch].offset = offset;
+	epoch_index[epoch].len = len;
+	if (epoch > latest_epoch)
+		uatomic_set(&latest_epoch, epoch);
+}
+
+/*
+ * Rewrite the log with the live records.  Called with epoch_log_lock held
+ * for write.
+ */
+static int compact_epoch_log(void)
+{
+	struct epoch_record *rec;
+	uint64_t len = 0, offset = 0, *offsets;
+	char *buf;
+	int fd, ret;
+
+	for (uint32_t e = 1; e <= latest_epoch; e++)
+		if (lookup_epoch_index(e))
+			len += sizeof(*rec) + epoch_index[e].len;
+
+	buf = xmalloc(len);
+	offsets = xzalloc(sizeof(*offsets) * (latest_epoch + 1));
+	for (uint32_t e = 1; e <= latest_epoch; e++) {
+		struct epoch_index *idx = lookup_epoch_index(e);
+
+		if (!idx)
+			continue;
+
+		rec = (struct epoch_record *)(buf + offset);
+		ret = xpread(epoch_log_fd, rec, sizeof(*rec) + idx->len,
+			     idx->offset - sizeof(*rec));
+		if (ret != sizeof(*rec) + idx->len) {
+			sd_err("failed to read %s, %m", epoch_log_path);
+			goto err;
+		}
+		offset += sizeof(*rec);
+		offsets[e] = offset;
+		offset += idx->len;
+	}
+
+	ret = atomic_create_and_write(epoch_log_path, buf, len, true);
+	if (ret < 0)
+		goto err;
+
+	fd = open(epoch_log_path, O_RDWR | O_APPEND);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", epoch_log_path);
+		goto err;
+	}
+	close(epoch_log_fd);
+	epoch_log_fd = fd;
+	for (uint32_t e = 1; e <= latest_epoch; e++)
+		if (offsets[e])
+			epoch_index[e].offset = offsets[e];
+	free(offsets);
+	free(buf);
+	sd_debug("%" PRIu64 " bytes of stale records are dropped",
+		 epoch_log_stale);
+	epoch_log_len = len;
+	epoch_log_stale = 0;
+
+	return 0;
+err:
+	free(offsets);
+	free(buf);
+	return -1;
+}
+
+/* Called with epoch_log_lock held for write */
+static int append_epoch_record(uint32_t epoch, const void *buf, uint32_t len)
+{
+	struct epoch_record rec = {
+		.magic = SD_EPOCH_RECORD_MAGIC,
+		.epoch = epoch,
+		.len = len,
+		.checksum = epoch_checksum(buf, len),
+	};
+
+	if (epoch_log_fd < 0) {
+		sd_err("epoch log is not initialized");
+		return -1;
+	}
+
+	if (writev2(epoch_log_fd, &rec, (void *)buf, len) !=
+	    sizeof(rec) + len) {
+		sd_err("failed to write %s, %m", epoch_log_path);
+		/* drop the torn record, if any */
+		if (ftruncate(epoch_log_fd, epoch_log_len) < 0)
+			sd_err("failed to truncate %s, %m", epoch_log_path);
+		return -1;
+	}
+	if (fdatasync(epoch_log_fd) < 0) {
+		sd_err("failed to sync %s, %m", epoch_log_path);
+		return -1;
+	}
+
+	epoch_log_len += sizeof(rec);
+	set_epoch_index(epoch, epoch_log_len, len);
+	epoch_log_len += len;
+
+	if (epoch_log_stale > epoch_log_len - epoch_log_stale)
+		return compact_epoch_log();
+
+	return 0;
+}
+
+/*
+ * Read the payload of the epoch into a new buffer.  Return its length, or -1
+ * if the epoch isn't logged.
+ */
+static int read_epoch_record(uint32_t epoch, char **buf)
+{
+	struct epoch_index *idx;
+	int ret;
+
+	sd_read_lock(&epoch_log_lock);
+	idx = lookup_epoch_index(epoch);
+	if (!idx) {
+		sd_rw_unlock(&epoch_log_lock);
+		sd_debug("epoch %"PRIu32" is not logged", epoch);
+		return -1;
+	}
+
+	*buf = xmalloc(idx->len);
+	ret = xpread(epoch_log_fd, *buf, idx->len, idx->offset);
+	if (ret != idx->len) {
+		sd_err("failed to read epoch %"PRIu32" log, %m", epoch);
+		free(*buf);
+		ret = -1;
+	}
+	sd_rw_unlock(&epoch_log_lock);
+
+	return ret;
+}
+
+/* Return the number of deltas to read to get the nodes of 'epoch' */
+static int epoch_log_depth(uint32_t epoch)
+{
+	struct epoch_index *idx;
+	int depth, ret = -1;
+
+	sd_read_lock(&epoch_log_lock);
+	for (depth = 0; depth <= SD_EPOCH_MAX_DELTAS; depth++, epoch--) {
+		idx = lookup_epoch_index(epoch);
+		if (!idx)
+			break;
+		if (is_full_epoch(idx->len)) {
+			ret = depth;
+			break;
+		}
+	}
+	sd_rw_unlock(&epoch_log_lock);
+
+	return ret;
+}
+
 int update_epoch_log(uint32_t epoch, struct sd_node *nodes, size_t nr_nodes)
 {
-	int ret, len, nodes_len;
+	int ret, len, nodes_len, nr_old, depth;
+	struct epoch_delta *delta = NULL;
+	struct sd_node *old;
 	time_t t;
-	char path[PATH_MAX], *buf;
+	char *buf;
 
 	sd_debug("update epoch: %d, %zu", epoch, nr_nodes);
 
 	/* Piggyback the epoch creation time for 'dog cluster info' */
 	time(&t);
-	nodes_len = nr_nodes * sizeof(struct sd_node);
-	len = nodes_len + sizeof(time_t);
-	buf = xmalloc(len);
-	memcpy(buf, nodes, nodes_len);
-	memcpy(buf + nodes_len, &t, sizeof(time_t));
 
-	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
+	depth = epoch > 1 ? epoch_log_depth(epoch - 1) : -1;
+	if (depth >= 0 && depth < SD_EPOCH_MAX_DELTAS) {
+		old = xmalloc(sizeof(*old) * SD_MAX_NODES);
+		nr_old = epoch_log_read(epoch - 1, old,
+					sizeof(*old) * SD_MAX_NODES);
+		if (nr_old >= 0)
+			delta = build_epoch_delta(old, nr_old, nodes,
+						  nr_nodes);
+		free(old);
+	}
+
+	if (delta) {
+		delta->time = t;
+		buf = (char *)delta;
+		len = sizeof(*delta) + sizeof(struct sd_node) *
+			(delta->nr_removed + delta->nr_added);
+		sd_debug("%d removed, %d added", delta->nr_removed,
+			 delta->nr_added);
+	} else {
+		nodes_len = nr_nodes * sizeof(struct sd_node);
+		len = nodes_len + sizeof(time_t);
+		buf = xmalloc(len);
+		memcpy(buf, nodes, nodes_len);
+		memcpy(buf + nodes_len, &t, sizeof(time_t));
+	}
+
+	sd_write_lock(&epoch_log_lock);
+	ret = append_epoch_record(epoch, buf, len);
+	sd_rw_unlock(&epoch_log_lock);
 
-	ret = atomic_create_and_write(path, buf, len, true);
+	/* the nodes of the epoch might be changed */
+	invalidate_vnode_info_epoch(epoch);
 
 	free(buf);
 	return ret;
 }
 
 static int do_epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len,
-			     time_t *timestamp)
+			     time_t *timestamp, int depth)
 {
-	int fd, ret, nr_nodes;
-	char path[PATH_MAX];
-	struct stat epoch_stat;
+	int size, nr_nodes;
+	struct epoch_delta *delta;
+	char *buf = NULL;
 
-	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		sd_debug("failed to open epoch %"PRIu32" log, %m", epoch);
-		goto err;
-	}
+	size = read_epoch_record(epoch, &buf);
+	if (size < 0)
+		return -1;
 
-	memset(&epoch_stat, 0, sizeof(epoch_stat));
-	ret = fstat(fd, &epoch_stat);
-	if (ret < 0) {
-		sd_err("failed to stat epoch %"PRIu32" log, %m", epoch);
-		goto err;
-	}
+	if (!is_full_epoch(size))
+		goto read_delta;
 
-	if (len < epoch_stat.st_size - sizeof(*timestamp)) {
+	if (len < size - sizeof(*timestamp)) {
 		sd_err("invalid epoch %"PRIu32" log", epoch);
 		goto err;
 	}
 
-	ret = xread(fd, nodes, epoch_stat.st_size - sizeof(*timestamp));
-	if (ret < 0) {
-		sd_err("failed to read epoch %"PRIu32" log, %m", epoch);
+	nr_nodes = (size - sizeof(*timestamp)) / sizeof(struct sd_node);
+	memcpy(nodes, buf, size - sizeof(*timestamp));
+	if (timestamp)
+		memcpy(timestamp, buf + size - sizeof(*timestamp),
+		       sizeof(*timestamp));
+
+	free(buf);
+	return nr_nodes;
+read_delta:
+	delta = (struct epoch_delta *)buf;
+	if (size < sizeof(*delta) || delta->magic != SD_EPOCH_DELTA_MAGIC ||
+	    size != sizeof(*delta) + sizeof(struct sd_node) *
+	    (delta->nr_removed + delta->nr_added) ||
+	    depth == SD_EPOCH_MAX_DELTAS) {
+		sd_err("invalid epoch %"PRIu32" log", epoch);
 		goto err;
 	}
 
-	/* Broken epoch, just ignore */
-	if (ret % sizeof(struct sd_node) != 0) {
+	nr_nodes = do_epoch_log_read(epoch - 1, nodes, len, NULL, depth + 1);
+	if (nr_nodes >= 0)
+		nr_nodes = apply_epoch_delta(nodes, nr_nodes,
+					     len / sizeof(struct sd_node),
+					     delta);
+	if (nr_nodes < 0) {
 		sd_err("invalid epoch %"PRIu32" log", epoch);
 		goto err;
 	}
 
-	nr_nodes = ret / sizeof(struct sd_node);
-
-	if (timestamp) {
-		ret = xread(fd, timestamp, sizeof(*timestamp));
-		if (ret != sizeof(*timestamp)) {
-			sd_err("invalid epoch %"PRIu32" log", epoch);
-			goto err;
-		}
-	}
+	if (timestamp)
+		*timestamp = delta->time;
 
-	close(fd);
+	free(buf);
 	return nr_nodes;
 err:
-	if (fd >= 0)
-		close(fd);
+	free(buf);
 	return -1;
 }
 
 int epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len)
 {
-	return do_epoch_log_read(epoch, nodes, len, NULL);
+	return do_epoch_log_read(epoch, nodes, len, NULL, 0);
 }
 
 int epoch_log_read_with_timestamp(uint32_t epoch, struct sd_node *nodes,
 				int len, time_t *timestamp)
 {
-	return do_epoch_log_read(epoch, nodes, len, timestamp);
+	return do_epoch_log_read(epoch, nodes, len, timestamp, 0);
 }
 
 uint32_t get_latest_epoch(void)
 {
-	DIR *dir;
+	return uatomic_read(&latest_epoch);
+}
+
+/* Remove all the epochs, used when the cluster is formatted */
+int reset_epoch_log(void)
+{
+	uint32_t latest;
+	int ret = 0;
+
+	sd_write_lock(&epoch_log_lock);
+	latest = latest_epoch;
+	if (epoch_log_fd >= 0 && ftruncate(epoch_log_fd, 0) < 0) {
+		sd_err("failed to truncate %s, %m", epoch_log_path);
+		ret = -1;
+	}
+	memset(epoch_index, 0, sizeof(*epoch_index) * nr_epoch_index);
+	epoch_log_len = 0;
+	epoch_log_stale = 0;
+	uatomic_set(&latest_epoch, 0);
+	sd_rw_unlock(&epoch_log_lock);
+
+	for (uint32_t e = 1; e <= latest; e++)
+		invalidate_vnode_info_epoch(e);
+
+	return ret;
+}
+
+static int epoch_cmp(const uint32_t *a, const uint32_t *b)
+{
+	return intcmp(*a, *b);
+}
+
+/* Move the epoch files of the older sheep into the log */
+static int import_epoch_files(void)
+{
+	uint32_t *epochs = NULL, e;
+	size_t nr = 0;
+	char path[PATH_MAX], *p;
 	struct dirent *d;
-	uint32_t e, epoch = 0;
-	char *p;
+	struct stat st;
+	DIR *dir;
+	int ret = 0;
 
 	dir = opendir(epoch_path);
-	if (!dir)
-		panic("failed to get the latest epoch: %m");
-
+	if (!dir) {
+		sd_err("failed to open %s, %m", epoch_path);
+		return -1;
+	}
 	while ((d = readdir(dir))) {
 		e = strtol(d->d_name, &p, 10);
-		if (d->d_name == p)
+		if (d->d_name == p || strlen(d->d_name) != 8)
 			continue;
 
-		if (strlen(d->d_name) != 8)
+		epochs = xrealloc(epochs, sizeof(*epochs) * (nr + 1));
+		epochs[nr++] = e;
+	}
+	closedir(dir);
+
+	if (!nr)
+		return 0;
+
+	xqsort(epochs, nr, epoch_cmp);
+	sd_info("import %zu epoch files into %s", nr, epoch_log_path);
+
+	sd_write_lock(&epoch_log_lock);
+	for (int i = 0; i < nr; i++) {
+		char *buf;
+		int fd;
+
+		snprintf(path, sizeof(path), "%s%08u", epoch_path, epochs[i]);
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			sd_err("failed to open %s, %m", path);
+			if (fd >= 0)
+				close(fd);
 			continue;
+		}
+		buf = xmalloc(st.st_size);
+		if (xread(fd, buf, st.st_size) == st.st_size)
+			ret = append_epoch_record(epochs[i], buf, st.st_size);
+		else
+			sd_err("failed to read %s, %m", path);
+		free(buf);
+		close(fd);
+		if (ret < 0)
+			break;
+	}
+	sd_rw_unlock(&epoch_log_lock);
 
-		if (e > epoch)
-			epoch = e;
+	/* the files are removed only after all of them are in the log */
+	for (int i = 0; ret == 0 && i < nr; i++) {
+		snprintf(path, sizeof(path), "%s%08u", epoch_path, epochs[i]);
+		if (unlink(path) < 0)
+			sd_err("failed to remove %s, %m", path);
 	}
-	closedir(dir);
+	free(epochs);
+
+	return ret;
+}
+
+/*
+ * Build the index of the epoch log.  This has to be called after the store is
+ * migrated, which works on the epoch files.
+ */
+int init_epoch_log(void)
+{
+	struct epoch_record *rec;
+	struct stat st;
+	uint64_t offset = 0;
+	char *buf = NULL;
+	int len;
+
+	len = strlen(epoch_path) + strlen(EPOCH_LOG_NAME) + 1;
+	epoch_log_path = xzalloc(len);
+	snprintf(epoch_log_path, len, "%s" EPOCH_LOG_NAME, epoch_path);
+
+	epoch_log_fd = open(epoch_log_path, O_RDWR | O_APPEND | O_CREAT,
+			    sd_def_fmode);
+	if (epoch_log_fd < 0) {
+		sd_err("failed to open %s, %m", epoch_log_path);
+		return -1;
+	}
+
+	if (fstat(epoch_log_fd, &st) < 0) {
+		sd_err("failed to stat %s, %m", epoch_log_path);
+		return -1;
+	}
+
+	buf = xmalloc(st.st_size);
+	if (xpread(epoch_log_fd, buf, st.st_size, 0) != st.st_size) {
+		sd_err("failed to read %s, %m", epoch_log_path);
+		free(buf);
+		return -1;
+	}
+
+	while (offset + sizeof(*rec) <= st.st_size) {
+		rec = (struct epoch_record *)(buf + offset);
+		if (rec->magic != SD_EPOCH_RECORD_MAGIC || rec->epoch == 0 ||
+		    offset + sizeof(*rec) + rec->len > st.st_size ||
+		    epoch_checksum(rec + 1, rec->len) != rec->checksum)
+			break;
+
+		offset += sizeof(*rec);
+		set_epoch_index(rec->epoch, offset, rec->len);
+		offset += rec->len;
+	}
+	free(buf);
+	epoch_log_len = offset;
+
+	/* Drop a torn record at the tail if any */
+	if (offset != st.st_size) {
+		sd_err("drop a broken record at %" PRIu64 " of %s", offset,
+		       epoch_log_path);
+		if (ftruncate(epoch_log_fd, offset) < 0) {
+			sd_err("failed to truncate %s, %m", epoch_log_path);
+			return -1;
+		}
+	}
+
+	sd_debug("latest epoch %" PRIu32 ", %" PRIu64 " bytes of %" PRIu64
+		 " are stale", latest_epoch, epoch_log_stale, epoch_log_len);
 
-	return epoch;
+	return import_epoch_files();
 }
 
 int lock_base_dir(const char *d)
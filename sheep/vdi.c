@@ -16,12 +16,70 @@ struct vdi_state_entry {
 	unsigned int nr_copies;
 	bool snapshot;
 	uint8_t copy_policy;
+	uint8_t ec_stripe_shift;
+	uint64_t version;
 	struct rb_node node;
+	struct list_node list;
 };
 
 static struct rb_root vdi_state_root = RB_ROOT;
 static struct sd_rw_lock vdi_state_lock = SD_RW_LOCK_INITIALIZER;
 
+/*
+ * Every change of the vdi states gets a new version, and vdi_state_list keeps
+ * the entries in the order of their versions.  Other nodes remember the
+ * generation and the version which they got last time, and fetch only the
+ * entries changed after it.  The generation is renewed when the table is
+ * cleared, so that the versions of the old table are never reused.
+ */
+static LIST_HEAD(vdi_state_list);
+static uint64_t vdi_state_generation;
+static uint64_t vdi_state_version;
+static size_t nr_vdi_states;
+
+/*
+ * The table is persisted as an append-only log of the changed entries, which
+ * is rewritten when the stale records outnumber the live ones.
+ */
+struct vdi_state_log_header {
+	uint32_t magic;
+	uint32_t __pad;
+	uint64_t generation;
+};
+
+struct vdi_state_record {
+	struct vdi_state vs;
+	uint64_t version;
+};
+
+#define VDI_STATE_LOG_MAGIC 0x76647374
+#define VDI_STATE_PATH "/vdi_state"
+#define VDI_STATE_PEERS_PATH "/vdi_state.peers"
+
+static char *vdi_state_path, *vdi_state_peers_path;
+static int vdi_state_fd = -1;
+static size_t nr_vdi_state_records;
+
+/*
+ * Only sync_vdi_state_log() writes the log, so that the main thread never
+ * waits for the disk when it changes the table.  The entries after the logged
+ * version of the logged generation are not in the log yet.
+ */
+static struct sd_mutex vdi_state_log_lock = SD_MUTEX_INITIALIZER;
+static uint64_t vdi_state_logged_generation, vdi_state_logged_version;
+static uatomic_bool vdi_state_log_sync_queued;
+
+/* The generation and the version of the other nodes which we have synced */
+struct vdi_state_peer {
+	struct node_id nid;
+	uint64_t generation;
+	uint64_t version;
+};
+
+static struct vdi_state_peer *vdi_state_peers;
+static size_t nr_vdi_state_peers;
+static struct sd_mutex vdi_state_peers_lock = SD_MUTEX_INITIALIZER;
+
 /*
  * ec_max_data_strip represent max number of data strips in the cluster. When
  * nr_zones < it, we don't purge the stale objects because for erasure coding,
@@ -121,6 +179,20 @@ int get_vdi_copy_policy(uint32_t vid)
 	return entry->copy_policy;
 }
 
+uint32_t get_vdi_ec_stripe_size(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+	uint8_t shift = 0;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (entry)
+		shift = entry->ec_stripe_shift;
+	sd_rw_unlock(&vdi_state_lock);
+
+	return ec_stripe_size(shift);
+}
+
 int get_obj_copy_number(uint64_t oid, int nr_zones)
 {
 	return min(get_vdi_copy_number(oid_to_vid(oid)), nr_zones);
@@ -138,59 +210,469 @@ int get_req_copy_number(struct request *req)
 	return nr_copies;
 }
 
-int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot, uint8_t cp)
+static uint64_t new_vdi_state_generation(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec << 32 ^ (uint64_t)ts.tv_nsec << 8 ^ getpid();
+}
+
+static void fill_vdi_state_record(struct vdi_state_record *rec,
+				  const struct vdi_state_entry *entry)
+{
+	rec->vs.vid = entry->vid;
+	rec->vs.nr_copies = entry->nr_copies;
+	rec->vs.snapshot = entry->snapshot;
+	rec->vs.copy_policy = entry->copy_policy;
+	rec->vs.ec_stripe_shift = entry->ec_stripe_shift;
+	rec->version = entry->version;
+}
+
+/*
+ * Rewrite the log with 'buf', which has the header and 'nr' records.  Called
+ * with vdi_state_log_lock held.
+ */
+static int write_vdi_state_log(char *buf, size_t nr, uint64_t generation)
+{
+	struct vdi_state_log_header *hdr = (struct vdi_state_log_header *)buf;
+	size_t len = sizeof(*hdr) + sizeof(struct vdi_state_record) * nr;
+
+	hdr->magic = VDI_STATE_LOG_MAGIC;
+	hdr->generation = generation;
+	if (atomic_create_and_write(vdi_state_path, buf, len, true) < 0)
+		return -1;
+
+	if (vdi_state_fd >= 0)
+		close(vdi_state_fd);
+	vdi_state_fd = open(vdi_state_path, O_WRONLY | O_APPEND);
+	if (vdi_state_fd < 0) {
+		sd_err("failed to open %s, %m", vdi_state_path);
+		return -1;
+	}
+	nr_vdi_state_records = nr;
+
+	return 0;
+}
+
+/*
+ * Append the entries which are not in the log yet and sync them to disk.  The
+ * log is rewritten with all the entries instead if it is of an old generation
+ * or the stale records would outnumber the live ones.
+ *
+ * The startup scan skips the inodes of the VDIs in the log, so a lost record
+ * would leave a stale state which is never corrected.  The entries are copied
+ * under vdi_state_lock and written after it is released, so this can run
+ * in a worker while the main thread keeps changing the table.
+ */
+int sync_vdi_state_log(void)
+{
+	struct vdi_state_record *rec;
+	struct vdi_state_entry *entry;
+	struct list_node *n;
+	uint64_t generation, version;
+	size_t nr = 0;
+	bool rewrite;
+	char *buf;
+	int ret = 0;
+
+	sd_mutex_lock(&vdi_state_log_lock);
+	if (!vdi_state_path)
+		goto out;
+
+	sd_read_lock(&vdi_state_lock);
+	generation = vdi_state_generation;
+	version = vdi_state_version;
+	rewrite = vdi_state_fd < 0 ||
+		generation != vdi_state_logged_generation;
+
+	/* Walk back to the last logged entry */
+	for (n = vdi_state_list.n.prev; n != &vdi_state_list.n && !rewrite;
+	     n = n->prev) {
+		entry = list_entry(n, struct vdi_state_entry, list);
+		if (entry->version <= vdi_state_logged_version)
+			break;
+		nr++;
+	}
+	if (rewrite || nr_vdi_state_records + nr > nr_vdi_states * 2 + 1024) {
+		rewrite = true;
+		n = &vdi_state_list.n;
+		nr = nr_vdi_states;
+	}
+
+	buf = xzalloc(sizeof(struct vdi_state_log_header) + sizeof(*rec) * nr);
+	rec = (struct vdi_state_record *)
+		(buf + sizeof(struct vdi_state_log_header));
+	for (n = n->next; n != &vdi_state_list.n; n = n->next)
+		fill_vdi_state_record(rec++,
+				      list_entry(n, struct vdi_state_entry,
+						 list));
+	sd_rw_unlock(&vdi_state_lock);
+
+	if (rewrite)
+		ret = write_vdi_state_log(buf, nr, generation);
+	else if (nr) {
+		size_t len = sizeof(*rec) * nr;
+
+		rec = (struct vdi_state_record *)
+			(buf + sizeof(struct vdi_state_log_header));
+		if (xwrite(vdi_state_fd, rec, len) != len) {
+			sd_err("failed to write %s, %m", vdi_state_path);
+			ret = -1;
+		} else if (fdatasync(vdi_state_fd) < 0) {
+			sd_err("failed to sync %s, %m", vdi_state_path);
+			ret = -1;
+		}
+		nr_vdi_state_records += nr;
+	}
+	free(buf);
+
+	if (ret == 0) {
+		vdi_state_logged_generation = generation;
+		vdi_state_logged_version = version;
+	}
+out:
+	sd_mutex_unlock(&vdi_state_log_lock);
+	return ret;
+}
+
+static void do_sync_vdi_state_log(struct work *work)
+{
+	/* the changes made from now on need another sync */
+	uatomic_set_false(&vdi_state_log_sync_queued);
+	sync_vdi_state_log();
+}
+
+static void sync_vdi_state_log_done(struct work *work)
+{
+	free(work);
+}
+
+/* Sync the log in the vdi state worker unless a sync is already queued */
+main_fn void queue_sync_vdi_state_log(void)
+{
+	struct work *work;
+
+	if (!uatomic_set_true(&vdi_state_log_sync_queued))
+		return;
+
+	work = xzalloc(sizeof(*work));
+	work->fn = do_sync_vdi_state_log;
+	work->done = sync_vdi_state_log_done;
+	queue_work(sys->vdi_state_wqueue, work);
+}
+
+/*
+ * Insert or update the entry.  A new version is assigned if 'version' is 0.
+ * Return the entry if it is changed, or NULL.  Called with vdi_state_lock
+ * held.
+ */
+static struct vdi_state_entry *update_vdi_state(const struct vdi_state *vs,
+						uint64_t version)
 {
 	struct vdi_state_entry *entry, *old;
 
 	entry = xzalloc(sizeof(*entry));
-	entry->vid = vid;
-	entry->nr_copies = nr_copies;
-	entry->snapshot = snapshot;
-	entry->copy_policy = cp;
+	entry->vid = vs->vid;
+	entry->nr_copies = vs->nr_copies;
+	entry->snapshot = vs->snapshot;
+	entry->copy_policy = vs->copy_policy;
+	entry->ec_stripe_shift = vs->ec_stripe_shift;
 
-	if (cp) {
+	if (vs->copy_policy) {
 		int d;
 
-		ec_policy_to_dp(cp, &d, NULL);
+		ec_policy_to_dp(vs->copy_policy, &d, NULL);
 		ec_max_data_strip = max(d, ec_max_data_strip);
 	}
 
-	sd_debug("%" PRIx32 ", %d, %d", vid, nr_copies, cp);
-
-	sd_write_lock(&vdi_state_lock);
 	old = vdi_state_insert(&vdi_state_root, entry);
 	if (old) {
 		free(entry);
 		entry = old;
-		entry->nr_copies = nr_copies;
-		entry->snapshot = snapshot;
-		entry->copy_policy = cp;
+		if (entry->nr_copies == vs->nr_copies &&
+		    entry->snapshot == !!vs->snapshot &&
+		    entry->copy_policy == vs->copy_policy &&
+		    entry->ec_stripe_shift == vs->ec_stripe_shift)
+			return NULL;
+
+		entry->nr_copies = vs->nr_copies;
+		entry->snapshot = vs->snapshot;
+		entry->copy_policy = vs->copy_policy;
+		entry->ec_stripe_shift = vs->ec_stripe_shift;
+		list_move_tail(&entry->list, &vdi_state_list);
+	} else {
+		list_add_tail(&entry->list, &vdi_state_list);
+		nr_vdi_states++;
 	}
 
+	if (version)
+		vdi_state_version = max(version, vdi_state_version);
+	else
+		version = ++vdi_state_version;
+	entry->version = version;
+
+	return entry;
+}
+
+int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot, uint8_t cp,
+		  uint8_t stripe_shift)
+{
+	struct vdi_state vs = {
+		.vid = vid,
+		.nr_copies = nr_copies,
+		.snapshot = snapshot,
+		.copy_policy = cp,
+		.ec_stripe_shift = stripe_shift,
+	};
+
+	sd_debug("%" PRIx32 ", %d, %d, %d", vid, nr_copies, cp, stripe_shift);
+
+	sd_write_lock(&vdi_state_lock);
+	update_vdi_state(&vs, 0);
 	sd_rw_unlock(&vdi_state_lock);
 
 	return SD_RES_SUCCESS;
 }
 
-int fill_vdi_state_list(void *data)
+bool vdi_state_exist(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	sd_rw_unlock(&vdi_state_lock);
+
+	return entry != NULL;
+}
+
+/*
+ * Fill 'data' with the entries changed after the version in the request, in
+ * the order of their versions.  If the requested generation is not ours, all
+ * the entries are returned.  The response has the version of the last filled
+ * entry, so the caller can fetch the rest with it.
+ */
+void fill_vdi_state_list(const struct sd_req *hdr, struct sd_rsp *rsp,
+			 void *data)
 {
-	int nr = 0;
 	struct vdi_state *vs = data;
 	struct vdi_state_entry *entry;
+	struct list_node *n;
+	uint64_t version = hdr->vdi_sync.version;
+	size_t nr = 0, max_nr = hdr->data_length / sizeof(*vs);
 
 	sd_read_lock(&vdi_state_lock);
-	rb_for_each_entry(entry, &vdi_state_root, node) {
+	if (hdr->vdi_sync.generation != vdi_state_generation)
+		version = 0;
+
+	/* Walk back to the first entry after 'version' */
+	for (n = vdi_state_list.n.prev; n != &vdi_state_list.n; n = n->prev) {
+		entry = list_entry(n, struct vdi_state_entry, list);
+		if (entry->version <= version)
+			break;
+	}
+
+	for (n = n->next; n != &vdi_state_list.n && nr < max_nr; n = n->next) {
+		entry = list_entry(n, struct vdi_state_entry, list);
 		memset(vs, 0, sizeof(*vs));
 		vs->vid = entry->vid;
 		vs->nr_copies = entry->nr_copies;
 		vs->snapshot = entry->snapshot;
 		vs->copy_policy = entry->copy_policy;
+		vs->ec_stripe_shift = entry->ec_stripe_shift;
+		version = entry->version;
 		vs++;
 		nr++;
 	}
+	if (n == &vdi_state_list.n)
+		version = max(version, vdi_state_version);
+
+	rsp->vdi_sync.generation = vdi_state_generation;
+	rsp->vdi_sync.version = version;
+	sd_rw_unlock(&vdi_state_lock);
+
+	rsp->data_length = nr * sizeof(*vs);
+}
+
+static struct vdi_state_peer *find_vdi_state_peer(const struct node_id *nid)
+{
+	for (int i = 0; i < nr_vdi_state_peers; i++)
+		if (node_id_cmp(&vdi_state_peers[i].nid, nid) == 0)
+			return vdi_state_peers + i;
+
+	return NULL;
+}
+
+/* Get the generation and the version of 'nid' which we have synced */
+void get_vdi_state_sync_point(const struct node_id *nid, uint64_t *generation,
+			      uint64_t *version)
+{
+	struct vdi_state_peer *peer;
+
+	sd_mutex_lock(&vdi_state_peers_lock);
+	peer = find_vdi_state_peer(nid);
+	*generation = peer ? peer->generation : 0;
+	*version = peer ? peer->version : 0;
+	sd_mutex_unlock(&vdi_state_peers_lock);
+}
+
+void set_vdi_state_sync_point(const struct node_id *nid, uint64_t generation,
+			      uint64_t version)
+{
+	struct vdi_state_peer *peer;
+	struct vdi_state_log_header hdr = {
+		.magic = VDI_STATE_LOG_MAGIC,
+	};
+	size_t len;
+	char *buf;
+
+	sd_mutex_lock(&vdi_state_peers_lock);
+	peer = find_vdi_state_peer(nid);
+	if (!peer) {
+		vdi_state_peers = xrealloc(vdi_state_peers,
+					   sizeof(*peer) *
+					   (nr_vdi_state_peers + 1));
+		peer = vdi_state_peers + nr_vdi_state_peers++;
+		peer->nid = *nid;
+	}
+	peer->generation = generation;
+	peer->version = version;
+
+	if (!vdi_state_peers_path)
+		goto out;
+
+	/* The synced entries must be on disk before the sync point */
+	sync_vdi_state_log();
+	sd_read_lock(&vdi_state_lock);
+	hdr.generation = vdi_state_generation;
 	sd_rw_unlock(&vdi_state_lock);
 
-	return nr * sizeof(*vs);
+	len = sizeof(*peer) * nr_vdi_state_peers;
+	buf = xmalloc(sizeof(hdr) + len);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), vdi_state_peers, len);
+	atomic_create_and_write(vdi_state_peers_path, buf, sizeof(hdr) + len,
+				true);
+	free(buf);
+out:
+	sd_mutex_unlock(&vdi_state_peers_lock);
+}
+
+static void load_vdi_state_peers(void)
+{
+	struct vdi_state_log_header *hdr;
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(vdi_state_peers_path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr))
+		goto out;
+
+	buf = xmalloc(st.st_size);
+	if (xread(fd, buf, st.st_size) != st.st_size)
+		goto free_buf;
+
+	hdr = (struct vdi_state_log_header *)buf;
+	if (hdr->magic != VDI_STATE_LOG_MAGIC ||
+	    hdr->generation != vdi_state_generation)
+		goto free_buf;
+
+	nr_vdi_state_peers = (st.st_size - sizeof(*hdr)) /
+		sizeof(struct vdi_state_peer);
+	vdi_state_peers = xmalloc(sizeof(struct vdi_state_peer) *
+				  nr_vdi_state_peers);
+	memcpy(vdi_state_peers, hdr + 1,
+	       sizeof(struct vdi_state_peer) * nr_vdi_state_peers);
+free_buf:
+	free(buf);
+out:
+	close(fd);
+}
+
+/*
+ * Load the vdi states persisted by the previous run, so that the store
+ * doesn't have to read all the inodes again.
+ */
+int init_vdi_state_log(const char *base_path)
+{
+	struct vdi_state_log_header *hdr;
+	struct vdi_state_record *rec;
+	struct stat st;
+	size_t nr = 0;
+	char *buf = NULL;
+	int fd, len;
+
+	len = strlen(base_path) + strlen(VDI_STATE_PEERS_PATH) + 1;
+	vdi_state_path = xzalloc(len);
+	snprintf(vdi_state_path, len, "%s" VDI_STATE_PATH, base_path);
+	vdi_state_peers_path = xzalloc(len);
+	snprintf(vdi_state_peers_path, len, "%s" VDI_STATE_PEERS_PATH,
+		 base_path);
+
+	fd = open(vdi_state_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			sd_err("failed to open %s, %m", vdi_state_path);
+			return -1;
+		}
+		goto new_log;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		sd_err("failed to stat %s, %m", vdi_state_path);
+		close(fd);
+		return -1;
+	}
+
+	buf = xmalloc(st.st_size);
+	if (st.st_size < sizeof(*hdr) ||
+	    xread(fd, buf, st.st_size) != st.st_size) {
+		close(fd);
+		goto broken;
+	}
+	close(fd);
+
+	hdr = (struct vdi_state_log_header *)buf;
+	if (hdr->magic != VDI_STATE_LOG_MAGIC)
+		goto broken;
+
+	vdi_state_generation = hdr->generation;
+	rec = (struct vdi_state_record *)(hdr + 1);
+	nr = (st.st_size - sizeof(*hdr)) / sizeof(*rec);
+	for (int i = 0; i < nr; i++) {
+		update_vdi_state(&rec[i].vs, rec[i].version);
+		atomic_set_bit(rec[i].vs.vid, sys->vdi_inuse);
+	}
+	free(buf);
+
+	sd_info("%zu vdi states loaded, generation %" PRIx64, nr_vdi_states,
+		vdi_state_generation);
+	load_vdi_state_peers();
+	nr_vdi_state_records = nr;
+
+	/* Drop a torn record at the tail if any */
+	if (st.st_size != sizeof(*hdr) + sizeof(*rec) * nr)
+		return sync_vdi_state_log();
+
+	vdi_state_fd = open(vdi_state_path, O_WRONLY | O_APPEND);
+	if (vdi_state_fd < 0) {
+		sd_err("failed to open %s, %m", vdi_state_path);
+		return -1;
+	}
+	vdi_state_logged_generation = vdi_state_generation;
+	vdi_state_logged_version = vdi_state_version;
+
+	return 0;
+broken:
+	sd_err("broken %s, the vdi states are rebuilt", vdi_state_path);
+	free(buf);
+new_log:
+	vdi_state_generation = new_vdi_state_generation();
+	return sync_vdi_state_log();
 }
 
 static inline bool vdi_is_deleted(struct sd_inode *inode)
@@ -235,6 +717,7 @@ static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 	new->vdi_size = iocb->size;
 	new->copy_policy = iocb->copy_policy;
 	new->store_policy = iocb->store_policy;
+	new->ec_stripe_shift = iocb->ec_stripe_shift;
 	new->nr_copies = iocb->nr_copies;
 	new->block_size_shift = find_next_bit(&block_size, BITS_PER_LONG, 0);
 	new->snap_id = new_snapid;
@@ -498,17 +981,41 @@ out:
  * Otherwise:
  * Return NO_VDI (bit not set) or FULL_VDI (bitmap fully set)
  */
-static int get_vdi_bitmap_range(const char *name, unsigned long *left,
-				unsigned long *right)
+static bool vid_is_reserved(const struct vdi_reservation *reserved,
+			    unsigned long vid)
 {
-	*left = sd_hash_vdi(name);
-	*right = find_next_zero_bit(sys->vdi_inuse, SD_NR_VDIS, *left);
+	if (!reserved)
+		return false;
+
+	for (int i = 0; i < reserved->nr; i++)
+		if (reserved->vids[i] == vid)
+			return true;
+	return false;
+}
+
+/* Find the next vid which is neither in use nor reserved by the batch */
+static unsigned long find_next_free_vid(const struct vdi_reservation *reserved,
+					unsigned long start)
+{
+	unsigned long vid = find_next_zero_bit(sys->vdi_inuse, SD_NR_VDIS,
+					       start);
+
+	while (vid < SD_NR_VDIS && vid_is_reserved(reserved, vid))
+		vid = find_next_zero_bit(sys->vdi_inuse, SD_NR_VDIS, vid + 1);
+	return vid;
+}
+
+static int get_vdi_bitmap_range(const struct vdi_iocb *iocb,
+				unsigned long *left, unsigned long *right)
+{
+	*left = sd_hash_vdi(iocb->name);
+	*right = find_next_free_vid(iocb->reserved, *left);
 	if (*left == *right)
 		return SD_RES_NO_VDI;
 
 	if (*right == SD_NR_VDIS) {
 		/* Wrap around */
-		*right = find_next_zero_bit(sys->vdi_inuse, SD_NR_VDIS, 0);
+		*right = find_next_free_vid(iocb->reserved, 0);
 		if (*right == SD_NR_VDIS)
 			return SD_RES_FULL_VDI;
 	}
@@ -622,7 +1129,7 @@ int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
 	unsigned long left, right;
 	int ret;
 
-	ret = get_vdi_bitmap_range(iocb->name, &left, &right);
+	ret = get_vdi_bitmap_range(iocb, &left, &right);
 	info->free_bit = right;
 	sd_debug("%s left %lx right %lx, %x", iocb->name, left, right, ret);
 	switch (ret) {
@@ -636,7 +1143,7 @@ int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
 }
 
 static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid,
-			  uint8_t copy_policy)
+			  uint8_t copy_policy, uint8_t stripe_shift)
 {
 	int ret = SD_RES_SUCCESS;
 	struct sd_req hdr;
@@ -647,6 +1154,7 @@ static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid,
 	hdr.vdi_state.copies = nr_copies;
 	hdr.vdi_state.set_bitmap = false;
 	hdr.vdi_state.copy_policy = copy_policy;
+	hdr.vdi_state.ec_stripe_shift = stripe_shift;
 
 	ret = exec_local_req(&hdr, NULL);
 	if (ret != SD_RES_SUCCESS)
@@ -702,7 +1210,7 @@ int vdi_create(const struct vdi_iocb *iocb, uint32_t *new_vid)
 		info.snapid = 1;
 	*new_vid = info.free_bit;
 	ret = notify_vdi_add(*new_vid, iocb->nr_copies, info.vid,
-			     iocb->copy_policy);
+			     iocb->copy_policy, iocb->ec_stripe_shift);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -742,7 +1250,7 @@ int vdi_snapshot(const struct vdi_iocb *iocb, uint32_t *new_vid)
 	assert(info.snapid > 0);
 	*new_vid = info.free_bit;
 	ret = notify_vdi_add(*new_vid, iocb->nr_copies, info.vid,
-			     iocb->copy_policy);
+			     iocb->copy_policy, iocb->ec_stripe_shift);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -1200,10 +1708,25 @@ out:
 
 void clean_vdi_state(void)
 {
+	sd_mutex_lock(&vdi_state_peers_lock);
+	free(vdi_state_peers);
+	vdi_state_peers = NULL;
+	nr_vdi_state_peers = 0;
+	if (vdi_state_peers_path)
+		unlink(vdi_state_peers_path);
+	sd_mutex_unlock(&vdi_state_peers_lock);
+
 	sd_write_lock(&vdi_state_lock);
 	rb_destroy(&vdi_state_root, struct vdi_state_entry, node);
 	INIT_RB_ROOT(&vdi_state_root);
+	INIT_LIST_HEAD(&vdi_state_list);
+	nr_vdi_states = 0;
+	vdi_state_version = 0;
+	vdi_state_generation = new_vdi_state_generation();
 	sd_rw_unlock(&vdi_state_lock);
+
+	/* the log of the old generation is rewritten */
+	sync_vdi_state_log();
 }
 
 int sd_delete_vdi(const char *name)
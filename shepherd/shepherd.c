@@ -21,6 +21,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -36,6 +37,13 @@
 
 #define EPOLL_SIZE SD_MAX_NODES
 
+/* max nr of messages read from a sheep in one wakeup */
+#define SPH_READ_BATCH		32
+/* max nr of messages written to a sheep in one sendmsg() */
+#define SPH_WRITE_BATCH		64
+/* a sheep which doesn't read this much of queued messages is removed */
+#define SPH_MAX_QUEUED_BYTES	(256 * 1024 * 1024)
+
 enum shepherd_state {
 	SPH_STATE_DEFAULT,
 	SPH_STATE_JOINING,
@@ -58,9 +66,36 @@ struct sheep {
 
 	struct list_node sheep_list;
 	struct list_node join_wait_list;
+
+	/* messages which are not sent to this sheep yet */
+	struct list_head out_queue;
+	/* bytes of the first message in out_queue which are already sent */
+	size_t out_offset;
+	size_t out_bytes;
+	/* linked to flush_list_head while out_queue has new messages */
+	struct list_node flush_list;
+	/* out_queue is waiting for EPOLLOUT */
+	bool out_polling;
+};
+
+/*
+ * A message from shepherd.  The same buffer is queued to all the sheep
+ * which it is fanned out to.
+ */
+struct sph_out_msg {
+	refcnt_t refcnt;
+	size_t len;
+	struct sph_msg hdr;
+	uint8_t body[0];
+};
+
+struct sph_out_entry {
+	struct list_node list;
+	struct sph_out_msg *msg;
 };
 
 static LIST_HEAD(sheep_list_head);
+static LIST_HEAD(flush_list_head);
 
 static bool running;
 static const char *progname;
@@ -112,37 +147,184 @@ static inline void remove_sheep(struct sheep *sheep)
 	event_force_refresh();
 }
 
-static int notify_remove_sheep(struct sheep *leaving)
+static struct sph_out_msg *alloc_out_msg(uint32_t type, size_t body_len)
 {
-	int ret, failed = 0;
-	struct sheep *s;
-	struct sph_msg snd;
+	struct sph_out_msg *msg = xzalloc(sizeof(*msg) + body_len);
 
-	snd.type = SPH_SRV_MSG_REMOVE;
-	snd.body_len = sizeof(struct sd_node);
+	refcount_set(&msg->refcnt, 1);
+	msg->len = sizeof(msg->hdr) + body_len;
+	msg->hdr.type = type;
+	msg->hdr.body_len = body_len;
+
+	return msg;
+}
+
+static void put_out_msg(struct sph_out_msg *msg)
+{
+	if (refcount_dec(&msg->refcnt) == 0)
+		free(msg);
+}
+
+/*
+ * Queue 'msg' to 'sheep'.  The queued messages are sent by
+ * flush_sheep_queues() after the current events are processed, so the
+ * messages to the same sheep are sent together.
+ */
+static void queue_out_msg(struct sheep *sheep, struct sph_out_msg *msg)
+{
+	struct sph_out_entry *entry;
+
+	if (sheep->state == SHEEP_STATE_LEAVING)
+		return;
+
+	if (sheep->out_bytes + msg->len > SPH_MAX_QUEUED_BYTES) {
+		sd_err("too many messages are queued to %s",
+		       node_to_str(&sheep->node));
+		remove_sheep(sheep);
+		return;
+	}
+
+	entry = xmalloc(sizeof(*entry));
+	refcount_inc(&msg->refcnt);
+	entry->msg = msg;
+	list_add_tail(&entry->list, &sheep->out_queue);
+	sheep->out_bytes += msg->len;
+
+	if (!list_linked(&sheep->flush_list))
+		list_add_tail(&sheep->flush_list, &flush_list_head);
+}
+
+static void send_msg_to_sheep(struct sheep *sheep, uint32_t type,
+			      const void *body, size_t body_len)
+{
+	struct sph_out_msg *msg = alloc_out_msg(type, body_len);
+
+	if (body_len)
+		memcpy(msg->body, body, body_len);
+	queue_out_msg(sheep, msg);
+	put_out_msg(msg);
+}
+
+/* Queue 'msg' to all the joined sheep except 'except' */
+static void broadcast_out_msg(struct sph_out_msg *msg, struct sheep *except)
+{
+	struct sheep *s;
 
 	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		if (s->state != SHEEP_STATE_JOINED)
+		if (s->state != SHEEP_STATE_JOINED || s == except)
 			continue;
 
-		ret = writev2(s->fd, &snd,
-			&leaving->node, sizeof(struct sd_node));
+		queue_out_msg(s, msg);
+	}
+}
+
+static void free_out_queue(struct sheep *sheep)
+{
+	struct sph_out_entry *entry;
+
+	list_for_each_entry(entry, &sheep->out_queue, list) {
+		list_del(&entry->list);
+		put_out_msg(entry->msg);
+		free(entry);
+	}
+	sheep->out_offset = 0;
+	sheep->out_bytes = 0;
+
+	if (list_linked(&sheep->flush_list))
+		list_del(&sheep->flush_list);
+}
+
+/*
+ * Send as many queued messages as the socket accepts without blocking, up
+ * to SPH_WRITE_BATCH messages in one sendmsg().  If the socket is full, the
+ * rest is sent when EPOLLOUT comes.
+ */
+static void flush_sheep(struct sheep *sheep)
+{
+	struct iovec iov[SPH_WRITE_BATCH];
+	struct msghdr mh = { .msg_iov = iov };
+	struct sph_out_entry *entry;
+	ssize_t ret;
+
+	while (!list_empty(&sheep->out_queue)) {
+		size_t offset = sheep->out_offset;
+		int nr = 0;
+
+		list_for_each_entry(entry, &sheep->out_queue, list) {
+			iov[nr].iov_base = (char *)&entry->msg->hdr + offset;
+			iov[nr].iov_len = entry->msg->len - offset;
+			offset = 0;
+			if (++nr == SPH_WRITE_BATCH)
+				break;
+		}
+		mh.msg_iovlen = nr;
+
+		ret = sendmsg(sheep->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				goto wait_out;
+
+			sd_err("sendmsg() failed: %m");
+			remove_sheep(sheep);
+			return;
+		}
+
+		sheep->out_bytes -= ret;
+		list_for_each_entry(entry, &sheep->out_queue, list) {
+			size_t rest = entry->msg->len - sheep->out_offset;
 
-		if (sizeof(snd) + sizeof(struct sd_node) != ret) {
-			sd_err("writev2() failed: %m");
+			if (ret < rest) {
+				sheep->out_offset += ret;
+				break;
+			}
 
-			remove_sheep(s);
-			failed++;
+			ret -= rest;
+			sheep->out_offset = 0;
+			list_del(&entry->list);
+			put_out_msg(entry->msg);
+			free(entry);
 		}
 	}
 
-	return failed;
+	if (sheep->out_polling) {
+		modify_event(sheep->fd, EPOLLIN);
+		sheep->out_polling = false;
+	}
+	return;
+wait_out:
+	if (!sheep->out_polling) {
+		modify_event(sheep->fd, EPOLLIN | EPOLLOUT);
+		sheep->out_polling = true;
+	}
+}
+
+static void flush_sheep_queues(void)
+{
+	struct sheep *s;
+
+	list_for_each_entry(s, &flush_list_head, flush_list) {
+		list_del(&s->flush_list);
+		if (s->state != SHEEP_STATE_LEAVING && !s->out_polling)
+			flush_sheep(s);
+	}
+}
+
+static void notify_remove_sheep(struct sheep *leaving)
+{
+	struct sph_out_msg *msg;
+
+	msg = alloc_out_msg(SPH_SRV_MSG_REMOVE, sizeof(struct sd_node));
+	memcpy(msg->body, &leaving->node, sizeof(struct sd_node));
+	broadcast_out_msg(msg, NULL);
+	put_out_msg(msg);
 }
 
 static void remove_handler(int fd, int events, void *data)
 {
 	struct sheep *s;
-	int nr_removed, failed = 0;
+	int nr_removed;
 
 	nr_removed = eventfd_xread(remove_efd);
 
@@ -180,58 +362,48 @@ del:
 	close(s->fd);
 
 	list_del(&s->sheep_list);
-	list_del(&s->join_wait_list);
+	if (list_linked(&s->join_wait_list))
+		list_del(&s->join_wait_list);
+	free_out_queue(s);
 	free(s);
 
 	if (--nr_removed)
 		goto remove;
 
 end:
-	sd_debug("nodes which failed during remove_handler(): %d", failed);
+	flush_sheep_queues();
 }
 
 static LIST_HEAD(join_wait_queue);
 
-static int release_joining_sheep(void)
+static void release_joining_sheep(void)
 {
-	ssize_t wbytes;
 	struct sheep *waiting;
-	struct sph_msg snd;
-	int nr_failed = 0;
-
-retry:
-	if (list_empty(&join_wait_queue))
-		return nr_failed;
-
-	waiting = list_first_entry(&join_wait_queue,
-				struct sheep, join_wait_list);
-	list_del(&waiting->join_wait_list);
-
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_JOIN_RETRY;
 
-	wbytes = xwrite(waiting->fd, &snd, sizeof(snd));
-	if (sizeof(snd) != wbytes) {
-		sd_err("xwrite() failed: %m");
-		remove_sheep(waiting);
+	while (!list_empty(&join_wait_queue)) {
+		waiting = list_first_entry(&join_wait_queue,
+					   struct sheep, join_wait_list);
+		list_del(&waiting->join_wait_list);
 
-		sd_info("node %s is failed to join",
-			node_to_str(&waiting->node));
-		nr_failed++;
+		if (waiting->state == SHEEP_STATE_LEAVING) {
+			sd_info("node %s is failed to join",
+				node_to_str(&waiting->node));
+			continue;
+		}
 
-		goto retry;
+		send_msg_to_sheep(waiting, SPH_SRV_MSG_JOIN_RETRY, NULL, 0);
+		return;
 	}
-
-	return nr_failed;
 }
 
 static void sph_handle_join(struct sph_msg *msg, struct sheep *sheep)
 {
 	int fd = sheep->fd;
-	ssize_t rbytes, wbytes;
+	ssize_t rbytes;
 
-	struct sph_msg snd;
+	struct sph_out_msg *snd;
 	struct sph_msg_join *join;
+	struct sheep *master = sheep;
 
 	if (state == SPH_STATE_JOINING) {
 		/* we have to trash opaque from the sheep */
@@ -240,6 +412,7 @@ static void sph_handle_join(struct sph_msg *msg, struct sheep *sheep)
 		rbytes = xread(fd, buf, msg->body_len);
 		if (rbytes != msg->body_len) {
 			sd_err("xread() failed: %m");
+			free(buf);
 			goto purge_current_sheep;
 		}
 		free(buf);
@@ -250,34 +423,27 @@ static void sph_handle_join(struct sph_msg *msg, struct sheep *sheep)
 		return;
 	}
 
-	join = xzalloc(msg->body_len);
+	/* the join message is forwarded as is to the elected node */
+	snd = alloc_out_msg(SPH_SRV_MSG_NEW_NODE, msg->body_len);
+	join = (struct sph_msg_join *)snd->body;
 	rbytes = xread(fd, join, msg->body_len);
 	if (msg->body_len != rbytes) {
 		sd_err("xread() failed: %m");
-		free(join);
+		put_out_msg(snd);
 		goto purge_current_sheep;
 	}
 
 	sheep->node = join->new_node;
 	join->nr_nodes = build_node_array(join->nodes);
 
-	snd.type = SPH_SRV_MSG_NEW_NODE;
-	snd.body_len = msg->body_len;
-
 	/* elect one node from the already joined nodes */
 	if (join->nr_nodes > 0) {
 		struct sd_node *n = join->nodes + rand() % join->nr_nodes;
-		fd = find_sheep_by_nid(&n->nid)->fd;
+		master = find_sheep_by_nid(&n->nid);
 	}
 
-	wbytes = writev2(fd, &snd, join, msg->body_len);
-	free(join);
-
-	if (sizeof(snd) + msg->body_len != wbytes) {
-		sd_err("writev2() failed: %m");
-
-		goto purge_current_sheep;
-	}
+	queue_out_msg(master, snd);
+	put_out_msg(snd);
 
 	state = SPH_STATE_JOINING;
 	return;
@@ -288,15 +454,14 @@ purge_current_sheep:
 
 static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 {
-	int fd = sheep->fd, removed = 0;
-	ssize_t rbytes, wbytes;
+	int fd = sheep->fd;
+	ssize_t rbytes;
 
-	char *opaque;
 	int opaque_len;
 
 	struct sph_msg_join *join;
-	struct sheep *s, *joining_sheep;
-	struct sph_msg snd;
+	struct sheep *joining_sheep;
+	struct sph_out_msg *snd;
 	struct sph_msg_join_reply *join_reply_body;
 	struct sph_msg_join_node_finish *join_node_finish;
 
@@ -317,15 +482,11 @@ static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 	assert(joining_sheep != NULL);
 
 	opaque_len = msg->body_len - sizeof(struct sph_msg_join);
-	opaque = xzalloc(opaque_len);
-	memcpy(opaque, join->opaque, opaque_len);
-
 	sd_debug("length of opaque: %d", opaque_len);
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_JOIN_REPLY;
-	snd.body_len = sizeof(struct sph_msg_join_reply) + opaque_len;
 
-	join_reply_body = xzalloc(snd.body_len);
+	snd = alloc_out_msg(SPH_SRV_MSG_JOIN_REPLY,
+			    sizeof(*join_reply_body) + opaque_len);
+	join_reply_body = (struct sph_msg_join_reply *)snd->body;
 
 	join_reply_body->nr_nodes = build_node_array(join_reply_body->nodes);
 	/*
@@ -334,53 +495,30 @@ static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 	 */
 	join_reply_body->nodes[join_reply_body->nr_nodes++] =
 		joining_sheep->node;
-	memcpy(join_reply_body->opaque, opaque, opaque_len);
-
-	wbytes = writev2(joining_sheep->fd, &snd,
-			join_reply_body, snd.body_len);
-	free(join_reply_body);
-	free(join);
+	memcpy(join_reply_body->opaque, join->opaque, opaque_len);
 
-	if (sizeof(snd) + snd.body_len != wbytes) {
-		sd_err("writev2() to master failed: %m");
+	queue_out_msg(joining_sheep, snd);
+	put_out_msg(snd);
 
-		goto purge_current_sheep;
-	}
+	snd = alloc_out_msg(SPH_SRV_MSG_NEW_NODE_FINISH,
+			    sizeof(*join_node_finish) + opaque_len);
+	join_node_finish = (struct sph_msg_join_node_finish *)snd->body;
 
-	snd.type = SPH_SRV_MSG_NEW_NODE_FINISH;
-	snd.body_len = sizeof(*join_node_finish) + opaque_len;
-
-	join_node_finish = xzalloc(snd.body_len);
 	join_node_finish->new_node = joining_sheep->node;
-	memcpy(join_node_finish->opaque, opaque, opaque_len);
+	memcpy(join_node_finish->opaque, join->opaque, opaque_len);
 	join_node_finish->nr_nodes = build_node_array(join_node_finish->nodes);
 	join_node_finish->nodes[join_node_finish->nr_nodes++] =
 		joining_sheep->node;
 
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		if (s == joining_sheep)
-			continue;
-
-		wbytes = writev2(s->fd, &snd, join_node_finish, snd.body_len);
-
-		if (sizeof(snd) + snd.body_len != wbytes) {
-			sd_err("writev2() failed: %m");
-			remove_sheep(s);
-			removed++;
-		}
-	}
-
-	free(join_node_finish);
-	free(opaque);
+	broadcast_out_msg(snd, joining_sheep);
+	put_out_msg(snd);
+	free(join);
 
 	joining_sheep->state = SHEEP_STATE_JOINED;
 
 	state = SPH_STATE_DEFAULT;
 
-	removed += release_joining_sheep();
+	release_joining_sheep();
 	return;
 
 purge_current_sheep:
@@ -391,53 +529,35 @@ purge_current_sheep:
 
 static void sph_handle_notify(struct sph_msg *msg, struct sheep *sheep)
 {
-	ssize_t rbytes, wbytes;
-	int fd = sheep->fd, removed = 0;
+	ssize_t rbytes;
+	int fd = sheep->fd;
 
-	struct sph_msg snd;
+	struct sph_out_msg *snd;
 	struct sph_msg_notify *notify;
 	int notify_msg_len;
 	struct sph_msg_notify_forward *notify_forward;
-	struct sheep *s;
 
 	notify = xzalloc(msg->body_len);
 	rbytes = xread(fd, notify, msg->body_len);
 	if (rbytes != msg->body_len) {
 		sd_err("xread() failed: %m");
+		free(notify);
 		goto purge_current_sheep;
 	}
 
-	notify_forward = xzalloc(msg->body_len + sizeof(*notify_forward));
 	notify_msg_len = msg->body_len - sizeof(*notify);
+	snd = alloc_out_msg(SPH_SRV_MSG_NOTIFY_FORWARD,
+			    notify_msg_len + sizeof(*notify_forward));
+	notify_forward = (struct sph_msg_notify_forward *)snd->body;
 
 	memcpy(notify_forward->notify_msg, notify->notify_msg, notify_msg_len);
 	notify_forward->unblock = notify->unblock;
 	free(notify);
 
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_NOTIFY_FORWARD;
-	snd.body_len = notify_msg_len + sizeof(*notify_forward);
-
 	notify_forward->from_node = sheep->node;
 
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		wbytes = writev2(s->fd, &snd, notify_forward, snd.body_len);
-		if (sizeof(snd) + snd.body_len != wbytes) {
-			sd_err("writev2() failed: %m");
-			goto notify_failed;
-		}
-
-		continue;
-
-notify_failed:
-		remove_sheep(s);
-		removed++;
-	}
-
-	free(notify_forward);
+	broadcast_out_msg(snd, NULL);
+	put_out_msg(snd);
 	return;
 
 purge_current_sheep:
@@ -446,66 +566,26 @@ purge_current_sheep:
 
 static void sph_handle_block(struct sph_msg *msg, struct sheep *sheep)
 {
-	int removed = 0;
-	struct sheep *s;
-	struct sph_msg snd;
-
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_BLOCK_FORWARD;
-	snd.body_len = sizeof(struct sd_node);
-
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		ssize_t wbytes;
-
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		wbytes = writev2(s->fd, &snd,
-				&sheep->node, sizeof(struct sd_node));
-		if (sizeof(snd) + sizeof(struct sd_node) != wbytes) {
-			sd_err("writev2() failed: %m");
-			goto block_failed;
-		}
+	struct sph_out_msg *snd;
 
-		continue;
-
-block_failed:	/* FIXME: is this correct behaviour? */
-		remove_sheep(s);
-		removed++;
-	}
+	snd = alloc_out_msg(SPH_SRV_MSG_BLOCK_FORWARD, sizeof(struct sd_node));
+	memcpy(snd->body, &sheep->node, sizeof(struct sd_node));
 
-	return;
+	broadcast_out_msg(snd, NULL);
+	put_out_msg(snd);
 }
 
 static void sph_handle_leave(struct sph_msg *msg, struct sheep *sheep)
 {
-	struct sheep *s;
-	struct sph_msg snd;
+	struct sph_out_msg *snd;
 
 	sd_info("%s is leaving", node_to_str(&sheep->node));
 
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_LEAVE_FORWARD;
-	snd.body_len = sizeof(struct sd_node);
-
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		ssize_t wbytes;
+	snd = alloc_out_msg(SPH_SRV_MSG_LEAVE_FORWARD, sizeof(struct sd_node));
+	memcpy(snd->body, &sheep->node, sizeof(struct sd_node));
 
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		wbytes = writev2(s->fd, &snd,
-				&sheep->node, sizeof(struct sd_node));
-		if (sizeof(snd) + sizeof(struct sd_node) != wbytes) {
-			sd_err("writev2() failed: %m");
-			goto fwd_leave_failed;
-		}
-
-		continue;
-
-fwd_leave_failed:
-		remove_sheep(s);
-	}
+	broadcast_out_msg(snd, NULL);
+	put_out_msg(snd);
 }
 
 static void (*msg_handlers[])(struct sph_msg*, struct sheep *) = {
@@ -547,14 +627,35 @@ remove:
 	remove_sheep(sheep);
 }
 
+static bool sheep_has_msg(struct sheep *sheep)
+{
+	struct sph_msg hdr;
+
+	return recv(sheep->fd, &hdr, sizeof(hdr), MSG_PEEK | MSG_DONTWAIT) ==
+		sizeof(hdr);
+}
+
 static void sheep_comm_handler(int fd, int events, void *data)
 {
-	if (events & EPOLLIN)
-		read_msg_from_sheep(data);
-	else if (events & EPOLLHUP || events & EPOLLERR) {
-		sd_err("epoll() error: %s",
-		       node_to_str(&((struct sheep *)data)->node));
-		remove_sheep(data);
+	struct sheep *sheep = data;
+	int nr = 0;
+
+	if (sheep->state == SHEEP_STATE_LEAVING)
+		return;
+
+	if (events & EPOLLOUT)
+		flush_sheep(sheep);
+
+	if (events & EPOLLIN) {
+		/* process the messages which have already arrived together */
+		do {
+			read_msg_from_sheep(sheep);
+		} while (++nr < SPH_READ_BATCH &&
+			 sheep->state != SHEEP_STATE_LEAVING &&
+			 sheep_has_msg(sheep));
+	} else if (events & EPOLLHUP || events & EPOLLERR) {
+		sd_err("epoll() error: %s", node_to_str(&sheep->node));
+		remove_sheep(sheep);
 	}
 }
 
@@ -565,6 +666,7 @@ static void sheep_accept_handler(int fd, int events, void *data)
 	socklen_t len;
 
 	new_sheep = xzalloc(sizeof(struct sheep));
+	INIT_LIST_HEAD(&new_sheep->out_queue);
 
 	len = sizeof(struct sockaddr_in);
 	new_sheep->fd = accept(fd, (struct sockaddr *)&new_sheep->addr, &len);
@@ -744,8 +846,15 @@ int main(int argc, char **argv)
 
 	running = true;
 
-	while (running)
+	/*
+	 * The messages queued while processing the events of one epoll_wait()
+	 * are sent together.  remove_handler() flushes them too, because the
+	 * event loop restarts epoll_wait() after remove_sheep().
+	 */
+	while (running) {
 		event_loop_prio(-1);
+		flush_sheep_queues();
+	}
 
 	return 0;
 }
@@ -24,6 +24,8 @@ bool highlight = true;
 bool raw_output;
 struct rb_root sd_vroot = RB_ROOT;
 struct rb_root sd_nroot = RB_ROOT;
+uint32_t sd_epoch;
+int sd_nodes_nr;
 
 MOCK_METHOD(update_node_list, int, 0, int max_nodes)
 MOCK_VOID_METHOD(subcommand_usage, char *cmd, char *subcmd, int status)
@@ -0,0 +1,445 @@
+#include <check.h>
+
+#include "fec.c"
+
+typedef void (*addmul_func_t)(uint8_t *, const uint8_t *, uint8_t, size_t);
+
+struct addmul_impl {
+	const char *name;
+	addmul_func_t fn;
+	bool usable;
+};
+
+static struct addmul_impl impls[] = {
+	{ "generic", _addmul1, true },
+#ifdef __x86_64__
+	{ "ssse3", addmul_ssse3 },
+	{ "avx2", addmul_avx2 },
+	{ "avx512", addmul_avx512 },
+#endif
+};
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = random();
+}
+
+/* encode stripe by stripe as the gateway used to do */
+static void encode_per_stripe(struct fec *ctx, const uint8_t *buf,
+			      uint8_t *ds[], uint8_t *ps[], int nr_stripe,
+			      uint32_t stripe_size)
+{
+	int d = ctx->d, p = ctx->dp - ctx->d;
+	size_t strip_size = stripe_size / d;
+	int pidx[p];
+
+	for (int i = 0; i < p; i++)
+		pidx[i] = d + i;
+
+	for (int i = 0; i < nr_stripe; i++) {
+		const uint8_t *sds[d];
+		uint8_t *sps[p];
+
+		for (int j = 0; j < d; j++) {
+			sds[j] = ds[j] + strip_size * i;
+			memcpy(ds[j] + strip_size * i, buf + strip_size * j,
+			       strip_size);
+		}
+		for (int j = 0; j < p; j++)
+			sps[j] = ps[j] + strip_size * i;
+		fec_encode(ctx, sds, sps, pidx, p, strip_size);
+		buf += stripe_size;
+	}
+}
+
+static const int stripe_policies[][2] = { {2, 1}, {4, 2}, {8, 3}, {16, 4} };
+
+/*
+ * encode one object with both ec_encode_stripes() and encode_per_stripe(),
+ * and check that they give the same strips
+ */
+static void encode_object(int d, int p, uint8_t stripe_shift)
+{
+	uint32_t stripe_size = ec_stripe_size(stripe_shift);
+	int nr_stripe = SD_DATA_OBJ_SIZE / stripe_size;
+	size_t strip_len = SD_DATA_OBJ_SIZE / d;
+	struct fec *ctx = ec_init(d, d + p);
+	uint8_t *buf = xvalloc(SD_DATA_OBJ_SIZE);
+	uint8_t *ds1[d], *ps1[p], *ds2[d], *ps2[p];
+
+	fill_random(buf, SD_DATA_OBJ_SIZE);
+	for (int i = 0; i < d; i++) {
+		ds1[i] = xvalloc(strip_len);
+		ds2[i] = xvalloc(strip_len);
+	}
+	for (int i = 0; i < p; i++) {
+		ps1[i] = xvalloc(strip_len);
+		ps2[i] = xvalloc(strip_len);
+	}
+
+	encode_per_stripe(ctx, buf, ds2, ps2, nr_stripe, stripe_size);
+	ec_encode_stripes(ctx, buf, ds1, ps1, nr_stripe, stripe_size);
+
+	for (int i = 0; i < d; i++) {
+		ck_assert(memcmp(ds1[i], ds2[i], strip_len) == 0);
+		free(ds1[i]);
+		free(ds2[i]);
+	}
+	for (int i = 0; i < p; i++) {
+		ck_assert(memcmp(ps1[i], ps2[i], strip_len) == 0);
+		free(ps1[i]);
+		free(ps2[i]);
+	}
+	free(buf);
+	ec_destroy(ctx);
+}
+
+static void setup(void)
+{
+	init_fec();
+#ifdef __x86_64__
+	impls[1].usable = cpu_has_ssse3;
+	impls[2].usable = cpu_has_avx2 &&
+		xstate_enabled(XSTATE_SSE | XSTATE_YMM);
+	impls[3].usable = cpu_has_avx512f && cpu_has_avx512bw &&
+		xstate_enabled(XSTATE_SSE | XSTATE_YMM | XSTATE_OPMASK |
+			       XSTATE_ZMM_Hi256 | XSTATE_Hi16_ZMM);
+#endif
+}
+
+/*
+ * check that every SIMD kernel gives the same result as the generic one for
+ * all the constants, with unaligned buffers and lengths which are not a
+ * multiple of the vector width
+ */
+START_TEST(test_addmul)
+{
+	static const size_t sizes[] = { 1, 15, 16, 17, 31, 33, 63, 64, 65,
+					127, 200, 4096, 4096 + 77 };
+	uint8_t src[8192], dst[8192], expect[8192];
+
+	for (int i = 1; i < ARRAY_SIZE(impls); i++) {
+		if (!impls[i].usable)
+			continue;
+
+		for (int c = 0; c < 256; c++) {
+			for (int j = 0; j < ARRAY_SIZE(sizes); j++) {
+				size_t off = (c + j) % 7, sz = sizes[j];
+
+				fill_random(src, sizeof(src));
+				fill_random(dst, sizeof(dst));
+				memcpy(expect, dst, sizeof(dst));
+
+				_addmul1(expect + off, src + off, c, sz);
+				impls[i].fn(dst + off, src + off, c, sz);
+				ck_assert_msg(memcmp(dst, expect,
+						     sizeof(dst)) == 0,
+					      "%s: c %d, size %zu",
+					      impls[i].name, c, sz);
+			}
+		}
+	}
+}
+END_TEST
+
+/*
+ * check that the parity strips and the decoded strips are bit-exact with
+ * the generic implementation for all the supported policies
+ */
+START_TEST(test_encode_decode)
+{
+	static const int policies[][2] = { {2, 1}, {4, 2}, {8, 4}, {16, 15} };
+
+	for (int k = 0; k < ARRAY_SIZE(policies); k++) {
+		int d = policies[k][0], p = policies[k][1], dp = d + p;
+		size_t strip_size = SD_EC_DATA_STRIPE_SIZE / d;
+		struct fec *ctx = ec_init(d, dp);
+		uint8_t *ds[d], *ps[p], *expect[p], *in[d], out[strip_size];
+		int in_idx[d];
+
+		for (int i = 0; i < d; i++) {
+			ds[i] = xmalloc(strip_size);
+			fill_random(ds[i], strip_size);
+		}
+		for (int i = 0; i < p; i++) {
+			ps[i] = xmalloc(strip_size);
+			expect[i] = xmalloc(strip_size);
+		}
+
+		addmul_fn = _addmul1;
+		ec_encode(ctx, (const uint8_t **)ds, expect);
+		select_addmul();
+		ec_encode(ctx, (const uint8_t **)ds, ps);
+		for (int i = 0; i < p; i++)
+			ck_assert(memcmp(ps[i], expect[i], strip_size) == 0);
+
+		/* lose the first min(d, p) data strips and recover them */
+		for (int i = 0; i < d; i++)
+			in_idx[i] = i + min(d, p);
+		for (int i = 0; i < d; i++)
+			in[i] = in_idx[i] < d ? ds[in_idx[i]] :
+				ps[in_idx[i] - d];
+		for (int i = 0; i < d && i < p; i++) {
+			ec_decode(ctx, (const uint8_t **)in, in_idx, out, i);
+			ck_assert(memcmp(out, ds[i], strip_size) == 0);
+		}
+
+		for (int i = 0; i < d; i++)
+			free(ds[i]);
+		for (int i = 0; i < p; i++) {
+			free(ps[i]);
+			free(expect[i]);
+		}
+		ec_destroy(ctx);
+	}
+}
+END_TEST
+
+/*
+ * check that the decode matrices from the LRU are the same as the ones built
+ * from scratch, while the available strips keep changing
+ */
+START_TEST(test_decode_matrix_cache)
+{
+	int d = 8, dp = 12;
+	struct fec *ctx = ec_init(d, dp);
+	uint8_t m1[d * d], m2[d * d];
+	int idx[d];
+
+	ck_assert(ec_init(d, dp) == ctx);
+
+	for (int round = 0; round < 2000; round++) {
+		/* lose a random data strip and use the first parity strip */
+		int lost = random() % d;
+
+		for (int i = 0; i < d; i++)
+			idx[i] = i == lost ? d + round % (dp - d) : i;
+
+		get_decode_matrix(ctx, idx, m1);
+		build_decode_matrix_into_space(ctx, idx, d, m2);
+		ck_assert(memcmp(m1, m2, sizeof(m1)) == 0);
+		ck_assert_int_le(ctx->dec_cache->nr, MAX_DEC_MATRIX);
+	}
+	ec_destroy(ctx);
+}
+END_TEST
+
+/*
+ * check that ec_encode_stripes() gives the same strips as encoding stripe by
+ * stripe, for strips both shorter and longer than EC_ENCODE_LEN
+ */
+START_TEST(test_encode_stripes)
+{
+	static const uint8_t shifts[] = { 0, 3, 6, SD_EC_MAX_STRIPE_SHIFT };
+
+	for (int k = 0; k < ARRAY_SIZE(stripe_policies); k++)
+		for (int i = 0; i < ARRAY_SIZE(shifts); i++)
+			encode_object(stripe_policies[k][0],
+				      stripe_policies[k][1], shifts[i]);
+}
+END_TEST
+
+/*
+ * check that ec_decode_buffer() rebuilds a range of the lost strips from the
+ * same range of the others, as the gateway does for degraded reads
+ */
+START_TEST(test_decode_range)
+{
+	int d = 4, p = 2, dp = d + p;
+	uint32_t stripe_size = ec_stripe_size(2);
+	size_t strip_len = SD_DATA_OBJ_SIZE / d, strip_size = stripe_size / d;
+	int nr_stripe = SD_DATA_OBJ_SIZE / stripe_size;
+	struct fec *ctx = ec_init(d, dp);
+	uint8_t *buf = xvalloc(SD_DATA_OBJ_SIZE), *strips[dp];
+	char *out = xmalloc(strip_len);
+
+	fill_random(buf, SD_DATA_OBJ_SIZE);
+	for (int i = 0; i < dp; i++)
+		strips[i] = xvalloc(strip_len);
+	ec_encode_stripes(ctx, buf, strips, strips + d, nr_stripe,
+			  stripe_size);
+
+	for (int round = 0; round < 16; round++) {
+		size_t off = strip_size * (random() % nr_stripe);
+		size_t len = strip_size * (random() % 8 + 1);
+		int lost = random() % d, nr = 0, in_idx[d];
+		uint8_t *in[d];
+
+		len = min(len, strip_len - off);
+		for (int i = 0; i < dp && nr < d; i++) {
+			if (i == lost || i == (lost + 1) % d)
+				continue;
+			in[nr] = strips[i] + off;
+			in_idx[nr++] = i;
+		}
+		ec_decode_buffer(ctx, in, in_idx, out, lost, len);
+		ck_assert(memcmp(out, strips[lost] + off, len) == 0);
+	}
+
+	for (int i = 0; i < dp; i++)
+		free(strips[i]);
+	free(buf);
+	free(out);
+	ec_destroy(ctx);
+}
+END_TEST
+
+/* check that the parity updated by a delta is the same as re-encoded one */
+START_TEST(test_update_parity)
+{
+	int d = 4, p = 2;
+	size_t strip_size = SD_EC_DATA_STRIPE_SIZE / d;
+	struct fec *ctx = ec_init(d, d + p);
+	uint8_t *ds[d], *ps[p], *expect[p], *pp[p];
+	uint8_t delta[strip_size];
+
+	for (int i = 0; i < d; i++) {
+		ds[i] = xmalloc(strip_size);
+		fill_random(ds[i], strip_size);
+	}
+	for (int i = 0; i < p; i++) {
+		ps[i] = xmalloc(strip_size);
+		expect[i] = xmalloc(strip_size);
+	}
+	ec_encode(ctx, (const uint8_t **)ds, ps);
+
+	for (int round = 0; round < 100; round++) {
+		int idx = random() % d, off = random() % strip_size;
+		int len = random() % (strip_size - off) + 1;
+
+		for (int i = 0; i < len; i++) {
+			uint8_t new = random();
+
+			delta[i] = ds[idx][off + i] ^ new;
+			ds[idx][off + i] = new;
+		}
+		for (int i = 0; i < p; i++)
+			pp[i] = ps[i] + off;
+		ec_update_parity(ctx, idx, delta, pp, len);
+
+		ec_encode(ctx, (const uint8_t **)ds, expect);
+		for (int i = 0; i < p; i++)
+			ck_assert(memcmp(ps[i], expect[i], strip_size) == 0);
+	}
+
+	for (int i = 0; i < d; i++)
+		free(ds[i]);
+	for (int i = 0; i < p; i++) {
+		free(ps[i]);
+		free(expect[i]);
+	}
+	ec_destroy(ctx);
+}
+END_TEST
+
+/*
+ * check that LRC rebuilds the lost strips from the ones picked by
+ * ec_pick_strips() for all the patterns of up to r + 1 lost strips, and a
+ * single lost strip from its local group
+ */
+START_TEST(test_lrc)
+{
+	static const int policies[][3] = { {4, 2, 1}, {8, 2, 2}, {16, 4, 2} };
+
+	for (int k = 0; k < ARRAY_SIZE(policies); k++) {
+		int d = policies[k][0], l = policies[k][1], r = policies[k][2];
+		int dp = d + l + r, group[SD_EC_MAX_STRIP];
+		uint8_t policy = lrc_dlr_to_policy(d, l, r);
+		size_t strip_size = SD_EC_DATA_STRIPE_SIZE / d;
+		struct fec *ctx = ec_init_policy(policy);
+		uint8_t *strips[dp], out[strip_size];
+
+		ck_assert(ec_policy_is_lrc(policy));
+		ck_assert_int_eq(ec_policy_to_dp(policy, NULL, NULL), dp);
+		ck_assert(ec_init_policy(policy) == ctx);
+
+		for (int i = 0; i < dp; i++)
+			strips[i] = xmalloc(strip_size);
+		for (int i = 0; i < d; i++)
+			fill_random(strips[i], strip_size);
+		ec_encode(ctx, (const uint8_t **)strips, strips + d);
+
+		for (int i = 0; i < d + l; i++) {
+			const uint8_t *in[SD_EC_MAX_STRIP];
+			int nr = ec_local_group(ctx, i, group);
+
+			ck_assert_int_eq(nr, d / l);
+			for (int j = 0; j < nr; j++)
+				in[j] = strips[group[j]];
+			ec_local_decode(in, nr, out, strip_size);
+			ck_assert(memcmp(out, strips[i], strip_size) == 0);
+		}
+		ck_assert_int_eq(ec_local_group(ctx, dp - 1, group), 0);
+
+		for (uint32_t lost = 1; lost < (1U << dp); lost++) {
+			int nr_lost = __builtin_popcount(lost), idx[d];
+			const uint8_t *in[d];
+			bool avail[dp];
+
+			if (nr_lost > r + 1)
+				continue;
+			for (int i = 0; i < dp; i++)
+				avail[i] = !(lost & (1U << i));
+			if (!ec_pick_strips(ctx, avail, idx)) {
+				/* any r lost strips can be rebuilt */
+				ck_assert_int_gt(nr_lost, r);
+				continue;
+			}
+
+			for (int i = 0; i < d; i++) {
+				ck_assert(avail[idx[i]]);
+				ck_assert(i == 0 || idx[i - 1] < idx[i]);
+				in[i] = strips[idx[i]];
+			}
+			/* a lost data strip is rebuilt by its local parity */
+			if (nr_lost == 1 && __builtin_ctz(lost) < d)
+				ck_assert_int_eq(idx[d - 1],
+						 d + __builtin_ctz(lost) / (d / l));
+
+			for (int i = 0; i < dp; i++) {
+				if (avail[i])
+					continue;
+				ec_decode(ctx, in, idx, out, i);
+				ck_assert(memcmp(out, strips[i], strip_size) == 0);
+			}
+		}
+
+		for (int i = 0; i < dp; i++)
+			free(strips[i]);
+		ec_destroy(ctx);
+	}
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test fec");
+
+	TCase *tc_simd = tcase_create("simd");
+
+	tcase_add_checked_fixture(tc_simd, setup, NULL);
+
+	tcase_add_test(tc_simd, test_addmul);
+	tcase_add_test(tc_simd, test_encode_decode);
+	tcase_add_test(tc_simd, test_decode_matrix_cache);
+	tcase_add_test(tc_simd, test_encode_stripes);
+	tcase_add_test(tc_simd, test_update_parity);
+	tcase_add_test(tc_simd, test_decode_range);
+	tcase_add_test(tc_simd, test_lrc);
+
+	suite_add_tcase(s, tc_simd);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
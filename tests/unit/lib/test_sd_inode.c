@@ -0,0 +1,325 @@
+#include <check.h>
+
+#include "sd_inode.c"
+
+#define TEST_VID	0x123456
+#define NR_LEAVES	16
+#define MAX_BNODES	64
+/* every other index is allocated, so a half full leaf-node spans 512K */
+#define LEAF_SPAN	(2 * 262144)
+
+struct bnode_store {
+	uint64_t oid;
+	char *buf;
+};
+
+static struct bnode_store store[MAX_BNODES];
+static int nr_stored;
+static uint64_t nr_reads, read_bytes, write_bytes, leaf_bytes;
+static struct sd_inode *inode;
+static uint32_t *expect;
+static uint32_t nr_idx;
+
+static struct bnode_store *find_bnode(uint64_t oid)
+{
+	for (int i = 0; i < nr_stored; i++)
+		if (store[i].oid == oid)
+			return store + i;
+	return NULL;
+}
+
+static int test_writer(uint64_t oid, void *mem, unsigned int len,
+		       uint64_t offset, uint32_t flags, int copies,
+		       int copy_policy, bool create, bool direct)
+{
+	struct bnode_store *b = find_bnode(oid);
+
+	if (!b) {
+		ck_assert(create);
+		ck_assert_int_lt(nr_stored, MAX_BNODES);
+		b = store + nr_stored++;
+		b->oid = oid;
+		b->buf = xzalloc(SD_INODE_DATA_INDEX_SIZE);
+	}
+	ck_assert_int_le(offset + len, SD_INODE_DATA_INDEX_SIZE);
+	memcpy(b->buf + offset, mem, len);
+	write_bytes += len;
+
+	return SD_RES_SUCCESS;
+}
+
+static int test_reader(uint64_t oid, void **mem, unsigned int len,
+		       uint64_t offset)
+{
+	struct bnode_store *b = find_bnode(oid);
+
+	if (!b)
+		return SD_RES_NO_OBJ;
+	ck_assert_int_le(offset + len, SD_INODE_DATA_INDEX_SIZE);
+	memcpy(*mem, b->buf + offset, len);
+	nr_reads++;
+	read_bytes += len;
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Build a hyper volume whose root is an idx-node pointing to NR_LEAVES
+ * leaf-nodes.  The first leaf-node is full and the others are half full.
+ */
+static void setup(void)
+{
+	struct sd_extent_header *root, *leaf;
+	uint32_t idx = 0;
+
+	nr_stored = 0;
+	nr_reads = read_bytes = write_bytes = leaf_bytes = 0;
+	nr_idx = 2 * EXT_MAX_ENTRIES + LEAF_SPAN * (NR_LEAVES - 1);
+	expect = xzalloc(sizeof(*expect) * (nr_idx + LEAF_SPAN));
+	inode = xzalloc(sizeof(*inode));
+	inode->vdi_id = TEST_VID;
+	inode->store_policy = 1;
+	inode->nr_copies = 1;
+
+	root = EXT_HEADER(inode->data_vdi_id);
+	sd_inode_init(root, 2);
+	leaf = xvalloc(SD_INODE_DATA_INDEX_SIZE);
+	for (int i = 0; i < NR_LEAVES; i++) {
+		uint32_t nr = i == 0 ? EXT_MAX_ENTRIES : LEAF_SPAN / 2;
+		uint64_t oid = vid_to_btree_oid(TEST_VID,
+						inode->btree_counter++);
+
+		sd_inode_init(leaf, 2);
+		for (uint32_t j = 0; j < nr; j++, idx += 2) {
+			FIRST_EXT(leaf)[j].idx = idx;
+			FIRST_EXT(leaf)[j].vdi_id = TEST_VID + (idx % 7);
+			expect[idx] = TEST_VID + (idx % 7);
+		}
+		leaf->entries = nr;
+		leaf_bytes += leaf_node_size(leaf);
+		test_writer(oid, leaf, SD_INODE_DATA_INDEX_SIZE, 0, 0, 1, 0,
+			    true, false);
+		insert_idx_entry(root, idx - 2, oid);
+	}
+	free(leaf);
+}
+
+static void teardown(void)
+{
+	/* the tests may run in one process, so drop the cached leaf-nodes */
+	sd_inode_set_cache_size(0);
+	sd_inode_set_cache_size(DEFAULT_BNODE_CACHE_SIZE);
+	for (int i = 0; i < nr_stored; i++)
+		free(store[i].buf);
+	free(expect);
+	free(inode);
+}
+
+static uint32_t get_vid(uint32_t idx)
+{
+	return sd_inode_get_vid(test_reader, inode, idx);
+}
+
+struct check_arg {
+	uint32_t *vids;
+	int64_t prev, bound;
+};
+
+static void check_cb(void *data, enum btree_node_type type, void *arg)
+{
+	struct check_arg *carg = arg;
+	struct sd_extent *ext = data;
+
+	switch (type) {
+	case BTREE_IDX:
+		carg->bound = ((struct sd_extent_idx *)data)->idx;
+		break;
+	case BTREE_EXT:
+		ck_assert_int_gt(ext->idx, carg->prev);
+		ck_assert_int_le(ext->idx, carg->bound);
+		carg->vids[ext->idx] = ext->vdi_id;
+		carg->prev = ext->idx;
+		break;
+	default:
+		break;
+	}
+}
+
+/* check the B-tree in the store has the expected entries in order */
+static void check_btree(void)
+{
+	size_t size = sizeof(*expect) * (nr_idx + LEAF_SPAN);
+	struct check_arg arg = { xzalloc(size), -1, 0 };
+
+	traverse_btree(test_reader, inode, check_cb, &arg);
+	ck_assert(memcmp(arg.vids, expect, size) == 0);
+	free(arg.vids);
+}
+
+/*
+ * check that random lookups, including the holes between the allocated
+ * indexes, read each page of the leaf-nodes only once
+ */
+START_TEST(test_lookup)
+{
+	for (int i = 0; i < 100000; i++) {
+		uint32_t idx = random() % (nr_idx + LEAF_SPAN);
+
+		ck_assert_int_eq(get_vid(idx), expect[idx]);
+	}
+	for (uint32_t idx = 0; idx < nr_idx + LEAF_SPAN; idx++)
+		ck_assert_int_eq(get_vid(idx), expect[idx]);
+	/* a hit reads the header and a page again to check the cached node */
+	ck_assert_int_le(read_bytes, leaf_bytes + NR_LEAVES * BNODE_PAGE_SIZE +
+			 (100000ULL + nr_idx + LEAF_SPAN) *
+			 (BNODE_PAGE_SIZE + sizeof(struct sd_extent_header)));
+}
+END_TEST
+
+/*
+ * check that a lookup reads the header and the pages which the binary search
+ * probes only, and an insertion writes the header and the shifted entries
+ */
+START_TEST(test_partial_rw)
+{
+	/* the header and a page for each step down to a page of entries */
+	uint64_t max_read = (2 + __builtin_ctz(BNODE_MAX_PAGES)) *
+		BNODE_PAGE_SIZE;
+	uint32_t idx;
+
+	for (int i = 0; i < 1000; i++) {
+		sd_inode_set_cache_size(0);
+		sd_inode_set_cache_size(DEFAULT_BNODE_CACHE_SIZE);
+		idx = random() % nr_idx;
+		read_bytes = 0;
+		ck_assert_int_eq(get_vid(idx), expect[idx]);
+		ck_assert_int_le(read_bytes, max_read);
+	}
+
+	/* insert into the tail of a half full leaf-node */
+	idx = nr_idx - 3;
+	write_bytes = 0;
+	sd_inode_set_vid(test_writer, test_reader, inode, idx, TEST_VID);
+	expect[idx] = TEST_VID;
+	ck_assert_int_le(write_bytes, BNODE_PAGE_SIZE * 2 +
+			 sizeof(struct sd_extent_header));
+
+	/* append to the last leaf-node */
+	idx = nr_idx + 1;
+	write_bytes = 0;
+	sd_inode_set_vid(test_writer, test_reader, inode, idx, TEST_VID);
+	expect[idx] = TEST_VID;
+	ck_assert_int_le(write_bytes, BNODE_PAGE_SIZE * 2 +
+			 sizeof(struct sd_extent_header));
+	ck_assert_int_eq(get_vid(idx), TEST_VID);
+	check_btree();
+}
+END_TEST
+
+/*
+ * check that the updates, the insertions and the splits of leaf-nodes are
+ * written through, with and without the cache
+ */
+START_TEST(test_set_vid)
+{
+	uint32_t idx;
+
+	for (int round = 0; round < 2; round++) {
+		sd_inode_set_cache_size(round ? 0 : DEFAULT_BNODE_CACHE_SIZE);
+		check_btree();
+
+		for (int i = 0; i < 200; i++) {
+			uint32_t vid = TEST_VID + 100 + i + round;
+
+			idx = random() % (nr_idx + LEAF_SPAN);
+			sd_inode_set_vid(test_writer, test_reader, inode, idx,
+					 vid);
+			expect[idx] = vid;
+			ck_assert_int_eq(get_vid(idx), vid);
+		}
+		/* insert into the full leaf-node to split it */
+		idx = 1 + round * 2;
+		sd_inode_set_vid(test_writer, test_reader, inode, idx,
+				 TEST_VID);
+		expect[idx] = TEST_VID;
+		check_btree();
+	}
+	ck_assert_int_gt(inode->btree_counter, NR_LEAVES);
+	sd_inode_set_cache_size(DEFAULT_BNODE_CACHE_SIZE);
+	check_btree();
+}
+END_TEST
+
+/*
+ * check that a cached leaf-node written by others, e.g. through another
+ * gateway, is not trusted
+ */
+START_TEST(test_stale)
+{
+	struct bnode_store *b = store + 1;
+	struct sd_extent_header *header = (struct sd_extent_header *)b->buf;
+	struct sd_extent *ext = FIRST_EXT(header);
+	uint32_t idx = ext->idx, first = ext->idx, end;
+
+	end = (LAST_EXT(header) - 1)->idx + 1;
+	for (uint32_t i = first; i < end; i++)
+		ck_assert_int_eq(get_vid(i), expect[i]);
+
+	/* update a vdi_id in place */
+	ext->vdi_id = TEST_VID + 1000;
+	expect[idx] = TEST_VID + 1000;
+	ck_assert_int_eq(get_vid(idx), expect[idx]);
+
+	/* insert an entry, which shifts the following ones */
+	memmove(ext + 2, ext + 1,
+		(LAST_EXT(header) - ext - 1) * sizeof(*ext));
+	ext[1].idx = idx + 1;
+	ext[1].vdi_id = TEST_VID + 1001;
+	header->entries++;
+	expect[idx + 1] = TEST_VID + 1001;
+	for (uint32_t i = first; i < end; i++)
+		ck_assert_int_eq(get_vid(i), expect[i]);
+
+	/*
+	 * the cached node is checked by its header and at most two pages, it
+	 * is not read again at every lookup
+	 */
+	read_bytes = 0;
+	for (uint32_t i = first; i < end; i++)
+		ck_assert_int_eq(get_vid(i), expect[i]);
+	ck_assert_int_le(read_bytes, (uint64_t)(end - first) *
+			 (BNODE_PAGE_SIZE * 2 + sizeof(*header)));
+	ck_assert_int_gt((char *)LAST_EXT(header) - b->buf, BNODE_PAGE_SIZE * 2);
+	check_btree();
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test sd_inode");
+
+	TCase *tc_btree = tcase_create("btree");
+
+	tcase_add_checked_fixture(tc_btree, setup, teardown);
+	tcase_set_timeout(tc_btree, 60);
+
+	tcase_add_test(tc_btree, test_lookup);
+	tcase_add_test(tc_btree, test_partial_rw);
+	tcase_add_test(tc_btree, test_set_vid);
+	tcase_add_test(tc_btree, test_stale);
+
+	suite_add_tcase(s, tc_btree);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
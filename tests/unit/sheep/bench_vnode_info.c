@@ -0,0 +1,158 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of get_vnode_info() and put_vnode_info()
+ *
+ * This reports the CPU time taken by a pair of get_vnode_info() and
+ * put_vnode_info() in each of the given number of threads.  The baseline is a
+ * pair of grab_vnode_info() and put_vnode_info() on the current vnode info,
+ * which is what get_vnode_info() did when only the main thread could call
+ * it.  With -p, the main thread publishes a new vnode info at the given
+ * interval while the threads run, as it does on epoch changes.
+ *
+ * This is built with the unit tests but is not run by 'make check'.
+ *
+ * usage: bench_vnode_info [-t threads] [-n pairs] [-p publish interval (ms)]
+ */
+
+#include <getopt.h>
+
+#include "group.c"
+
+static int nr_threads = 4;
+static int nr_pairs = 10000000;
+static int publish_interval;
+
+static struct rb_root nroot = RB_ROOT;
+static struct sd_node nodes[8];
+static int running;
+
+static void init_nodes(void)
+{
+	for (int i = 0; i < ARRAY_SIZE(nodes); i++) {
+		/* IPv4 10.0.0.x */
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[15] = i;
+		nodes[i].nid.port = 7000;
+		nodes[i].nr_vnodes = SD_DEFAULT_VNODES;
+		nodes[i].zone = i;
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+	}
+}
+
+static void publish(void)
+{
+	put_vnode_info(publish_vnode_info(alloc_vnode_info(&nroot)));
+}
+
+/* the CPU time of this thread, which is not inflated by time slicing */
+static uint64_t thread_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t bench_grab(void)
+{
+	uint64_t start = thread_time();
+
+	for (int i = 0; i < nr_pairs; i++)
+		put_vnode_info(grab_vnode_info(current_vnode_info));
+
+	return (thread_time() - start) * 10 / nr_pairs;
+}
+
+static void *bench_get(void *arg)
+{
+	uint64_t *ns = arg, start;
+
+	/* the first call registers the reader slot of this thread */
+	put_vnode_info(get_vnode_info());
+
+	start = thread_time();
+	for (int i = 0; i < nr_pairs; i++)
+		put_vnode_info(get_vnode_info());
+	*ns = (thread_time() - start) * 10 / nr_pairs;
+
+	uatomic_dec(&running);
+	return NULL;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-n pairs] "
+		"[-p publish interval (ms)]\n", progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	uint64_t *ns, sum = 0;
+	int ch, nr_published = 0;
+
+	while ((ch = getopt(argc, argv, "t:n:p:h")) >= 0) {
+		switch (ch) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_pairs = atoi(optarg);
+			break;
+		case 'p':
+			publish_interval = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nr_threads <= 0 || nr_pairs <= 0 || publish_interval < 0)
+		usage(argv[0]);
+
+	sys = xzalloc(sizeof(*sys));
+	if (init_event(64) < 0)
+		exit(1);
+	init_nodes();
+	publish();
+
+	printf("get/put of the vnode info, %d pairs (ns/pair)\n", nr_pairs);
+	printf("  grab/put (baseline)  %5.1f\n", bench_grab() / 10.0);
+	uatomic_set(&running, 1);
+	bench_get(&sum);
+	printf("  get/put, 1 thread    %5.1f\n", sum / 10.0);
+
+	threads = xmalloc(sizeof(*threads) * nr_threads);
+	ns = xzalloc(sizeof(*ns) * nr_threads);
+	uatomic_set(&running, nr_threads);
+	for (int i = 0; i < nr_threads; i++)
+		pthread_create(threads + i, NULL, bench_get, ns + i);
+	while (uatomic_read(&running)) {
+		if (publish_interval) {
+			publish();
+			nr_published++;
+			/* run the timer which puts the replaced vnode infos */
+			event_loop(publish_interval);
+		} else
+			usleep(10000);
+	}
+	sum = 0;
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		sum += ns[i];
+	}
+	printf("  get/put, %d thread%s  %5.1f (%d vnode infos published)\n",
+	       nr_threads, nr_threads > 1 ? "s" : "", sum / 10.0 / nr_threads,
+	       nr_published);
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mock.h"
+#include "sheep_priv.h"
+
+MOCK_METHOD(set_cluster_config, int, SD_RES_SUCCESS,
+	    const struct cluster_info *cinfo)
+MOCK_METHOD(set_cluster_shutdown, int, SD_RES_SUCCESS, bool down)
+MOCK_METHOD(was_cluster_shutdowned, bool, false)
+MOCK_METHOD(is_cluster_formatted, bool, true)
@@ -21,7 +21,7 @@ MOCK_VOID_METHOD(sd_accept_handler, const struct sd_node *joined,
 		 const void *opaque)
 MOCK_METHOD(sd_join_handler, bool, true, const struct sd_node *joining,
 	    const struct rb_root *nroot, size_t nr_nodes,
-	    void *opaque)
+	    void *opaque, size_t *opaque_len)
 MOCK_VOID_METHOD(sd_leave_handler, const struct sd_node *left,
 		 const struct rb_root *nroot, size_t nr_nodes)
 MOCK_VOID_METHOD(sd_notify_handler, const struct sd_node *sender, void *msg,
@@ -31,6 +31,11 @@ MOCK_METHOD(sd_reconnect_handler, int, 0)
 MOCK_VOID_METHOD(sd_update_node_handler, struct sd_node *node)
 
 MOCK_METHOD(get_vnode_info, struct vnode_info *, NULL)
-MOCK_METHOD(start_recovery, int, 0, struct vnode_info *cur_vinfo,
-	    struct vnode_info *old_vinfo, bool epoch_lifted)
 MOCK_VOID_METHOD(put_vnode_info, struct vnode_info *vnode_info)
+MOCK_METHOD(grab_vnode_info, struct vnode_info *, vnode_info,
+	    struct vnode_info *vnode_info)
+MOCK_METHOD(get_vnode_info_epoch, struct vnode_info *, NULL, uint32_t epoch,
+	    struct vnode_info *cur_vinfo)
+MOCK_VOID_METHOD(wait_get_vdis_done, void)
+
+uint32_t last_gathered_epoch = 1;
@@ -0,0 +1,21 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mock.h"
+#include "sheep_priv.h"
+
+MOCK_METHOD(get_sd_op, const struct sd_op_template *, NULL, uint8_t opcode)
+MOCK_METHOD(op_name, const char *, "", const struct sd_op_template *op)
+MOCK_METHOD(is_batch_op, bool, false, const struct sd_op_template *op)
+MOCK_METHOD(has_process_main, bool, false, const struct sd_op_template *op)
+MOCK_METHOD(has_process_work, bool, false, const struct sd_op_template *op)
+MOCK_VOID_METHOD(do_process_work, struct work *work)
+MOCK_METHOD(do_process_main, int, SD_RES_SUCCESS,
+	    const struct sd_op_template *op, const struct sd_req *req,
+	    struct sd_rsp *rsp, void *data)
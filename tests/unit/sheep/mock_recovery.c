@@ -0,0 +1,14 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mock.h"
+#include "sheep_priv.h"
+
+MOCK_METHOD(start_recovery, int, 0, struct vnode_info *cur_vinfo,
+	    struct vnode_info *old_vinfo, bool epoch_lifted)
@@ -16,3 +16,8 @@
 
 MOCK_METHOD(exec_local_req, int, 0, struct sd_req *rq, void *data)
 MOCK_VOID_METHOD(put_request, struct request *req)
+MOCK_METHOD(sheep_exec_req, int, 0, const struct node_id *nid,
+	    struct sd_req *hdr, void *data)
+MOCK_VOID_METHOD(wakeup_requests_on_epoch, void)
+MOCK_VOID_METHOD(wakeup_requests_on_oid, uint64_t oid)
+MOCK_VOID_METHOD(wakeup_all_requests, void)
@@ -23,3 +23,13 @@ MOCK_METHOD(read_backend_object, int, 0,
 	    uint64_t oid, char *data, unsigned int datalen, uint64_t offset)
 MOCK_METHOD(sd_remove_object, int, 0,
 	    uint64_t oid)
+MOCK_METHOD(get_store_objsize, size_t, 0,
+	    uint64_t oid)
+MOCK_METHOD(epoch_log_read, int, SD_RES_NO_TAG,
+	    uint32_t epoch, struct sd_node *nodes, int len)
+MOCK_METHOD(update_epoch_log, int, SD_RES_SUCCESS,
+	    uint32_t epoch, struct sd_node *nodes, size_t nr_nodes)
+MOCK_METHOD(get_latest_epoch, uint32_t, 0)
+
+struct store_driver *sd_store;
+LIST_HEAD(store_drivers);
@@ -0,0 +1,21 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mock.h"
+#include "sheep_priv.h"
+
+MOCK_METHOD(get_vdi_copy_policy, int, 0, uint32_t vid)
+MOCK_METHOD(get_obj_copy_number, int, min(SD_DEFAULT_COPIES, nr_zones),
+	    uint64_t oid, int nr_zones)
+MOCK_METHOD(add_vdi_state, int, SD_RES_SUCCESS, uint32_t vid, int nr_copies,
+	    bool snapshot, uint8_t cp, uint8_t block_size_shift)
+MOCK_VOID_METHOD(get_vdi_state_sync_point, const struct node_id *nid,
+		 uint64_t *generation, uint64_t *version)
+MOCK_VOID_METHOD(set_vdi_state_sync_point, const struct node_id *nid,
+		 uint64_t generation, uint64_t version)
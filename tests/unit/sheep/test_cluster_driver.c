@@ -12,6 +12,8 @@
  */
 
 #include <check.h>
+#include <pthread.h>
+#include <sched.h>
 
 #ifdef BUILD_ZOOKEEPER
 #include <zookeeper/zookeeper.h>
@@ -96,6 +98,113 @@ START_TEST(test_zookeeper)
 }
 END_TEST
 
+/* send more notifications than the event ring of the local driver holds */
+START_TEST(test_local_ring)
+{
+	struct cluster_driver *driver = find_cdrv("local");
+	struct sd_node node;
+	size_t len = 64 * 1024;
+	int nr_batches = 80, batch = 16;
+	void *msg;
+
+	assert_ret(init_event(4096), 0);
+	msg = xzalloc(len);
+
+	assert_ret(driver->init("/tmp/sheepdog_test_ring_shm"), 0);
+	assert_ret(driver->join(&node, msg, sizeof(int)), 0);
+	LOOP_WHEN(method_nr_call(sd_accept_handler) == 0);
+
+	for (int i = 0; i < nr_batches; i++) {
+		for (int j = 0; j < batch; j++)
+			assert_ret(driver->notify(msg, len), 0);
+		LOOP_WHEN(method_nr_call(sd_notify_handler) < (i + 1) * batch);
+	}
+
+	ck_assert_int_eq(method_nr_call(sd_notify_handler),
+			 nr_batches * batch);
+
+	free(msg);
+}
+END_TEST
+
+static int nr_acquired, nr_released, nr_holders;
+static bool overlapped;
+
+static void fake_acquire(uint64_t lock_id)
+{
+	uatomic_inc(&nr_acquired);
+}
+
+static void fake_release(uint64_t lock_id)
+{
+	uatomic_inc(&nr_released);
+}
+
+static const struct cluster_lock_ops fake_lock_ops = {
+	.acquire = fake_acquire,
+	.release = fake_release,
+};
+
+static void *lock_worker(void *arg)
+{
+	int nr = *(int *)arg;
+
+	for (int i = 0; i < nr; i++) {
+		cluster_lock_acquire(&fake_lock_ops, 1);
+		if (uatomic_add_return(&nr_holders, 1) != 1)
+			overlapped = true;
+		sched_yield();
+		uatomic_dec(&nr_holders);
+		cluster_lock_release(&fake_lock_ops, 1);
+	}
+
+	return NULL;
+}
+
+START_TEST(test_lock_handover)
+{
+	struct s_lock before, after;
+	pthread_t waiter;
+	int nr = 1;
+
+	cluster_lock_get_stat(&before);
+	cluster_lock_acquire(&fake_lock_ops, 1);
+	ck_assert_int_eq(nr_acquired, 1);
+
+	pthread_create(&waiter, NULL, lock_worker, &nr);
+	do {
+		sched_yield();
+		cluster_lock_get_stat(&after);
+	} while (after.contended_nr == before.contended_nr);
+
+	/* the waiter takes over the lock without the lock service */
+	cluster_lock_release(&fake_lock_ops, 1);
+	pthread_join(waiter, NULL);
+
+	cluster_lock_get_stat(&after);
+	ck_assert_int_eq(nr_acquired, 1);
+	ck_assert_int_eq(nr_released, 1);
+	ck_assert_int_eq(after.acquire_nr - before.acquire_nr, 2);
+	ck_assert_int_eq(after.cached_nr - before.cached_nr, 1);
+}
+END_TEST
+
+START_TEST(test_lock_exclusive)
+{
+	pthread_t workers[4];
+	int nr = 1000;
+
+	for (int i = 0; i < ARRAY_SIZE(workers); i++)
+		pthread_create(workers + i, NULL, lock_worker, &nr);
+	for (int i = 0; i < ARRAY_SIZE(workers); i++)
+		pthread_join(workers[i], NULL);
+
+	ck_assert(!overlapped);
+	ck_assert_int_eq(nr_acquired, nr_released);
+	ck_assert_int_le(nr_acquired, ARRAY_SIZE(workers) * nr);
+}
+END_TEST
+
 static Suite *test_suite(void)
 {
 	Suite *s = suite_create("test cluster driver");
@@ -108,11 +217,16 @@ static Suite *test_suite(void)
 	 */
 	TCase *tc_local = tcase_create("local");
 	TCase *tc_zk = tcase_create("zookeeper");
+	TCase *tc_lock = tcase_create("lock");
 	tcase_add_test(tc_local, test_local);
+	tcase_add_test(tc_local, test_local_ring);
 	tcase_add_test(tc_zk, test_zookeeper);
+	tcase_add_test(tc_lock, test_lock_handover);
+	tcase_add_test(tc_lock, test_lock_exclusive);
 
 	suite_add_tcase(s, tc_local);
 	suite_add_tcase(s, tc_zk);
+	suite_add_tcase(s, tc_lock);
 	tcase_add_checked_fixture(tc_local, NULL, teardown);
 	tcase_add_checked_fixture(tc_zk, NULL, teardown);
 
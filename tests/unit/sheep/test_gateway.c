@@ -0,0 +1,351 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+
+#include "gateway.c"
+#include "mock.h"
+
+/*
+ * An erasure coded object of 4:2 with the default stripe size.  Each peer
+ * listens on the loopback and keeps the strip of its ec_index in memory.
+ */
+#define TEST_VID	0x123456
+#define TEST_POLICY	0x22
+#define TEST_D		4
+#define TEST_DP		6
+#define STRIPE_SIZE	SD_EC_DATA_STRIPE_SIZE
+#define STRIP_SIZE	(STRIPE_SIZE / TEST_D)
+#define STRIP_OBJ_SIZE	(SD_DATA_OBJ_SIZE / TEST_D)
+
+static struct sd_node nodes[TEST_DP];
+static struct vnode_info vinfo;
+static uint8_t *strips[TEST_DP];
+static uint8_t *expect;
+
+/* the next nr_fail writes to the strip fail_index are dropped */
+static int fail_index = -1, nr_fail;
+static int nr_peer_reads, nr_local_reads;
+
+int get_vdi_copy_policy(uint32_t vid)
+{
+	return TEST_POLICY;
+}
+
+uint32_t get_vdi_ec_stripe_size(uint32_t vid)
+{
+	return STRIPE_SIZE;
+}
+
+int get_req_copy_number(struct request *req)
+{
+	return TEST_DP;
+}
+
+bool sheep_need_retry(uint32_t epoch)
+{
+	return false;
+}
+
+int gateway_to_peer_opcode(int opcode)
+{
+	switch (opcode) {
+	case SD_OP_READ_OBJ:
+		return SD_OP_READ_PEER;
+	case SD_OP_WRITE_OBJ:
+		return SD_OP_WRITE_PEER;
+	default:
+		ck_assert_msg(false, "unexpected opcode %x", opcode);
+		return 0;
+	}
+}
+
+MOCK_METHOD(oid_is_readonly, bool, false, uint64_t oid)
+MOCK_METHOD(bypass_object_cache, bool, true, const struct request *req)
+MOCK_METHOD(object_cache_handle_request, int, SD_RES_SUCCESS,
+	    struct request *req)
+MOCK_METHOD(peer_read_obj, int, SD_RES_SUCCESS, struct request *req)
+MOCK_METHOD(sheep_exec_req, int, SD_RES_SUCCESS, const struct node_id *nid,
+	    struct sd_req *hdr, void *data)
+
+/* Read the object from the data strips, as the gateway of this node does */
+int exec_local_req(struct sd_req *rq, void *data)
+{
+	uint8_t *buf = data;
+
+	ck_assert_int_eq(rq->opcode, SD_OP_READ_OBJ);
+	for (uint64_t pos = rq->obj.offset;
+	     pos < rq->obj.offset + rq->data_length; pos++) {
+		uint64_t s = pos / STRIPE_SIZE, x = pos % STRIPE_SIZE;
+
+		*buf++ = strips[x / STRIP_SIZE][s * STRIP_SIZE +
+						x % STRIP_SIZE];
+	}
+	nr_local_reads++;
+
+	return SD_RES_SUCCESS;
+}
+
+/* Serve the requests on a connection, or drop it to inject a failure */
+static void serve_peer(int fd)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint8_t *buf = NULL;
+
+	while (xread(fd, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+		uint8_t *strip = strips[hdr.obj.ec_index];
+		uint64_t off = hdr.obj.offset;
+		uint32_t len = hdr.data_length;
+
+		ck_assert_int_lt(hdr.obj.ec_index, TEST_DP);
+		ck_assert_int_le(off + len, STRIP_OBJ_SIZE);
+		buf = xrealloc(buf, len);
+		switch (hdr.opcode) {
+		case SD_OP_READ_PEER:
+			memcpy(buf, strip + off, len);
+			uatomic_inc(&nr_peer_reads);
+			break;
+		case SD_OP_WRITE_PEER:
+		case SD_OP_CREATE_AND_WRITE_PEER:
+			if (xread(fd, buf, len) != len)
+				goto out;
+			if (hdr.obj.ec_index == fail_index && nr_fail > 0) {
+				nr_fail--;
+				goto out;
+			}
+			memcpy(strip + off, buf, len);
+			len = 0;
+			break;
+		default:
+			ck_assert_msg(false, "unexpected opcode %x",
+				      hdr.opcode);
+		}
+
+		rsp->result = SD_RES_SUCCESS;
+		rsp->data_length = len;
+		if (xwrite(fd, rsp, sizeof(*rsp)) != sizeof(*rsp) ||
+		    xwrite(fd, buf, len) != len)
+			break;
+	}
+out:
+	free(buf);
+}
+
+static void *peer_main(void *arg)
+{
+	int listen_fd = (long)arg, fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		serve_peer(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+static void start_peer(struct sd_node *n)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+	long fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+	ck_assert_int_eq(listen(fd, 16), 0);
+	ck_assert_int_eq(getsockname(fd, (struct sockaddr *)&addr, &len), 0);
+
+	/* IPv4 127.0.0.1 */
+	n->nid.addr[12] = 127;
+	n->nid.addr[15] = 1;
+	n->nid.port = ntohs(addr.sin_port);
+	n->nr_vnodes = SD_DEFAULT_VNODES;
+	ck_assert_int_eq(pthread_create(&thread, NULL, peer_main, (void *)fd),
+			 0);
+}
+
+/* Check that the strips are the encoded expected object */
+static void check_strips(void)
+{
+	struct fec *ctx = ec_init_policy(TEST_POLICY);
+	uint8_t *ds[TEST_D], *ps[TEST_DP - TEST_D];
+
+	for (int i = 0; i < TEST_DP; i++) {
+		uint8_t *s = xmalloc(STRIP_OBJ_SIZE);
+
+		if (i < TEST_D)
+			ds[i] = s;
+		else
+			ps[i - TEST_D] = s;
+	}
+	ec_encode_stripes(ctx, expect, ds, ps, SD_DATA_OBJ_SIZE / STRIPE_SIZE,
+			  STRIPE_SIZE);
+	for (int i = 0; i < TEST_DP; i++) {
+		uint8_t *s = i < TEST_D ? ds[i] : ps[i - TEST_D];
+
+		ck_assert_msg(memcmp(s, strips[i], STRIP_OBJ_SIZE) == 0,
+			      "strip %d is inconsistent", i);
+		free(s);
+	}
+	ec_destroy(ctx);
+}
+
+static void setup(void)
+{
+	static bool started;
+	struct rb_root nroot = RB_ROOT;
+
+	if (!started) {
+		sys = xzalloc(sizeof(*sys));
+		for (int i = 0; i < TEST_DP; i++) {
+			nodes[i].zone = i;
+			start_peer(nodes + i);
+			strips[i] = xmalloc(STRIP_OBJ_SIZE);
+		}
+		expect = xmalloc(SD_DATA_OBJ_SIZE);
+		started = true;
+	}
+
+	INIT_RB_ROOT(&vinfo.vroot);
+	for (int i = 0; i < TEST_DP; i++)
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+	nodes_to_vnode_ring(&nroot, &vinfo.vroot, &vinfo.vring, 0);
+	vinfo.pcache = xvalloc(sizeof(*vinfo.pcache));
+	memset(vinfo.pcache, 0, sizeof(*vinfo.pcache));
+	vinfo.nr_nodes = vinfo.nr_zones = TEST_DP;
+
+	for (int i = 0; i < SD_DATA_OBJ_SIZE; i++)
+		expect[i] = random();
+	ec_encode_stripes(ec_init_policy(TEST_POLICY), expect, strips,
+			  strips + TEST_D, SD_DATA_OBJ_SIZE / STRIPE_SIZE,
+			  STRIPE_SIZE);
+	fail_index = -1;
+	nr_fail = nr_peer_reads = nr_local_reads = 0;
+}
+
+static void teardown(void)
+{
+	free(vinfo.pcache);
+	rb_destroy(&vinfo.vroot, struct sd_vnode, rb);
+}
+
+static void init_write_req(struct request *req, uint64_t off, uint32_t len)
+{
+	memset(req, 0, sizeof(*req));
+	req->rq.opcode = SD_OP_WRITE_OBJ;
+	req->rq.flags = SD_FLAG_CMD_WRITE;
+	req->rq.obj.oid = vid_to_data_oid(TEST_VID, 0);
+	req->rq.obj.offset = off;
+	req->rq.data_length = len;
+	req->data = xmalloc(len);
+	req->vinfo = &vinfo;
+	for (uint32_t i = 0; i < len; i++)
+		((uint8_t *)req->data)[i] = random();
+	memcpy(expect + off, req->data, len);
+}
+
+/* small misaligned writes update the parity by delta */
+START_TEST(test_delta_write)
+{
+	static const uint32_t writes[][2] = {
+		{ 100, 10 }, { STRIPE_SIZE - 4, 8 },
+		{ STRIPE_SIZE * 5 + STRIP_SIZE, STRIP_SIZE * 2 + 1 },
+		{ STRIPE_SIZE * 9 + 1, STRIPE_SIZE },
+	};
+	struct request req;
+
+	for (int i = 0; i < ARRAY_SIZE(writes); i++) {
+		init_write_req(&req, writes[i][0], writes[i][1]);
+		ck_assert(need_parity_delta(&req));
+		ck_assert_int_eq(gateway_forward_request(&req),
+				 SD_RES_SUCCESS);
+		free(req.data);
+		check_strips();
+	}
+	ck_assert_int_gt(nr_peer_reads, 0);
+	ck_assert_int_eq(nr_local_reads, 0);
+}
+END_TEST
+
+/*
+ * a failed write of a strip in the delta write leaves the stripe half
+ * updated, so the touched stripes are re-encoded in the same call
+ */
+START_TEST(test_delta_write_failure)
+{
+	static const int fail_strips[] = { TEST_D, TEST_DP - 1, 0, 1 };
+	struct request req;
+
+	for (int i = 0; i < ARRAY_SIZE(fail_strips); i++) {
+		init_write_req(&req, STRIPE_SIZE * i + 30, 300);
+		fail_index = fail_strips[i];
+		nr_fail = 1;
+		nr_local_reads = 0;
+		ck_assert_int_eq(gateway_forward_request(&req),
+				 SD_RES_SUCCESS);
+		ck_assert_int_eq(nr_fail, 0);
+		ck_assert_int_gt(nr_local_reads, 0);
+		free(req.data);
+		check_strips();
+	}
+}
+END_TEST
+
+/*
+ * if the re-encoded write fails too, the retry of the request must not
+ * apply the delta to the parity which might be updated already
+ */
+START_TEST(test_delta_write_retry)
+{
+	struct request req;
+
+	init_write_req(&req, STRIPE_SIZE * 3 + 700, 500);
+	fail_index = TEST_D;
+	nr_fail = 2;
+	ck_assert_int_eq(gateway_forward_request(&req), SD_RES_NETWORK_ERROR);
+	ck_assert_int_eq(nr_fail, 0);
+
+	/* gateway_op_done() requeues the request on a network error */
+	ck_assert_int_eq(gateway_forward_request(&req), SD_RES_SUCCESS);
+	free(req.data);
+	check_strips();
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test gateway");
+
+	TCase *tc_ec = tcase_create("erasure code");
+
+	tcase_add_checked_fixture(tc_ec, setup, teardown);
+	tcase_add_test(tc_ec, test_delta_write);
+	tcase_add_test(tc_ec, test_delta_write_failure);
+	tcase_add_test(tc_ec, test_delta_write_retry);
+
+	suite_add_tcase(s, tc_ec);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,6 +2,7 @@
 #include <math.h>
 
 #include "md.c"
+#include "recovery.c"
 
 /* Constant values for the chi-squared test */
 #define DATA_SIZE 1024
@@ -541,6 +542,369 @@ START_TEST(test_objects_dispersion)
 }
 END_TEST
 
+#define NR_PLACEMENT_NODES 100
+#define NR_PLACEMENT_OBJECTS (1 << 20)
+#define NR_PLACEMENT_COPIES 3
+
+/* The placement by walking the rb-tree, which the vnode ring replaced */
+static void rb_hash_to_nodes(uint64_t hash, struct rb_root *vroot,
+			     int nr_copies, const struct sd_node **nodes)
+{
+	struct sd_vnode *v, dummy = { .hash = hash };
+
+	v = rb_nsearch(vroot, &dummy, rb, vnode_cmp);
+	nodes[0] = v->node;
+	for (int j = 1; j < nr_copies; j++) {
+next:
+		v = rb_entry(rb_next(&v->rb), struct sd_vnode, rb);
+		if (!v)
+			v = rb_entry(rb_first(vroot), struct sd_vnode, rb);
+		for (int k = 0; k < j; k++)
+			if (nodes[k]->zone == v->node->zone)
+				goto next;
+		nodes[j] = v->node;
+	}
+}
+
+static void init_placement_nodes(struct sd_node *nodes, int nr_zones,
+				 struct rb_root *vroot)
+{
+	memset(nodes, 0, sizeof(*nodes) * NR_PLACEMENT_NODES);
+	INIT_RB_ROOT(vroot);
+	for (int i = 0; i < NR_PLACEMENT_NODES; i++) {
+		/* IPv4 10.0.0.x */
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[15] = i;
+		nodes[i].nid.port = 7000;
+		nodes[i].nr_vnodes = 128;
+		nodes[i].zone = i % nr_zones;
+		node_to_vnodes(nodes + i, vroot);
+	}
+}
+
+#define NR_SCREEN_OBJECTS (NR_PLACEMENT_OBJECTS / 64)
+#define NR_SCREEN_LISTS 8
+
+/*
+ * check that screen_object_list() keeps each object placed on this node once,
+ * even when it is listed by two nodes, in the order of the hash values with
+ * both placement algorithms
+ */
+START_TEST(test_screen_object_list)
+{
+	static const uint16_t algos[] = { 0, SD_CLUSTER_FLAG_STRAW2 };
+	static struct sd_node nodes[NR_PLACEMENT_NODES];
+	const struct sd_node *n[SD_MAX_COPIES];
+	struct object_hash *expect;
+	struct vnode_info vinfo;
+	struct rb_root nroot;
+	uint64_t *oids;
+	size_t chunk = NR_SCREEN_OBJECTS / NR_SCREEN_LISTS;
+
+	sys = xzalloc(sizeof(*sys));
+	oids = xmalloc(sizeof(*oids) * NR_SCREEN_OBJECTS);
+	expect = xmalloc(sizeof(*expect) * NR_SCREEN_OBJECTS);
+	for (int i = 0; i < NR_SCREEN_OBJECTS; i++)
+		oids[i] = vid_to_data_oid(i / 1024, i % 1024);
+
+	for (int k = 0; k < ARRAY_SIZE(algos); k++) {
+		struct recovery_list_work *rlw = xzalloc(sizeof(*rlw));
+		uint64_t nr_expect = 0;
+
+		init_placement_nodes(nodes, NR_PLACEMENT_NODES, &vinfo.vroot);
+		rb_destroy(&vinfo.vroot, struct sd_vnode, rb);
+		INIT_RB_ROOT(&nroot);
+		for (int i = 0; i < NR_PLACEMENT_NODES; i++)
+			rb_insert(&nroot, &nodes[i], rb, node_cmp);
+		nodes_to_vnode_ring(&nroot, &vinfo.vroot, &vinfo.vring,
+				    algos[k]);
+		vinfo.nr_zones = NR_PLACEMENT_NODES;
+		sys->this_node = nodes[k];
+
+		rlw->base.cur_vinfo = &vinfo;
+		rlw->oids = xmalloc(list_buffer_size);
+
+		/* every object is listed by two nodes */
+		for (int i = 0; i < NR_SCREEN_LISTS; i++)
+			screen_object_list(rlw, &vinfo.vring, oids + i * chunk,
+					   min(chunk * 2, NR_SCREEN_OBJECTS -
+					       i * chunk));
+		finish_screen_object_list(rlw);
+
+		for (int i = 0; i < NR_SCREEN_OBJECTS; i++) {
+			oid_to_nodes(oids[i], &vinfo.vring, NR_PLACEMENT_COPIES,
+				     n);
+			for (int j = 0; j < NR_PLACEMENT_COPIES; j++) {
+				if (!node_is_local(n[j]))
+					continue;
+				expect[nr_expect].hash = sd_hash_oid(oids[i]);
+				expect[nr_expect++].oid = oids[i];
+				break;
+			}
+		}
+		xqsort(expect, nr_expect, object_hash_cmp);
+
+		ck_assert(nr_expect > 0);
+		ck_assert_int_eq(rlw->count, nr_expect);
+		for (int i = 0; i < nr_expect; i++)
+			ck_assert(rlw->oids[i] == expect[i].oid);
+
+		free(rlw->oids);
+		free(rlw);
+		vnode_ring_destroy(&vinfo.vring);
+		rb_destroy(&vinfo.vroot, struct sd_vnode, rb);
+	}
+
+	free(oids);
+	free(expect);
+	free(sys);
+	sys = NULL;
+}
+END_TEST
+
+/*
+ * check that oid_to_vnodes() over the flattened ring places objects as the
+ * rb-tree walk did, also when some nodes share a zone
+ */
+START_TEST(test_ring_lookup)
+{
+	static struct sd_node nodes[NR_PLACEMENT_NODES];
+	static const int zones[] = { NR_PLACEMENT_NODES, 10, 4 };
+	const struct sd_node *n1[SD_MAX_COPIES];
+	const struct sd_vnode *v2[SD_MAX_COPIES];
+	struct vnode_ring ring;
+	struct rb_root vroot;
+
+	for (int k = 0; k < ARRAY_SIZE(zones); k++) {
+		int nr_copies = min(zones[k], 4);
+
+		init_placement_nodes(nodes, zones[k], &vroot);
+		vnode_ring_init(&ring, &vroot);
+
+		for (int i = 0; i < NR_PLACEMENT_OBJECTS / 16; i++) {
+			uint64_t oid = vid_to_data_oid(i / 1024, i % 1024);
+
+			rb_hash_to_nodes(sd_hash_oid(oid), &vroot, nr_copies,
+					 n1);
+			oid_to_vnodes(oid, &ring, nr_copies, v2);
+			for (int j = 0; j < nr_copies; j++)
+				ck_assert(n1[j] == v2[j]->node);
+			ck_assert(oid_to_node(oid, &ring, nr_copies - 1) ==
+				  n1[nr_copies - 1]);
+		}
+
+		vnode_ring_destroy(&ring);
+		rb_destroy(&vroot, struct sd_vnode, rb);
+	}
+}
+END_TEST
+
+#define NR_HOT_OBJECTS 4096
+#define NR_CACHE_THREADS 4
+
+struct placement_arg {
+	struct vnode_ring *ring;
+	struct placement_cache *pc;
+	int nr_copies;
+	int nr_errors;
+};
+
+static void *placement_worker(void *data)
+{
+	struct placement_arg *arg = data;
+	const struct sd_vnode *v1[SD_MAX_COPIES], *v2[SD_MAX_COPIES];
+
+	for (int i = 0; i < NR_PLACEMENT_OBJECTS / 16; i++) {
+		uint64_t oid = vid_to_data_oid(1, random() % NR_HOT_OBJECTS);
+		int nr_copies = random() % arg->nr_copies + 1;
+
+		oid_to_vnodes_cached(oid, arg->ring, arg->pc, nr_copies, v1);
+		oid_to_vnodes(oid, arg->ring, nr_copies, v2);
+		if (memcmp(v1, v2, sizeof(*v1) * nr_copies) != 0)
+			arg->nr_errors++;
+	}
+
+	return NULL;
+}
+
+/*
+ * check that the placement cache gives the same replica as the ring, also
+ * when threads race for the same entries, and that it counts the lookups
+ * and the misses
+ */
+START_TEST(test_placement_cache)
+{
+	static struct sd_node nodes[NR_PLACEMENT_NODES];
+	struct placement_arg args[NR_CACHE_THREADS];
+	pthread_t threads[NR_CACHE_THREADS];
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	struct placement_cache *pc = xvalloc(sizeof(*pc));
+	struct vnode_ring ring;
+	struct rb_root vroot;
+	uint64_t nr_lookup, nr_miss;
+
+	init_placement_nodes(nodes, NR_PLACEMENT_NODES, &vroot);
+	vnode_ring_init(&ring, &vroot);
+
+	memset(pc, 0, sizeof(*pc));
+	for (int i = 0; i < NR_CACHE_THREADS; i++) {
+		args[i] = (struct placement_arg) {
+			.ring = &ring, .pc = pc, .nr_copies = 6,
+		};
+		pthread_create(threads + i, NULL, placement_worker, args + i);
+	}
+	for (int i = 0; i < NR_CACHE_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		ck_assert_int_eq(args[i].nr_errors, 0);
+	}
+	/* every lookup is counted, and some of the hot objects must hit */
+	placement_cache_get_stat(pc, &nr_lookup, &nr_miss);
+	ck_assert_int_eq(nr_lookup, NR_CACHE_THREADS * NR_PLACEMENT_OBJECTS /
+			 16);
+	ck_assert(nr_miss < nr_lookup);
+
+	memset(pc, 0, sizeof(*pc));
+	for (int i = 0; i < NR_PLACEMENT_OBJECTS; i++)
+		oid_to_vnodes_cached(vid_to_data_oid(1, i % 256), &ring, pc,
+				     NR_PLACEMENT_COPIES, vnodes);
+
+	placement_cache_get_stat(pc, &nr_lookup, &nr_miss);
+	/* each hot object is placed on the ring at least once, then cached */
+	ck_assert_int_eq(nr_lookup, NR_PLACEMENT_OBJECTS);
+	ck_assert(nr_miss >= 256 && nr_miss < NR_PLACEMENT_OBJECTS / 16);
+
+	free(pc);
+	vnode_ring_destroy(&ring);
+	rb_destroy(&vroot, struct sd_vnode, rb);
+}
+END_TEST
+
+#define NR_BALANCE_NODES 20
+#define NR_BALANCE_OBJECTS (1 << 15)
+
+/* Place the objects on the nodes by the algorithm of 'flags' */
+static const struct sd_node **place_objects(struct sd_node *nodes,
+					    int nr_nodes, int nr_copies,
+					    uint16_t flags)
+{
+	const struct sd_node **placement;
+	struct rb_root nroot = RB_ROOT, vroot = RB_ROOT;
+	struct vnode_ring ring;
+
+	for (int i = 0; i < nr_nodes; i++)
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+	nodes_to_vnode_ring(&nroot, &vroot, &ring, flags);
+
+	placement = xmalloc(sizeof(*placement) * NR_BALANCE_OBJECTS *
+			    nr_copies);
+	for (int i = 0; i < NR_BALANCE_OBJECTS; i++)
+		oid_to_nodes(vid_to_data_oid(i / 1024, i % 1024), &ring,
+			     nr_copies, placement + i * nr_copies);
+
+	vnode_ring_destroy(&ring);
+	rb_destroy(&vroot, struct sd_vnode, rb);
+	return placement;
+}
+
+/* Return the largest ratio of the load of a node to its fair share */
+static double load_imbalance(struct sd_node *nodes, int nr_nodes,
+			     int nr_copies, const struct sd_node **placement)
+{
+	double max = 0, total_weight = 0;
+	int *load = xzalloc(sizeof(*load) * nr_nodes);
+
+	for (int i = 0; i < nr_nodes; i++)
+		total_weight += nodes[i].nr_vnodes;
+	for (int i = 0; i < NR_BALANCE_OBJECTS * nr_copies; i++)
+		load[placement[i] - nodes]++;
+
+	for (int i = 0; i < nr_nodes; i++) {
+		double fair = (double)NR_BALANCE_OBJECTS * nr_copies *
+			nodes[i].nr_vnodes / total_weight;
+
+		max = max(max, load[i] / fair);
+	}
+
+	free(load);
+	return max;
+}
+
+/* Return the ratio of the replica which are moved to another node */
+static double moved_ratio(int nr_copies, const struct sd_node **p1,
+			  const struct sd_node **p2)
+{
+	int moved = 0;
+
+	for (int i = 0; i < NR_BALANCE_OBJECTS; i++) {
+		const struct sd_node **r1 = p1 + i * nr_copies;
+		const struct sd_node **r2 = p2 + i * nr_copies;
+
+		for (int j = 0; j < nr_copies; j++) {
+			int k;
+
+			for (k = 0; k < nr_copies; k++)
+				if (node_eq(r2[j], r1[k]))
+					break;
+			moved += k == nr_copies;
+		}
+	}
+
+	return (double)moved / (NR_BALANCE_OBJECTS * nr_copies);
+}
+
+/*
+ * check that the load imbalance and the object movement on node addition and
+ * removal of straw2 are close to ideal
+ */
+START_TEST(test_placement_balance)
+{
+	static struct sd_node nodes[NR_PLACEMENT_NODES + 1];
+	const struct sd_node **p1, **p2;
+	int n = NR_BALANCE_NODES, copies = NR_PLACEMENT_COPIES;
+	uint16_t algo = SD_CLUSTER_FLAG_STRAW2;
+	struct rb_root vroot;
+	double imbalance, zoned, weighted, added, removed;
+
+	/* every node in its own zone, plus one node to add */
+	init_placement_nodes(nodes, n, &vroot);
+	rb_destroy(&vroot, struct sd_vnode, rb);
+	nodes[n] = nodes[n - 1];
+	nodes[n].nid.addr[14] = 1;
+	nodes[n].zone = n;
+
+	p1 = place_objects(nodes, n, copies, algo);
+	imbalance = load_imbalance(nodes, n, copies, p1);
+
+	p2 = place_objects(nodes, n + 1, copies, algo);
+	added = moved_ratio(copies, p1, p2);
+	free(p2);
+
+	p2 = place_objects(nodes + 1, n - 1, copies, algo);
+	removed = moved_ratio(copies, p1, p2);
+	free(p2);
+	free(p1);
+
+	/* a node of double weight */
+	nodes[0].nr_vnodes *= 2;
+	p1 = place_objects(nodes, n, copies, algo);
+	weighted = load_imbalance(nodes, n, copies, p1);
+	free(p1);
+
+	/* some nodes share a zone */
+	init_placement_nodes(nodes, 10, &vroot);
+	rb_destroy(&vroot, struct sd_vnode, rb);
+	p1 = place_objects(nodes, n, copies, algo);
+	zoned = load_imbalance(nodes, n, copies, p1);
+	free(p1);
+
+	ck_assert(imbalance < 1.1);
+	ck_assert(weighted < 1.1);
+	ck_assert(zoned < 1.1);
+	ck_assert(added < 1.2 / (n + 1));
+	ck_assert(removed < 1.2 / n);
+}
+END_TEST
+
 static Suite *test_suite(void)
 {
 	Suite *s = suite_create("test hash");
@@ -557,6 +921,7 @@ static Suite *test_suite(void)
 	TCase *tc_disks3 = tcase_create("many disks with some vdisks");
 	TCase *tc_objects1 = tcase_create("many data objects");
 	TCase *tc_objects2 = tcase_create("many vdi objects");
+	TCase *tc_placement = tcase_create("batched placement");
 
 	tcase_add_checked_fixture(tc_basic1, basic1_setup, NULL);
 	tcase_add_checked_fixture(tc_basic2, basic2_setup, NULL);
@@ -589,6 +954,10 @@ static Suite *test_suite(void)
 	tcase_add_test(tc_disks3, test_disks_dispersion);
 	tcase_add_test(tc_objects1, test_objects_dispersion);
 	tcase_add_test(tc_objects2, test_objects_dispersion);
+	tcase_add_test(tc_placement, test_screen_object_list);
+	tcase_add_test(tc_placement, test_ring_lookup);
+	tcase_add_test(tc_placement, test_placement_cache);
+	tcase_add_test(tc_placement, test_placement_balance);
 
 	suite_add_tcase(s, tc_basic1);
 	suite_add_tcase(s, tc_basic2);
@@ -599,6 +968,7 @@ static Suite *test_suite(void)
 	suite_add_tcase(s, tc_disks2);
 	suite_add_tcase(s, tc_objects1);
 	suite_add_tcase(s, tc_objects2);
+	suite_add_tcase(s, tc_placement);
 
 	return s;
 }
@@ -0,0 +1,665 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+
+#include "object_cache.c"
+
+/*
+ * The backend is a pattern computed from the oid and the offset.  Writes to
+ * the backend are only recorded, so that the pushed runs can be checked.
+ */
+#define VID_A		0x100
+#define VID_B		0x200
+#define VID_RO		0x300	/* a snapshot */
+#define VID_EC		0x400	/* erasure coded with 16K stripes */
+
+#define BSIZE		BLOCK_SIZE
+#define MAX_PUSHES	256
+
+struct push {
+	uint64_t oid;
+	uint64_t offset;
+	uint32_t len;
+	bool create;
+};
+
+static char test_dir[] = "/tmp/test_object_cache.XXXXXX";
+static struct push pushes[MAX_PUSHES];
+static int nr_pushes;
+static struct sd_mutex push_lock = SD_MUTEX_INITIALIZER;
+
+static inline uint8_t backend_byte(uint64_t oid, uint64_t pos)
+{
+	return (oid >> 16) + oid + pos / 7;
+}
+
+bool oid_is_readonly(uint64_t oid)
+{
+	return oid_to_vid(oid) == VID_RO;
+}
+
+bool is_erasure_oid(uint64_t oid)
+{
+	return oid_to_vid(oid) == VID_EC;
+}
+
+uint32_t get_vdi_ec_stripe_size(uint32_t vid)
+{
+	return vid == VID_EC ? ec_stripe_size(4) : SD_EC_DATA_STRIPE_SIZE;
+}
+
+int prealloc(int fd, uint32_t size)
+{
+	return ftruncate(fd, size);
+}
+
+int exec_local_req(struct sd_req *rq, void *data)
+{
+	uint8_t *buf = data;
+	struct push *p;
+
+	switch (rq->opcode) {
+	case SD_OP_READ_OBJ:
+		for (uint32_t i = 0; i < rq->data_length; i++)
+			buf[i] = backend_byte(rq->obj.oid, rq->obj.offset + i);
+		break;
+	case SD_OP_WRITE_OBJ:
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		/* pushed by the workers */
+		sd_mutex_lock(&push_lock);
+		ck_assert_int_lt(nr_pushes, MAX_PUSHES);
+		p = pushes + nr_pushes++;
+		p->oid = rq->obj.oid;
+		p->offset = rq->obj.offset;
+		p->len = rq->data_length;
+		p->create = rq->opcode == SD_OP_CREATE_AND_WRITE_OBJ;
+		sd_mutex_unlock(&push_lock);
+		break;
+	default:
+		ck_assert_msg(false, "unexpected opcode %x", rq->opcode);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static size_t get_nr_nodes(void)
+{
+	return 1;
+}
+
+static void check_push(int i, uint64_t oid, int first_bit, int last_bit,
+		       bool create)
+{
+	ck_assert_int_lt(i, nr_pushes);
+	ck_assert_msg(pushes[i].oid == oid, "push %d of %"PRIx64, i,
+		      pushes[i].oid);
+	ck_assert_int_eq(pushes[i].offset, first_bit * BSIZE);
+	ck_assert_int_eq(pushes[i].len, (last_bit - first_bit + 1) * BSIZE);
+	ck_assert_int_eq(pushes[i].create, create);
+}
+
+/* Read or write 'len' bytes at 'off' of the object through the cache */
+static int cache_io(uint32_t vid, uint64_t idx, bool write, uint64_t off,
+		    uint32_t len)
+{
+	struct request req = {};
+	int ret;
+
+	req.rq.opcode = write ? SD_OP_WRITE_OBJ : SD_OP_READ_OBJ;
+	req.rq.flags = write ? SD_FLAG_CMD_WRITE | SD_FLAG_CMD_CACHE : 0;
+	req.rq.obj.oid = vid_to_data_oid(vid, idx);
+	req.rq.obj.offset = off;
+	req.rq.data_length = len;
+	req.data = xvalloc(len);
+	memset(req.data, 0xab, len);
+
+	ret = object_cache_handle_request(&req);
+	if (!write && ret == SD_RES_SUCCESS)
+		for (uint32_t i = 0; i < len; i++)
+			ck_assert_int_eq(((uint8_t *)req.data)[i],
+					 backend_byte(req.rq.obj.oid, off + i));
+	free(req.data);
+
+	return ret;
+}
+
+static struct object_cache_entry *get_entry(uint32_t vid, uint64_t idx)
+{
+	struct object_cache *oc = find_object_cache(vid, false);
+
+	return oc ? lru_tree_search(&oc->lru_tree, idx) : NULL;
+}
+
+/*
+ * The pushers signal the completion before they clear the dirty bits and put
+ * the entries, so wait for them to finish.
+ */
+static void wait_for_pushers(void)
+{
+	while (!work_queue_empty(sys->oc_push_wqueue))
+		event_loop(100);
+}
+
+static bool is_dirty(uint32_t vid, uint64_t idx)
+{
+	wait_for_pushers();
+	return entry_is_dirty(get_entry(vid, idx));
+}
+
+/* Add clean entries of 'vid' with empty files, without kicking the reclaimer */
+static void add_entries(uint32_t vid, uint64_t start, int nr)
+{
+	struct object_cache *oc = find_object_cache(vid, true);
+	char path[PATH_MAX];
+
+	for (int i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), "%s/%06"PRIx32"/%016"PRIx64,
+			 object_cache_dir, vid, start + i);
+		close(open(path, O_CREAT | O_WRONLY, sd_def_fmode));
+		add_to_lru_cache(oc, start + i, false);
+	}
+}
+
+/* Reference the entry again after the correlated reference period */
+static void reference_entry(struct object_cache_entry *entry)
+{
+	uatomic_set(&entry->ref_time, 0);
+	lru_touch(entry);
+}
+
+static void reclaim(void)
+{
+	struct reclaim_work rw = {};
+
+	do_reclaim(&rw.work);
+}
+
+static uint64_t nr_evicted(void)
+{
+	struct object_cache_info info;
+
+	object_cache_get_info(&info);
+	return info.evict;
+}
+
+static void setup(void)
+{
+	static bool initialized;
+
+	if (!initialized) {
+		sys = xzalloc(sizeof(*sys));
+		/* a RAM tier of two objects */
+		sys->object_cache_mem_size = 8;
+		ck_assert_int_eq(init_event(64), 0);
+		ck_assert_int_eq(init_work_queue(get_nr_nodes), 0);
+		sys->oc_push_wqueue = create_work_queue("oc_push", WQ_DYNAMIC);
+		sys->oc_reclaim_wqueue = create_ordered_work_queue("oc_reclaim");
+		ck_assert_ptr_ne(mkdtemp(test_dir), NULL);
+		ck_assert_int_eq(object_cache_init(test_dir), 0);
+		initialized = true;
+	}
+
+	/* large enough not to reclaim unless a test says so */
+	sys->object_cache_size = 1024;
+	sys->object_cache_reserve = 0;
+	sys->object_cache_dirty_age = 0;
+	sys->object_cache_dirty_ratio = 100;
+	sys->object_cache_push_rate = 0;
+	/* don't kick the writeback worker behind the tests */
+	sys->cinfo.status = SD_STATUS_WAIT;
+	gcache.wb_budget = UINT64_MAX;
+	memset(gcache.stat, 0, sizeof(gcache.stat));
+	nr_pushes = 0;
+}
+
+static void teardown(void)
+{
+	wait_for_pushers();
+	object_cache_format();
+	ck_assert_int_eq(gcache.capacity, 0);
+	ck_assert_int_eq(gcache.nr_inactive, 0);
+	ck_assert_int_eq(gcache.nr_active, 0);
+}
+
+/* dirty runs with small clean gaps between them are pushed together */
+START_TEST(test_push_merge)
+{
+	DECLARE_BITMAP(bmap, CACHE_NR_BLOCKS) = {};
+	uint64_t oid = vid_to_data_oid(VID_A, 1);
+
+	ck_assert_int_eq(cache_io(VID_A, 1, false, 0, 1), SD_RES_SUCCESS);
+
+	/* 0-1 and 6-7 are merged, the gap before 13 is too large */
+	set_bit(0, bmap);
+	set_bit(1, bmap);
+	set_bit(6, bmap);
+	set_bit(7, bmap);
+	set_bit(13, bmap);
+	/* 100, 102 and 105 are merged, so are the last two runs */
+	set_bit(100, bmap);
+	set_bit(102, bmap);
+	set_bit(105, bmap);
+	set_bit(CACHE_NR_BLOCKS - 6, bmap);
+	set_bit(CACHE_NR_BLOCKS - 1, bmap);
+	ck_assert_int_eq(push_cache_object(VID_A, 1, bmap, false),
+			 SD_RES_SUCCESS);
+	ck_assert_int_eq(nr_pushes, 4);
+	check_push(0, oid, 0, 7, false);
+	check_push(1, oid, 13, 13, false);
+	check_push(2, oid, 100, 105, false);
+	check_push(3, oid, CACHE_NR_BLOCKS - 6, CACHE_NR_BLOCKS - 1, false);
+
+	/* an object created in the cache is pushed with one request */
+	nr_pushes = 0;
+	ck_assert_int_eq(push_cache_object(VID_A, 1, bmap, true),
+			 SD_RES_SUCCESS);
+	ck_assert_int_eq(nr_pushes, 1);
+	check_push(0, oid, 0, CACHE_NR_BLOCKS - 1, true);
+
+	/* the dirty blocks of writes are tracked in 4K */
+	nr_pushes = 0;
+	ck_assert_int_eq(cache_io(VID_A, 1, true, BSIZE * 10 + 100, 10),
+			 SD_RES_SUCCESS);
+	ck_assert_int_eq(cache_io(VID_A, 1, true, BSIZE * 20 - 1, 2),
+			 SD_RES_SUCCESS);
+	ck_assert_int_eq(object_cache_flush_vdi(VID_A), SD_RES_SUCCESS);
+	ck_assert_int_eq(nr_pushes, 2);
+	check_push(0, oid, 10, 10, false);
+	check_push(1, oid, 19, 20, false);
+	ck_assert(!is_dirty(VID_A, 1));
+}
+END_TEST
+
+/* the runs of erasure coded objects are widened to whole stripes */
+START_TEST(test_push_stripe)
+{
+	DECLARE_BITMAP(bmap, CACHE_NR_BLOCKS) = {};
+	uint64_t oid = vid_to_data_oid(VID_EC, 0);
+
+	ck_assert_int_eq(cache_io(VID_EC, 0, false, 0, 1), SD_RES_SUCCESS);
+
+	/* 1 and 6 are in the adjacent stripes, 21 and 30 are 4 blocks apart */
+	set_bit(1, bmap);
+	set_bit(6, bmap);
+	set_bit(21, bmap);
+	set_bit(30, bmap);
+	set_bit(CACHE_NR_BLOCKS - 1, bmap);
+	ck_assert_int_eq(push_cache_object(VID_EC, 0, bmap, false),
+			 SD_RES_SUCCESS);
+	ck_assert_int_eq(nr_pushes, 3);
+	check_push(0, oid, 0, 7, false);
+	check_push(1, oid, 20, 31, false);
+	check_push(2, oid, CACHE_NR_BLOCKS - 4, CACHE_NR_BLOCKS - 1, false);
+
+	/* so are the runs of writes */
+	nr_pushes = 0;
+	ck_assert_int_eq(cache_io(VID_EC, 0, true, BSIZE * 9 + 100, 10),
+			 SD_RES_SUCCESS);
+	ck_assert_int_eq(object_cache_flush_vdi(VID_EC), SD_RES_SUCCESS);
+	ck_assert_int_eq(nr_pushes, 1);
+	check_push(0, oid, 8, 11, false);
+}
+END_TEST
+
+/* the objects older than dirty_age are pushed with their dirty neighbours */
+START_TEST(test_writeback_dirty_age)
+{
+	struct object_cache *oc;
+	uint64_t now;
+
+	sys->object_cache_dirty_age = 2;
+	for (int i = 0; i < 4; i++)
+		ck_assert_int_eq(cache_io(VID_A, i * 2, true, 0, BSIZE),
+				 SD_RES_SUCCESS);
+	for (int i = 10; i < 13; i++)
+		ck_assert_int_eq(cache_io(VID_A, i, true, 0, BSIZE),
+				 SD_RES_SUCCESS);
+	oc = find_object_cache(VID_A, false);
+	ck_assert_int_eq(oc->dirty_count, 7);
+
+	/* nothing is old enough */
+	now = clock_get_time();
+	sd_mutex_lock(&oc->push_mutex);
+	object_cache_writeback(oc, now);
+	ck_assert_int_eq(nr_pushes, 0);
+
+	/* 10 is aged, and 11 and 12 are pushed together with it */
+	get_entry(VID_A, 10)->dirty_time = now - 3000000000ULL;
+	list_move(&get_entry(VID_A, 10)->dirty_list, &oc->dirty_head);
+	object_cache_writeback(oc, now);
+	ck_assert_int_eq(nr_pushes, 3);
+	ck_assert_int_eq(oc->dirty_count, 4);
+	for (int i = 10; i < 13; i++)
+		ck_assert(!is_dirty(VID_A, i));
+
+	/* all aged, but 0, 2, 4 and 6 are not neighbours */
+	object_cache_writeback(oc, now + 3000000000ULL);
+	sd_mutex_unlock(&oc->push_mutex);
+	ck_assert_int_eq(nr_pushes, 7);
+	ck_assert_int_eq(oc->dirty_count, 0);
+	ck_assert(list_empty(&oc->dirty_head));
+}
+END_TEST
+
+/* the oldest dirty objects are pushed until the VDI is under dirty_ratio */
+START_TEST(test_writeback_dirty_ratio)
+{
+	struct object_cache *oc;
+
+	sys->object_cache_dirty_ratio = 50;
+	/* 14 dirty objects out of 20 */
+	for (int i = 0; i < 14; i++)
+		ck_assert_int_eq(cache_io(VID_A, i * 2, true, 0, BSIZE),
+				 SD_RES_SUCCESS);
+	for (int i = 0; i < 6; i++)
+		ck_assert_int_eq(cache_io(VID_A, i * 2 + 1, false, 0, BSIZE),
+				 SD_RES_SUCCESS);
+	oc = find_object_cache(VID_A, false);
+	ck_assert(over_dirty_ratio(oc));
+
+	sd_mutex_lock(&oc->push_mutex);
+	object_cache_writeback(oc, clock_get_time());
+	sd_mutex_unlock(&oc->push_mutex);
+
+	/* down to MAX_DIRTY_OBJECT_COUNT, where the ratio isn't applied */
+	ck_assert_int_eq(nr_pushes, 4);
+	ck_assert_int_eq(oc->dirty_count, MAX_DIRTY_OBJECT_COUNT);
+	ck_assert(!over_dirty_ratio(oc));
+	for (int i = 0; i < 4; i++)
+		ck_assert(!is_dirty(VID_A, i * 2));
+	for (int i = 4; i < 14; i++)
+		ck_assert(is_dirty(VID_A, i * 2));
+}
+END_TEST
+
+/* the pushed data is paced by push_rate */
+START_TEST(test_writeback_push_rate)
+{
+	struct object_cache *oc;
+
+	sys->object_cache_dirty_age = 1;
+	sys->object_cache_push_rate = 1;
+	/* 512K dirty in each object */
+	for (int i = 0; i < 4; i++)
+		ck_assert_int_eq(cache_io(VID_A, i * 2, true, 0, 512 * 1024),
+				 SD_RES_SUCCESS);
+	oc = find_object_cache(VID_A, false);
+
+	/* half a second earns half of the rate */
+	gcache.wb_budget = 0;
+	gcache.wb_refill_time = clock_get_time() - 500000000;
+	refill_writeback_budget();
+	ck_assert_int_ge(gcache.wb_budget, 512 * 1024);
+	ck_assert_int_lt(gcache.wb_budget, 1024 * 1024);
+
+	/* but never more than one second of it */
+	gcache.wb_refill_time = clock_get_time() - 10000000000ULL;
+	refill_writeback_budget();
+	ck_assert_int_eq(gcache.wb_budget, 1024 * 1024);
+
+	sd_mutex_lock(&oc->push_mutex);
+	object_cache_writeback(oc, clock_get_time() + 2000000000ULL);
+	ck_assert_int_eq(nr_pushes, 2);
+	ck_assert_int_eq(gcache.wb_budget, 0);
+	ck_assert_int_eq(oc->dirty_count, 2);
+
+	/* no limit */
+	sys->object_cache_push_rate = 0;
+	refill_writeback_budget();
+	object_cache_writeback(oc, clock_get_time() + 2000000000ULL);
+	sd_mutex_unlock(&oc->push_mutex);
+	ck_assert_int_eq(nr_pushes, 4);
+	ck_assert_int_eq(oc->dirty_count, 0);
+}
+END_TEST
+
+/* a sequential scan of a VDI doesn't evict the hot objects of another VDI */
+START_TEST(test_reclaim_scan)
+{
+	struct object_cache *a, *b;
+
+	/* 10 objects, reclaimed down to 9 */
+	sys->object_cache_size = 40;
+	add_entries(VID_A, 0, 4);
+	for (int i = 0; i < 4; i++)
+		reference_entry(get_entry(VID_A, i));
+
+	/* VDI B reads 8 objects once, within the correlated period */
+	add_entries(VID_B, 0, 8);
+	for (int i = 0; i < 8; i++)
+		lru_touch(get_entry(VID_B, i));
+	ck_assert_int_eq(gcache.nr_inactive, 12);
+
+	reclaim();
+	a = find_object_cache(VID_A, false);
+	b = find_object_cache(VID_B, false);
+	ck_assert_int_eq(gcache.capacity, 36);
+	ck_assert_int_eq(a->total_count, 4);
+	ck_assert_int_eq(b->total_count, 5);
+	for (int i = 0; i < 3; i++)
+		ck_assert_ptr_eq(get_entry(VID_B, i), NULL);
+	for (int i = 0; i < 4; i++)
+		ck_assert(get_entry(VID_A, i)->active);
+	ck_assert_int_eq(gcache.nr_active, 4);
+	ck_assert_int_eq(gcache.nr_inactive, 5);
+	ck_assert_int_eq(nr_evicted(), 3);
+
+	/* the scan goes on and evicts its own objects only */
+	add_entries(VID_B, 8, 8);
+	reclaim();
+	ck_assert_int_eq(a->total_count, 4);
+	ck_assert_int_eq(b->total_count, 5);
+	for (int i = 0; i < 11; i++)
+		ck_assert_ptr_eq(get_entry(VID_B, i), NULL);
+	ck_assert_int_eq(nr_evicted(), 11);
+
+	/*
+	 * With few inactive objects left, the active ones are evicted too, but
+	 * a referenced one is given another round.
+	 */
+	sys->object_cache_size = 12;
+	reference_entry(get_entry(VID_A, 0));
+	reclaim();
+	ck_assert_int_eq(gcache.capacity, 8);
+	ck_assert_int_eq(b->total_count, 0);
+	ck_assert_int_eq(a->total_count, 2);
+	ck_assert_ptr_ne(get_entry(VID_A, 0), NULL);
+	ck_assert_ptr_ne(get_entry(VID_A, 3), NULL);
+	ck_assert_int_eq(nr_evicted(), 18);
+}
+END_TEST
+
+/* neither dirty nor in-use objects are reclaimed */
+START_TEST(test_reclaim_skip)
+{
+	sys->object_cache_size = 20;
+	add_entries(VID_A, 0, 8);
+	set_bit(0, get_entry(VID_A, 0)->bmap);
+	get_cache_entry(get_entry(VID_A, 1));
+
+	reclaim();
+	ck_assert_int_eq(gcache.capacity, 16);
+	ck_assert_ptr_ne(get_entry(VID_A, 0), NULL);
+	ck_assert_ptr_ne(get_entry(VID_A, 1), NULL);
+	for (int i = 2; i < 6; i++)
+		ck_assert_ptr_eq(get_entry(VID_A, i), NULL);
+
+	clear_bit(0, get_entry(VID_A, 0)->bmap);
+	put_cache_entry(get_entry(VID_A, 1));
+}
+END_TEST
+
+/* the reclaimer leaves 'reserve' of each VDI cached */
+START_TEST(test_reclaim_reserve)
+{
+	struct object_cache *a, *b;
+
+	/* two objects of each VDI are reserved */
+	sys->object_cache_size = 40;
+	sys->object_cache_reserve = 8;
+	add_entries(VID_A, 0, 3);
+	add_entries(VID_B, 0, 9);
+
+	/* the oldest of A is reclaimed, then B */
+	reclaim();
+	a = find_object_cache(VID_A, false);
+	b = find_object_cache(VID_B, false);
+	ck_assert_int_eq(gcache.capacity, 36);
+	ck_assert_int_eq(a->total_count, 2);
+	ck_assert_int_eq(b->total_count, 7);
+	ck_assert_ptr_eq(get_entry(VID_A, 0), NULL);
+	ck_assert_ptr_eq(get_entry(VID_B, 0), NULL);
+	ck_assert_ptr_eq(get_entry(VID_B, 1), NULL);
+
+	/* the reclaimer gives up when everything left is reserved */
+	sys->object_cache_size = 4;
+	reclaim();
+	ck_assert_int_eq(a->total_count, 2);
+	ck_assert_int_eq(b->total_count, 2);
+	ck_assert_int_eq(gcache.capacity, 16);
+	ck_assert_int_eq(nr_evicted(), 8);
+}
+END_TEST
+
+static void *read_thread(void *arg)
+{
+	ck_assert_int_eq(cache_io(VID_A, 0, false, 0, BSIZE), SD_RES_SUCCESS);
+	return NULL;
+}
+
+/* hits, misses and evictions counted by many threads are summed up */
+START_TEST(test_counters)
+{
+	struct object_cache_info info;
+	pthread_t threads[4];
+
+	for (int i = 0; i < 3; i++)
+		ck_assert_int_eq(cache_io(VID_A, i, false, 0, BSIZE),
+				 SD_RES_SUCCESS);
+	ck_assert_int_eq(cache_io(VID_A, 0, false, BSIZE, BSIZE),
+			 SD_RES_SUCCESS);
+	ck_assert_int_eq(cache_io(VID_A, 1, true, 0, BSIZE), SD_RES_SUCCESS);
+	for (int i = 0; i < ARRAY_SIZE(threads); i++)
+		pthread_create(threads + i, NULL, read_thread, NULL);
+	for (int i = 0; i < ARRAY_SIZE(threads); i++)
+		pthread_join(threads[i], NULL);
+
+	ck_assert_int_eq(cache_io(VID_B, 0, false, 0, BSIZE), SD_RES_SUCCESS);
+
+	/* all but the dirty one are evicted */
+	sys->object_cache_size = 8;
+	reclaim();
+
+	object_cache_get_info(&info);
+	ck_assert_int_eq(info.miss, 4);
+	ck_assert_int_eq(info.hit, 6);
+	ck_assert_int_eq(info.evict, 3);
+	ck_assert_int_eq(info.used, 4 * 1024 * 1024);
+	ck_assert_int_eq(info.size, 8 * 1024 * 1024);
+	ck_assert_int_eq(info.count, 2);
+}
+END_TEST
+
+/* only the hot snapshot objects are copied into the RAM tier */
+START_TEST(test_ram_tier)
+{
+	struct object_cache_info info;
+	struct object_cache_entry *entry;
+
+	ck_assert_int_eq(mem_arena.nr_slots, 2);
+
+	/* read once, which might be a scan */
+	ck_assert_int_eq(cache_io(VID_RO, 0, false, 0, BSIZE), SD_RES_SUCCESS);
+	entry = get_entry(VID_RO, 0);
+	ck_assert_ptr_eq(entry->mem, NULL);
+
+	/* referenced again, from memory */
+	uatomic_set(&entry->ref_time, 0);
+	ck_assert_int_eq(cache_io(VID_RO, 0, false, 0, BSIZE), SD_RES_SUCCESS);
+	ck_assert_int_eq(cache_io(VID_RO, 0, false, 100, 5000),
+			 SD_RES_SUCCESS);
+	ck_assert_ptr_ne(entry->mem, NULL);
+	ck_assert_int_eq(cache_io(VID_RO, 0, false, SD_DATA_OBJ_SIZE - BSIZE,
+				  BSIZE), SD_RES_SUCCESS);
+
+	/* writable objects aren't copied */
+	ck_assert_int_eq(cache_io(VID_A, 0, false, 0, BSIZE), SD_RES_SUCCESS);
+	entry = get_entry(VID_A, 0);
+	uatomic_set(&entry->ref_time, 0);
+	for (int i = 0; i < 2; i++)
+		ck_assert_int_eq(cache_io(VID_A, 0, false, 0, BSIZE),
+				 SD_RES_SUCCESS);
+	ck_assert_ptr_eq(entry->mem, NULL);
+
+	/* the objects which don't fit are read from the cache files */
+	for (int i = 1; i < 3; i++) {
+		ck_assert_int_eq(cache_io(VID_RO, i, false, 0, BSIZE),
+				 SD_RES_SUCCESS);
+		entry = get_entry(VID_RO, i);
+		uatomic_set(&entry->ref_time, 0);
+		for (int j = 0; j < 2; j++)
+			ck_assert_int_eq(cache_io(VID_RO, i, false, BSIZE * j,
+						  BSIZE), SD_RES_SUCCESS);
+	}
+	ck_assert_ptr_ne(get_entry(VID_RO, 1)->mem, NULL);
+	ck_assert_ptr_eq(get_entry(VID_RO, 2)->mem, NULL);
+	object_cache_get_info(&info);
+	ck_assert_int_eq(info.mem_size, 8 * 1024 * 1024);
+	ck_assert_int_eq(info.mem_used, 8 * 1024 * 1024);
+
+	/* the slots are freed with the entries */
+	object_cache_format();
+	object_cache_get_info(&info);
+	ck_assert_int_eq(info.mem_used, 0);
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test object cache");
+
+	TCase *tc_push = tcase_create("push");
+	TCase *tc_reclaim = tcase_create("reclaim");
+	TCase *tc_stat = tcase_create("stat");
+
+	tcase_add_checked_fixture(tc_push, setup, teardown);
+	tcase_add_test(tc_push, test_push_merge);
+	tcase_add_test(tc_push, test_push_stripe);
+	tcase_add_test(tc_push, test_writeback_dirty_age);
+	tcase_add_test(tc_push, test_writeback_dirty_ratio);
+	tcase_add_test(tc_push, test_writeback_push_rate);
+
+	tcase_add_checked_fixture(tc_reclaim, setup, teardown);
+	tcase_add_test(tc_reclaim, test_reclaim_scan);
+	tcase_add_test(tc_reclaim, test_reclaim_skip);
+	tcase_add_test(tc_reclaim, test_reclaim_reserve);
+
+	tcase_add_checked_fixture(tc_stat, setup, teardown);
+	tcase_add_test(tc_stat, test_counters);
+	tcase_add_test(tc_stat, test_ram_tier);
+
+	suite_add_tcase(s, tc_push);
+	suite_add_tcase(s, tc_reclaim);
+	suite_add_tcase(s, tc_stat);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	rmdir_r(test_dir);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
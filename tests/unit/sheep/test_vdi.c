@@ -15,11 +15,14 @@
 
 #include "sheep_priv.h"
 
+/* struct vdi_state and its version */
+#define LOG_RECORD_SIZE (sizeof(struct vdi_state) + sizeof(uint64_t))
+
 START_TEST(test_vdi)
 {
-	add_vdi_state(1, 1, true);
-	add_vdi_state(2, 1, true);
-	add_vdi_state(3, 2, false);
+	add_vdi_state(1, 1, true, 0, 0);
+	add_vdi_state(2, 1, true, 0, 0);
+	add_vdi_state(3, 2, false, 0, 0);
 
 	ck_assert_int_eq(get_vdi_copy_number(1), 1);
 	ck_assert_int_eq(get_vdi_copy_number(2), 1);
@@ -27,12 +30,118 @@ START_TEST(test_vdi)
 }
 END_TEST
 
+static int fetch_vdi_states(uint64_t *generation, uint64_t *version,
+			    struct vdi_state *vs, int max_nr)
+{
+	struct sd_req hdr;
+	struct sd_rsp rsp;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&rsp, 0, sizeof(rsp));
+	hdr.data_length = sizeof(*vs) * max_nr;
+	hdr.vdi_sync.generation = *generation;
+	hdr.vdi_sync.version = *version;
+	fill_vdi_state_list(&hdr, &rsp, vs);
+	*generation = rsp.vdi_sync.generation;
+	*version = rsp.vdi_sync.version;
+
+	return rsp.data_length / sizeof(*vs);
+}
+
+START_TEST(test_vdi_state_sync)
+{
+	struct vdi_state vs[4];
+	uint64_t generation = 0, version = 0;
+
+	clean_vdi_state();
+	add_vdi_state(10, 1, false, 0, 0);
+	add_vdi_state(11, 2, false, 0, 0);
+	add_vdi_state(12, 3, false, 0, 0);
+
+	/* paginated full sync */
+	ck_assert_int_eq(fetch_vdi_states(&generation, &version, vs, 2), 2);
+	ck_assert_int_eq(vs[0].vid, 10);
+	ck_assert_int_eq(vs[1].vid, 11);
+	ck_assert_int_eq(fetch_vdi_states(&generation, &version, vs, 2), 1);
+	ck_assert_int_eq(vs[0].vid, 12);
+	ck_assert_int_eq(fetch_vdi_states(&generation, &version, vs, 2), 0);
+
+	/* only the changed entries are returned */
+	add_vdi_state(11, 2, false, 0, 0);
+	ck_assert_int_eq(fetch_vdi_states(&generation, &version, vs, 4), 0);
+	add_vdi_state(10, 1, true, 0, 0);
+	add_vdi_state(13, 1, false, 0, 0);
+	ck_assert_int_eq(fetch_vdi_states(&generation, &version, vs, 4), 2);
+	ck_assert_int_eq(vs[0].vid, 10);
+	ck_assert_int_eq(vs[0].snapshot, 1);
+	ck_assert_int_eq(vs[1].vid, 13);
+
+	/* a new generation starts over */
+	clean_vdi_state();
+	add_vdi_state(20, 1, false, 0, 0);
+	ck_assert_int_eq(fetch_vdi_states(&generation, &version, vs, 4), 1);
+	ck_assert_int_eq(vs[0].vid, 20);
+}
+END_TEST
+
+static off_t vdi_state_log_size(const char *dir)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/vdi_state", dir);
+	ck_assert_int_eq(stat(path, &st), 0);
+
+	/* the header has the magic, the padding and the generation */
+	ck_assert_int_eq((st.st_size - 16) % LOG_RECORD_SIZE, 0);
+	return (st.st_size - 16) / LOG_RECORD_SIZE;
+}
+
+/*
+ * check that changing the states doesn't write the log, and a sync appends
+ * the changed entries only
+ */
+START_TEST(test_vdi_state_log)
+{
+	char dir[] = "/tmp/test_vdi.XXXXXX", path[PATH_MAX];
+
+	ck_assert(mkdtemp(dir) != NULL);
+	ck_assert_int_eq(init_vdi_state_log(dir), 0);
+	clean_vdi_state();
+	ck_assert_int_eq(vdi_state_log_size(dir), 0);
+
+	add_vdi_state(30, 1, false, 0, 0);
+	add_vdi_state(31, 2, false, 0, 0);
+	add_vdi_state(32, 3, false, 0, 0);
+	ck_assert_int_eq(vdi_state_log_size(dir), 0);
+	ck_assert_int_eq(sync_vdi_state_log(), 0);
+	ck_assert_int_eq(vdi_state_log_size(dir), 3);
+
+	add_vdi_state(31, 2, false, 0, 0);
+	ck_assert_int_eq(sync_vdi_state_log(), 0);
+	ck_assert_int_eq(vdi_state_log_size(dir), 3);
+	add_vdi_state(30, 1, true, 0, 0);
+	ck_assert_int_eq(sync_vdi_state_log(), 0);
+	ck_assert_int_eq(vdi_state_log_size(dir), 4);
+
+	/* a new generation rewrites the log */
+	clean_vdi_state();
+	ck_assert_int_eq(vdi_state_log_size(dir), 0);
+
+	snprintf(path, sizeof(path), "%s/vdi_state", dir);
+	unlink(path);
+	rmdir(dir);
+}
+END_TEST
+
 static Suite *test_suite(void)
 {
 	Suite *s = suite_create("test vdi");
 
 	TCase *tc_vdi = tcase_create("vdi");
 	tcase_add_test(tc_vdi, test_vdi);
+	tcase_add_test(tc_vdi, test_vdi_state_sync);
+	tcase_add_test(tc_vdi, test_vdi_state_log);
 
 	suite_add_tcase(s, tc_vdi);
 
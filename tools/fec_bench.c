@@ -0,0 +1,235 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the erasure code
+ *
+ * This reports the throughput of each GF(2^8) multiply-accumulate kernel
+ * which the CPU supports, the throughput of encoding a whole object with
+ * ec_encode_stripes() against encoding it stripe by stripe for some
+ * policies, and the encode throughput by stripe size.
+ *
+ * usage: fec_bench [-r rounds]
+ */
+
+#include <getopt.h>
+
+#include "fec.c"
+
+#define BENCH_BUF_SIZE	(1024 * 1024)
+
+typedef void (*addmul_func_t)(uint8_t *, const uint8_t *, uint8_t, size_t);
+
+struct addmul_impl {
+	const char *name;
+	addmul_func_t fn;
+	bool usable;
+};
+
+static struct addmul_impl impls[] = {
+	{ "generic", _addmul1, true },
+#ifdef __x86_64__
+	{ "ssse3", addmul_ssse3 },
+	{ "avx2", addmul_avx2 },
+	{ "avx512", addmul_avx512 },
+#endif
+};
+
+static const int stripe_policies[][2] = { {2, 1}, {4, 2}, {8, 3}, {16, 4} };
+
+static int nr_rounds = 8;
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = random();
+}
+
+static uint64_t mb_per_sec(uint64_t bytes, uint64_t ns)
+{
+	return bytes * 1000000 / (ns / 1000 + 1) / 1024 / 1024;
+}
+
+/* encode stripe by stripe as the gateway used to do */
+static void encode_per_stripe(struct fec *ctx, const uint8_t *buf,
+			      uint8_t *ds[], uint8_t *ps[], int nr_stripe,
+			      uint32_t stripe_size)
+{
+	int d = ctx->d, p = ctx->dp - ctx->d;
+	size_t strip_size = stripe_size / d;
+	int pidx[p];
+
+	for (int i = 0; i < p; i++)
+		pidx[i] = d + i;
+
+	for (int i = 0; i < nr_stripe; i++) {
+		const uint8_t *sds[d];
+		uint8_t *sps[p];
+
+		for (int j = 0; j < d; j++) {
+			sds[j] = ds[j] + strip_size * i;
+			memcpy(ds[j] + strip_size * i, buf + strip_size * j,
+			       strip_size);
+		}
+		for (int j = 0; j < p; j++)
+			sps[j] = ps[j] + strip_size * i;
+		fec_encode(ctx, sds, sps, pidx, p, strip_size);
+		buf += stripe_size;
+	}
+}
+
+/*
+ * encode one object with ec_encode_stripes() and, if 't2' is given, with
+ * encode_per_stripe(), and return the elapsed time of each in t1 and t2
+ */
+static void encode_object(int d, int p, uint8_t stripe_shift, uint64_t *t1,
+			  uint64_t *t2)
+{
+	uint32_t stripe_size = ec_stripe_size(stripe_shift);
+	int nr_stripe = SD_DATA_OBJ_SIZE / stripe_size;
+	size_t strip_len = SD_DATA_OBJ_SIZE / d;
+	struct fec *ctx = ec_init(d, d + p);
+	uint8_t *buf = xvalloc(SD_DATA_OBJ_SIZE);
+	uint8_t *ds[d], *ps[p];
+	uint64_t start;
+
+	fill_random(buf, SD_DATA_OBJ_SIZE);
+	/* touch all the pages in advance not to measure page faults */
+	for (int i = 0; i < d; i++) {
+		ds[i] = xvalloc(strip_len);
+		memset(ds[i], 0, strip_len);
+	}
+	for (int i = 0; i < p; i++) {
+		ps[i] = xvalloc(strip_len);
+		memset(ps[i], 0, strip_len);
+	}
+
+	if (t2) {
+		start = clock_get_time();
+		encode_per_stripe(ctx, buf, ds, ps, nr_stripe, stripe_size);
+		*t2 += clock_get_time() - start;
+	}
+
+	start = clock_get_time();
+	ec_encode_stripes(ctx, buf, ds, ps, nr_stripe, stripe_size);
+	*t1 += clock_get_time() - start;
+
+	for (int i = 0; i < d; i++)
+		free(ds[i]);
+	for (int i = 0; i < p; i++)
+		free(ps[i]);
+	free(buf);
+	ec_destroy(ctx);
+}
+
+static void bench_addmul(void)
+{
+	uint8_t *src = xvalloc(BENCH_BUF_SIZE), *dst = xvalloc(BENCH_BUF_SIZE);
+	int rounds = nr_rounds * 32;
+
+	fill_random(src, BENCH_BUF_SIZE);
+	fill_random(dst, BENCH_BUF_SIZE);
+	printf("addmul throughput (selected: %s)\n", fec_simd_name());
+	for (int i = 0; i < ARRAY_SIZE(impls); i++) {
+		uint64_t start, elapsed;
+
+		if (!impls[i].usable)
+			continue;
+
+		start = clock_get_time();
+		for (int j = 0; j < rounds; j++)
+			impls[i].fn(dst, src, j % 255 + 1, BENCH_BUF_SIZE);
+		elapsed = clock_get_time() - start;
+
+		printf("  %-8s %6"PRIu64" MB/s\n", impls[i].name,
+		       mb_per_sec((uint64_t)rounds * BENCH_BUF_SIZE, elapsed));
+	}
+
+	free(src);
+	free(dst);
+}
+
+static void bench_encode_stripes(void)
+{
+	printf("object encode throughput\n");
+	for (int k = 0; k < ARRAY_SIZE(stripe_policies); k++) {
+		uint64_t t1 = 0, t2 = 0;
+
+		for (int i = 0; i < nr_rounds; i++)
+			encode_object(stripe_policies[k][0],
+				      stripe_policies[k][1], 0, &t1, &t2);
+		printf("  %2d:%-2d batched %5"PRIu64" MB/s, per stripe %5"PRIu64
+		       " MB/s\n", stripe_policies[k][0], stripe_policies[k][1],
+		       mb_per_sec((uint64_t)nr_rounds * SD_DATA_OBJ_SIZE, t1),
+		       mb_per_sec((uint64_t)nr_rounds * SD_DATA_OBJ_SIZE, t2));
+	}
+}
+
+static void bench_stripe_size(void)
+{
+	printf("object encode throughput by stripe size (MB/s)\n      ");
+	for (int s = 0; s <= SD_EC_MAX_STRIPE_SHIFT; s += 2)
+		printf(" %5uK", ec_stripe_size(s) / 1024);
+	printf("\n");
+	for (int k = 0; k < ARRAY_SIZE(stripe_policies); k++) {
+		printf("  %2d:%-2d", stripe_policies[k][0],
+		       stripe_policies[k][1]);
+		for (int s = 0; s <= SD_EC_MAX_STRIPE_SHIFT; s += 2) {
+			uint64_t t = 0;
+
+			for (int i = 0; i < nr_rounds; i++)
+				encode_object(stripe_policies[k][0],
+					      stripe_policies[k][1], s, &t,
+					      NULL);
+			printf(" %6"PRIu64, mb_per_sec((uint64_t)nr_rounds *
+						       SD_DATA_OBJ_SIZE, t));
+		}
+		printf("\n");
+	}
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-r rounds]\n", progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r:h")) >= 0) {
+		switch (ch) {
+		case 'r':
+			nr_rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nr_rounds <= 0)
+		usage(argv[0]);
+
+	init_fec();
+#ifdef __x86_64__
+	impls[1].usable = cpu_has_ssse3;
+	impls[2].usable = cpu_has_avx2 &&
+		xstate_enabled(XSTATE_SSE | XSTATE_YMM);
+	impls[3].usable = cpu_has_avx512f && cpu_has_avx512bw &&
+		xstate_enabled(XSTATE_SSE | XSTATE_YMM | XSTATE_OPMASK |
+			       XSTATE_ZMM_Hi256 | XSTATE_Hi16_ZMM);
+#endif
+
+	bench_addmul();
+	bench_encode_stripes();
+	bench_stripe_size();
+
+	return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the object placement
+ *
+ * This places objects on a simulated cluster and reports the time taken by
+ * the rb-tree walk and the flattened vnode ring for single object lookups,
+ * by placing a sorted object list with one sweep over the ring as recovery
+ * does, and by the placement cache for hot objects.  It also reports the
+ * load imbalance and the objects moved on node addition and removal of the
+ * ring and straw2.
+ *
+ * usage: placement_bench [-n nodes] [-o objects] [-c copies]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "sheep.h"
+
+struct object_hash {
+	uint64_t hash;
+	uint64_t oid;
+};
+
+static int nr_nodes = 100;
+static int nr_objects = 1 << 18;
+static int nr_copies = 3;
+
+static struct sd_node *nodes;
+
+static void init_nodes(int nr, int nr_zones, struct rb_root *vroot)
+{
+	memset(nodes, 0, sizeof(*nodes) * (nr + 1));
+	INIT_RB_ROOT(vroot);
+	for (int i = 0; i < nr; i++) {
+		/* IPv4 10.0.x.y */
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[14] = i / 256;
+		nodes[i].nid.addr[15] = i % 256;
+		nodes[i].nid.port = 7000;
+		nodes[i].nr_vnodes = 128;
+		nodes[i].zone = i % nr_zones;
+		node_to_vnodes(nodes + i, vroot);
+	}
+}
+
+static void init_ring(int nr, int nr_zones, uint16_t flags,
+		      struct rb_root *vroot, struct vnode_ring *ring)
+{
+	struct rb_root nroot = RB_ROOT;
+
+	init_nodes(nr, nr_zones, vroot);
+	rb_destroy(vroot, struct sd_vnode, rb);
+	for (int i = 0; i < nr; i++)
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+	nodes_to_vnode_ring(&nroot, vroot, ring, flags);
+}
+
+static void destroy_ring(struct rb_root *vroot, struct vnode_ring *ring)
+{
+	vnode_ring_destroy(ring);
+	rb_destroy(vroot, struct sd_vnode, rb);
+}
+
+static uint64_t ns_per_object(uint64_t elapsed, int nr)
+{
+	return elapsed / nr;
+}
+
+/* The placement by walking the rb-tree, which the vnode ring replaced */
+static void rb_hash_to_nodes(uint64_t hash, struct rb_root *vroot,
+			     int nr, const struct sd_node **out)
+{
+	struct sd_vnode *v, dummy = { .hash = hash };
+
+	v = rb_nsearch(vroot, &dummy, rb, vnode_cmp);
+	out[0] = v->node;
+	for (int j = 1; j < nr; j++) {
+next:
+		v = rb_entry(rb_next(&v->rb), struct sd_vnode, rb);
+		if (!v)
+			v = rb_entry(rb_first(vroot), struct sd_vnode, rb);
+		for (int k = 0; k < j; k++)
+			if (out[k]->zone == v->node->zone)
+				goto next;
+		out[j] = v->node;
+	}
+}
+
+static void bench_lookup(void)
+{
+	int zones[] = { nr_nodes, 10, 4 };
+	const struct sd_node *n[SD_MAX_COPIES];
+	struct vnode_ring ring;
+	struct rb_root vroot;
+	uint64_t start, t1, t2;
+
+	printf("lookup of %d objects (ns/object)\n", nr_objects);
+	for (int k = 0; k < ARRAY_SIZE(zones); k++) {
+		int copies = min(zones[k], nr_copies);
+
+		init_nodes(nr_nodes, zones[k], &vroot);
+		vnode_ring_init(&ring, &vroot);
+
+		start = clock_get_time();
+		for (int i = 0; i < nr_objects; i++)
+			rb_hash_to_nodes(sd_hash_oid(vid_to_data_oid(i, 0)),
+					 &vroot, copies, n);
+		t1 = clock_get_time() - start;
+
+		start = clock_get_time();
+		for (int i = 0; i < nr_objects; i++)
+			oid_to_nodes(vid_to_data_oid(i, 0), &ring, copies, n);
+		t2 = clock_get_time() - start;
+
+		printf("  %3d zones, %d copies: rb-tree %4"PRIu64", ring %4"
+		       PRIu64"\n", zones[k], copies,
+		       ns_per_object(t1, nr_objects),
+		       ns_per_object(t2, nr_objects));
+
+		destroy_ring(&vroot, &ring);
+	}
+}
+
+static int object_hash_cmp(const struct object_hash *a,
+			   const struct object_hash *b)
+{
+	return intcmp(a->hash, b->hash);
+}
+
+/*
+ * Recovery sorts the objects which it lists by their hash values anyway, then
+ * places them either one by one with a binary search each or, as it does now,
+ * with one sweep over the ring
+ */
+static void bench_screen(void)
+{
+	const struct sd_node *n[SD_MAX_COPIES];
+	struct object_hash *objs;
+	struct vnode_ring ring;
+	struct rb_root vroot;
+	uint64_t start, t1, t2, t3;
+	int nr_local1 = 0, nr_local2 = 0, idx = 0;
+
+	objs = xmalloc(sizeof(*objs) * nr_objects);
+
+	init_ring(nr_nodes, nr_nodes, 0, &vroot, &ring);
+
+	start = clock_get_time();
+	for (int i = 0; i < nr_objects; i++) {
+		objs[i].oid = vid_to_data_oid(i / 1024, i % 1024);
+		objs[i].hash = sd_hash_oid(objs[i].oid);
+	}
+	xqsort(objs, nr_objects, object_hash_cmp);
+	t1 = clock_get_time() - start;
+
+	start = clock_get_time();
+	for (int i = 0; i < nr_objects; i++) {
+		oid_to_nodes(objs[i].oid, &ring, nr_copies, n);
+		for (int j = 0; j < nr_copies; j++)
+			if (n[j] == nodes) {
+				nr_local1++;
+				break;
+			}
+	}
+	t2 = clock_get_time() - start;
+
+	start = clock_get_time();
+	for (int i = 0; i < nr_objects; i++) {
+		idx = vnode_ring_seek(&ring, objs[i].hash, idx);
+		vnode_ring_to_nodes(&ring, idx, nr_copies, n);
+		for (int j = 0; j < nr_copies; j++)
+			if (n[j] == nodes) {
+				nr_local2++;
+				break;
+			}
+	}
+	t3 = clock_get_time() - start;
+
+	printf("screening of %d objects for one node (ns/object)\n"
+	       "  hash and sort %"PRIu64", then place one by one %"PRIu64
+	       ", by a sweep %"PRIu64"%s\n", nr_objects,
+	       ns_per_object(t1, nr_objects), ns_per_object(t2, nr_objects),
+	       ns_per_object(t3, nr_objects),
+	       nr_local1 == nr_local2 ? "" : " (mismatch)");
+
+	destroy_ring(&vroot, &ring);
+	free(objs);
+}
+
+static void bench_cache(void)
+{
+	static const int nr_hot[] = { 256, 1024, 4096 };
+	const struct sd_vnode *v[SD_MAX_COPIES];
+	struct placement_cache *pc = xvalloc(sizeof(*pc));
+	struct vnode_ring ring;
+	struct rb_root vroot;
+	uint64_t start, t1, t2, nr_lookup, nr_miss;
+
+	init_nodes(nr_nodes, nr_nodes, &vroot);
+	vnode_ring_init(&ring, &vroot);
+
+	printf("placement of %d hot objects (ns/object)\n", nr_objects);
+	for (int k = 0; k < ARRAY_SIZE(nr_hot); k++) {
+		memset(pc, 0, sizeof(*pc));
+
+		start = clock_get_time();
+		for (int i = 0; i < nr_objects; i++)
+			oid_to_vnodes(vid_to_data_oid(1, i % nr_hot[k]),
+				      &ring, nr_copies, v);
+		t1 = clock_get_time() - start;
+
+		start = clock_get_time();
+		for (int i = 0; i < nr_objects; i++)
+			oid_to_vnodes_cached(vid_to_data_oid(1, i % nr_hot[k]),
+					     &ring, pc, nr_copies, v);
+		t2 = clock_get_time() - start;
+
+		placement_cache_get_stat(pc, &nr_lookup, &nr_miss);
+		printf("  %4d objects: ring %3"PRIu64", cache %3"PRIu64
+		       ", hit rate %.1f%%\n", nr_hot[k],
+		       ns_per_object(t1, nr_objects),
+		       ns_per_object(t2, nr_objects),
+		       100.0 * (nr_lookup - nr_miss) / nr_lookup);
+	}
+
+	free(pc);
+	destroy_ring(&vroot, &ring);
+}
+
+/* Place the objects on the nodes by the algorithm of 'flags' */
+static const struct sd_node **place_objects(struct sd_node *n, int nr,
+					    uint16_t flags)
+{
+	const struct sd_node **placement;
+	struct rb_root nroot = RB_ROOT, vroot = RB_ROOT;
+	struct vnode_ring ring;
+
+	for (int i = 0; i < nr; i++)
+		rb_insert(&nroot, &n[i], rb, node_cmp);
+	nodes_to_vnode_ring(&nroot, &vroot, &ring, flags);
+
+	placement = xmalloc(sizeof(*placement) * nr_objects * nr_copies);
+	for (int i = 0; i < nr_objects; i++)
+		oid_to_nodes(vid_to_data_oid(i / 1024, i % 1024), &ring,
+			     nr_copies, placement + i * nr_copies);
+
+	destroy_ring(&vroot, &ring);
+	return placement;
+}
+
+/* Return the largest ratio of the load of a node to its fair share */
+static double load_imbalance(int nr, const struct sd_node **placement)
+{
+	double max = 0, total_weight = 0;
+	uint64_t *load = xzalloc(sizeof(*load) * nr);
+
+	for (int i = 0; i < nr; i++)
+		total_weight += nodes[i].nr_vnodes;
+	for (int i = 0; i < nr_objects * nr_copies; i++)
+		load[placement[i] - nodes]++;
+
+	for (int i = 0; i < nr; i++) {
+		double fair = (double)nr_objects * nr_copies *
+			nodes[i].nr_vnodes / total_weight;
+
+		max = max(max, load[i] / fair);
+	}
+
+	free(load);
+	return max;
+}
+
+/* Return the ratio of the replica which are moved to another node */
+static double moved_ratio(const struct sd_node **p1,
+			  const struct sd_node **p2)
+{
+	int moved = 0;
+
+	for (int i = 0; i < nr_objects; i++) {
+		const struct sd_node **r1 = p1 + i * nr_copies;
+		const struct sd_node **r2 = p2 + i * nr_copies;
+
+		for (int j = 0; j < nr_copies; j++) {
+			int k;
+
+			for (k = 0; k < nr_copies; k++)
+				if (node_eq(r2[j], r1[k]))
+					break;
+			moved += k == nr_copies;
+		}
+	}
+
+	return (double)moved / ((double)nr_objects * nr_copies);
+}
+
+static void bench_balance(void)
+{
+	static const uint16_t algos[] = { 0, SD_CLUSTER_FLAG_STRAW2 };
+	static const char *names[] = { "ring", "straw2" };
+	const struct sd_node **p1, **p2;
+	int n = nr_nodes;
+	struct rb_root vroot;
+
+	printf("balance of %d objects on %d nodes\n", nr_objects, n);
+	for (int k = 0; k < ARRAY_SIZE(algos); k++) {
+		double imbalance, zoned, weighted, added, removed;
+
+		/* every node in its own zone, plus one node to add */
+		init_nodes(n, n, &vroot);
+		rb_destroy(&vroot, struct sd_vnode, rb);
+		nodes[n] = nodes[n - 1];
+		nodes[n].nid.addr[13] = 1;
+		nodes[n].zone = n;
+
+		p1 = place_objects(nodes, n, algos[k]);
+		imbalance = load_imbalance(n, p1);
+
+		p2 = place_objects(nodes, n + 1, algos[k]);
+		added = moved_ratio(p1, p2);
+		free(p2);
+
+		p2 = place_objects(nodes + 1, n - 1, algos[k]);
+		removed = moved_ratio(p1, p2);
+		free(p2);
+		free(p1);
+
+		/* a node of double weight */
+		nodes[0].nr_vnodes *= 2;
+		p1 = place_objects(nodes, n, algos[k]);
+		weighted = load_imbalance(n, p1);
+		free(p1);
+
+		/* some nodes share a zone */
+		init_nodes(n, 10, &vroot);
+		rb_destroy(&vroot, struct sd_vnode, rb);
+		p1 = place_objects(nodes, n, algos[k]);
+		zoned = load_imbalance(n, p1);
+		free(p1);
+
+		printf("  %-6s imbalance %.3f, weighted %.3f, 10 zones %.3f, "
+		       "moved on add %.4f (ideal %.4f), "
+		       "on remove %.4f (ideal %.4f)\n", names[k], imbalance,
+		       weighted, zoned, added, 1.0 / (n + 1), removed,
+		       1.0 / n);
+	}
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-n nodes] [-o objects] [-c copies]\n",
+		progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:o:c:h")) >= 0) {
+		switch (ch) {
+		case 'n':
+			nr_nodes = atoi(optarg);
+			break;
+		case 'o':
+			nr_objects = atoi(optarg);
+			break;
+		case 'c':
+			nr_copies = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nr_nodes < 10 || nr_nodes >= 65536 || nr_objects <= 0 ||
+	    nr_copies <= 0 || nr_copies > min(nr_nodes, SD_MAX_COPIES))
+		usage(argv[0]);
+
+	nodes = xzalloc(sizeof(*nodes) * (nr_nodes + 1));
+
+	bench_lookup();
+	bench_screen();
+	bench_cache();
+	bench_balance();
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the index lookups of hyper volumes
+ *
+ * This builds the B-tree of a hyper volume with the given number of full
+ * leaf-nodes in memory and reports the time taken and the bytes read by
+ * random lookups, with and without the leaf-node cache.  With -d, each read
+ * of a B-tree node takes the given extra time, like a read from the
+ * cluster does.
+ *
+ * usage: sd_inode_bench [-n leaf-nodes] [-l lookups] [-d read delay (us)]
+ */
+
+#include <getopt.h>
+
+#include "sd_inode.c"
+
+#define BENCH_VID	0x123456
+
+struct bench_node {
+	uint64_t oid;
+	char *buf;
+};
+
+static int nr_leaves = 16;
+static int nr_lookups = 10000;
+static int read_delay;
+
+static struct bench_node *bnodes;
+static int nr_bnodes;
+static uint64_t read_bytes;
+static uint32_t nr_idx;
+
+static struct bench_node *find_bnode(uint64_t oid)
+{
+	for (int i = 0; i < nr_bnodes; i++)
+		if (bnodes[i].oid == oid)
+			return bnodes + i;
+	return NULL;
+}
+
+static int bench_reader(uint64_t oid, void **mem, unsigned int len,
+			uint64_t offset)
+{
+	struct bench_node *b = find_bnode(oid);
+	uint64_t start = clock_get_time();
+
+	if (!b)
+		return SD_RES_NO_OBJ;
+	memcpy(*mem, b->buf + offset, len);
+	read_bytes += len;
+	while (read_delay &&
+	       clock_get_time() - start < (uint64_t)read_delay * 1000)
+		;
+
+	return SD_RES_SUCCESS;
+}
+
+/* Build the root idx-node and the full leaf-nodes of every other index */
+static struct sd_inode *build_inode(void)
+{
+	struct sd_inode *inode = xzalloc(sizeof(*inode));
+	struct sd_extent_header *root, *leaf;
+	uint32_t idx = 0;
+
+	inode->vdi_id = BENCH_VID;
+	inode->store_policy = 1;
+	inode->nr_copies = 1;
+	root = EXT_HEADER(inode->data_vdi_id);
+	sd_inode_init(root, 2);
+
+	bnodes = xzalloc(sizeof(*bnodes) * nr_leaves);
+	for (int i = 0; i < nr_leaves; i++) {
+		struct bench_node *b = bnodes + nr_bnodes++;
+
+		b->oid = vid_to_btree_oid(BENCH_VID, inode->btree_counter++);
+		b->buf = xvalloc(SD_INODE_DATA_INDEX_SIZE);
+		leaf = (struct sd_extent_header *)b->buf;
+		sd_inode_init(leaf, 2);
+		for (uint32_t j = 0; j < EXT_MAX_ENTRIES; j++, idx += 2) {
+			FIRST_EXT(leaf)[j].idx = idx;
+			FIRST_EXT(leaf)[j].vdi_id = BENCH_VID + idx % 7;
+		}
+		leaf->entries = EXT_MAX_ENTRIES;
+		insert_idx_entry(root, idx - 2, b->oid);
+	}
+	nr_idx = idx;
+
+	return inode;
+}
+
+static void bench_lookup(struct sd_inode *inode, size_t cache_size)
+{
+	uint64_t start, elapsed;
+	int nr_errors = 0;
+
+	sd_inode_set_cache_size(0);
+	sd_inode_set_cache_size(cache_size);
+	read_bytes = 0;
+
+	start = clock_get_time();
+	for (int i = 0; i < nr_lookups; i++) {
+		uint32_t idx = random() % nr_idx;
+		uint32_t vid = sd_inode_get_vid(bench_reader, inode, idx);
+
+		if (vid != (idx % 2 ? 0 : BENCH_VID + idx % 7))
+			nr_errors++;
+	}
+	elapsed = clock_get_time() - start;
+
+	printf("  cache %4zu MB: %8"PRIu64" ns/lookup, %6"PRIu64
+	       " bytes read/lookup%s\n", cache_size / 1024 / 1024,
+	       elapsed / nr_lookups, read_bytes / nr_lookups,
+	       nr_errors ? " (wrong vdi_id)" : "");
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-n leaf-nodes] [-l lookups] "
+		"[-d read delay (us)]\n", progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sd_inode *inode;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:l:d:h")) >= 0) {
+		switch (ch) {
+		case 'n':
+			nr_leaves = atoi(optarg);
+			break;
+		case 'l':
+			nr_lookups = atoi(optarg);
+			break;
+		case 'd':
+			read_delay = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nr_leaves <= 0 || nr_leaves > EXT_IDX_MAX_ENTRIES ||
+	    nr_lookups <= 0 || read_delay < 0)
+		usage(argv[0]);
+
+	inode = build_inode();
+	printf("random lookups of %u objects in %d leaf-nodes\n", nr_idx,
+	       nr_leaves);
+	bench_lookup(inode, 0);
+	bench_lookup(inode, DEFAULT_BNODE_CACHE_SIZE);
+
+	return 0;
+}
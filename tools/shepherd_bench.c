@@ -0,0 +1,292 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the notify fan-out of shepherd
+ *
+ * This simulates many sheep on top of the shepherd protocol: it joins the
+ * given number of fake nodes to a running shepherd, lets them send notify
+ * messages in turn with a bounded number of messages in flight and reports
+ * the throughput and the latency from sending a notify to receiving it on
+ * each node.  With -x, the given number of nodes stop reading after they
+ * join, to see how a slow sheep affects the others.
+ *
+ * usage: shepherd_bench [-a address] [-p port] [-n nodes] [-m messages]
+ *                       [-s size] [-w window] [-x stalled nodes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+
+#include "net.h"
+#include "util.h"
+#include "internal_proto.h"
+#include "shepherd.h"
+
+struct bench_node {
+	int fd;
+	struct sd_node node;
+	bool joined;
+};
+
+struct bench_payload {
+	uint64_t seq;
+	uint64_t send_time;
+};
+
+static const char *address = "127.0.0.1";
+static int port = SHEPHERD_PORT;
+static int nr_nodes = 64;
+static int nr_msgs = 10000;
+static size_t msg_size = 64;
+static int window = 32;
+static int nr_stalled;
+
+static struct bench_node *nodes;
+static int efd;
+static void *rbuf;
+static size_t rbuf_len = sizeof(struct sph_msg_join) + 65536;
+
+static uint64_t *latencies;
+static int nr_latencies;
+/* nr of nodes which have received each message */
+static int *nr_received;
+static int nr_completed;
+
+static void send_msg(struct bench_node *n, uint32_t type, void *body,
+		     size_t body_len)
+{
+	struct sph_msg hdr = {
+		.type = type,
+		.body_len = body_len,
+	};
+
+	if (writev2(n->fd, &hdr, body, body_len) != sizeof(hdr) + body_len) {
+		fprintf(stderr, "failed to send to shepherd, %m\n");
+		exit(1);
+	}
+}
+
+static struct sph_msg recv_msg(struct bench_node *n)
+{
+	struct sph_msg hdr;
+
+	if (xread(n->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "failed to receive from shepherd, %m\n");
+		exit(1);
+	}
+	if (hdr.body_len > rbuf_len) {
+		rbuf_len = hdr.body_len;
+		rbuf = xrealloc(rbuf, rbuf_len);
+	}
+	if (xread(n->fd, rbuf, hdr.body_len) != hdr.body_len) {
+		fprintf(stderr, "failed to receive from shepherd, %m\n");
+		exit(1);
+	}
+
+	return hdr;
+}
+
+static void send_join(struct bench_node *n)
+{
+	struct sph_msg_join *join = xzalloc(sizeof(*join));
+
+	join->new_node = n->node;
+	send_msg(n, SPH_CLI_MSG_JOIN, join, sizeof(*join));
+	free(join);
+}
+
+static void handle_msg(struct bench_node *n)
+{
+	struct sph_msg hdr = recv_msg(n);
+	struct sph_msg_notify_forward *forward;
+	struct bench_payload *payload;
+
+	switch (hdr.type) {
+	case SPH_SRV_MSG_NEW_NODE:
+		/* accept the joining node as is */
+		send_msg(n, SPH_CLI_MSG_ACCEPT, rbuf, hdr.body_len);
+		break;
+	case SPH_SRV_MSG_JOIN_REPLY:
+		n->joined = true;
+		break;
+	case SPH_SRV_MSG_JOIN_RETRY:
+		send_join(n);
+		break;
+	case SPH_SRV_MSG_NOTIFY_FORWARD:
+		forward = rbuf;
+		payload = (struct bench_payload *)forward->notify_msg;
+		latencies[nr_latencies++] = clock_get_time() -
+			payload->send_time;
+		if (++nr_received[payload->seq] == nr_nodes - nr_stalled)
+			nr_completed++;
+		break;
+	default:
+		break;
+	}
+}
+
+static void process_events(void)
+{
+	struct epoll_event events[128];
+	int nr;
+
+	nr = epoll_wait(efd, events, ARRAY_SIZE(events), -1);
+	if (nr < 0) {
+		if (errno == EINTR)
+			return;
+		fprintf(stderr, "epoll_wait failed, %m\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < nr; i++)
+		handle_msg(nodes + events[i].data.u32);
+}
+
+static void join_nodes(void)
+{
+	for (int i = 0; i < nr_nodes; i++) {
+		struct bench_node *n = nodes + i;
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.u32 = i,
+		};
+
+		n->fd = connect_to(address, port);
+		if (n->fd < 0) {
+			fprintf(stderr, "failed to connect to %s:%d\n",
+				address, port);
+			exit(1);
+		}
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, n->fd, &ev) < 0) {
+			fprintf(stderr, "epoll_ctl failed, %m\n");
+			exit(1);
+		}
+
+		str_to_addr("127.0.0.1", n->node.nid.addr);
+		n->node.nid.port = 10000 + i;
+		n->node.nr_vnodes = SD_DEFAULT_VNODES;
+		n->node.zone = i;
+
+		send_join(n);
+		while (!n->joined)
+			process_events();
+	}
+
+	for (int i = nr_nodes - nr_stalled; i < nr_nodes; i++)
+		epoll_ctl(efd, EPOLL_CTL_DEL, nodes[i].fd, NULL);
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	return intcmp(*(const uint64_t *)a, *(const uint64_t *)b);
+}
+
+static void run_bench(void)
+{
+	size_t body_len = sizeof(struct sph_msg_notify) + msg_size;
+	struct sph_msg_notify *notify = xzalloc(body_len);
+	struct bench_payload *payload = (struct bench_payload *)
+		notify->notify_msg;
+	uint64_t start, elapsed, sum = 0;
+	int sent = 0;
+
+	start = clock_get_time();
+	while (nr_completed < nr_msgs) {
+		while (sent < nr_msgs && sent - nr_completed < window) {
+			payload->seq = sent;
+			payload->send_time = clock_get_time();
+			send_msg(nodes + sent % (nr_nodes - nr_stalled),
+				 SPH_CLI_MSG_NOTIFY, notify, body_len);
+			sent++;
+		}
+		process_events();
+	}
+	elapsed = clock_get_time() - start;
+	free(notify);
+
+	qsort(latencies, nr_latencies, sizeof(*latencies), u64_cmp);
+	for (int i = 0; i < nr_latencies; i++)
+		sum += latencies[i];
+
+	printf("nodes %d (%d stalled), messages %d, size %zu, window %d\n",
+	       nr_nodes, nr_stalled, nr_msgs, msg_size, window);
+	printf("notify %.0f msg/s, delivery %.0f msg/s\n",
+	       nr_msgs * 1e9 / elapsed, nr_latencies * 1e9 / elapsed);
+	printf("latency (us) avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+	       sum / 1e3 / nr_latencies,
+	       latencies[nr_latencies / 2] / 1e3,
+	       latencies[(int)(nr_latencies * 0.99)] / 1e3,
+	       latencies[nr_latencies - 1] / 1e3);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-a address] [-p port] [-n nodes] "
+		"[-m messages] [-s size] [-w window] [-x stalled nodes]\n",
+		progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "a:p:n:m:s:w:x:h")) >= 0) {
+		switch (ch) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'n':
+			nr_nodes = atoi(optarg);
+			break;
+		case 'm':
+			nr_msgs = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'x':
+			nr_stalled = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nr_nodes <= 0 || nr_nodes > SD_MAX_NODES || nr_msgs <= 0 ||
+	    window <= 0 || msg_size < sizeof(struct bench_payload) ||
+	    nr_stalled < 0 || nr_stalled >= nr_nodes)
+		usage(argv[0]);
+
+	nodes = xzalloc(sizeof(*nodes) * nr_nodes);
+	latencies = xmalloc(sizeof(*latencies) * nr_msgs * nr_nodes);
+	nr_received = xzalloc(sizeof(*nr_received) * nr_msgs);
+	rbuf = xmalloc(rbuf_len);
+
+	efd = epoll_create(nr_nodes);
+	if (efd < 0) {
+		fprintf(stderr, "epoll_create failed, %m\n");
+		exit(1);
+	}
+
+	join_nodes();
+	run_bench();
+
+	return 0;
+}